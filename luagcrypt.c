@@ -4,6 +4,10 @@
  * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
  * Licensed under the MIT license. See the LICENSE file for details.
  */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <gcrypt.h>
 #include <lua.h>
 #include <lauxlib.h>
@@ -24,322 +28,10573 @@ luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
     }
 }
 
+static void *
+luaL_testudata(lua_State *L, int ud, const char *tname)
+{
+    void *p = lua_touserdata(L, ud);
+
+    if (p && lua_getmetatable(L, ud)) {
+        luaL_getmetatable(L, tname);
+        if (!lua_rawequal(L, -1, -2)) {
+            p = NULL;
+        }
+        lua_pop(L, 2);
+        return p;
+    }
+    return NULL;
+}
+
 #define luaL_newlibtable(L,l)   lua_createtable(L, 0, sizeof(l)/sizeof*(l) - 1)
 #define luaL_newlib(L,l)        (luaL_newlibtable(L,l), luaL_setfuncs(L,l,0))
 #endif
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE          "FILE*"
+#endif
 #ifndef luaL_checkint
 #define luaL_checkint(L,n)      ((int)luaL_checkinteger(L,n))
 #endif
-/* }}} */
+/* }}} */
+
+/* {{{ Encoding */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+/* GCC 5 and Clang compile functions for other x86 instruction sets, which
+ * are used if cpu_detect finds them. */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define HAVE_TARGET_ISA
+#define TARGET_ISA(isa)     __attribute__((target(isa)))
+
+static int cpu_ssse3, cpu_sse42, cpu_pclmul, cpu_avx2;
+
+/* Called when the module is loaded. */
+static void
+cpu_detect(void)
+{
+    __builtin_cpu_init();
+    cpu_ssse3 = __builtin_cpu_supports("ssse3");
+    cpu_sse42 = __builtin_cpu_supports("sse4.2");
+    cpu_pclmul = __builtin_cpu_supports("pclmul");
+    cpu_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Stores a 32-bit unsigned integer in big-endian byte order. */
+static void
+put_be32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/* Loads a 32-bit unsigned integer in little-endian byte order. */
+static unsigned long
+get_le32(const unsigned char *p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+        ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Stores a 64-bit unsigned integer in big-endian byte order. */
+static void
+put_be64(unsigned char *p, unsigned long long v)
+{
+    put_be32(p, (unsigned long)(v >> 32));
+    put_be32(p + 4, (unsigned long)(v & 0xffffffff));
+}
+
+/* Loads a 32-bit unsigned integer in big-endian byte order. */
+static unsigned long
+get_be32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+        ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+/* Loads a 64-bit unsigned integer in big-endian byte order. */
+static unsigned long long
+get_be64(const unsigned char *p)
+{
+    return ((unsigned long long)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/* Adds blocks to the big-endian counter. */
+static void
+ctr_add(unsigned char *ctr, size_t len, unsigned long long blocks)
+{
+    unsigned long long carry = blocks;
+    size_t i;
+
+    for (i = len; i-- > 0 && carry; ) {
+        carry += ctr[i];
+        ctr[i] = (unsigned char)carry;
+        carry >>= 8;
+    }
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+static const char b64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Output formats for digests. */
+enum { FORMAT_BINARY, FORMAT_HEX, FORMAT_BASE64 };
+static const char *const format_names[] = { "binary", "hex", "base64", NULL };
+
+#ifdef HAVE_SSE2
+/* Converts 16 nibbles to lowercase hexadecimal characters. */
+static __m128i
+nibbles_to_hex_sse2(__m128i n)
+{
+    __m128i letters = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+    n = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(n, _mm_and_si128(letters, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+/* Converts 16 hexadecimal characters to nibbles. Returns 0 if any of the
+ * characters is invalid. */
+static int
+hex_to_nibbles_sse2(__m128i c, __m128i *out)
+{
+    __m128i digits, letters, valid_digits, valid_letters;
+
+    digits = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    /* Setting bit 5 lowercases letters (and would map 0x10-0x19 to digits). */
+    letters = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                           _mm_set1_epi8('a' - 10));
+    valid_digits = _mm_and_si128(_mm_cmpgt_epi8(digits, _mm_set1_epi8(-1)),
+                                 _mm_cmplt_epi8(digits, _mm_set1_epi8(10)));
+    valid_letters = _mm_and_si128(_mm_cmpgt_epi8(letters, _mm_set1_epi8(9)),
+                                  _mm_cmplt_epi8(letters, _mm_set1_epi8(16)));
+    if (_mm_movemask_epi8(_mm_or_si128(valid_digits, valid_letters)) != 0xffff) {
+        return 0;
+    }
+    *out = _mm_or_si128(_mm_and_si128(valid_digits, digits),
+                        _mm_and_si128(valid_letters, letters));
+    return 1;
+}
+#endif
+
+/* Writes 2 * len hexadecimal characters to out. */
+static void
+hex_encode(const unsigned char *in, size_t len, char *out)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+        __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+
+        hi = nibbles_to_hex_sse2(hi);
+        lo = nibbles_to_hex_sse2(lo);
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i < len; i++) {
+        out[2 * i] = hex_digits[in[i] >> 4];
+        out[2 * i + 1] = hex_digits[in[i] & 0x0f];
+    }
+}
+
+static int
+hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Decodes len (an even number) hexadecimal characters into len / 2 bytes.
+ * Returns 0 if an invalid character is found. */
+static int
+hex_decode(const char *in, size_t len, unsigned char *out)
+{
+    size_t i = 0;
+    int hi, lo;
+
+#ifdef HAVE_SSE2
+    for (; i + 32 <= len; i += 32) {
+        __m128i a, b;
+
+        if (!hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(in + i)), &a) ||
+            !hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(in + i + 16)), &b)) {
+            return 0;
+        }
+        /* Each 16-bit lane holds the high nibble in the low byte. */
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0xff)), 4),
+                         _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, _mm_set1_epi16(0xff)), 4),
+                         _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(out + i / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < len; i += 2) {
+        hi = hex_value((unsigned char)in[i]);
+        lo = hex_value((unsigned char)in[i + 1]);
+        if (hi < 0 || lo < 0) {
+            return 0;
+        }
+        out[i / 2] = (unsigned char)(hi << 4 | lo);
+    }
+    return 1;
+}
+
+#ifdef HAVE_TARGET_ISA
+/* Base64 after Mula, Kurz and Lemire, "Faster Base64 Encoding and Decoding
+ * Using AVX2 Instructions". Every 128-bit lane converts 12 bytes to 16
+ * characters or back. */
+
+/* Spreads the 12 bytes at the start of each lane over 16 6-bit indices and
+ * adds the offset of the alphabet range of every index. */
+TARGET_ISA("ssse3") static __m128i
+b64_encode_lane_ssse3(__m128i in)
+{
+    __m128i indices, range;
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                4, 5, 3, 4, 1, 2, 0, 1));
+    indices = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                _mm_set1_epi32(0x01000010)));
+    /* 0-25 map to 13, 26-51 to 0, 52-61 to 1-10, 62 to 11 and 63 to 12. */
+    range = _mm_or_si128(_mm_subs_epu8(indices, _mm_set1_epi8(51)),
+            _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                _mm_set1_epi8(13)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(_mm_setr_epi8('a' - 26,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63,
+                    'A', 0, 0), range));
+}
+
+TARGET_ISA("avx2") static __m256i
+b64_encode_lanes_avx2(__m256i in)
+{
+    __m256i indices, range;
+
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6, 7,
+                4, 5, 3, 4, 1, 2, 0, 1));
+    indices = _mm256_or_si256(
+            _mm256_mulhi_epu16(_mm256_and_si256(in,
+                    _mm256_set1_epi32(0x0fc0fc00)),
+                _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(_mm256_and_si256(in,
+                    _mm256_set1_epi32(0x003f03f0)),
+                _mm256_set1_epi32(0x01000010)));
+    range = _mm256_or_si256(_mm256_subs_epu8(indices, _mm256_set1_epi8(51)),
+            _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+                _mm256_set1_epi8(13)));
+    return _mm256_add_epi8(indices, _mm256_shuffle_epi8(_mm256_setr_epi8(
+                    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                    '/' - 63, 'A', 0, 0, 'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), range));
+}
+
+/* Encodes whole groups of 12 bytes while 16 bytes can be loaded, returns the
+ * number of bytes consumed. */
+TARGET_ISA("ssse3") static size_t
+b64_encode_ssse3(const unsigned char *in, size_t len, char *out)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 12, out += 16) {
+        _mm_storeu_si128((__m128i *) out, b64_encode_lane_ssse3(
+                    _mm_loadu_si128((const __m128i *)(in + i))));
+    }
+    return i;
+}
+
+TARGET_ISA("avx2") static size_t
+b64_encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+    size_t i;
+
+    for (i = 0; i + 28 <= len; i += 24, out += 32) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((const __m128i *)(in + i))),
+                _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+
+        _mm256_storeu_si256((__m256i *) out, b64_encode_lanes_avx2(v));
+    }
+    return i;
+}
+
+/* Validates 16 characters with a table for each nibble (a character is
+ * invalid if the bits of both entries intersect), maps them to their values
+ * and packs those in the first 12 bytes. Returns 0 for invalid input. */
+TARGET_ISA("ssse3") static int
+b64_decode_lane_ssse3(__m128i in, __m128i *out)
+{
+    __m128i hi, lo, v;
+
+    hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    v = _mm_and_si128(
+            _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                    0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b,
+                    0x1a), lo),
+            _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                    0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                    0x10), hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+        return 0;
+    }
+    /* The offset follows from the high nibble, '/' shares it with '+'. */
+    v = _mm_add_epi8(in, _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65,
+                    -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+                _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi)));
+    v = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)),
+            _mm_set1_epi32(0x00011000));
+    *out = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1));
+    return 1;
+}
+
+TARGET_ISA("avx2") static int
+b64_decode_lanes_avx2(__m256i in, __m256i *out)
+{
+    __m256i hi, lo, v;
+
+    hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+    lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+    v = _mm256_and_si256(
+            _mm256_shuffle_epi8(_mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+                    0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b,
+                    0x1b, 0x1a, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                    0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo),
+            _mm256_shuffle_epi8(_mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+                    0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                    0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+                    0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+                    _mm256_setzero_si256())) != -1) {
+        return 0;
+    }
+    v = _mm256_add_epi8(in, _mm256_shuffle_epi8(_mm256_setr_epi8(0, 16, 19, 4,
+                    -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4,
+                    -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+                _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')),
+                    hi)));
+    v = _mm256_madd_epi16(_mm256_maddubs_epi16(v,
+                _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1));
+    /* Move the 12 bytes of the high lane next to those of the low lane. */
+    *out = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+                7, 7));
+    return 1;
+}
+
+/* Decodes groups of 16 characters, leaving the final quantum (which may have
+ * padding) and enough room for the 16-byte stores of out. Returns the number
+ * of characters consumed, which stops before an invalid group. */
+TARGET_ISA("ssse3") static size_t
+b64_decode_ssse3(const unsigned char *in, size_t len, unsigned char *out)
+{
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 24 <= len; i += 16, out += 12) {
+        if (!b64_decode_lane_ssse3(_mm_loadu_si128((const __m128i *)(in + i)),
+                    &v)) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *) out, v);
+    }
+    return i;
+}
+
+TARGET_ISA("avx2") static size_t
+b64_decode_avx2(const unsigned char *in, size_t len, unsigned char *out)
+{
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 44 <= len; i += 32, out += 24) {
+        if (!b64_decode_lanes_avx2(_mm256_loadu_si256(
+                        (const __m256i *)(in + i)), &v)) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *) out, v);
+    }
+    return i;
+}
+#endif
+
+/* Writes 4 * ceil(len / 3) base64 characters (with padding) to out. */
+static void
+b64_encode(const unsigned char *in, size_t len, char *out)
+{
+    unsigned long v;
+#ifdef HAVE_TARGET_ISA
+    size_t i = 0;
+
+    if (cpu_avx2) {
+        i = b64_encode_avx2(in, len, out);
+    }
+    if (cpu_ssse3) {
+        i += b64_encode_ssse3(in + i, len - i, out + i / 3 * 4);
+    }
+    in += i;
+    len -= i;
+    out += i / 3 * 4;
+#endif
+
+    for (; len >= 3; len -= 3, in += 3, out += 4) {
+        v = (unsigned long)in[0] << 16 | in[1] << 8 | in[2];
+        out[0] = b64_alphabet[v >> 18];
+        out[1] = b64_alphabet[(v >> 12) & 0x3f];
+        out[2] = b64_alphabet[(v >> 6) & 0x3f];
+        out[3] = b64_alphabet[v & 0x3f];
+    }
+    if (len > 0) {
+        v = (unsigned long)in[0] << 16 | (len > 1 ? in[1] << 8 : 0);
+        out[0] = b64_alphabet[v >> 18];
+        out[1] = b64_alphabet[(v >> 12) & 0x3f];
+        out[2] = len > 1 ? b64_alphabet[(v >> 6) & 0x3f] : '=';
+        out[3] = '=';
+    }
+}
+
+/* Decodes base64 (len must be a multiple of four) and returns the number of
+ * bytes written to out, or (size_t)-1 if the input is invalid. */
+static size_t
+b64_decode(const char *in, size_t len, unsigned char *out)
+{
+    static signed char table[256];
+    const unsigned char *p = (const unsigned char *) in;
+    size_t i, n = 0, pad = 0;
+    int a, b, c, d;
+
+    if (!table[0]) {
+        memset(table, -1, sizeof(table));
+        for (i = 0; i < 64; i++) {
+            table[(unsigned char)b64_alphabet[i]] = (signed char)i;
+        }
+    }
+
+    if (len % 4) {
+        return (size_t)-1;
+    }
+    if (len > 0 && p[len - 1] == '=') {
+        pad = p[len - 2] == '=' ? 2 : 1;
+    }
+    i = 0;
+#ifdef HAVE_TARGET_ISA
+    /* An invalid group is left to the loop below, which rejects it. */
+    if (cpu_avx2) {
+        i = b64_decode_avx2(p, len, out);
+    }
+    if (cpu_ssse3) {
+        i += b64_decode_ssse3(p + i, len - i, out + i / 4 * 3);
+    }
+    n = i / 4 * 3;
+#endif
+    for (; i < len; i += 4) {
+        a = table[p[i]];
+        b = table[p[i + 1]];
+        c = table[p[i + 2]];
+        d = table[p[i + 3]];
+        if (i + 4 == len && pad) {
+            /* Padding is only allowed in the final quantum. */
+            d = 0;
+            if (pad == 2) {
+                c = 0;
+            }
+        }
+        if ((a | b | c | d) < 0) {
+            return (size_t)-1;
+        }
+        out[n++] = (unsigned char)(a << 2 | b >> 4);
+        if (i + 4 < len || pad < 2) {
+            out[n++] = (unsigned char)(b << 4 | c >> 2);
+        }
+        if (i + 4 < len || pad < 1) {
+            out[n++] = (unsigned char)(c << 6 | d);
+        }
+    }
+    return n;
+}
+
+/* Pushes data on the stack in the given FORMAT_* encoding. */
+static void
+push_encoded(lua_State *L, const void *data, size_t len, int format)
+{
+    char *out;
+    size_t out_len;
+
+    switch (format) {
+    case FORMAT_HEX:
+        out_len = 2 * len;
+        out = lua_newuserdata(L, out_len);
+        hex_encode(data, len, out);
+        break;
+    case FORMAT_BASE64:
+        out_len = (len + 2) / 3 * 4;
+        out = lua_newuserdata(L, out_len);
+        b64_encode(data, len, out);
+        break;
+    default:
+        lua_pushlstring(L, data, len);
+        return;
+    }
+    lua_pushlstring(L, out, out_len);
+    lua_remove(L, -2);
+}
+
+static int
+lgcrypt_tohex(lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+
+    push_encoded(L, s, len, FORMAT_HEX);
+    return 1;
+}
+
+static int
+lgcrypt_fromhex(lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    unsigned char *out;
+
+    if (len % 2) {
+        luaL_error(L, "Hex string must be a multiple of two");
+    }
+    out = lua_newuserdata(L, len / 2);
+    if (!hex_decode(s, len, out)) {
+        luaL_error(L, "Invalid chars in hex");
+    }
+    lua_pushlstring(L, (const char *) out, len / 2);
+    lua_remove(L, -2);
+    return 1;
+}
+
+static int
+lgcrypt_b64encode(lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+
+    push_encoded(L, s, len, FORMAT_BASE64);
+    return 1;
+}
+
+static int
+lgcrypt_b64decode(lua_State *L)
+{
+    size_t len, out_len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    unsigned char *out;
+
+    out = lua_newuserdata(L, len / 4 * 3);
+    out_len = b64_decode(s, len, out);
+    if (out_len == (size_t)-1) {
+        luaL_error(L, "Invalid base64 string");
+    }
+    lua_pushlstring(L, (const char *) out, out_len);
+    lua_remove(L, -2);
+    return 1;
+}
+/* }}} */
+
+/* {{{ Buffers */
+/* Mutable byte buffer, the data follows the structure. */
+typedef struct {
+    size_t len;
+} LgcryptBuffer;
+
+#define BUFFER_DATA(buf)    ((unsigned char *)((buf) + 1))
+
+static LgcryptBuffer *
+lgcrypt_buffer_new(lua_State *L, size_t len)
+{
+    LgcryptBuffer *buf;
+
+    buf = (LgcryptBuffer *) lua_newuserdata(L, sizeof(LgcryptBuffer) + len);
+    buf->len = len;
+    luaL_getmetatable(L, "gcrypt.Buffer");
+    lua_setmetatable(L, -2);
+    return buf;
+}
+
+static LgcryptBuffer *
+checkBuffer(lua_State *L, int arg)
+{
+    return (LgcryptBuffer *)luaL_checkudata(L, arg, "gcrypt.Buffer");
+}
+
+/* Returns the bytes of a string or gcrypt.Buffer argument. */
+static const unsigned char *
+check_bytes(lua_State *L, int arg, size_t *len)
+{
+    LgcryptBuffer *buf;
+
+    if (lua_type(L, arg) == LUA_TUSERDATA) {
+        buf = checkBuffer(L, arg);
+        *len = buf->len;
+        return BUFFER_DATA(buf);
+    }
+    return (const unsigned char *) luaL_checklstring(L, arg, len);
+}
+
+/* Checks that [offset, offset + len) lies within the buffer. */
+static size_t
+check_buffer_range(lua_State *L, LgcryptBuffer *buf, int arg, size_t len)
+{
+    lua_Integer offset = luaL_optinteger(L, arg, 0);
+
+    if (offset < 0 || (size_t)offset > buf->len || len > buf->len - (size_t)offset) {
+        luaL_argerror(L, arg, "out of buffer bounds");
+    }
+    return (size_t)offset;
+}
+
+/* gcrypt.Buffer(size or string) */
+static int
+lgcrypt_buffer_open(lua_State *L)
+{
+    LgcryptBuffer *buf;
+    size_t len;
+    const char *s;
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        s = lua_tolstring(L, 1, &len);
+        buf = lgcrypt_buffer_new(L, len);
+        memcpy(BUFFER_DATA(buf), s, len);
+    } else {
+        lua_Integer size = luaL_checkinteger(L, 1);
+
+        luaL_argcheck(L, size >= 0, 1, "size must be non-negative");
+        buf = lgcrypt_buffer_new(L, (size_t)size);
+        memset(BUFFER_DATA(buf), 0, buf->len);
+    }
+    return 1;
+}
+
+static int
+lgcrypt_buffer___len(lua_State *L)
+{
+    LgcryptBuffer *buf = checkBuffer(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)buf->len);
+    return 1;
+}
+
+/* buf:tostring([offset[, len]]) */
+static int
+lgcrypt_buffer_tostring(lua_State *L)
+{
+    LgcryptBuffer *buf = checkBuffer(L, 1);
+    lua_Integer offset = luaL_optinteger(L, 2, 0);
+    size_t len;
+
+    luaL_argcheck(L, offset >= 0 && (size_t)offset <= buf->len, 2,
+            "out of buffer bounds");
+    len = (size_t)luaL_optinteger(L, 3, (lua_Integer)(buf->len - (size_t)offset));
+    check_buffer_range(L, buf, 2, len);
+    lua_pushlstring(L, (const char *) BUFFER_DATA(buf) + offset, len);
+    return 1;
+}
+
+/* buf:write(data[, offset]) */
+static int
+lgcrypt_buffer_write(lua_State *L)
+{
+    LgcryptBuffer *buf = checkBuffer(L, 1);
+    size_t len, offset;
+    const unsigned char *data = check_bytes(L, 2, &len);
+
+    offset = check_buffer_range(L, buf, 3, len);
+    memmove(BUFFER_DATA(buf) + offset, data, len);
+    return 0;
+}
+
+static const struct luaL_Reg lgcrypt_buffer_meta[] = {
+    {"__len",       lgcrypt_buffer___len},
+    {"len",         lgcrypt_buffer___len},
+    {"tostring",    lgcrypt_buffer_tostring},
+    {"write",       lgcrypt_buffer_write},
+    {NULL,          NULL}
+};
+/* }}} */
+/* {{{ Bulk XOR and comparison */
+/* out = a ^ b. out may be exactly a or b, but must not partially overlap
+ * them, or the loops would read bytes that were already written. The bindings
+ * only alias whole Buffers, whose range in out then starts at offset zero. */
+static void
+xor_bytes(unsigned char *out, const unsigned char *a, const unsigned char *b,
+          size_t len)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(x, y));
+    }
+#else
+    size_t x, y;
+
+    for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+        memcpy(&x, a + i, sizeof(size_t));
+        memcpy(&y, b + i, sizeof(size_t));
+        x ^= y;
+        memcpy(out + i, &x, sizeof(size_t));
+    }
+#endif
+    for (; i < len; i++) {
+        out[i] = a[i] ^ b[i];
+    }
+}
+
+/* Compares two buffers of the same length in constant time. Returns 1 if
+ * they are equal. */
+static int
+ct_equal(const void *a, const void *b, size_t len)
+{
+    const unsigned char *x = a, *y = b;
+    unsigned char diff = 0;
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16) {
+        acc = _mm_or_si128(acc, _mm_xor_si128(
+                    _mm_loadu_si128((const __m128i *)(x + i)),
+                    _mm_loadu_si128((const __m128i *)(y + i))));
+    }
+    /* Each byte of the mask is 0xff if the accumulated difference is 0. */
+    diff = (unsigned char)(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff);
+#endif
+    for (; i < len; i++) {
+        diff |= x[i] ^ y[i];
+    }
+    return diff == 0;
+}
+
+/* gcrypt.xor(a, b[, out]) returns a ^ b as string or stores it in Buffer out. */
+static int
+lgcrypt_xor(lua_State *L)
+{
+    size_t a_len, b_len, offset;
+    const unsigned char *a = check_bytes(L, 1, &a_len);
+    const unsigned char *b = check_bytes(L, 2, &b_len);
+    LgcryptBuffer *out;
+    unsigned char *tmp;
+
+    if (a_len != b_len) {
+        luaL_error(L, "Arguments must have equal length");
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        out = checkBuffer(L, 3);
+        offset = check_buffer_range(L, out, 4, a_len);
+        xor_bytes(BUFFER_DATA(out) + offset, a, b, a_len);
+        lua_settop(L, 3);
+        return 1;
+    }
+    tmp = lua_newuserdata(L, a_len);
+    xor_bytes(tmp, a, b, a_len);
+    lua_pushlstring(L, (const char *) tmp, a_len);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/* gcrypt.xor_into(buffer, mask[, offset]) XORs mask into the buffer. */
+static int
+lgcrypt_xor_into(lua_State *L)
+{
+    LgcryptBuffer *buf = checkBuffer(L, 1);
+    size_t mask_len, offset;
+    const unsigned char *mask = check_bytes(L, 2, &mask_len);
+
+    offset = check_buffer_range(L, buf, 3, mask_len);
+    xor_bytes(BUFFER_DATA(buf) + offset, BUFFER_DATA(buf) + offset, mask, mask_len);
+    return 0;
+}
+
+/* gcrypt.equal(a, b) compares the contents in constant time. Only the length
+ * is not considered secret. */
+static int
+lgcrypt_equal(lua_State *L)
+{
+    size_t a_len, b_len;
+    const unsigned char *a = check_bytes(L, 1, &a_len);
+    const unsigned char *b = check_bytes(L, 2, &b_len);
+
+    lua_pushboolean(L, a_len == b_len && ct_equal(a, b, a_len));
+    return 1;
+}
+/* }}} */
+
+/* {{{ Worker threads */
+/* Libgcrypt is thread-safe without callbacks since 1.6.0. */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 && !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_PTHREAD
+#endif
+
+#define MAX_THREADS     64
+
+typedef void (*parallel_fn)(void *ctx, size_t index);
+
+typedef struct {
+    parallel_fn fn;
+    void *ctx;
+    size_t count;
+    size_t next;        /* Next index to process */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} ParallelJob;
+
+#ifdef HAVE_PTHREAD
+static void *
+parallel_worker(void *arg)
+{
+    ParallelJob *job = (ParallelJob *) arg;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) {
+            break;
+        }
+        job->fn(job->ctx, i);
+    }
+    return NULL;
+}
+#endif
+
+/* Calls fn(ctx, i) for every i in [0, count) using up to threads threads
+ * (including the calling thread). The order of the calls is undefined. */
+static void
+parallel_for(size_t count, unsigned threads, parallel_fn fn, void *ctx)
+{
+#ifdef HAVE_PTHREAD
+    pthread_t tids[MAX_THREADS];
+    ParallelJob job;
+    unsigned i, started = 0;
+
+    if (threads > count) {
+        threads = (unsigned)count;
+    }
+    if (threads > 1) {
+        job.fn = fn;
+        job.ctx = ctx;
+        job.count = count;
+        job.next = 0;
+        pthread_mutex_init(&job.lock, NULL);
+        for (i = 1; i < threads; i++) {
+            if (pthread_create(&tids[started], NULL, parallel_worker, &job)) {
+                break;
+            }
+            started++;
+        }
+        parallel_worker(&job);
+        for (i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        pthread_mutex_destroy(&job.lock);
+        return;
+    }
+#else
+    (void)threads;
+#endif
+    {
+        size_t j;
+
+        for (j = 0; j < count; j++) {
+            fn(ctx, j);
+        }
+    }
+}
+
+/* Returns the number of online processors. */
+static unsigned
+default_threads(void)
+{
+    long ncpu = 1;
+
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncpu < 1) {
+        return 1;
+    }
+    return ncpu > MAX_THREADS ? MAX_THREADS : (unsigned)ncpu;
+}
+
+/* Checks an optional thread count argument, defaulting to the number of
+ * online processors. */
+static unsigned
+check_threads(lua_State *L, int arg)
+{
+    lua_Integer threads;
+
+    threads = luaL_optinteger(L, arg, default_threads());
+    luaL_argcheck(L, threads >= 1, arg, "thread count must be positive");
+    return threads > MAX_THREADS ? MAX_THREADS : (unsigned)threads;
+}
+/* }}} */
+
+/* {{{ Checksums */
+/* CRC-32 (ISO-HDLC, as in zlib) and CRC-32C (Castagnoli) in the reflected
+ * form, without the overhead of a digest handle for short data. CRC-32C uses
+ * the SSE4.2 crc32 instruction and CRC-32 folds with carry-less multiplication
+ * if the processor has them. */
+
+#define CRC32_POLY      0xedb88320UL
+#define CRC32C_POLY     0x82f63b78UL
+
+/* Slicing-by-8 tables, crc_tables[poly][k][b] is the CRC of byte b followed by
+ * k zero bytes. */
+static unsigned long crc_tables[2][8][256];
+static int crc_tables_ready;
+
+static void
+crc_tables_init(void)
+{
+    unsigned long polys[2] = { CRC32_POLY, CRC32C_POLY };
+    unsigned long c;
+    int p, k, i, j;
+
+    if (crc_tables_ready) {
+        return;
+    }
+    for (p = 0; p < 2; p++) {
+        for (i = 0; i < 256; i++) {
+            c = (unsigned long)i;
+            for (j = 0; j < 8; j++) {
+                c = c & 1 ? (c >> 1) ^ polys[p] : c >> 1;
+            }
+            crc_tables[p][0][i] = c;
+        }
+        for (k = 1; k < 8; k++) {
+            for (i = 0; i < 256; i++) {
+                c = crc_tables[p][k - 1][i];
+                crc_tables[p][k][i] = (c >> 8) ^ crc_tables[p][0][c & 0xff];
+            }
+        }
+    }
+    crc_tables_ready = 1;
+}
+
+/* Updates the inverted CRC register with the tables of a polynomial. */
+static unsigned long
+crc_update_table(unsigned long (*t)[256], unsigned long crc,
+                 const unsigned char *p, size_t len)
+{
+    while (len >= 8) {
+        crc ^= p[0] | (unsigned long)p[1] << 8 | (unsigned long)p[2] << 16 |
+            (unsigned long)p[3] << 24;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+            t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+            t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_TARGET_ISA
+/* Folds 64-byte blocks with carry-less multiplication and reduces the result
+ * (Gopal et al., "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction"). len must be a multiple of 16 and at least 64. */
+TARGET_ISA("sse2,pclmul") static unsigned long
+crc32_fold_pclmul(unsigned long crc, const unsigned char *p, size_t len)
+{
+    static const unsigned long long k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const unsigned long long k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const unsigned long long k5k0[2] = { 0x0163cd6124ULL, 0 };
+    static const unsigned long long poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+                       _mm_cvtsi32_si128((int)crc));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+    p += 64;
+    len -= 64;
+
+    x0 = _mm_loadu_si128((const __m128i *)k1k2);
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(p + 48)));
+        p += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes and the remaining 16-byte blocks into one. */
+    x0 = _mm_loadu_si128((const __m128i *)k3k4);
+    x2 = _mm_xor_si128(x2, _mm_clmulepi64_si128(x1, x0, 0x00));
+    x1 = _mm_xor_si128(x2, _mm_clmulepi64_si128(x1, x0, 0x11));
+    x3 = _mm_xor_si128(x3, _mm_clmulepi64_si128(x1, x0, 0x00));
+    x1 = _mm_xor_si128(x3, _mm_clmulepi64_si128(x1, x0, 0x11));
+    x4 = _mm_xor_si128(x4, _mm_clmulepi64_si128(x1, x0, 0x00));
+    x1 = _mm_xor_si128(x4, _mm_clmulepi64_si128(x1, x0, 0x11));
+    while (len >= 16) {
+        x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+                           _mm_clmulepi64_si128(x1, x0, 0x00));
+        x1 = _mm_xor_si128(x2, _mm_clmulepi64_si128(x1, x0, 0x11));
+        p += 16;
+        len -= 16;
+    }
+
+    /* Fold 128 bits to 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits. */
+    x0 = _mm_loadu_si128((const __m128i *)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned long)(unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+/* Updates the inverted CRC-32C register with the crc32 instruction. */
+TARGET_ISA("sse4.2") static unsigned long
+crc32c_sse42(unsigned long crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+    unsigned long long c = crc, v;
+#else
+    unsigned int c = (unsigned int)crc, v;
+#endif
+
+    while (len >= sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+#ifdef __x86_64__
+        c = _mm_crc32_u64(c, v);
+#else
+        c = _mm_crc32_u32(c, v);
+#endif
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+    while (len--) {
+        c = _mm_crc32_u8((unsigned int)c, *p++);
+    }
+    return (unsigned long)c;
+}
+#endif
+
+/* Multiplies two polynomials modulo the reflected poly (zlib's multmodp). */
+static unsigned long
+crc_multmodp(unsigned long a, unsigned long b, unsigned long poly)
+{
+    unsigned long m = 0x80000000UL, p = 0;
+
+    while (m && a) {
+        if (a & m) {
+            p ^= b;
+            a ^= m;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+    }
+    return p;
+}
+
+/* Returns the CRC of A || B from crc1 = CRC(A), crc2 = CRC(B) and len2 = #B,
+ * by multiplying crc1 with x^(8 * len2). */
+static unsigned long
+crc_combine(unsigned long crc1, unsigned long crc2, unsigned long long len2,
+            unsigned long poly)
+{
+    unsigned long xn = 0x80000000UL;    /* x^0 */
+    unsigned long sq = 0x00800000UL;    /* x^8, x^16, x^32, ... */
+
+    while (len2) {
+        if (len2 & 1) {
+            xn = crc_multmodp(sq, xn, poly);
+        }
+        sq = crc_multmodp(sq, sq, poly);
+        len2 >>= 1;
+    }
+    return crc_multmodp(xn, crc1, poly) ^ crc2;
+}
+
+/* Without PCLMULQDQ, the CRC-32 of Libgcrypt is faster than the tables from
+ * this size on despite opening a digest. */
+#define CRC32_GCRY_MIN          2048
+
+/* Returns the CRC-32 of data, continuing from crc (0 for a new checksum). */
+static unsigned long
+crc32_update(unsigned long crc, const unsigned char *p, size_t len)
+{
+    unsigned char digest[4];
+
+#ifdef HAVE_TARGET_ISA
+    if (cpu_pclmul && len >= 64) {
+        crc = crc32_fold_pclmul(~crc & 0xffffffffUL, p, len & ~(size_t)15);
+        crc = crc_update_table(crc_tables[0], crc, p + (len & ~(size_t)15),
+                len & 15);
+        return ~crc & 0xffffffffUL;
+    }
+    if (!cpu_pclmul && len >= CRC32_GCRY_MIN) {
+#else
+    if (len >= CRC32_GCRY_MIN) {
+#endif
+        gcry_md_hash_buffer(GCRY_MD_CRC32, digest, p, len);
+        return crc_combine(crc, get_be32(digest), len, CRC32_POLY);
+    }
+    crc = crc_update_table(crc_tables[0], ~crc & 0xffffffffUL, p, len);
+    return ~crc & 0xffffffffUL;
+}
+
+/* Returns the CRC-32C of data, continuing from crc (0 for a new checksum). */
+static unsigned long
+crc32c_update(unsigned long crc, const unsigned char *p, size_t len)
+{
+#ifdef HAVE_TARGET_ISA
+    if (cpu_sse42) {
+        return ~crc32c_sse42(~crc & 0xffffffffUL, p, len) & 0xffffffffUL;
+    }
+#endif
+    crc = crc_update_table(crc_tables[1], ~crc & 0xffffffffUL, p, len);
+    return ~crc & 0xffffffffUL;
+}
+
+/* Data of at least this size is split between threads. */
+#define CRC_MIN_PARALLEL        (1024 * 1024)
+
+typedef struct {
+    int castagnoli;
+    const unsigned char *data;
+    size_t len;
+    size_t part_len;
+    unsigned long crcs[MAX_THREADS];
+} CrcJob;
+
+static void
+crc_part(void *ctx, size_t i)
+{
+    CrcJob *job = (CrcJob *) ctx;
+    size_t offset = i * job->part_len;
+    size_t len = job->len - offset < job->part_len ? job->len - offset : job->part_len;
+
+    job->crcs[i] = job->castagnoli ?
+        crc32c_update(0, job->data + offset, len) :
+        crc32_update(0, job->data + offset, len);
+}
+
+static int
+crc_checksum(lua_State *L, int castagnoli)
+{
+    size_t len, i, count;
+    const unsigned char *data = check_bytes(L, 1, &len);
+    unsigned long crc = (unsigned long)luaL_optinteger(L, 2, 0) & 0xffffffffUL;
+    unsigned threads = 1;
+    CrcJob job;
+
+    /* Small checksums skip the processor count lookup, it costs more. */
+    if (len >= CRC_MIN_PARALLEL || !lua_isnoneornil(L, 3)) {
+        threads = check_threads(L, 3);
+    }
+    crc_tables_init();
+    if (threads > 1 && len >= CRC_MIN_PARALLEL) {
+        job.castagnoli = castagnoli;
+        job.data = data;
+        job.len = len;
+        job.part_len = (len + threads - 1) / threads;
+        count = (len + job.part_len - 1) / job.part_len;
+        parallel_for(count, threads, crc_part, &job);
+        for (i = 0; i < count; i++) {
+            crc = crc_combine(crc, job.crcs[i],
+                    i + 1 < count ? job.part_len : len - i * job.part_len,
+                    castagnoli ? CRC32C_POLY : CRC32_POLY);
+        }
+    } else if (castagnoli) {
+        crc = crc32c_update(crc, data, len);
+    } else {
+        crc = crc32_update(crc, data, len);
+    }
+    lua_pushinteger(L, (lua_Integer)crc);
+    return 1;
+}
+
+/* gcrypt.crc32(data[, crc[, threads]]) */
+static int
+lgcrypt_crc32(lua_State *L)
+{
+    return crc_checksum(L, 0);
+}
+
+/* gcrypt.crc32c(data[, crc[, threads]]) */
+static int
+lgcrypt_crc32c(lua_State *L)
+{
+    return crc_checksum(L, 1);
+}
+
+static int
+crc_combine_args(lua_State *L, unsigned long poly)
+{
+    unsigned long crc1 = (unsigned long)luaL_checkinteger(L, 1) & 0xffffffffUL;
+    unsigned long crc2 = (unsigned long)luaL_checkinteger(L, 2) & 0xffffffffUL;
+    lua_Number len2 = luaL_checknumber(L, 3);
+
+    luaL_argcheck(L, len2 >= 0, 3, "length must not be negative");
+    lua_pushinteger(L, (lua_Integer)crc_combine(crc1, crc2,
+                (unsigned long long)len2, poly));
+    return 1;
+}
+
+/* gcrypt.crc32_combine(crc1, crc2, len2) */
+static int
+lgcrypt_crc32_combine(lua_State *L)
+{
+    return crc_combine_args(L, CRC32_POLY);
+}
+
+/* gcrypt.crc32c_combine(crc1, crc2, len2) */
+static int
+lgcrypt_crc32c_combine(lua_State *L)
+{
+    return crc_combine_args(L, CRC32C_POLY);
+}
+/* }}} */
+
+/* {{{ Data sources */
+/* A file path, io file handle or Buffer to read data from. */
+typedef struct {
+    FILE *fp;                   /* NULL for in-memory data */
+    int owned;                  /* Whether fp must be closed */
+    const unsigned char *data;  /* In-memory data */
+    size_t len;
+    size_t pos;
+} LgcryptSource;
+
+static int
+lgcrypt_source___gc(lua_State *L)
+{
+    LgcryptSource *src = (LgcryptSource *)luaL_checkudata(L, 1, "gcrypt.Source");
+
+    if (src->owned && src->fp) {
+        fclose(src->fp);
+    }
+    src->fp = NULL;
+    return 0;
+}
+
+static const struct luaL_Reg lgcrypt_source_meta[] = {
+    {"__gc",    lgcrypt_source___gc},
+    {NULL,      NULL}
+};
+
+/* Opens the source at argument arg and pushes it on the stack. Files that are
+ * opened by path are closed when the source is collected. */
+static LgcryptSource *
+push_source(lua_State *L, int arg)
+{
+    LgcryptSource *src;
+    LgcryptBuffer *buf;
+    const char *path;
+
+    src = (LgcryptSource *) lua_newuserdata(L, sizeof(LgcryptSource));
+    memset(src, 0, sizeof(LgcryptSource));
+    luaL_getmetatable(L, "gcrypt.Source");
+    lua_setmetatable(L, -2);
+
+    if (lua_type(L, arg) == LUA_TSTRING) {
+        path = lua_tostring(L, arg);
+        src->fp = fopen(path, "rb");
+        if (!src->fp) {
+            luaL_error(L, "%s: %s", path, strerror(errno));
+        }
+        src->owned = 1;
+    } else if ((buf = (LgcryptBuffer *)luaL_testudata(L, arg, "gcrypt.Buffer"))) {
+        src->data = BUFFER_DATA(buf);
+        src->len = buf->len;
+    } else {
+#if LUA_VERSION_NUM >= 502
+        luaL_Stream *stream = (luaL_Stream *)luaL_checkudata(L, arg, LUA_FILEHANDLE);
+
+        if (!stream->closef) {
+            luaL_error(L, "attempt to use a closed file");
+        }
+        src->fp = stream->f;
+#else
+        FILE **fp = (FILE **)luaL_checkudata(L, arg, LUA_FILEHANDLE);
+
+        if (!*fp) {
+            luaL_error(L, "attempt to use a closed file");
+        }
+        src->fp = *fp;
+#endif
+    }
+    return src;
+}
+
+/* Reads up to len bytes and returns the number of bytes read. A short count
+ * indicates the end of the data or a read error (see source_error). */
+static size_t
+source_read(LgcryptSource *src, unsigned char *buf, size_t len)
+{
+    size_t n, total = 0;
+
+    if (!src->fp) {
+        n = src->len - src->pos < len ? src->len - src->pos : len;
+        memcpy(buf, src->data + src->pos, n);
+        src->pos += n;
+        return n;
+    }
+    while (total < len) {
+        n = fread(buf + total, 1, len - total, src->fp);
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int
+source_error(LgcryptSource *src)
+{
+    return src->fp && ferror(src->fp);
+}
+/* }}} */
+/* {{{ Piece hashing */
+/* Limit for the data that is read ahead for hashing in parallel. */
+#define READ_BATCH_LIMIT    (64 * 1024 * 1024)
+
+typedef struct {
+    int algo;
+    size_t digest_len;
+    size_t piece_size;
+    int leaf_prefix;
+    const unsigned char *data;
+    size_t len;
+    unsigned long long total;   /* bytes hashed so far */
+    unsigned char *out;
+} PieceJob;
+
+/* Hashes prefix || a || b, the prefix is a Merkle tree domain separator. */
+static void
+hash_prefixed(int algo, unsigned char prefix, const void *a, size_t a_len,
+        const void *b, size_t b_len, unsigned char *out)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    gcry_buffer_t iov[3];
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].size = iov[0].len = 1;
+    iov[0].data = &prefix;
+    iov[1].size = iov[1].len = a_len;
+    iov[1].data = (void *) a;
+    iov[2].size = iov[2].len = b_len;
+    iov[2].data = (void *) b;
+    gcry_md_hash_buffers(algo, 0, out, iov, 3);
+#else
+    gcry_md_hd_t h;
+
+    if (gcry_md_open(&h, algo, 0)) {
+        memset(out, 0, gcry_md_get_algo_dlen(algo));
+        return;
+    }
+    gcry_md_putc(h, prefix);
+    gcry_md_write(h, a, a_len);
+    gcry_md_write(h, b, b_len);
+    memcpy(out, gcry_md_read(h, algo), gcry_md_get_algo_dlen(algo));
+    gcry_md_close(h);
+#endif
+}
+
+static void
+hash_piece(void *ctx, size_t i)
+{
+    PieceJob *job = (PieceJob *) ctx;
+    size_t offset = i * job->piece_size;
+    size_t len = job->len - offset;
+    unsigned char *out = job->out + i * job->digest_len;
+
+    if (len > job->piece_size) {
+        len = job->piece_size;
+    }
+    if (job->leaf_prefix) {
+        hash_prefixed(job->algo, 0, job->data + offset, len, NULL, 0, out);
+    } else {
+        gcry_md_hash_buffer(job->algo, out, job->data + offset, len);
+    }
+}
+
+/* Pushes the concatenated digests of all pieces of the source. The algo,
+ * digest_len, piece_size and leaf_prefix fields of the job must be set. */
+static void
+push_piece_digests(lua_State *L, LgcryptSource *src, PieceJob *job,
+        unsigned threads)
+{
+    luaL_Buffer b;
+    size_t batch, count;
+    unsigned char *data;
+
+    if (!src->fp) {
+        /* Hash in-memory data without copying. */
+        job->data = src->data;
+        job->len = src->len;
+        job->total = src->len;
+        count = (job->len + job->piece_size - 1) / job->piece_size;
+        job->out = lua_newuserdata(L, count * job->digest_len);
+        parallel_for(count, threads, hash_piece, job);
+        lua_pushlstring(L, (const char *) job->out, count * job->digest_len);
+        lua_remove(L, -2);
+        return;
+    }
+
+    /* Read a few pieces per thread and hash them while no I/O happens. */
+    batch = threads * 4;
+    if (job->piece_size > READ_BATCH_LIMIT / batch) {
+        batch = READ_BATCH_LIMIT / job->piece_size;
+        if (batch == 0) {
+            batch = 1;
+        }
+    }
+    data = lua_newuserdata(L, batch * job->piece_size);
+    job->data = data;
+    job->out = lua_newuserdata(L, batch * job->digest_len);
+
+    job->total = 0;
+    luaL_buffinit(L, &b);
+    do {
+        job->len = source_read(src, data, batch * job->piece_size);
+        job->total += job->len;
+        count = (job->len + job->piece_size - 1) / job->piece_size;
+        parallel_for(count, threads, hash_piece, job);
+        luaL_addlstring(&b, (const char *) job->out, count * job->digest_len);
+    } while (job->len == batch * job->piece_size);
+    if (source_error(src)) {
+        luaL_error(L, "Failed to read source: %s", strerror(errno));
+    }
+    luaL_pushresult(&b);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+}
+
+/* gcrypt.hash_pieces(algo, source, piece_size[, threads]) returns the
+ * concatenated digests of every piece_size bytes of the source. */
+static int
+lgcrypt_hash_pieces(lua_State *L)
+{
+    PieceJob job;
+    LgcryptSource *src;
+    unsigned threads;
+    lua_Integer piece_size;
+
+    job.algo = luaL_checkint(L, 1);
+    piece_size = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, piece_size > 0, 3, "piece size must be positive");
+    job.piece_size = (size_t)piece_size;
+    job.leaf_prefix = 0;
+    threads = check_threads(L, 4);
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    src = push_source(L, 2);
+    push_piece_digests(L, src, &job, threads);
+    return 1;
+}
+
+typedef struct {
+    int algo;
+    size_t digest_len;
+    const char **messages;
+    size_t *lens;
+    unsigned char *out;
+} DigestManyJob;
+
+static void
+digest_one(void *ctx, size_t i)
+{
+    DigestManyJob *job = (DigestManyJob *) ctx;
+
+    gcry_md_hash_buffer(job->algo, job->out + i * job->digest_len,
+            job->messages[i], job->lens[i]);
+}
+
+/* gcrypt.digest_many(algo, messages[, threads]) returns the concatenated
+ * digests of the strings in the list messages. */
+static int
+lgcrypt_digest_many(lua_State *L)
+{
+    DigestManyJob job;
+    unsigned threads;
+    size_t count, i;
+
+    job.algo = luaL_checkint(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    threads = check_threads(L, 3);
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    /* The strings are kept alive by the table. */
+    for (count = 0; ; count++) {
+        lua_rawgeti(L, 2, (int)count + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_error(L, "messages must be strings");
+        }
+        lua_pop(L, 1);
+    }
+    job.messages = lua_newuserdata(L, (count + 1) * sizeof(const char *));
+    job.lens = lua_newuserdata(L, (count + 1) * sizeof(size_t));
+    job.out = lua_newuserdata(L, (count + 1) * job.digest_len);
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 2, (int)i + 1);
+        job.messages[i] = lua_tolstring(L, -1, &job.lens[i]);
+        lua_pop(L, 1);
+    }
+    parallel_for(count, threads, digest_one, &job);
+    lua_pushlstring(L, (const char *) job.out, count * job.digest_len);
+    return 1;
+}
+/* }}} */
+
+/* {{{ Content-defined chunking */
+/* Returns the integer field name of the options table at arg, or def if the
+ * table or field is absent. */
+static lua_Integer
+opt_field_integer(lua_State *L, int arg, const char *name, lua_Integer def)
+{
+    lua_Integer v = def;
+
+    if (lua_istable(L, arg)) {
+        lua_getfield(L, arg, name);
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isnumber(L, -1)) {
+                luaL_error(L, "option '%s' must be a number", name);
+            }
+            v = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return v;
+}
+
+/* Gear hash table, generated with SplitMix64 so it is fixed across runs. */
+static unsigned long long gear_table[256];
+
+static void
+init_gear_table(void)
+{
+    unsigned long long x = 0, z;
+    int i;
+
+    if (gear_table[0]) {
+        return;
+    }
+    for (i = 255; i >= 0; i--) {
+        x += 0x9e3779b97f4a7c15ULL;
+        z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+typedef struct {
+    size_t min_size, avg_size, max_size;
+    unsigned long long mask_s;  /* Used before avg_size (more bits) */
+    unsigned long long mask_l;  /* Used after avg_size (fewer bits) */
+} CdcParams;
+
+/* Returns the length of the next chunk in data (FastCDC with normalized
+ * chunking level 2). */
+static size_t
+cdc_cut(const CdcParams *p, const unsigned char *data, size_t len)
+{
+    unsigned long long fp = 0;
+    size_t i, normal, end;
+
+    if (len <= p->min_size) {
+        return len;
+    }
+    end = len < p->max_size ? len : p->max_size;
+    normal = end < p->avg_size ? end : p->avg_size;
+    for (i = p->min_size; i < normal; i++) {
+        fp = (fp << 1) + gear_table[data[i]];
+        if (!(fp & p->mask_s)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + gear_table[data[i]];
+        if (!(fp & p->mask_l)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+typedef struct {
+    int algo;
+    size_t digest_len;
+    const unsigned char *data;
+    const size_t *chunks;       /* Pairs of offset and length */
+    unsigned char *out;
+} ChunkJob;
+
+static void
+hash_chunk(void *ctx, size_t i)
+{
+    ChunkJob *job = (ChunkJob *) ctx;
+
+    gcry_md_hash_buffer(job->algo, job->out + i * job->digest_len,
+            job->data + job->chunks[2 * i], job->chunks[2 * i + 1]);
+}
+
+/* Finds chunk boundaries in data, hashes the chunks and appends the records
+ * (offset, length, digest) to b. Unless final is set, the data after the last
+ * max_size boundary is left for the next call. Returns the consumed length. */
+static size_t
+cdc_process(const CdcParams *p, ChunkJob *job, unsigned threads,
+            size_t *chunks, const unsigned char *data, size_t len, int final,
+            unsigned long long base, luaL_Buffer *b)
+{
+    unsigned char record[16];
+    size_t pos = 0, count = 0, i;
+
+    while (pos < len && (final || len - pos >= p->max_size)) {
+        chunks[2 * count] = pos;
+        chunks[2 * count + 1] = cdc_cut(p, data + pos, len - pos);
+        pos += chunks[2 * count + 1];
+        count++;
+    }
+
+    job->data = data;
+    job->chunks = chunks;
+    parallel_for(count, threads, hash_chunk, job);
+    for (i = 0; i < count; i++) {
+        put_be64(record, base + chunks[2 * i]);
+        put_be64(record + 8, chunks[2 * i + 1]);
+        luaL_addlstring(b, (const char *) record, sizeof(record));
+        luaL_addlstring(b, (const char *) job->out + i * job->digest_len,
+                job->digest_len);
+    }
+    return pos;
+}
+
+/* gcrypt.cdc(source[, options]) splits the source into content-defined chunks
+ * and returns the packed offsets, lengths (both 64-bit big-endian) and
+ * digests. Options: min, avg, max, algo, threads. */
+static int
+lgcrypt_cdc(lua_State *L)
+{
+    CdcParams p;
+    ChunkJob job;
+    LgcryptSource *src;
+    luaL_Buffer b;
+    lua_Integer min_size, avg_size, max_size, threads;
+    size_t window, filled = 0, consumed, n, count, record_len, i;
+    unsigned long long base = 0;
+    unsigned char *buf, *offsets, *lengths, *digests;
+    const unsigned char *records;
+    size_t *chunks;
+    int bits, eof = 0;
+
+    avg_size = opt_field_integer(L, 2, "avg", 8192);
+    min_size = opt_field_integer(L, 2, "min", avg_size / 4);
+    max_size = opt_field_integer(L, 2, "max", avg_size * 8);
+    job.algo = (int)opt_field_integer(L, 2, "algo", GCRY_MD_SHA256);
+    threads = opt_field_integer(L, 2, "threads", 0);
+    if (avg_size < 256 || min_size < 64 || min_size > avg_size ||
+        max_size < avg_size || max_size > 0x40000000) {
+        luaL_argerror(L, 2, "invalid chunk sizes (64 <= min <= avg <= max, avg >= 256)");
+    }
+    p.min_size = (size_t)min_size;
+    p.avg_size = (size_t)avg_size;
+    p.max_size = (size_t)max_size;
+    for (bits = 0; ((lua_Integer)1 << (bits + 1)) <= avg_size; bits++)
+        ;
+    p.mask_s = ((1ULL << (bits + 2)) - 1) << (64 - (bits + 2));
+    p.mask_l = ((1ULL << (bits - 2)) - 1) << (64 - (bits - 2));
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    if (threads <= 0) {
+        threads = default_threads();
+    } else if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    init_gear_table();
+    src = push_source(L, 1);
+
+    if (!src->fp) {
+        window = src->len;
+    } else {
+        /* Must hold at least two maximum-sized chunks to make progress. */
+        window = p.max_size * 16;
+        if (window > READ_BATCH_LIMIT) {
+            window = p.max_size * 2 > READ_BATCH_LIMIT ?
+                p.max_size * 2 : READ_BATCH_LIMIT;
+        }
+    }
+    count = window / p.min_size + 1;
+    chunks = lua_newuserdata(L, 2 * count * sizeof(size_t));
+    job.out = lua_newuserdata(L, count * job.digest_len);
+    buf = src->fp ? lua_newuserdata(L, window) : NULL;
+
+    luaL_buffinit(L, &b);
+    if (!src->fp) {
+        cdc_process(&p, &job, (unsigned)threads, chunks, src->data, src->len,
+                1, 0, &b);
+    } else {
+        while (!eof) {
+            n = source_read(src, buf + filled, window - filled);
+            filled += n;
+            eof = filled < window;
+            consumed = cdc_process(&p, &job, (unsigned)threads, chunks, buf,
+                    filled, eof, base, &b);
+            memmove(buf, buf + consumed, filled - consumed);
+            filled -= consumed;
+            base += consumed;
+        }
+        if (source_error(src)) {
+            luaL_error(L, "Failed to read source: %s", strerror(errno));
+        }
+    }
+    luaL_pushresult(&b);
+
+    /* Split the records into the three packed results. */
+    records = (const unsigned char *) lua_tolstring(L, -1, &n);
+    record_len = 16 + job.digest_len;
+    count = n / record_len;
+    offsets = lua_newuserdata(L, count * 8);
+    lengths = lua_newuserdata(L, count * 8);
+    digests = lua_newuserdata(L, count * job.digest_len);
+    for (i = 0; i < count; i++) {
+        memcpy(offsets + 8 * i, records + i * record_len, 8);
+        memcpy(lengths + 8 * i, records + i * record_len + 8, 8);
+        memcpy(digests + i * job.digest_len, records + i * record_len + 16,
+                job.digest_len);
+    }
+    lua_pushlstring(L, (const char *) offsets, count * 8);
+    lua_pushlstring(L, (const char *) lengths, count * 8);
+    lua_pushlstring(L, (const char *) digests, count * job.digest_len);
+    return 3;
+}
+/* }}} */
+
+/* {{{ Merkle trees */
+/* Leaves are hashed as H(0x00 || data) and interior nodes as
+ * H(0x01 || left || right) like RFC 6962. An odd node at the end of a level is
+ * promoted unchanged which yields the same tree as the RFC 6962 split. */
+typedef struct {
+    int algo;
+    size_t digest_len;
+    size_t count;
+    const unsigned char *in;
+    unsigned char *out;
+} MerkleLevelJob;
+
+/* Tree files: magic, algorithm, digest length, leaf size, data size and the
+ * number of levels (big-endian), followed by the levels from the leaves to the
+ * root. */
+#define MERKLE_TREE_MAGIC       "GCRYMTRE"
+#define MERKLE_TREE_HEADER_SIZE 40
+
+static void
+hash_node_pair(void *ctx, size_t i)
+{
+    MerkleLevelJob *job = (MerkleLevelJob *) ctx;
+    const unsigned char *left = job->in + 2 * i * job->digest_len;
+    unsigned char *out = job->out + i * job->digest_len;
+
+    if (2 * i + 1 < job->count) {
+        hash_prefixed(job->algo, 1, left, job->digest_len,
+                left + job->digest_len, job->digest_len, out);
+    } else {
+        memmove(out, left, job->digest_len);
+    }
+}
+
+/* Writes the levels table at index levels_idx to a tree file. */
+static void
+merkle_tree_write(lua_State *L, const char *path, PieceJob *job,
+        int levels_idx, int depth)
+{
+    unsigned char header[MERKLE_TREE_HEADER_SIZE];
+    const char *level;
+    size_t level_len;
+    FILE *fp;
+    int i, failed;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, MERKLE_TREE_MAGIC, 8);
+    put_be32(header + 8, (unsigned long)job->algo);
+    put_be32(header + 12, (unsigned long)job->digest_len);
+    put_be64(header + 16, job->piece_size);
+    put_be64(header + 24, job->total);
+    put_be32(header + 32, (unsigned long)depth);
+
+    fp = fopen(path, "wb");
+    if (!fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    failed = fwrite(header, sizeof(header), 1, fp) != 1;
+    for (i = 1; i <= depth && !failed; i++) {
+        lua_rawgeti(L, levels_idx, i);
+        level = lua_tolstring(L, -1, &level_len);
+        failed = fwrite(level, 1, level_len, fp) != level_len;
+        lua_pop(L, 1);
+    }
+    if (fclose(fp) || failed) {
+        luaL_error(L, "Failed to write %s: %s", path, strerror(errno));
+    }
+}
+
+/* gcrypt.merkle_root(algo, source, leaf_size[, threads[, all_levels]])
+ * returns the tree root and optionally a table with all levels, starting
+ * with the concatenated leaf hashes and ending with the root. If all_levels
+ * is a path, the levels are written to that tree file instead. */
+static int
+lgcrypt_merkle_root(lua_State *L)
+{
+    PieceJob job;
+    MerkleLevelJob level;
+    LgcryptSource *src;
+    unsigned threads;
+    lua_Integer leaf_size;
+    int levels_idx = 0, depth = 1;
+    const char *leaves, *tree_path = NULL;
+    size_t len;
+    unsigned char *nodes;
+
+    job.algo = luaL_checkint(L, 1);
+    leaf_size = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, leaf_size > 0, 3, "leaf size must be positive");
+    job.piece_size = (size_t)leaf_size;
+    job.leaf_prefix = 1;
+    threads = check_threads(L, 4);
+    if (lua_type(L, 5) == LUA_TSTRING) {
+        tree_path = lua_tostring(L, 5);
+    }
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    src = push_source(L, 2);
+    push_piece_digests(L, src, &job, threads);
+    leaves = lua_tolstring(L, -1, &len);
+
+    if (lua_toboolean(L, 5)) {
+        lua_newtable(L);
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, -2, depth++);
+        levels_idx = lua_gettop(L);
+    }
+
+    /* Combine the levels in a scratch copy of the leaf hashes. */
+    level.algo = job.algo;
+    level.digest_len = job.digest_len;
+    level.count = len / job.digest_len;
+    nodes = lua_newuserdata(L, len ? len : job.digest_len);
+    memcpy(nodes, leaves, len);
+    if (level.count == 0) {
+        /* The root of an empty tree is the hash of an empty string. */
+        gcry_md_hash_buffer(job.algo, nodes, "", 0);
+        if (levels_idx) {
+            lua_pushlstring(L, (const char *) nodes, job.digest_len);
+            lua_rawseti(L, levels_idx, depth++);
+        }
+    } else {
+        while (level.count > 1) {
+            level.in = level.out = nodes;
+            /* A level can be reduced in place only if pairs are processed in
+             * order, parallel levels are written to a separate area. */
+            if (threads > 1 && level.count >= 2 * threads) {
+                level.out = lua_newuserdata(L, (level.count + 1) / 2 *
+                        job.digest_len);
+                parallel_for((level.count + 1) / 2, threads, hash_node_pair,
+                        &level);
+                memcpy(nodes, level.out, (level.count + 1) / 2 *
+                        job.digest_len);
+                lua_pop(L, 1);
+            } else {
+                parallel_for((level.count + 1) / 2, 1, hash_node_pair, &level);
+            }
+            level.count = (level.count + 1) / 2;
+            if (levels_idx) {
+                lua_pushlstring(L, (const char *) nodes,
+                        level.count * job.digest_len);
+                lua_rawseti(L, levels_idx, depth++);
+            }
+        }
+    }
+    if (tree_path) {
+        merkle_tree_write(L, tree_path, &job, levels_idx, depth - 1);
+        levels_idx = 0;
+    }
+    lua_pushlstring(L, (const char *) nodes, job.digest_len);
+    if (levels_idx) {
+        lua_pushvalue(L, levels_idx);
+        return 2;
+    }
+    return 1;
+}
+/* }}} */
+
+/* {{{ Merkle logs */
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+/* On-disk format: magic, algorithm, digest length and the number of leaves
+ * (big-endian), followed by the nodes. */
+#define MERKLE_LOG_MAGIC        "GCRYMLOG"
+#define MERKLE_LOG_HEADER_SIZE  32
+#define MERKLE_LOG_MIN_NODES    64
+#define MERKLE_MAX_DIGEST       64
+
+/* The hashes of all perfect subtrees are stored in post-order, that is, every
+ * leaf is followed by the parents that it completes. The last node of every
+ * level forms the frontier that is needed for the root. */
+typedef struct {
+    int algo;
+    size_t digest_len;
+    size_t size;            /* number of leaves */
+    size_t capacity;        /* number of nodes that fit in the storage */
+    unsigned char *nodes;
+    unsigned char *map;     /* header and nodes if stored in a file */
+    size_t map_len;
+    int fd;
+} LgcryptMerkleLog;
+
+static unsigned
+bit_count(size_t v)
+{
+    unsigned n = 0;
+
+    for (; v; v &= v - 1) {
+        n++;
+    }
+    return n;
+}
+
+static unsigned
+trailing_zeros(size_t v)
+{
+    unsigned n = 0;
+
+    for (; v && !(v & 1); v >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+/* Number of stored nodes for a log with the given number of leaves. */
+static size_t
+merkle_node_count(size_t leaves)
+{
+    return 2 * leaves - bit_count(leaves);
+}
+
+/* Returns the hash of the perfect subtree with 2^level leaves at the given
+ * index within its level. */
+static const unsigned char *
+merkle_node(LgcryptMerkleLog *log, unsigned level, size_t index)
+{
+    size_t m = (index + 1) << level;
+
+    return log->nodes + (merkle_node_count(m) - 1 -
+            (trailing_zeros(m) - level)) * log->digest_len;
+}
+
+/* Calculates the Merkle tree hash of count leaves starting at first. The
+ * first leaf must be aligned to a power of two that is not smaller than
+ * count, which holds for the ranges of the RFC 6962 proofs. */
+static void
+merkle_range_hash(LgcryptMerkleLog *log, size_t first, size_t count,
+        unsigned char *out)
+{
+    const unsigned char *subtrees[sizeof(size_t) * 8];
+    unsigned char tmp[MERKLE_MAX_DIGEST];
+    unsigned level, n = 0;
+
+    if (count == 0) {
+        gcry_md_hash_buffer(log->algo, out, "", 0);
+        return;
+    }
+    /* Decompose the range in perfect subtrees, largest first. */
+    for (level = sizeof(size_t) * 8; level-- > 0; ) {
+        if (count & ((size_t)1 << level)) {
+            subtrees[n++] = merkle_node(log, level, first >> level);
+            first += (size_t)1 << level;
+        }
+    }
+    memcpy(out, subtrees[--n], log->digest_len);
+    while (n-- > 0) {
+        hash_prefixed(log->algo, 1, subtrees[n], log->digest_len,
+                out, log->digest_len, tmp);
+        memcpy(out, tmp, log->digest_len);
+    }
+}
+
+/* Appends the hash of count leaves starting at first to a proof. Ranges of a
+ * proof are perfect subtrees that are stored as one node, except for at most
+ * one range that ends at the tree size and is combined from the frontier. */
+static void
+merkle_add_range_hash(LgcryptMerkleLog *log, luaL_Buffer *b, size_t first,
+        size_t count)
+{
+    unsigned char digest[MERKLE_MAX_DIGEST];
+    unsigned level;
+
+    if ((count & (count - 1)) == 0) {
+        level = trailing_zeros(count);
+        luaL_addlstring(b, (const char *) merkle_node(log, level,
+                    first >> level), log->digest_len);
+        return;
+    }
+    merkle_range_hash(log, first, count, digest);
+    luaL_addlstring(b, (const char *) digest, log->digest_len);
+}
+
+/* Largest power of two smaller than n (n > 1). */
+static size_t
+merkle_split(size_t n)
+{
+    size_t k = 1;
+
+    while (k < n - k) {
+        k <<= 1;
+    }
+    return k;
+}
+
+/* PATH(m, D[first:first+count]) from RFC 6962, section 2.1.1. */
+static void
+merkle_path(LgcryptMerkleLog *log, luaL_Buffer *b, size_t m, size_t first,
+        size_t count)
+{
+    size_t k;
+
+    if (count <= 1) {
+        return;
+    }
+    k = merkle_split(count);
+    if (m < k) {
+        merkle_path(log, b, m, first, k);
+        merkle_add_range_hash(log, b, first + k, count - k);
+    } else {
+        merkle_path(log, b, m - k, first + k, count - k);
+        merkle_add_range_hash(log, b, first, k);
+    }
+}
+
+/* SUBPROOF(m, D[first:first+count], complete) from RFC 6962, section 2.1.2. */
+static void
+merkle_subproof(LgcryptMerkleLog *log, luaL_Buffer *b, size_t m, size_t first,
+        size_t count, int complete)
+{
+    size_t k;
+
+    if (m == count) {
+        if (!complete) {
+            merkle_add_range_hash(log, b, first, count);
+        }
+        return;
+    }
+    k = merkle_split(count);
+    if (m <= k) {
+        merkle_subproof(log, b, m, first, k, complete);
+        merkle_add_range_hash(log, b, first + k, count - k);
+    } else {
+        merkle_subproof(log, b, m - k, first + k, count - k, 0);
+        merkle_add_range_hash(log, b, first, k);
+    }
+}
+
+/* Makes room for the given number of nodes. */
+static void
+merkle_log_reserve(lua_State *L, LgcryptMerkleLog *log, size_t nodes)
+{
+    size_t capacity = log->capacity;
+    unsigned char *p;
+
+    if (nodes <= capacity) {
+        return;
+    }
+    while (capacity < nodes) {
+        capacity = capacity ? capacity * 2 : MERKLE_LOG_MIN_NODES;
+    }
+#ifdef HAVE_MMAP
+    if (log->map) {
+        size_t map_len = MERKLE_LOG_HEADER_SIZE + capacity * log->digest_len;
+
+        if (ftruncate(log->fd, (off_t)map_len)) {
+            luaL_error(L, "Failed to grow Merkle log: %s", strerror(errno));
+        }
+        p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+        if (p == MAP_FAILED) {
+            luaL_error(L, "Failed to map Merkle log: %s", strerror(errno));
+        }
+        munmap(log->map, log->map_len);
+        log->map = p;
+        log->map_len = map_len;
+        log->nodes = p + MERKLE_LOG_HEADER_SIZE;
+        log->capacity = capacity;
+        return;
+    }
+#endif
+    p = realloc(log->nodes, capacity * log->digest_len);
+    if (!p) {
+        luaL_error(L, "Out of memory");
+    }
+    log->nodes = p;
+    log->capacity = capacity;
+}
+
+#ifdef HAVE_MMAP
+/* Maps an existing log file or initializes a new one. */
+static void
+merkle_log_map(lua_State *L, LgcryptMerkleLog *log, const char *path)
+{
+    struct stat st;
+    unsigned char *p;
+
+    log->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (log->fd < 0) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    if (fstat(log->fd, &st)) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    if (st.st_size == 0) {
+        log->map_len = MERKLE_LOG_HEADER_SIZE +
+            MERKLE_LOG_MIN_NODES * log->digest_len;
+        if (ftruncate(log->fd, (off_t)log->map_len)) {
+            luaL_error(L, "Failed to grow Merkle log: %s", strerror(errno));
+        }
+    } else if (st.st_size < MERKLE_LOG_HEADER_SIZE) {
+        luaL_error(L, "Invalid Merkle log file");
+    } else {
+        log->map_len = (size_t)st.st_size;
+    }
+    p = mmap(NULL, log->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (p == MAP_FAILED) {
+        luaL_error(L, "Failed to map Merkle log: %s", strerror(errno));
+    }
+    log->map = p;
+    log->nodes = p + MERKLE_LOG_HEADER_SIZE;
+    log->capacity = (log->map_len - MERKLE_LOG_HEADER_SIZE) / log->digest_len;
+
+    if (st.st_size == 0) {
+        memcpy(p, MERKLE_LOG_MAGIC, 8);
+        put_be32(p + 8, (unsigned long)log->algo);
+        put_be32(p + 12, (unsigned long)log->digest_len);
+        return;
+    }
+    if (memcmp(p, MERKLE_LOG_MAGIC, 8)) {
+        luaL_error(L, "Invalid Merkle log file");
+    }
+    if (get_be32(p + 8) != (unsigned long)log->algo ||
+            get_be32(p + 12) != log->digest_len) {
+        luaL_error(L, "Merkle log uses a different hash algorithm");
+    }
+    /* Nodes beyond the recorded size are from an interrupted append. */
+    log->size = (size_t)get_be64(p + 16);
+    if (log->size > log->capacity ||
+            merkle_node_count(log->size) > log->capacity) {
+        luaL_error(L, "Truncated Merkle log file");
+    }
+}
+#endif
+
+static LgcryptMerkleLog *
+getMerkleLog(lua_State *L, int arg)
+{
+    return (LgcryptMerkleLog *)luaL_checkudata(L, arg, "gcrypt.MerkleLog");
+}
+
+static LgcryptMerkleLog *
+checkMerkleLog(lua_State *L, int arg)
+{
+    LgcryptMerkleLog *log = getMerkleLog(L, arg);
+    if (!log->digest_len) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return log;
+}
+
+/* Checks an optional tree size argument, defaulting to the current size. */
+static size_t
+check_tree_size(lua_State *L, LgcryptMerkleLog *log, int arg)
+{
+    lua_Integer n;
+
+    if (lua_isnoneornil(L, arg)) {
+        return log->size;
+    }
+    n = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, n >= 0 && (size_t)n <= log->size, arg,
+            "tree size out of range");
+    return (size_t)n;
+}
+
+static int
+lgcrypt_merkle_log___gc(lua_State *L)
+{
+    LgcryptMerkleLog *log = getMerkleLog(L, 1);
+
+#ifdef HAVE_MMAP
+    if (log->map) {
+        munmap(log->map, log->map_len);
+        log->map = NULL;
+        log->nodes = NULL;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+        log->fd = -1;
+    }
+#endif
+    free(log->nodes);
+    log->nodes = NULL;
+    log->digest_len = 0;
+    return 0;
+}
+
+/* gcrypt.MerkleLog(algo[, path]) */
+static int
+lgcrypt_merkle_log_open(lua_State *L)
+{
+    LgcryptMerkleLog *log;
+    int algo;
+    const char *path;
+
+    algo = luaL_checkint(L, 1);
+    path = luaL_optstring(L, 2, NULL);
+
+    log = (LgcryptMerkleLog *) lua_newuserdata(L, sizeof(LgcryptMerkleLog));
+    memset(log, 0, sizeof(LgcryptMerkleLog));
+    log->fd = -1;
+    luaL_getmetatable(L, "gcrypt.MerkleLog");
+    lua_setmetatable(L, -2);
+
+    log->algo = algo;
+    log->digest_len = gcry_md_get_algo_dlen(algo);
+    if (!log->digest_len || log->digest_len > MERKLE_MAX_DIGEST) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    if (path) {
+#ifdef HAVE_MMAP
+        merkle_log_map(L, log, path);
+#else
+        luaL_error(L, "File-backed Merkle logs are not supported");
+#endif
+    }
+    return 1;
+}
+
+/* log:append(data) adds a leaf and returns its zero-based index. */
+static int
+lgcrypt_merkle_log_append(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+    const unsigned char *data;
+    size_t data_len, pos, index = log->size;
+    unsigned level, completed;
+    unsigned char *node;
+
+    data = check_bytes(L, 2, &data_len);
+    merkle_log_reserve(L, log, merkle_node_count(index + 1));
+
+    pos = merkle_node_count(index);
+    node = log->nodes + pos * log->digest_len;
+    hash_prefixed(log->algo, 0, data, data_len, NULL, 0, node);
+    /* Hash the parents of the perfect subtrees completed by this leaf. */
+    completed = trailing_zeros(index + 1);
+    for (level = 0; level < completed; level++) {
+        const unsigned char *left = node -
+            (((size_t)2 << level) - 1) * log->digest_len;
+
+        hash_prefixed(log->algo, 1, left, log->digest_len,
+                node, log->digest_len, node + log->digest_len);
+        node += log->digest_len;
+    }
+
+    log->size++;
+#ifdef HAVE_MMAP
+    if (log->map) {
+        put_be64(log->map + 16, log->size);
+    }
+#endif
+    lua_pushinteger(L, (lua_Integer)index);
+    return 1;
+}
+
+/* log:root([size]) returns the tree hash of the first size leaves. */
+static int
+lgcrypt_merkle_log_root(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+    size_t n = check_tree_size(L, log, 2);
+    unsigned char digest[MERKLE_MAX_DIGEST];
+
+    merkle_range_hash(log, 0, n, digest);
+    lua_pushlstring(L, (const char *) digest, log->digest_len);
+    return 1;
+}
+
+/* log:inclusion_proof(index[, size]) returns the concatenated audit path. */
+static int
+lgcrypt_merkle_log_inclusion_proof(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    size_t n = check_tree_size(L, log, 3);
+    luaL_Buffer b;
+
+    luaL_argcheck(L, index >= 0 && (size_t)index < n, 2,
+            "leaf index out of range");
+    luaL_buffinit(L, &b);
+    merkle_path(log, &b, (size_t)index, 0, n);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* log:consistency_proof(old_size[, size]) */
+static int
+lgcrypt_merkle_log_consistency_proof(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+    lua_Integer m = luaL_checkinteger(L, 2);
+    size_t n = check_tree_size(L, log, 3);
+    luaL_Buffer b;
+
+    luaL_argcheck(L, m > 0 && (size_t)m <= n, 2, "tree size out of range");
+    luaL_buffinit(L, &b);
+    merkle_subproof(log, &b, (size_t)m, 0, n, 1);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* log:leaf(index) returns the leaf hash. */
+static int
+lgcrypt_merkle_log_leaf(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+    lua_Integer index = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, index >= 0 && (size_t)index < log->size, 2,
+            "leaf index out of range");
+    lua_pushlstring(L, (const char *) merkle_node(log, 0, (size_t)index),
+            log->digest_len);
+    return 1;
+}
+
+static int
+lgcrypt_merkle_log___len(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)log->size);
+    return 1;
+}
+
+/* log:sync() flushes a file-backed log to disk. */
+static int
+lgcrypt_merkle_log_sync(lua_State *L)
+{
+    LgcryptMerkleLog *log = checkMerkleLog(L, 1);
+
+#ifdef HAVE_MMAP
+    if (log->map && msync(log->map, log->map_len, MS_SYNC)) {
+        luaL_error(L, "Failed to sync Merkle log: %s", strerror(errno));
+    }
+#else
+    (void)log;
+#endif
+    return 0;
+}
+
+static const struct luaL_Reg lgcrypt_merkle_log_meta[] = {
+    {"__gc",                lgcrypt_merkle_log___gc},
+    {"__len",               lgcrypt_merkle_log___len},
+    {"size",                lgcrypt_merkle_log___len},
+    {"append",              lgcrypt_merkle_log_append},
+    {"root",                lgcrypt_merkle_log_root},
+    {"leaf",                lgcrypt_merkle_log_leaf},
+    {"inclusion_proof",     lgcrypt_merkle_log_inclusion_proof},
+    {"consistency_proof",   lgcrypt_merkle_log_consistency_proof},
+    {"sync",                lgcrypt_merkle_log_sync},
+    {NULL,                  NULL}
+};
+/* }}} */
+
+/* {{{ LRU caches */
+typedef struct LruEntry {
+    unsigned long long key;
+    struct LruEntry *newer, *older;     /* recency list */
+    struct LruEntry *chain;             /* hash bucket */
+} LruEntry;
+/* The value follows the entry. */
+#define LRU_VALUE(e)    ((unsigned char *)((e) + 1))
+
+typedef struct {
+    LruEntry **buckets;
+    size_t bucket_count;
+    LruEntry *newest, *oldest;
+    size_t count, capacity;
+    size_t value_len;
+} LruCache;
+
+/* Returns zero if the bucket array cannot be allocated. */
+static int
+lru_init(LruCache *c, size_t capacity, size_t value_len)
+{
+    memset(c, 0, sizeof(LruCache));
+    c->capacity = capacity;
+    c->value_len = value_len;
+    c->bucket_count = 16;
+    while (c->bucket_count < capacity) {
+        c->bucket_count <<= 1;
+    }
+    c->buckets = calloc(c->bucket_count, sizeof(LruEntry *));
+    return c->buckets != NULL;
+}
+
+static void
+lru_free(LruCache *c)
+{
+    LruEntry *e, *older;
+
+    for (e = c->newest; e; e = older) {
+        older = e->older;
+        free(e);
+    }
+    free(c->buckets);
+    memset(c, 0, sizeof(LruCache));
+}
+
+static LruEntry **
+lru_bucket(LruCache *c, unsigned long long key)
+{
+    key *= 0x9e3779b97f4a7c15ULL;
+    return &c->buckets[(size_t)(key >> 32) & (c->bucket_count - 1)];
+}
+
+static void
+lru_unlink(LruCache *c, LruEntry *e)
+{
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+}
+
+static void
+lru_push_newest(LruCache *c, LruEntry *e)
+{
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest) {
+        c->newest->newer = e;
+    } else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+/* Looks up a value and marks it as most recently used. */
+static unsigned char *
+lru_get(LruCache *c, unsigned long long key)
+{
+    LruEntry *e;
+
+    if (!c->buckets) {
+        return NULL;
+    }
+    for (e = *lru_bucket(c, key); e; e = e->chain) {
+        if (e->key == key) {
+            if (e != c->newest) {
+                lru_unlink(c, e);
+                lru_push_newest(c, e);
+            }
+            return LRU_VALUE(e);
+        }
+    }
+    return NULL;
+}
+
+/* Returns the value storage for a new key, evicting the least recently used
+ * entry if the cache is full. The storage is zeroed for a new entry and holds
+ * the old value for an evicted one. Returns NULL if nothing can be cached. */
+static unsigned char *
+lru_put(LruCache *c, unsigned long long key)
+{
+    LruEntry *e, **p;
+
+    if (!c->buckets || !c->capacity) {
+        return NULL;
+    }
+    if (c->count < c->capacity) {
+        e = calloc(1, sizeof(LruEntry) + c->value_len);
+        if (!e) {
+            return NULL;
+        }
+        c->count++;
+    } else {
+        e = c->oldest;
+        lru_unlink(c, e);
+        for (p = lru_bucket(c, e->key); *p != e; p = &(*p)->chain)
+            ;
+        *p = e->chain;
+    }
+    e->key = key;
+    p = lru_bucket(c, key);
+    e->chain = *p;
+    *p = e;
+    lru_push_newest(c, e);
+    return LRU_VALUE(e);
+}
+
+/* Removes the least recently used entry. */
+static void
+lru_remove_oldest(LruCache *c)
+{
+    LruEntry *e = c->oldest, **p;
+
+    if (!e) {
+        return;
+    }
+    lru_unlink(c, e);
+    for (p = lru_bucket(c, e->key); *p != e; p = &(*p)->chain)
+        ;
+    *p = e->chain;
+    free(e);
+    c->count--;
+}
+
+/* A fast non-cryptographic fingerprint for cache keys. */
+static unsigned long long
+fingerprint64(unsigned long long seed, const unsigned char *p, size_t len)
+{
+    unsigned long long h, w;
+    size_t i;
+
+    h = 0x9e3779b97f4a7c15ULL ^ (seed << 32) ^ len;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    for (w = 0, i = 0; i < len; i++) {
+        w |= (unsigned long long)p[i] << (8 * i);
+    }
+    h = (h ^ w) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 29);
+}
+/* }}} */
+
+/* {{{ Plaintext caches */
+/* Decrypted records keyed by session, direction and sequence number. An
+ * optional check string (such as the nonce and tag of the record) must match
+ * as well, so a changed record is decrypted again. */
+#define PLAIN_MAX_SESSION   255
+#define PLAIN_KEY_PREFIX    9       /* direction and be64(sequence) */
+/* Accounted per entry besides its data. */
+#define PLAIN_OVERHEAD      (sizeof(LruEntry) + sizeof(void *) + \
+        sizeof(PlainEntry))
+
+typedef struct {
+    size_t key_len, check_len, len;
+    /* The key, check and data follow. */
+} PlainEntry;
+
+typedef struct {
+    LruCache lru;               /* values are PlainEntry pointers */
+    size_t bytes, max_bytes;
+    unsigned long hits, misses;
+} LgcryptPlaintextCache;
+
+/* A cache with the session name used by a decryptor. */
+typedef struct {
+    LgcryptPlaintextCache *cache;
+    int ref;                    /* keeps the cache alive while set */
+    size_t session_len;
+    unsigned char session[PLAIN_MAX_SESSION];
+} PlainBinding;
+
+#define PLAIN_KEY(e)        ((unsigned char *)((e) + 1))
+#define PLAIN_CHECK(e)      (PLAIN_KEY(e) + (e)->key_len)
+#define PLAIN_DATA(e)       (PLAIN_CHECK(e) + (e)->check_len)
+#define PLAIN_SIZE(e)       (PLAIN_OVERHEAD + (e)->key_len + \
+        (e)->check_len + (e)->len)
+
+/* Builds the key, returns its length. */
+static size_t
+plain_key(unsigned char *key, const unsigned char *session, size_t session_len,
+        int direction, unsigned long long seq)
+{
+    key[0] = (unsigned char)direction;
+    put_be64(key + 1, seq);
+    memcpy(key + PLAIN_KEY_PREFIX, session, session_len);
+    return PLAIN_KEY_PREFIX + session_len;
+}
+
+/* Returns the cached data and its length, or NULL. */
+static const unsigned char *
+plain_lookup(LgcryptPlaintextCache *c, const unsigned char *key,
+        size_t key_len, const unsigned char *check, size_t check_len,
+        size_t *len)
+{
+    PlainEntry **slot, *e;
+
+    slot = (PlainEntry **) lru_get(&c->lru, fingerprint64(0, key, key_len));
+    e = slot ? *slot : NULL;
+    if (e && e->key_len == key_len && e->check_len == check_len &&
+            !memcmp(PLAIN_KEY(e), key, key_len) &&
+            !memcmp(PLAIN_CHECK(e), check, check_len)) {
+        c->hits++;
+        *len = e->len;
+        return PLAIN_DATA(e);
+    }
+    c->misses++;
+    return NULL;
+}
+
+static void
+plain_store(LgcryptPlaintextCache *c, const unsigned char *key,
+        size_t key_len, const unsigned char *check, size_t check_len,
+        const unsigned char *data, size_t len)
+{
+    unsigned long long fp = fingerprint64(0, key, key_len);
+    PlainEntry **slot, *e;
+    size_t size = PLAIN_OVERHEAD + key_len + check_len + len;
+
+    if (size > c->max_bytes) {
+        return;
+    }
+    /* Replace an entry with the same fingerprint, then make room. */
+    slot = (PlainEntry **) lru_get(&c->lru, fp);
+    if (slot) {
+        c->bytes -= PLAIN_SIZE(*slot);
+        free(*slot);
+        *slot = NULL;
+    }
+    while (c->bytes + size > c->max_bytes && c->lru.oldest) {
+        e = *(PlainEntry **) LRU_VALUE(c->lru.oldest);
+        if (e) {
+            c->bytes -= PLAIN_SIZE(e);
+            free(e);
+        }
+        if (slot && c->lru.oldest == c->lru.newest) {
+            /* Only the entry being replaced is left, and it is empty. */
+            break;
+        }
+        lru_remove_oldest(&c->lru);
+    }
+    if (!slot) {
+        slot = (PlainEntry **) lru_put(&c->lru, fp);
+        if (!slot) {
+            return;
+        }
+        if (*slot) {
+            c->bytes -= PLAIN_SIZE(*slot);
+            free(*slot);
+            *slot = NULL;
+        }
+    }
+    e = malloc(sizeof(PlainEntry) + key_len + check_len + len);
+    if (!e) {
+        return;
+    }
+    e->key_len = key_len;
+    e->check_len = check_len;
+    e->len = len;
+    memcpy(PLAIN_KEY(e), key, key_len);
+    memcpy(PLAIN_CHECK(e), check, check_len);
+    memcpy(PLAIN_DATA(e), data, len);
+    *slot = e;
+    c->bytes += size;
+}
+
+static void
+plain_clear(LgcryptPlaintextCache *c)
+{
+    LruEntry *e;
+
+    for (e = c->lru.newest; e; e = e->older) {
+        free(*(PlainEntry **) LRU_VALUE(e));
+    }
+    lru_free(&c->lru);
+    c->bytes = 0;
+}
+
+static LgcryptPlaintextCache *
+getPlaintextCache(lua_State *L, int arg)
+{
+    return (LgcryptPlaintextCache *)luaL_checkudata(L, arg,
+            "gcrypt.PlaintextCache");
+}
+
+static LgcryptPlaintextCache *
+checkPlaintextCache(lua_State *L, int arg)
+{
+    LgcryptPlaintextCache *c = getPlaintextCache(L, arg);
+    if (!c->lru.buckets) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return c;
+}
+
+static int
+lgcrypt_plaintext_cache___gc(lua_State *L)
+{
+    plain_clear(getPlaintextCache(L, 1));
+    return 0;
+}
+
+/* gcrypt.PlaintextCache(max_bytes[, max_entries]) */
+static int
+lgcrypt_plaintext_cache_open(lua_State *L)
+{
+    lua_Integer max_bytes = luaL_checkinteger(L, 1);
+    lua_Integer max_entries;
+    LgcryptPlaintextCache *c;
+
+    luaL_argcheck(L, max_bytes > 0, 1, "byte budget must be positive");
+    max_entries = luaL_optinteger(L, 2, max_bytes / 256 + 16);
+    luaL_argcheck(L, max_entries > 0, 2, "entry limit must be positive");
+
+    c = (LgcryptPlaintextCache *) lua_newuserdata(L,
+            sizeof(LgcryptPlaintextCache));
+    memset(c, 0, sizeof(LgcryptPlaintextCache));
+    luaL_getmetatable(L, "gcrypt.PlaintextCache");
+    lua_setmetatable(L, -2);
+    c->max_bytes = (size_t)max_bytes;
+    if (!lru_init(&c->lru, (size_t)max_entries, sizeof(PlainEntry *))) {
+        luaL_error(L, "Out of memory");
+    }
+    return 1;
+}
+
+/* Reads a direction given as boolean or number. */
+static int
+check_direction(lua_State *L, int arg)
+{
+    if (lua_type(L, arg) == LUA_TNUMBER) {
+        return lua_tointeger(L, arg) != 0;
+    }
+    return lua_toboolean(L, arg);
+}
+
+/* Builds the key from the session, direction and sequence arguments. */
+static size_t
+check_plain_key(lua_State *L, int arg, unsigned char *key)
+{
+    size_t session_len;
+    const char *session = luaL_checklstring(L, arg, &session_len);
+    lua_Integer seq = luaL_checkinteger(L, arg + 2);
+
+    luaL_argcheck(L, session_len <= PLAIN_MAX_SESSION, arg,
+            "session name too long");
+    return plain_key(key, (const unsigned char *) session, session_len,
+            check_direction(L, arg + 1), (unsigned long long)seq);
+}
+
+/* cache:get(session, direction, seq[, check]) returns the plaintext or
+ * nil. */
+static int
+lgcrypt_plaintext_cache_get(lua_State *L)
+{
+    LgcryptPlaintextCache *c = checkPlaintextCache(L, 1);
+    unsigned char key[PLAIN_KEY_PREFIX + PLAIN_MAX_SESSION];
+    size_t key_len = check_plain_key(L, 2, key), check_len, len;
+    const char *check = luaL_optlstring(L, 5, "", &check_len);
+    const unsigned char *data;
+
+    data = plain_lookup(c, key, key_len, (const unsigned char *) check,
+            check_len, &len);
+    if (data) {
+        lua_pushlstring(L, (const char *) data, len);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* cache:put(session, direction, seq, plaintext[, check]) */
+static int
+lgcrypt_plaintext_cache_put(lua_State *L)
+{
+    LgcryptPlaintextCache *c = checkPlaintextCache(L, 1);
+    unsigned char key[PLAIN_KEY_PREFIX + PLAIN_MAX_SESSION];
+    size_t key_len = check_plain_key(L, 2, key), check_len, len;
+    const char *data = luaL_checklstring(L, 5, &len);
+    const char *check = luaL_optlstring(L, 6, "", &check_len);
+
+    plain_store(c, key, key_len, (const unsigned char *) check, check_len,
+            (const unsigned char *) data, len);
+    return 0;
+}
+
+/* cache:stats() */
+static int
+lgcrypt_plaintext_cache_stats(lua_State *L)
+{
+    LgcryptPlaintextCache *c = checkPlaintextCache(L, 1);
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)c->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)c->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)c->lru.count);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, (lua_Integer)c->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)c->max_bytes);
+    lua_setfield(L, -2, "max_bytes");
+    return 1;
+}
+
+/* cache:clear() removes all entries. */
+static int
+lgcrypt_plaintext_cache_clear(lua_State *L)
+{
+    LgcryptPlaintextCache *c = checkPlaintextCache(L, 1);
+    size_t capacity = c->lru.capacity;
+
+    plain_clear(c);
+    if (!lru_init(&c->lru, capacity, sizeof(PlainEntry *))) {
+        luaL_error(L, "Out of memory");
+    }
+    return 0;
+}
+
+static const struct luaL_Reg lgcrypt_plaintext_cache_meta[] = {
+    {"__gc",    lgcrypt_plaintext_cache___gc},
+    {"get",     lgcrypt_plaintext_cache_get},
+    {"put",     lgcrypt_plaintext_cache_put},
+    {"stats",   lgcrypt_plaintext_cache_stats},
+    {"clear",   lgcrypt_plaintext_cache_clear},
+    {NULL,      NULL}
+};
+
+static void
+plain_binding_free(lua_State *L, PlainBinding *b)
+{
+    if (b->cache) {
+        luaL_unref(L, LUA_REGISTRYINDEX, b->ref);
+        b->cache = NULL;
+    }
+}
+
+/* decryptor:set_cache(cache, session) or decryptor:set_cache(nil) */
+static void
+plain_binding_set(lua_State *L, PlainBinding *b)
+{
+    const char *session;
+
+    plain_binding_free(L, b);
+    if (lua_isnoneornil(L, 2)) {
+        return;
+    }
+    b->cache = checkPlaintextCache(L, 2);
+    session = luaL_checklstring(L, 3, &b->session_len);
+    luaL_argcheck(L, b->session_len <= PLAIN_MAX_SESSION, 3,
+            "session name too long");
+    memcpy(b->session, session, b->session_len);
+    lua_pushvalue(L, 2);
+    b->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Pushes the cached plaintext of a record and returns 1 on a hit. */
+static int
+plain_binding_push(lua_State *L, PlainBinding *b, int direction,
+        unsigned long long seq, const unsigned char *check, size_t check_len)
+{
+    unsigned char key[PLAIN_KEY_PREFIX + PLAIN_MAX_SESSION];
+    const unsigned char *data;
+    size_t key_len, len;
+
+    if (!b->cache) {
+        return 0;
+    }
+    key_len = plain_key(key, b->session, b->session_len, direction, seq);
+    data = plain_lookup(b->cache, key, key_len, check, check_len, &len);
+    if (!data) {
+        return 0;
+    }
+    lua_pushlstring(L, (const char *) data, len);
+    return 1;
+}
+
+static void
+plain_binding_store(PlainBinding *b, int direction, unsigned long long seq,
+        const unsigned char *check, size_t check_len,
+        const unsigned char *data, size_t len)
+{
+    unsigned char key[PLAIN_KEY_PREFIX + PLAIN_MAX_SESSION];
+    size_t key_len;
+
+    if (b->cache) {
+        key_len = plain_key(key, b->session, b->session_len, direction, seq);
+        plain_store(b->cache, key, key_len, check, check_len, data, len);
+    }
+}
+/* }}} */
+
+/* {{{ Verified readers */
+/* Nodes are cached with the level in the upper bits of the key. */
+#define NODE_KEY(level, index) \
+    (((unsigned long long)(level) << 56) | (unsigned long long)(index))
+
+typedef struct {
+    FILE *data_fp;
+    FILE *tree_fp;
+    int algo;
+    size_t digest_len;
+    size_t leaf_size;
+    unsigned long long data_size;
+    unsigned levels;
+    unsigned long long level_offset[64];
+    unsigned long long level_count[64];
+    unsigned char root[MERKLE_MAX_DIGEST];
+    LruCache nodes;         /* verified node hashes */
+    LruCache blocks;        /* verified data blocks */
+} LgcryptVerifiedReader;
+
+/* Reads len bytes at the given offset, returns non-zero on failure. */
+static int
+read_at(FILE *fp, unsigned long long offset, void *buf, size_t len)
+{
+#ifdef _WIN32
+    if (_fseeki64(fp, (__int64)offset, SEEK_SET)) {
+        return -1;
+    }
+#else
+    if (fseeko(fp, (off_t)offset, SEEK_SET)) {
+        return -1;
+    }
+#endif
+    return fread(buf, 1, len, fp) != len;
+}
+
+static void
+verified_reader_close(LgcryptVerifiedReader *r)
+{
+    if (r->data_fp) {
+        fclose(r->data_fp);
+        r->data_fp = NULL;
+    }
+    if (r->tree_fp) {
+        fclose(r->tree_fp);
+        r->tree_fp = NULL;
+    }
+    lru_free(&r->nodes);
+    lru_free(&r->blocks);
+}
+
+/* Checks the hash of a leaf against the tree up to a verified node or the
+ * root. The nodes on the path and their siblings are cached once the path is
+ * verified. */
+static void
+verify_leaf_hash(lua_State *L, LgcryptVerifiedReader *r, size_t leaf,
+        unsigned char *hash)
+{
+    unsigned char path[64][2][MERKLE_MAX_DIGEST];
+    unsigned char has_sibling[64];
+    unsigned char parent[MERKLE_MAX_DIGEST];
+    unsigned char *cached, *slot;
+    size_t dlen = r->digest_len, index = leaf;
+    unsigned level, n;
+
+    for (level = 0; ; level++) {
+        cached = lru_get(&r->nodes, NODE_KEY(level, index));
+        if (cached || level + 1 == r->levels) {
+            if (memcmp(hash, cached ? cached : r->root, dlen)) {
+                luaL_error(L, "Hash tree verification failed");
+            }
+            break;
+        }
+        memcpy(path[level][0], hash, dlen);
+        has_sibling[level] = (index ^ 1) < r->level_count[level];
+        if (has_sibling[level]) {
+            if (read_at(r->tree_fp, r->level_offset[level] + (index ^ 1) * dlen,
+                        path[level][1], dlen)) {
+                luaL_error(L, "Failed to read hash tree");
+            }
+            if (index & 1) {
+                hash_prefixed(r->algo, 1, path[level][1], dlen, hash, dlen,
+                        parent);
+            } else {
+                hash_prefixed(r->algo, 1, hash, dlen, path[level][1], dlen,
+                        parent);
+            }
+            memcpy(hash, parent, dlen);
+        }
+        /* Otherwise the odd node is promoted unchanged. */
+        index >>= 1;
+    }
+
+    for (n = 0; n < level; n++) {
+        index = leaf >> n;
+        slot = lru_put(&r->nodes, NODE_KEY(n, index));
+        if (slot) {
+            memcpy(slot, path[n][0], dlen);
+        }
+        if (has_sibling[n]) {
+            slot = lru_put(&r->nodes, NODE_KEY(n, index ^ 1));
+            if (slot) {
+                memcpy(slot, path[n][1], dlen);
+            }
+        }
+    }
+}
+
+/* Returns a verified data block, the length is stored in block_len. */
+static const unsigned char *
+verified_block(lua_State *L, LgcryptVerifiedReader *r, size_t block,
+        unsigned char *scratch, size_t *block_len)
+{
+    unsigned long long offset = (unsigned long long)block * r->leaf_size;
+    unsigned char hash[MERKLE_MAX_DIGEST];
+    unsigned char *cached;
+
+    *block_len = r->leaf_size;
+    if (r->data_size - offset < r->leaf_size) {
+        *block_len = (size_t)(r->data_size - offset);
+    }
+    cached = lru_get(&r->blocks, block);
+    if (cached) {
+        return cached;
+    }
+    if (read_at(r->data_fp, offset, scratch, *block_len)) {
+        luaL_error(L, "Failed to read data block %d", (int)block);
+    }
+    hash_prefixed(r->algo, 0, scratch, *block_len, NULL, 0, hash);
+    verify_leaf_hash(L, r, block, hash);
+    cached = lru_put(&r->blocks, block);
+    if (cached) {
+        memcpy(cached, scratch, *block_len);
+        return cached;
+    }
+    return scratch;
+}
+
+static LgcryptVerifiedReader *
+getVerifiedReader(lua_State *L, int arg)
+{
+    return (LgcryptVerifiedReader *)luaL_checkudata(L, arg,
+            "gcrypt.VerifiedReader");
+}
+
+static LgcryptVerifiedReader *
+checkVerifiedReader(lua_State *L, int arg)
+{
+    LgcryptVerifiedReader *r = getVerifiedReader(L, arg);
+    if (!r->data_fp) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return r;
+}
+
+static int
+lgcrypt_verified_reader___gc(lua_State *L)
+{
+    verified_reader_close(getVerifiedReader(L, 1));
+    return 0;
+}
+
+/* Reads the tree file header and computes the level layout. */
+static void
+verified_reader_load_tree(lua_State *L, LgcryptVerifiedReader *r,
+        const char *tree_path, int algo)
+{
+    unsigned char header[MERKLE_TREE_HEADER_SIZE];
+    unsigned long long offset = MERKLE_TREE_HEADER_SIZE, count;
+    unsigned level;
+
+    if (read_at(r->tree_fp, 0, header, sizeof(header)) ||
+            memcmp(header, MERKLE_TREE_MAGIC, 8)) {
+        luaL_error(L, "Invalid hash tree file %s", tree_path);
+    }
+    r->algo = (int)get_be32(header + 8);
+    r->digest_len = get_be32(header + 12);
+    r->leaf_size = (size_t)get_be64(header + 16);
+    r->data_size = get_be64(header + 24);
+    r->levels = (unsigned)get_be32(header + 32);
+    if (algo && r->algo != algo) {
+        luaL_error(L, "Hash tree uses a different hash algorithm");
+    }
+    if (r->digest_len != gcry_md_get_algo_dlen(r->algo) ||
+            r->digest_len > MERKLE_MAX_DIGEST || r->leaf_size == 0) {
+        luaL_error(L, "Invalid hash tree file %s", tree_path);
+    }
+
+    count = (r->data_size + r->leaf_size - 1) / r->leaf_size;
+    for (level = 0; level < 64; level++) {
+        r->level_offset[level] = offset;
+        r->level_count[level] = count;
+        offset += count * r->digest_len;
+        if (count <= 1) {
+            break;
+        }
+        count = (count + 1) / 2;
+    }
+    /* An empty tree has a leaf level without nodes and a root. */
+    if (r->levels != level + 1 + (r->data_size == 0)) {
+        luaL_error(L, "Invalid hash tree file %s", tree_path);
+    }
+}
+
+/* gcrypt.VerifiedReader(path, tree_path, root[, options]) */
+static int
+lgcrypt_verified_reader_open(lua_State *L)
+{
+    LgcryptVerifiedReader *r;
+    const char *path, *tree_path, *root;
+    size_t root_len;
+    lua_Integer cache_blocks, cache_nodes;
+    int algo;
+
+    path = luaL_checkstring(L, 1);
+    tree_path = luaL_checkstring(L, 2);
+    root = luaL_checklstring(L, 3, &root_len);
+    algo = (int)opt_field_integer(L, 4, "algo", 0);
+    cache_blocks = opt_field_integer(L, 4, "cache_blocks", 64);
+    cache_nodes = opt_field_integer(L, 4, "cache_nodes", 4096);
+    luaL_argcheck(L, cache_blocks >= 0 && cache_nodes >= 0, 4,
+            "cache sizes must not be negative");
+
+    r = (LgcryptVerifiedReader *) lua_newuserdata(L,
+            sizeof(LgcryptVerifiedReader));
+    memset(r, 0, sizeof(LgcryptVerifiedReader));
+    luaL_getmetatable(L, "gcrypt.VerifiedReader");
+    lua_setmetatable(L, -2);
+
+    r->tree_fp = fopen(tree_path, "rb");
+    if (!r->tree_fp) {
+        luaL_error(L, "Failed to open %s: %s", tree_path, strerror(errno));
+    }
+    verified_reader_load_tree(L, r, tree_path, algo);
+    if (root_len != r->digest_len) {
+        luaL_error(L, "Invalid root hash length");
+    }
+    memcpy(r->root, root, root_len);
+
+    if (!lru_init(&r->nodes, (size_t)cache_nodes, r->digest_len) ||
+            !lru_init(&r->blocks, (size_t)cache_blocks, r->leaf_size)) {
+        luaL_error(L, "Out of memory");
+    }
+    r->data_fp = fopen(path, "rb");
+    if (!r->data_fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    return 1;
+}
+
+/* reader:read(offset, len) returns verified data, shorter at the end. */
+static int
+lgcrypt_verified_reader_read(lua_State *L)
+{
+    LgcryptVerifiedReader *r = checkVerifiedReader(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+    unsigned long long pos, end;
+    const unsigned char *block;
+    unsigned char *scratch;
+    size_t block_len, skip, n;
+    luaL_Buffer b;
+
+    luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+    luaL_argcheck(L, len >= 0, 3, "length must not be negative");
+    pos = (unsigned long long)offset;
+    end = pos + (unsigned long long)len;
+    if (end > r->data_size) {
+        end = r->data_size;
+    }
+
+    scratch = lua_newuserdata(L, r->leaf_size);
+    luaL_buffinit(L, &b);
+    while (pos < end) {
+        block = verified_block(L, r, (size_t)(pos / r->leaf_size), scratch,
+                &block_len);
+        skip = (size_t)(pos % r->leaf_size);
+        n = block_len - skip;
+        if (n > end - pos) {
+            n = (size_t)(end - pos);
+        }
+        luaL_addlstring(&b, (const char *) block + skip, n);
+        pos += n;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* reader:size() returns the data size. */
+static int
+lgcrypt_verified_reader_size(lua_State *L)
+{
+    LgcryptVerifiedReader *r = checkVerifiedReader(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)r->data_size);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_verified_reader_meta[] = {
+    {"__gc",    lgcrypt_verified_reader___gc},
+    {"read",    lgcrypt_verified_reader_read},
+    {"size",    lgcrypt_verified_reader_size},
+    {NULL,      NULL}
+};
+/* }}} */
+
+/* {{{ Digest caches */
+/* Identifies a file version. */
+typedef struct {
+    unsigned long long dev, ino, size, mtime_ns;
+    int cacheable;
+} FileKey;
+
+#ifdef HAVE_MMAP
+#include <time.h>
+
+/* On-disk format: magic, version, number of slots and number of used slots
+ * (big-endian), followed by the slots of an open addressing table. A file has
+ * a single slot per algorithm that is replaced when the file changes. */
+#define DIGEST_CACHE_MAGIC      "GCRYDGST"
+#define DIGEST_CACHE_VERSION    2
+#define DIGEST_CACHE_HEADER     64
+#define DIGEST_CACHE_MIN_SLOTS  1024
+#define DIGEST_CACHE_MAX_ENTRIES (256 * 1024)
+
+/* Slot layout: device, inode, size and mtime in nanoseconds (64-bit), algo
+ * and digest length (32-bit), the digest and a checksum of the other fields.
+ * Slots with a wrong checksum (torn writes after a crash) are ignored. */
+#define SLOT_SIZE               128
+#define SLOT_ALGO               32
+#define SLOT_DIGEST_LEN         36
+#define SLOT_DIGEST             40
+#define SLOT_CHECK              120
+#define SLOT_MAX_DIGEST         64
+
+#if defined(__APPLE__)
+#define ST_MTIME_NSEC(st)       ((st).st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)       ((st).st_mtim.tv_nsec)
+#endif
+
+typedef struct {
+    unsigned char *map;
+    size_t map_len;
+    size_t slots;
+    size_t max_slots;           /* the table is not grown beyond */
+    unsigned long long max_entries;
+    int fd;
+    unsigned long hits, misses, stores, evictions;
+} LgcryptDigestCache;
+
+/* FNV-1a */
+static unsigned long long
+fnv1a64(const unsigned char *p, size_t len)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static unsigned long long
+slot_checksum(const unsigned char *slot)
+{
+    unsigned long long h = fnv1a64(slot, SLOT_CHECK);
+
+    return h ? h : 1;
+}
+
+static void
+slot_put_key(unsigned char *slot, const FileKey *key, int algo,
+        size_t digest_len)
+{
+    memset(slot, 0, SLOT_SIZE);
+    put_be64(slot, key->dev);
+    put_be64(slot + 8, key->ino);
+    put_be64(slot + 16, key->size);
+    put_be64(slot + 24, key->mtime_ns);
+    put_be32(slot + SLOT_ALGO, (unsigned long)algo);
+    put_be32(slot + SLOT_DIGEST_LEN, (unsigned long)digest_len);
+}
+
+/* Returns non-zero if two slots are for the same file (device and inode)
+ * and algorithm, regardless of the file version. */
+static int
+slot_same_file(const unsigned char *a, const unsigned char *b)
+{
+    return !memcmp(a, b, 16) && !memcmp(a + SLOT_ALGO, b + SLOT_ALGO, 8);
+}
+
+static size_t
+digest_cache_index(const LgcryptDigestCache *c, const unsigned char *slot)
+{
+    unsigned char id[24];
+    unsigned long long h;
+
+    memcpy(id, slot, 16);
+    memcpy(id + 16, slot + SLOT_ALGO, 8);
+    h = fnv1a64(id, sizeof(id));
+    /* Mix the upper bits into the index. */
+    h ^= h >> 29;
+    return (size_t)(h & (c->slots - 1));
+}
+
+#define CACHE_SLOT(c, i)    ((c)->map + DIGEST_CACHE_HEADER + (i) * SLOT_SIZE)
+
+/* Finds the slot of the file and algorithm of slot_key (any version),
+ * returns NULL if absent. If free_slot is given, it receives the first
+ * reusable slot on the probe sequence. */
+static unsigned char *
+digest_cache_find(LgcryptDigestCache *c, const unsigned char *slot_key,
+        unsigned char **free_slot)
+{
+    size_t i = digest_cache_index(c, slot_key), n;
+    unsigned char *slot;
+    unsigned long long check;
+
+    if (free_slot) {
+        *free_slot = NULL;
+    }
+    for (n = 0; n < c->slots; n++, i = (i + 1) & (c->slots - 1)) {
+        slot = CACHE_SLOT(c, i);
+        check = get_be64(slot + SLOT_CHECK);
+        if (check == 0 || check != slot_checksum(slot)) {
+            if (free_slot && !*free_slot) {
+                *free_slot = slot;
+            }
+            if (check == 0) {
+                break;
+            }
+            continue;
+        }
+        if (slot_same_file(slot, slot_key)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void
+digest_cache_set_used(LgcryptDigestCache *c, unsigned long long used)
+{
+    put_be64(c->map + 24, used);
+}
+
+static unsigned long long
+digest_cache_used(LgcryptDigestCache *c)
+{
+    return get_be64(c->map + 24);
+}
+
+/* Maps the file with the given number of slots, returns zero on failure. */
+static int
+digest_cache_map(LgcryptDigestCache *c, size_t slots)
+{
+    size_t map_len = DIGEST_CACHE_HEADER + slots * SLOT_SIZE;
+    unsigned char *p;
+
+    if (ftruncate(c->fd, (off_t)map_len)) {
+        return 0;
+    }
+    p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    if (c->map) {
+        munmap(c->map, c->map_len);
+    }
+    c->map = p;
+    c->map_len = map_len;
+    c->slots = slots;
+    return 1;
+}
+
+/* Doubles the number of slots and reinserts the valid entries. */
+static int
+digest_cache_grow(LgcryptDigestCache *c)
+{
+    size_t old_slots = c->slots, i, used = 0;
+    unsigned char *entries, *slot, *free_slot;
+
+    entries = malloc(old_slots * SLOT_SIZE);
+    if (!entries) {
+        return 0;
+    }
+    memcpy(entries, CACHE_SLOT(c, 0), old_slots * SLOT_SIZE);
+    if (!digest_cache_map(c, old_slots * 2)) {
+        free(entries);
+        return 0;
+    }
+    memset(CACHE_SLOT(c, 0), 0, c->slots * SLOT_SIZE);
+    for (i = 0; i < old_slots; i++) {
+        slot = entries + i * SLOT_SIZE;
+        if (get_be64(slot + SLOT_CHECK) != 0 &&
+                get_be64(slot + SLOT_CHECK) == slot_checksum(slot) &&
+                !digest_cache_find(c, slot, &free_slot) && free_slot) {
+            memcpy(free_slot, slot, SLOT_SIZE);
+            used++;
+        }
+    }
+    free(entries);
+    put_be64(c->map + 16, c->slots);
+    digest_cache_set_used(c, used);
+    return 1;
+}
+
+/* Copies a cached digest to out, returns non-zero on a hit. */
+static int
+digest_cache_lookup(LgcryptDigestCache *c, const FileKey *key, int algo,
+        size_t digest_len, unsigned char *out)
+{
+    unsigned char slot_key[SLOT_SIZE];
+    unsigned char *slot;
+
+    slot_put_key(slot_key, key, algo, digest_len);
+    slot = digest_cache_find(c, slot_key, NULL);
+    if (!slot || memcmp(slot, slot_key, SLOT_DIGEST)) {
+        c->misses++;
+        return 0;
+    }
+    memcpy(out, slot + SLOT_DIGEST, digest_len);
+    c->hits++;
+    return 1;
+}
+
+/* Writes an entry into a slot. The checksum is written last so that a torn
+ * slot is never trusted. */
+static void
+digest_cache_write(unsigned char *slot, const unsigned char *entry)
+{
+    memcpy(slot, entry, SLOT_CHECK);
+    put_be64(slot + SLOT_CHECK, slot_checksum(entry));
+}
+
+/* Evicts an entry to make room for entry: the one in its home slot is
+ * replaced (returns non-zero), otherwise the next one on the probe sequence
+ * is turned into a tombstone, a slot with a wrong checksum that lookups pass
+ * over and stores reuse. */
+static int
+digest_cache_evict(LgcryptDigestCache *c, const unsigned char *entry)
+{
+    size_t i = digest_cache_index(c, entry), n;
+    unsigned char *slot;
+    unsigned long long check;
+
+    for (n = 0; n < c->slots; n++, i = (i + 1) & (c->slots - 1)) {
+        slot = CACHE_SLOT(c, i);
+        check = get_be64(slot + SLOT_CHECK);
+        if (check != 0 && check == slot_checksum(slot)) {
+            break;
+        }
+    }
+    if (n == c->slots) {
+        return 0;
+    }
+    c->evictions++;
+    if (n == 0) {
+        digest_cache_write(slot, entry);
+        return 1;
+    }
+    put_be64(slot + SLOT_CHECK, check == 1 ? 2 : 1);
+    digest_cache_set_used(c, digest_cache_used(c) - 1);
+    return 0;
+}
+
+/* Stores a digest. The entry of an older version of the file is replaced.
+ * Once max_entries files are cached, a new entry evicts one near its home
+ * slot, so that files that disappeared are eventually evicted. */
+static void
+digest_cache_store(LgcryptDigestCache *c, const FileKey *key, int algo,
+        size_t digest_len, const unsigned char *digest)
+{
+    unsigned char entry[SLOT_SIZE];
+    unsigned char *slot, *free_slot;
+    unsigned long long used = digest_cache_used(c);
+
+    if (!key->cacheable || digest_len > SLOT_MAX_DIGEST) {
+        return;
+    }
+    slot_put_key(entry, key, algo, digest_len);
+    memcpy(entry + SLOT_DIGEST, digest, digest_len);
+    slot = digest_cache_find(c, entry, &free_slot);
+    if (slot) {
+        digest_cache_write(slot, entry);
+        c->stores++;
+        return;
+    }
+    if (used < c->max_entries &&
+            (used + 1) * 4 > (unsigned long long)c->slots * 3 &&
+            c->slots < c->max_slots && digest_cache_grow(c)) {
+        digest_cache_find(c, entry, &free_slot);
+    }
+    if (used >= c->max_entries ||
+            (used + 1) * 4 > (unsigned long long)c->slots * 3) {
+        if (digest_cache_evict(c, entry)) {
+            c->stores++;
+            return;
+        }
+        /* The tombstone may come before the first free slot. */
+        digest_cache_find(c, entry, &free_slot);
+    }
+    if (!free_slot) {
+        return;
+    }
+    digest_cache_write(free_slot, entry);
+    digest_cache_set_used(c, digest_cache_used(c) + 1);
+    c->stores++;
+}
+
+/* Fills the key from a stat result. Files modified within the last seconds
+ * are not cached since a later change could keep the same timestamp. */
+static void
+file_key_from_stat(FileKey *key, const struct stat *st)
+{
+    key->dev = (unsigned long long)st->st_dev;
+    key->ino = (unsigned long long)st->st_ino;
+    key->size = (unsigned long long)st->st_size;
+    key->mtime_ns = (unsigned long long)st->st_mtime * 1000000000ULL +
+        (unsigned long long)ST_MTIME_NSEC(*st);
+    key->cacheable = S_ISREG(st->st_mode) &&
+        (long)st->st_mtime + 2 <= (long)time(NULL);
+}
+
+static LgcryptDigestCache *
+getDigestCache(lua_State *L, int arg)
+{
+    return (LgcryptDigestCache *)luaL_checkudata(L, arg, "gcrypt.DigestCache");
+}
+
+static LgcryptDigestCache *
+checkDigestCache(lua_State *L, int arg)
+{
+    LgcryptDigestCache *c = getDigestCache(L, arg);
+    if (!c->map) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return c;
+}
+
+static int
+lgcrypt_digest_cache___gc(lua_State *L)
+{
+    LgcryptDigestCache *c = getDigestCache(L, 1);
+
+    if (c->map) {
+        munmap(c->map, c->map_len);
+        c->map = NULL;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    return 0;
+}
+
+/* gcrypt.DigestCache(path[, max_entries]) */
+static int
+lgcrypt_digest_cache_open(lua_State *L)
+{
+    LgcryptDigestCache *c;
+    const char *path = luaL_checkstring(L, 1);
+    lua_Integer max_entries = luaL_optinteger(L, 2, DIGEST_CACHE_MAX_ENTRIES);
+    struct stat st;
+    unsigned long long slots = DIGEST_CACHE_MIN_SLOTS;
+    int fresh;
+
+    luaL_argcheck(L, max_entries > 0, 2, "max_entries must be positive");
+
+    c = (LgcryptDigestCache *) lua_newuserdata(L, sizeof(LgcryptDigestCache));
+    memset(c, 0, sizeof(LgcryptDigestCache));
+    c->fd = -1;
+    luaL_getmetatable(L, "gcrypt.DigestCache");
+    lua_setmetatable(L, -2);
+    /* Keep the load factor at most 3/4. */
+    c->max_entries = (unsigned long long)max_entries;
+    c->max_slots = DIGEST_CACHE_MIN_SLOTS;
+    while ((unsigned long long)max_entries * 4 > (unsigned long long)c->max_slots * 3 &&
+            c->max_slots <= ((size_t)-1 / SLOT_SIZE) / 2) {
+        c->max_slots *= 2;
+    }
+
+    c->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (c->fd < 0 || fstat(c->fd, &st)) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    fresh = st.st_size == 0;
+    if (!fresh) {
+        unsigned char header[DIGEST_CACHE_HEADER];
+
+        if (st.st_size < DIGEST_CACHE_HEADER ||
+                pread(c->fd, header, sizeof(header), 0) != sizeof(header) ||
+                memcmp(header, DIGEST_CACHE_MAGIC, 8)) {
+            luaL_error(L, "Invalid digest cache file %s", path);
+        }
+        slots = get_be64(header + 16);
+        /* A file of another version or that was not grown completely is
+         * started over. */
+        if (get_be32(header + 8) != DIGEST_CACHE_VERSION ||
+                slots < DIGEST_CACHE_MIN_SLOTS || (slots & (slots - 1)) ||
+                (unsigned long long)st.st_size !=
+                DIGEST_CACHE_HEADER + slots * SLOT_SIZE) {
+            slots = DIGEST_CACHE_MIN_SLOTS;
+            fresh = 1;
+        }
+    }
+    if (fresh && ftruncate(c->fd, 0)) {
+        luaL_error(L, "Failed to reset %s: %s", path, strerror(errno));
+    }
+    if (!digest_cache_map(c, (size_t)slots)) {
+        luaL_error(L, "Failed to map %s: %s", path, strerror(errno));
+    }
+    if (fresh) {
+        memcpy(c->map, DIGEST_CACHE_MAGIC, 8);
+        put_be32(c->map + 8, DIGEST_CACHE_VERSION);
+        put_be64(c->map + 16, slots);
+        digest_cache_set_used(c, 0);
+    }
+    return 1;
+}
+
+/* cache:stats() returns a table with hits, misses, stores, evictions,
+ * entries and slots. */
+static int
+lgcrypt_digest_cache_stats(lua_State *L)
+{
+    LgcryptDigestCache *c = checkDigestCache(L, 1);
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)c->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)c->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)c->stores);
+    lua_setfield(L, -2, "stores");
+    lua_pushinteger(L, (lua_Integer)c->evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, (lua_Integer)digest_cache_used(c));
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, (lua_Integer)c->slots);
+    lua_setfield(L, -2, "slots");
+    return 1;
+}
+
+/* cache:clear() removes all entries. */
+static int
+lgcrypt_digest_cache_clear(lua_State *L)
+{
+    LgcryptDigestCache *c = checkDigestCache(L, 1);
+
+    memset(CACHE_SLOT(c, 0), 0, c->slots * SLOT_SIZE);
+    digest_cache_set_used(c, 0);
+    return 0;
+}
+
+/* cache:sync() flushes the table to disk. */
+static int
+lgcrypt_digest_cache_sync(lua_State *L)
+{
+    LgcryptDigestCache *c = checkDigestCache(L, 1);
+
+    if (msync(c->map, c->map_len, MS_SYNC)) {
+        luaL_error(L, "Failed to sync digest cache: %s", strerror(errno));
+    }
+    return 0;
+}
+
+static const struct luaL_Reg lgcrypt_digest_cache_meta[] = {
+    {"__gc",    lgcrypt_digest_cache___gc},
+    {"stats",   lgcrypt_digest_cache_stats},
+    {"clear",   lgcrypt_digest_cache_clear},
+    {"sync",    lgcrypt_digest_cache_sync},
+    {NULL,      NULL}
+};
+#endif
+/* }}} */
+
+/* {{{ Digest sets */
+/* On-disk format: magic, digest length and zero (big-endian 32-bit), number
+ * of slots and entries (big-endian 64-bit), then a bitmap of used slots and
+ * the slots of an open addressing table with linear probing. Files are used
+ * in place by mapping them. */
+#define DIGEST_SET_MAGIC        "GCRYDSET"
+#define DIGEST_SET_HEADER       32
+#define DIGEST_SET_MIN_SLOTS    64
+#define DIGEST_SET_MAX_DIGEST   64
+
+typedef struct {
+    unsigned char *data;        /* header, bitmap and slots */
+    size_t data_len;
+    size_t slots;               /* power of two */
+    size_t count;
+    size_t digest_len;
+    unsigned char *bitmap;
+    unsigned char *table;
+    int mapped;                 /* read-only file mapping */
+} LgcryptDigestSet;
+
+#define DIGEST_SET_USED(s, i)   ((s)->bitmap[(i) >> 3] & (1 << ((i) & 7)))
+
+/* The home slot takes the upper bits of the leading 64 bits times the
+ * golden ratio. */
+static size_t
+digest_set_index(const LgcryptDigestSet *s, const unsigned char *digest)
+{
+    unsigned long long h = 0;
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+        h = (h << 8) | (i < s->digest_len ? digest[i] : 0);
+    }
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (s->slots - 1);
+}
+
+/* Returns non-zero if the digest is present. pos receives its slot or the
+ * free slot where it would be inserted. */
+static int
+digest_set_find(const LgcryptDigestSet *s, const unsigned char *digest,
+        size_t *pos)
+{
+    size_t i = digest_set_index(s, digest), n;
+
+    /* The table is never full, so an unused slot ends the probe. The bound
+     * only matters for corrupt tables. */
+    for (n = 0; n < s->slots && DIGEST_SET_USED(s, i); n++) {
+        if (!memcmp(s->table + i * s->digest_len, digest, s->digest_len)) {
+            *pos = i;
+            return 1;
+        }
+        i = (i + 1) & (s->slots - 1);
+    }
+    *pos = i;
+    return 0;
+}
+
+static size_t
+digest_set_data_len(size_t slots, size_t digest_len)
+{
+    return DIGEST_SET_HEADER + slots / 8 + slots * digest_len;
+}
+
+/* Points the bitmap and table into data. */
+static void
+digest_set_layout(LgcryptDigestSet *s)
+{
+    s->bitmap = s->data + DIGEST_SET_HEADER;
+    s->table = s->bitmap + s->slots / 8;
+}
+
+/* Resizes the table to hold at least count entries at a load factor of at
+ * most 3/4. Returns zero if out of memory. */
+static int
+digest_set_reserve(LgcryptDigestSet *s, size_t count)
+{
+    LgcryptDigestSet old = *s;
+    size_t slots = s->slots ? s->slots : DIGEST_SET_MIN_SLOTS, i, pos;
+
+    while (count > slots / 4 * 3) {
+        slots *= 2;
+    }
+    if (slots == s->slots) {
+        return 1;
+    }
+    s->data_len = digest_set_data_len(slots, s->digest_len);
+    s->data = calloc(1, s->data_len);
+    if (!s->data) {
+        *s = old;
+        return 0;
+    }
+    s->slots = slots;
+    digest_set_layout(s);
+    memcpy(s->data, DIGEST_SET_MAGIC, 8);
+    put_be32(s->data + 8, (unsigned long)s->digest_len);
+    for (i = 0; i < old.slots; i++) {
+        if (DIGEST_SET_USED(&old, i)) {
+            digest_set_find(s, old.table + i * s->digest_len, &pos);
+            s->bitmap[pos >> 3] |= 1 << (pos & 7);
+            memcpy(s->table + pos * s->digest_len,
+                    old.table + i * s->digest_len, s->digest_len);
+        }
+    }
+    free(old.data);
+    return 1;
+}
+
+/* Adds count packed digests, returns the number of new entries. */
+static size_t
+digest_set_add(lua_State *L, LgcryptDigestSet *s, const unsigned char *digests,
+        size_t count)
+{
+    size_t i, pos, added = 0;
+
+    if (s->mapped) {
+        luaL_error(L, "Digest set is read-only");
+    }
+    for (i = 0; i < count; i++, digests += s->digest_len) {
+        if (!digest_set_reserve(s, s->count + 1)) {
+            luaL_error(L, "Out of memory");
+        }
+        if (!digest_set_find(s, digests, &pos)) {
+            s->bitmap[pos >> 3] |= 1 << (pos & 7);
+            memcpy(s->table + pos * s->digest_len, digests, s->digest_len);
+            s->count++;
+            added++;
+        }
+    }
+    return added;
+}
+
+static LgcryptDigestSet *
+getDigestSet(lua_State *L, int arg)
+{
+    return (LgcryptDigestSet *)luaL_checkudata(L, arg, "gcrypt.DigestSet");
+}
+
+static LgcryptDigestSet *
+checkDigestSet(lua_State *L, int arg)
+{
+    LgcryptDigestSet *s = getDigestSet(L, arg);
+    if (!s->data) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return s;
+}
+
+static int
+lgcrypt_digest_set___gc(lua_State *L)
+{
+    LgcryptDigestSet *s = getDigestSet(L, 1);
+
+    if (s->data) {
+#ifdef HAVE_MMAP
+        if (s->mapped) {
+            munmap(s->data, s->data_len);
+        } else
+#endif
+        free(s->data);
+        s->data = NULL;
+    }
+    return 0;
+}
+
+static LgcryptDigestSet *
+lgcrypt_digest_set_new(lua_State *L)
+{
+    LgcryptDigestSet *s;
+
+    s = (LgcryptDigestSet *) lua_newuserdata(L, sizeof(LgcryptDigestSet));
+    memset(s, 0, sizeof(LgcryptDigestSet));
+    luaL_getmetatable(L, "gcrypt.DigestSet");
+    lua_setmetatable(L, -2);
+    return s;
+}
+
+/* Checks a string of packed digests and returns their number. */
+static size_t
+check_packed(lua_State *L, int arg, LgcryptDigestSet *s,
+        const unsigned char **digests)
+{
+    size_t len;
+
+    *digests = (const unsigned char *) luaL_checklstring(L, arg, &len);
+    luaL_argcheck(L, len % s->digest_len == 0, arg,
+            "length is not a multiple of the digest length");
+    return len / s->digest_len;
+}
+
+/* gcrypt.DigestSet(digest_len[, digests]) creates a set from packed
+ * digests. */
+static int
+lgcrypt_digest_set_open(lua_State *L)
+{
+    lua_Integer digest_len = luaL_checkinteger(L, 1);
+    const unsigned char *digests = NULL;
+    LgcryptDigestSet *s;
+    size_t count = 0;
+
+    luaL_argcheck(L, digest_len > 0 && digest_len <= DIGEST_SET_MAX_DIGEST, 1,
+            "digest length out of range");
+    s = lgcrypt_digest_set_new(L);
+    s->digest_len = (size_t)digest_len;
+    if (!lua_isnoneornil(L, 2)) {
+        count = check_packed(L, 2, s, &digests);
+    }
+    if (!digest_set_reserve(s, count)) {
+        luaL_error(L, "Out of memory");
+    }
+    digest_set_add(L, s, digests, count);
+    return 1;
+}
+
+/* gcrypt.load_digest_set(path) maps a set saved by set:save(path). */
+static int
+lgcrypt_load_digest_set(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    unsigned char header[DIGEST_SET_HEADER];
+    unsigned long long slots = 0, count = 0, used = 0;
+    LgcryptDigestSet *s;
+    unsigned byte;
+    long long size;
+    size_t i;
+    FILE *fp;
+    int ok;
+
+    s = lgcrypt_digest_set_new(L);
+    fp = fopen(path, "rb");
+    if (!fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+#ifdef _WIN32
+    size = _fseeki64(fp, 0, SEEK_END) ? -1 : _ftelli64(fp);
+#else
+    size = fseeko(fp, 0, SEEK_END) ? -1 : (long long)ftello(fp);
+#endif
+    ok = size >= DIGEST_SET_HEADER && !read_at(fp, 0, header, sizeof(header));
+    if (ok) {
+        s->digest_len = get_be32(header + 8);
+        slots = get_be64(header + 16);
+        count = get_be64(header + 24);
+        ok = !memcmp(header, DIGEST_SET_MAGIC, 8) && s->digest_len > 0 &&
+            s->digest_len <= DIGEST_SET_MAX_DIGEST &&
+            slots >= DIGEST_SET_MIN_SLOTS && (slots & (slots - 1)) == 0 &&
+            slots <= (size_t)-1 / (s->digest_len + 1) && count < slots &&
+            (unsigned long long)size ==
+            digest_set_data_len((size_t)slots, s->digest_len);
+    }
+    if (!ok) {
+        fclose(fp);
+        luaL_error(L, "Invalid digest set file %s", path);
+    }
+    s->slots = (size_t)slots;
+    s->count = (size_t)count;
+    s->data_len = (size_t)size;
+#ifdef HAVE_MMAP
+    s->data = mmap(NULL, s->data_len, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (s->data == MAP_FAILED) {
+        s->data = NULL;
+    } else {
+        s->mapped = 1;
+    }
+#endif
+    if (!s->data) {
+        s->data = malloc(s->data_len);
+        if (s->data && read_at(fp, 0, s->data, s->data_len)) {
+            free(s->data);
+            s->data = NULL;
+        }
+    }
+    fclose(fp);
+    if (!s->data) {
+        luaL_error(L, "Failed to load %s", path);
+    }
+    digest_set_layout(s);
+    /* The bitmap must agree with the count, leaving a free slot. */
+    for (i = 0; i < s->slots / 8; i++) {
+        for (byte = s->bitmap[i]; byte; byte &= byte - 1) {
+            used++;
+        }
+    }
+    if (used != count) {
+        luaL_error(L, "Invalid digest set file %s", path);
+    }
+    return 1;
+}
+
+/* set:add(digest) returns true if the digest was not yet present. */
+static int
+lgcrypt_digest_set_add(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+    const unsigned char *digest;
+
+    luaL_argcheck(L, check_packed(L, 2, s, &digest) == 1, 2,
+            "length is not the digest length");
+    lua_pushboolean(L, digest_set_add(L, s, digest, 1) == 1);
+    return 1;
+}
+
+/* set:add_many(digests) adds packed digests, returns the number of new
+ * entries. */
+static int
+lgcrypt_digest_set_add_many(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+    const unsigned char *digests;
+    size_t count = check_packed(L, 2, s, &digests);
+
+    if (!s->mapped && !digest_set_reserve(s, s->count + count)) {
+        luaL_error(L, "Out of memory");
+    }
+    lua_pushinteger(L, (lua_Integer)digest_set_add(L, s, digests, count));
+    return 1;
+}
+
+/* set:contains(digest) */
+static int
+lgcrypt_digest_set_contains(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+    const unsigned char *digest;
+    size_t pos;
+
+    luaL_argcheck(L, check_packed(L, 2, s, &digest) == 1, 2,
+            "length is not the digest length");
+    lua_pushboolean(L, digest_set_find(s, digest, &pos));
+    return 1;
+}
+
+/* set:contains_many(digests) returns the list of the (one-based) indices of
+ * the packed digests that are present. */
+static int
+lgcrypt_digest_set_contains_many(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+    const unsigned char *digests;
+    size_t count = check_packed(L, 2, s, &digests), i, pos;
+    int found = 0;
+
+    lua_newtable(L);
+    for (i = 0; i < count; i++, digests += s->digest_len) {
+        if (digest_set_find(s, digests, &pos)) {
+            lua_pushinteger(L, (lua_Integer)(i + 1));
+            lua_rawseti(L, -2, ++found);
+        }
+    }
+    return 1;
+}
+
+/* set:save(path) writes the set for load_digest_set. */
+static int
+lgcrypt_digest_set_save(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    unsigned char header[DIGEST_SET_HEADER];
+    FILE *fp;
+    int failed;
+
+    memcpy(header, DIGEST_SET_MAGIC, 8);
+    put_be32(header + 8, (unsigned long)s->digest_len);
+    put_be32(header + 12, 0);
+    put_be64(header + 16, s->slots);
+    put_be64(header + 24, s->count);
+    fp = fopen(path, "wb");
+    if (!fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    failed = fwrite(header, 1, sizeof(header), fp) != sizeof(header) ||
+        fwrite(s->bitmap, 1, s->data_len - DIGEST_SET_HEADER, fp) !=
+        s->data_len - DIGEST_SET_HEADER;
+    if (fclose(fp) || failed) {
+        luaL_error(L, "Failed to write %s", path);
+    }
+    return 0;
+}
+
+/* set:size() and #set return the number of digests. */
+static int
+lgcrypt_digest_set_size(lua_State *L)
+{
+    LgcryptDigestSet *s = checkDigestSet(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)s->count);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_digest_set_meta[] = {
+    {"__gc",            lgcrypt_digest_set___gc},
+    {"__len",           lgcrypt_digest_set_size},
+    {"add",             lgcrypt_digest_set_add},
+    {"add_many",        lgcrypt_digest_set_add_many},
+    {"contains",        lgcrypt_digest_set_contains},
+    {"contains_many",   lgcrypt_digest_set_contains_many},
+    {"save",            lgcrypt_digest_set_save},
+    {"size",            lgcrypt_digest_set_size},
+    {NULL,              NULL}
+};
+/* }}} */
+
+/* {{{ I/O engines */
+/* Engines for reading whole files: "auto" maps large files and reads small
+ * ones, the others force a read loop, a memory mapping or io_uring. */
+enum { IO_ENGINE_AUTO, IO_ENGINE_READ, IO_ENGINE_MMAP, IO_ENGINE_IO_URING };
+static const char *const io_engine_names[] = {
+    "auto", "read", "mmap", "io_uring", NULL
+};
+
+#define IO_BLOCK_SIZE       (256 * 1024)
+#define IO_MAX_QUEUE_DEPTH  64
+
+/* Process-wide settings, only changed by gcrypt.io_engine(). */
+static int io_engine = IO_ENGINE_AUTO;
+static unsigned io_queue_depth = 8;
+
+/* Receives the file contents in order. */
+typedef void (*io_consume_fn)(void *ctx, const unsigned char *data,
+        size_t len);
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(HAVE_MMAP)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned char *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} IoUring;
+
+static void
+uring_close(IoUring *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    close(ring->fd);
+}
+
+static void *
+uring_map(int fd, size_t len, off_t offset)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Returns zero on success or an errno value if io_uring is unavailable. */
+static int
+uring_open(IoUring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(ring, 0, sizeof(IoUring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return errno;
+    }
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = uring_map(ring->fd, ring->sq_ring_len, IORING_OFF_SQ_RING);
+    ring->cq_ring = uring_map(ring->fd, ring->cq_ring_len, IORING_OFF_CQ_RING);
+    ring->sqes = uring_map(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+        err = errno;
+        uring_close(ring);
+        return err;
+    }
+    ring->sq_tail = (unsigned *)(ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)(ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+static void
+uring_queue_read(IoUring *ring, int fd, struct iovec *iov,
+        unsigned long long offset, unsigned slot)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits queued reads and collects at least one completion. Returns the
+ * number of completions or -1 on failure. */
+static int
+uring_wait(IoUring *ring, unsigned to_submit, long *results,
+        unsigned char *done)
+{
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    int n = 0;
+
+    while (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, n++) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        results[cqe->user_data] = cqe->res;
+        done[cqe->user_data] = 1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Reads a file of the given size with up to depth aligned reads in flight
+ * and passes the blocks in order to fn, overlapping I/O and processing.
+ * Returns zero on success or an errno value. */
+static int
+uring_read_file(int fd, unsigned long long size, unsigned depth,
+        io_consume_fn fn, void *ctx)
+{
+    IoUring ring;
+    struct iovec iov[IO_MAX_QUEUE_DEPTH];
+    unsigned long long offsets[IO_MAX_QUEUE_DEPTH], next = 0;
+    long results[IO_MAX_QUEUE_DEPTH];
+    unsigned char done[IO_MAX_QUEUE_DEPTH];
+    unsigned char *bufs;
+    unsigned slot, cur = 0, queued = 0, inflight = 0, pending;
+    size_t expected, n;
+    ssize_t r;
+    int err = 0, eof = 0;
+
+    err = uring_open(&ring, depth);
+    if (err) {
+        return err;
+    }
+    if (posix_memalign((void **)&bufs, 4096, (size_t)depth * IO_BLOCK_SIZE)) {
+        uring_close(&ring);
+        return ENOMEM;
+    }
+    memset(done, 0, sizeof(done));
+    for (slot = 0; slot < depth && next < size; slot++) {
+        iov[slot].iov_base = bufs + (size_t)slot * IO_BLOCK_SIZE;
+        iov[slot].iov_len = IO_BLOCK_SIZE;
+        offsets[slot] = next;
+        uring_queue_read(&ring, fd, &iov[slot], next, slot);
+        next += IO_BLOCK_SIZE;
+        queued++;
+        inflight++;
+    }
+
+    /* Reads that have not been consumed yet, in order of the slots. */
+    for (pending = inflight; pending > 0; pending--) {
+        while (!done[cur]) {
+            r = uring_wait(&ring, queued, results, done);
+            if (r < 0) {
+                err = errno;
+                goto out;
+            }
+            queued = 0;
+            inflight -= (unsigned)r;
+        }
+        done[cur] = 0;
+        if (results[cur] < 0) {
+            err = (int)-results[cur];
+            goto out;
+        }
+        expected = size - offsets[cur] < IO_BLOCK_SIZE ?
+            (size_t)(size - offsets[cur]) : IO_BLOCK_SIZE;
+        n = (size_t)results[cur];
+        /* Complete short reads synchronously, stop if the file shrank. */
+        while (n < expected && !eof) {
+            r = pread(fd, (unsigned char *)iov[cur].iov_base + n,
+                    expected - n, (off_t)(offsets[cur] + n));
+            if (r < 0) {
+                err = errno;
+                goto out;
+            }
+            if (r == 0) {
+                eof = 1;
+            }
+            n += (size_t)r;
+        }
+        if (!eof || n > 0) {
+            fn(ctx, iov[cur].iov_base, n);
+        }
+        if (next < size && !eof) {
+            offsets[cur] = next;
+            uring_queue_read(&ring, fd, &iov[cur], next, cur);
+            next += IO_BLOCK_SIZE;
+            queued++;
+            inflight++;
+            pending++;
+        }
+        cur = (cur + 1) % depth;
+    }
+
+out:
+    /* The buffers must outlive the reads that are still in flight. */
+    while (inflight > 0) {
+        r = uring_wait(&ring, queued, results, done);
+        if (r < 0) {
+            break;
+        }
+        queued = 0;
+        inflight -= (unsigned)r;
+    }
+    uring_close(&ring);
+    if (inflight == 0) {
+        free(bufs);
+    }
+    return err;
+}
+#endif
+
+/* gcrypt.io_engine([engine[, queue_depth]]) changes the engine for reading
+ * files and returns the current engine, queue depth and whether the engine
+ * can be used at runtime (file reads fall back to a read loop otherwise). */
+static int
+lgcrypt_io_engine(lua_State *L)
+{
+    int engine, usable = 1;
+    lua_Integer depth;
+#ifdef HAVE_IO_URING
+    IoUring ring;
+#endif
+
+    if (!lua_isnoneornil(L, 1)) {
+        engine = luaL_checkoption(L, 1, NULL, io_engine_names);
+#ifndef HAVE_IO_URING
+        if (engine == IO_ENGINE_IO_URING) {
+            luaL_argerror(L, 1, "io_uring is not supported");
+        }
+#endif
+#ifndef HAVE_MMAP
+        if (engine == IO_ENGINE_MMAP) {
+            luaL_argerror(L, 1, "mmap is not supported");
+        }
+#endif
+        depth = luaL_optinteger(L, 2, io_queue_depth);
+        luaL_argcheck(L, depth >= 1 && depth <= IO_MAX_QUEUE_DEPTH, 2,
+                "queue depth out of range");
+        io_engine = engine;
+        io_queue_depth = (unsigned)depth;
+    }
+#ifdef HAVE_IO_URING
+    /* Kernels may lack io_uring or refuse it (seccomp, locked memory). */
+    if (io_engine == IO_ENGINE_IO_URING) {
+        usable = uring_open(&ring, io_queue_depth) == 0;
+        if (usable) {
+            uring_close(&ring);
+        }
+    }
+#endif
+    lua_pushstring(L, io_engine_names[io_engine]);
+    lua_pushinteger(L, (lua_Integer)io_queue_depth);
+    lua_pushboolean(L, usable);
+    return 3;
+}
+/* }}} */
+
+/* {{{ File hashing */
+/* Files of at least this size are hashed from a memory mapping. */
+#define FILE_MMAP_THRESHOLD (1024 * 1024)
+#define FILE_READ_BUFFER    (64 * 1024)
+
+typedef struct {
+    int algo;
+    size_t digest_len;
+    const char **paths;
+    unsigned char *out;
+    int *errors;            /* errno value per file, zero on success */
+    FileKey *keys;          /* file versions if a cache is used */
+    unsigned char *hit;     /* non-zero if the digest was cached */
+} FileHashJob;
+
+/* Hashes a file with a read loop into a buffer on the stack of the worker. */
+static int
+hash_file_read(int algo, FILE *fp, unsigned char *out)
+{
+    unsigned char buf[FILE_READ_BUFFER];
+    gcry_md_hd_t h;
+    size_t n;
+
+    n = fread(buf, 1, sizeof(buf), fp);
+    if (n < sizeof(buf)) {
+        /* Small files fit in the buffer and need no hash handle. */
+        if (ferror(fp)) {
+            return errno ? errno : EIO;
+        }
+        gcry_md_hash_buffer(algo, out, buf, n);
+        return 0;
+    }
+    if (gcry_md_open(&h, algo, 0)) {
+        return ENOMEM;
+    }
+    do {
+        gcry_md_write(h, buf, n);
+        n = fread(buf, 1, sizeof(buf), fp);
+    } while (n > 0);
+    if (ferror(fp)) {
+        gcry_md_close(h);
+        return errno ? errno : EIO;
+    }
+    memcpy(out, gcry_md_read(h, algo), gcry_md_get_algo_dlen(algo));
+    gcry_md_close(h);
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+static void
+md_write_block(void *ctx, const unsigned char *data, size_t len)
+{
+    gcry_md_write(*(gcry_md_hd_t *)ctx, data, len);
+}
+
+/* Hashes a file with io_uring, returns zero on success or an errno value. */
+static int
+hash_file_uring(int algo, int fd, unsigned long long size, unsigned char *out)
+{
+    gcry_md_hd_t h;
+    int err;
+
+    if (gcry_md_open(&h, algo, 0)) {
+        return ENOMEM;
+    }
+    err = uring_read_file(fd, size, io_queue_depth, md_write_block, &h);
+    if (!err) {
+        memcpy(out, gcry_md_read(h, algo), gcry_md_get_algo_dlen(algo));
+    }
+    gcry_md_close(h);
+    return err;
+}
+#endif
+
+/* Returns zero on success or an errno value. If key is given, it identifies
+ * the hashed file version. */
+static int
+hash_file_into(int algo, const char *path, unsigned char *out, FileKey *key)
+{
+    FILE *fp;
+    int err = -1;
+#ifdef HAVE_MMAP
+    struct stat st;
+    FileKey after;
+    size_t map_len;
+    void *p;
+#endif
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return errno;
+    }
+#ifdef HAVE_MMAP
+    if (fstat(fileno(fp), &st)) {
+        err = errno;
+        fclose(fp);
+        return err;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fclose(fp);
+        return EISDIR;
+    }
+    if (key) {
+        file_key_from_stat(key, &st);
+    }
+#ifdef HAVE_IO_URING
+    /* Files that fit in one read buffer are read directly. */
+    if (io_engine == IO_ENGINE_IO_URING && S_ISREG(st.st_mode) &&
+            st.st_size > FILE_READ_BUFFER &&
+            hash_file_uring(algo, fileno(fp), (unsigned long long)st.st_size,
+                out) == 0) {
+        err = 0;
+    }
+#endif
+    if (err && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            ((io_engine == IO_ENGINE_AUTO &&
+              st.st_size >= FILE_MMAP_THRESHOLD) ||
+             io_engine == IO_ENGINE_MMAP)) {
+        map_len = (size_t)st.st_size;
+        p = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (p != MAP_FAILED) {
+            /* Touching pages past the end of a file that shrank raises
+             * SIGBUS, so a file whose size changed since the fstat() above
+             * is left to the read loop. */
+            if (!fstat(fileno(fp), &st) && (size_t)st.st_size == map_len) {
+                gcry_md_hash_buffer(algo, out, p, map_len);
+                err = 0;
+            }
+            munmap(p, map_len);
+        }
+    }
+    /* The read loop is also the fallback if io_uring is unavailable. */
+    if (err) {
+        err = hash_file_read(algo, fp, out);
+    }
+    /* Do not cache a file that changed while it was hashed. */
+    if (!err && key) {
+        if (fstat(fileno(fp), &st)) {
+            key->cacheable = 0;
+        } else {
+            file_key_from_stat(&after, &st);
+            if (after.size != key->size || after.mtime_ns != key->mtime_ns) {
+                key->cacheable = 0;
+            }
+        }
+    }
+#else
+    (void)key;
+    err = hash_file_read(algo, fp, out);
+#endif
+    fclose(fp);
+    return err;
+}
+
+static void
+hash_file_job(void *ctx, size_t i)
+{
+    FileHashJob *job = (FileHashJob *) ctx;
+
+    if (job->hit && job->hit[i]) {
+        return;
+    }
+    job->errors[i] = hash_file_into(job->algo, job->paths[i],
+            job->out + i * job->digest_len, job->keys ? &job->keys[i] : NULL);
+}
+
+/* Returns the digest cache argument or NULL if absent. */
+static void *
+opt_digest_cache(lua_State *L, int arg)
+{
+    if (lua_isnoneornil(L, arg)) {
+        return NULL;
+    }
+#ifdef HAVE_MMAP
+    return checkDigestCache(L, arg);
+#else
+    luaL_argerror(L, arg, "digest caches are not supported");
+    return NULL;
+#endif
+}
+
+/* Looks up the files in the cache before hashing them. */
+static void
+hash_files_lookup(FileHashJob *job, void *cache, size_t count)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        job->hit[i] = 0;
+        job->errors[i] = 0;
+        if (stat(job->paths[i], &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        file_key_from_stat(&job->keys[i], &st);
+        job->hit[i] = (unsigned char)digest_cache_lookup(cache,
+                &job->keys[i], job->algo, job->digest_len,
+                job->out + i * job->digest_len);
+    }
+#else
+    (void)job;
+    (void)cache;
+    (void)count;
+#endif
+}
+
+/* Stores the digests of the hashed files in the cache. */
+static void
+hash_files_store(FileHashJob *job, void *cache, size_t count)
+{
+#ifdef HAVE_MMAP
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!job->hit[i] && !job->errors[i]) {
+            digest_cache_store(cache, &job->keys[i], job->algo,
+                    job->digest_len, job->out + i * job->digest_len);
+        }
+    }
+#else
+    (void)job;
+    (void)cache;
+    (void)count;
+#endif
+}
+
+/* gcrypt.hash_files(algo, paths[, threads[, cache]]) returns a table with
+ * the digests in the order of paths and a table with error messages for the
+ * files that could not be read (false in the first table), or nil. */
+static int
+lgcrypt_hash_files(lua_State *L)
+{
+    FileHashJob job;
+    unsigned threads;
+    size_t count, i;
+    int failed = 0;
+    void *cache;
+
+    job.algo = luaL_checkint(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    threads = check_threads(L, 3);
+    cache = opt_digest_cache(L, 4);
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+
+    /* The path strings are kept alive by the table. */
+    for (count = 0; ; count++) {
+        lua_rawgeti(L, 2, (int)count + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_error(L, "paths must be strings");
+        }
+        lua_pop(L, 1);
+    }
+    job.paths = lua_newuserdata(L, (count + 1) * sizeof(const char *));
+    job.errors = lua_newuserdata(L, (count + 1) * sizeof(int));
+    job.out = lua_newuserdata(L, (count + 1) * job.digest_len);
+    job.keys = NULL;
+    job.hit = NULL;
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 2, (int)i + 1);
+        job.paths[i] = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (cache) {
+        job.keys = lua_newuserdata(L, (count + 1) * sizeof(FileKey));
+        job.hit = lua_newuserdata(L, count + 1);
+        hash_files_lookup(&job, cache, count);
+    }
+    parallel_for(count, threads, hash_file_job, &job);
+    if (cache) {
+        hash_files_store(&job, cache, count);
+    }
+
+    lua_createtable(L, (int)count, 0);
+    for (i = 0; i < count; i++) {
+        if (job.errors[i]) {
+            lua_pushboolean(L, 0);
+            failed = 1;
+        } else {
+            lua_pushlstring(L, (const char *) job.out + i * job.digest_len,
+                    job.digest_len);
+        }
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    if (!failed) {
+        lua_pushnil(L);
+        return 2;
+    }
+    lua_newtable(L);
+    for (i = 0; i < count; i++) {
+        if (job.errors[i]) {
+            lua_pushfstring(L, "%s: %s", job.paths[i], strerror(job.errors[i]));
+            lua_rawseti(L, -2, (int)i + 1);
+        }
+    }
+    return 2;
+}
+
+/* gcrypt.hash_file(algo, path[, cache]) */
+static int
+lgcrypt_hash_file(lua_State *L)
+{
+    FileHashJob job;
+    const char *path;
+    unsigned char digest[MERKLE_MAX_DIGEST];
+    FileKey key;
+    unsigned char hit = 0;
+    int err = 0;
+    void *cache;
+
+    job.algo = luaL_checkint(L, 1);
+    path = luaL_checkstring(L, 2);
+    cache = opt_digest_cache(L, 3);
+    job.digest_len = gcry_md_get_algo_dlen(job.algo);
+    if (!job.digest_len || job.digest_len > sizeof(digest)) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    job.paths = &path;
+    job.errors = &err;
+    job.out = digest;
+    job.keys = cache ? &key : NULL;
+    job.hit = cache ? &hit : NULL;
+
+    if (cache) {
+        hash_files_lookup(&job, cache, 1);
+    }
+    hash_file_job(&job, 0);
+    if (err) {
+        luaL_error(L, "%s: %s", path, strerror(err));
+    }
+    if (cache) {
+        hash_files_store(&job, cache, 1);
+    }
+    lua_pushlstring(L, (const char *) digest, job.digest_len);
+    return 1;
+}
+/* }}} */
+
+/* {{{ Keys */
+/* Key material in Libgcrypt secure memory (when enabled by gcrypt.init) that
+ * is wiped when the object is collected. */
+typedef struct {
+    unsigned char *data;        /* NULL once the object is dead */
+    size_t len;
+} LgcryptKey;
+
+static LgcryptKey *
+getKey(lua_State *L, int arg)
+{
+    return (LgcryptKey *)luaL_checkudata(L, arg, "gcrypt.Key");
+}
+
+static LgcryptKey *
+checkKey(lua_State *L, int arg)
+{
+    LgcryptKey *key = getKey(L, arg);
+    if (!key->data) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return key;
+}
+
+/* Pushes a new key of len bytes with uninitialized contents. */
+static LgcryptKey *
+key_new(lua_State *L, size_t len)
+{
+    LgcryptKey *key;
+
+    key = (LgcryptKey *) lua_newuserdata(L, sizeof(LgcryptKey));
+    key->data = NULL;
+    key->len = 0;
+    luaL_getmetatable(L, "gcrypt.Key");
+    lua_setmetatable(L, -2);
+    key->data = gcry_malloc_secure(len ? len : 1);
+    if (!key->data) {
+        luaL_error(L, "Out of secure memory");
+    }
+    key->len = len;
+    return key;
+}
+
+/* Allocates secure memory for key material that an object derives or keeps,
+ * freed by secure_free. */
+static unsigned char *
+secure_alloc(lua_State *L, size_t len)
+{
+    unsigned char *p = gcry_malloc_secure(len ? len : 1);
+
+    if (!p) {
+        luaL_error(L, "Out of secure memory");
+    }
+    return p;
+}
+
+/* Wipes and frees memory from secure_alloc, p may be NULL. */
+static void
+secure_free(unsigned char *p, size_t len)
+{
+    if (p) {
+        memset(p, 0, len);
+        gcry_free(p);
+    }
+}
+
+/* Returns the bytes of a key given as string or gcrypt.Key. */
+static const char *
+check_key(lua_State *L, int arg, size_t *len)
+{
+    LgcryptKey *key;
+
+    if (lua_type(L, arg) == LUA_TSTRING) {
+        return lua_tolstring(L, arg, len);
+    }
+    key = (LgcryptKey *) luaL_testudata(L, arg, "gcrypt.Key");
+    if (!key) {
+        luaL_argerror(L, arg, "string or gcrypt.Key expected");
+    }
+    if (!key->data) {
+        luaL_error(L, "Called into a dead object");
+    }
+    *len = key->len;
+    return (const char *) key->data;
+}
+
+/* Returns non-zero if the argument is a gcrypt.Key. Derived keys are
+ * returned as gcrypt.Key in that case. */
+static int
+is_key(lua_State *L, int arg)
+{
+    return luaL_testudata(L, arg, "gcrypt.Key") != NULL;
+}
+
+static int
+lgcrypt_key___gc(lua_State *L)
+{
+    LgcryptKey *key = getKey(L, 1);
+
+    if (key->data) {
+        memset(key->data, 0, key->len);
+        gcry_free(key->data);
+        key->data = NULL;
+        key->len = 0;
+    }
+    return 0;
+}
+
+/* gcrypt.Key(data) copies a string, gcrypt.Key(length) creates a random
+ * key. */
+static int
+lgcrypt_key_open(lua_State *L)
+{
+    LgcryptKey *key;
+    const char *data;
+    lua_Integer len;
+    size_t data_len;
+
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        len = lua_tointeger(L, 1);
+        luaL_argcheck(L, len > 0, 1, "key length must be positive");
+        key = key_new(L, (size_t)len);
+        gcry_randomize(key->data, key->len, GCRY_STRONG_RANDOM);
+        return 1;
+    }
+    data = luaL_checklstring(L, 1, &data_len);
+    key = key_new(L, data_len);
+    memcpy(key->data, data, data_len);
+    return 1;
+}
+
+static int
+lgcrypt_key___len(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkKey(L, 1)->len);
+    return 1;
+}
+
+/* The key bytes are not shown. */
+static int
+lgcrypt_key___tostring(lua_State *L)
+{
+    LgcryptKey *key = getKey(L, 1);
+
+    if (key->data) {
+        lua_pushfstring(L, "gcrypt.Key (%d bytes)", (int)key->len);
+    } else {
+        lua_pushliteral(L, "gcrypt.Key (wiped)");
+    }
+    return 1;
+}
+
+/* key:bytes() exports the key as string. */
+static int
+lgcrypt_key_bytes(lua_State *L)
+{
+    LgcryptKey *key = checkKey(L, 1);
+
+    lua_pushlstring(L, (const char *) key->data, key->len);
+    return 1;
+}
+
+/* key:sub(i[, j]) returns a new key with the bytes i to j, like
+ * string.sub. */
+static int
+lgcrypt_key_sub(lua_State *L)
+{
+    LgcryptKey *key = checkKey(L, 1), *part;
+    lua_Integer len = (lua_Integer)key->len;
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+
+    if (i < 0) {
+        i = i + len + 1;
+    }
+    if (j < 0) {
+        j = j + len + 1;
+    }
+    if (i < 1) {
+        i = 1;
+    }
+    if (j > len) {
+        j = len;
+    }
+    if (i > j) {
+        i = 1;
+        j = 0;
+    }
+    part = key_new(L, (size_t)(j - i + 1));
+    memcpy(part->data, key->data + i - 1, part->len);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_key_meta[] = {
+    {"__gc",        lgcrypt_key___gc},
+    {"__len",       lgcrypt_key___len},
+    {"__tostring",  lgcrypt_key___tostring},
+    {"bytes",       lgcrypt_key_bytes},
+    {"sub",         lgcrypt_key_sub},
+    {"wipe",        lgcrypt_key___gc},
+    {NULL,          NULL}
+};
+/* }}} */
+
+/* {{{ Kernel crypto API */
+/* Alternative backend for gcrypt.Cipher and gcrypt.Hash using AF_ALG sockets
+ * of the Linux kernel crypto API. Files are passed with splice(2), large
+ * hash inputs with vmsplice(2), to avoid copies through userspace. */
+enum { BACKEND_LIBGCRYPT, BACKEND_AF_ALG };
+static const char *const backend_names[] = { "libgcrypt", "af_alg", NULL };
+
+/* Chunk size for files and skcipher requests (below the socket buffer). */
+#define FILE_CHUNK_SIZE     (64 * 1024)
+
+#if defined(__linux__) && defined(__has_include) && defined(HAVE_MMAP)
+#if __has_include(<linux/if_alg.h>)
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define HAVE_AF_ALG
+#endif
+#endif
+
+#ifdef HAVE_AF_ALG
+#ifndef SOL_ALG
+#define SOL_ALG             279
+#endif
+#ifndef SPLICE_F_MORE
+#define SPLICE_F_MOVE       1
+#define SPLICE_F_MORE       4
+#endif
+
+typedef struct {
+    int tfm;                /* transform socket */
+    int op;                 /* operation socket, -1 until keyed */
+    int pipe[2];            /* for splice, created on first use */
+    /* Message digests */
+    int algo;
+    size_t digest_len;
+    int finalized;
+    unsigned char digest[64];
+    /* Ciphers */
+    int mode;
+    size_t block_len;
+    size_t key_len;
+    unsigned char iv[16];
+    unsigned char keystream[16];    /* unused CTR keystream */
+    size_t keystream_pos;
+} AfAlg;
+
+static void
+afalg_close(AfAlg *a)
+{
+    if (a->op >= 0) {
+        close(a->op);
+    }
+    if (a->pipe[0] >= 0) {
+        close(a->pipe[0]);
+        close(a->pipe[1]);
+    }
+    close(a->tfm);
+    free(a);
+}
+
+/* Returns a new transform or NULL with errno set. */
+static AfAlg *
+afalg_open(const char *type, const char *name)
+{
+    struct sockaddr_alg sa;
+    AfAlg *a;
+    int err;
+
+    a = calloc(1, sizeof(AfAlg));
+    if (!a) {
+        return NULL;
+    }
+    a->op = a->pipe[0] = a->pipe[1] = -1;
+    a->tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (a->tfm < 0) {
+        err = errno;
+        free(a);
+        errno = err;
+        return NULL;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strncpy((char *)sa.salg_type, type, sizeof(sa.salg_type) - 1);
+    strncpy((char *)sa.salg_name, name, sizeof(sa.salg_name) - 1);
+    if (bind(a->tfm, (struct sockaddr *)&sa, sizeof(sa))) {
+        err = errno;
+        afalg_close(a);
+        errno = err;
+        return NULL;
+    }
+    return a;
+}
+
+/* Starts a new operation, returns zero on success or an errno value. */
+static int
+afalg_accept(AfAlg *a)
+{
+    if (a->op >= 0) {
+        close(a->op);
+    }
+    a->op = accept(a->tfm, NULL, 0);
+    a->finalized = 0;
+    return a->op < 0 ? errno : 0;
+}
+
+static int
+afalg_setkey(AfAlg *a, const void *key, size_t key_len)
+{
+    if (setsockopt(a->tfm, SOL_ALG, ALG_SET_KEY, key, (socklen_t)key_len)) {
+        return errno;
+    }
+    return afalg_accept(a);
+}
+
+static int
+afalg_write_all(int fd, const unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+afalg_read_all(int fd, unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+afalg_pipe(AfAlg *a)
+{
+    if (a->pipe[0] < 0 && pipe(a->pipe)) {
+        a->pipe[0] = a->pipe[1] = -1;
+        return errno;
+    }
+    return 0;
+}
+
+/* Drops data left in the pipe after a failed splice. */
+static void
+afalg_reset_pipe(AfAlg *a)
+{
+    if (a->pipe[0] >= 0) {
+        close(a->pipe[0]);
+        close(a->pipe[1]);
+        a->pipe[0] = a->pipe[1] = -1;
+    }
+}
+
+/* Moves len bytes from the pipe to the operation socket. The request is
+ * continued (MSG_MORE) and must be ended by the caller. */
+static int
+afalg_drain_pipe(AfAlg *a, size_t len)
+{
+    long n;
+
+    while (len > 0) {
+        n = syscall(__NR_splice, a->pipe[0], NULL, a->op, NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            afalg_reset_pipe(a);
+            return n < 0 ? errno : EIO;
+        }
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Splices up to len bytes of a file at offset into the operation socket,
+ * stopping at the end of the file. The number of bytes is stored in done. */
+static int
+afalg_splice_file(AfAlg *a, int fd, long long offset, size_t len,
+        size_t *done)
+{
+    long n;
+    int err;
+
+    *done = 0;
+    if ((err = afalg_pipe(a)) != 0) {
+        return err;
+    }
+    while (*done < len) {
+        n = syscall(__NR_splice, fd, &offset, a->pipe[1], NULL,
+                len - *done < FILE_CHUNK_SIZE ? len - *done : FILE_CHUNK_SIZE,
+                SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        if ((err = afalg_drain_pipe(a, (size_t)n)) != 0) {
+            return err;
+        }
+        *done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Maps user pages into the pipe and splices them into the socket. */
+static int
+afalg_vmsplice(AfAlg *a, const unsigned char *data, size_t len)
+{
+    struct iovec iov;
+    long n;
+    int err;
+
+    while (len > 0) {
+        iov.iov_base = (void *)data;
+        iov.iov_len = len < FILE_CHUNK_SIZE ? len : FILE_CHUNK_SIZE;
+        n = syscall(__NR_vmsplice, a->pipe[1], &iov, 1UL, 0U);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        if ((err = afalg_drain_pipe(a, (size_t)n)) != 0) {
+            return err;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Sends data, continuing the current request. */
+static int
+afalg_send_more(AfAlg *a, const unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(a->op, data, len, MSG_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Kernel name of a digest algorithm, or NULL if unsupported. */
+static const char *
+afalg_md_name(int algo)
+{
+    switch (algo) {
+    case GCRY_MD_MD5:       return "md5";
+    case GCRY_MD_SHA1:      return "sha1";
+    case GCRY_MD_RMD160:    return "rmd160";
+    case GCRY_MD_SHA224:    return "sha224";
+    case GCRY_MD_SHA256:    return "sha256";
+    case GCRY_MD_SHA384:    return "sha384";
+    case GCRY_MD_SHA512:    return "sha512";
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    case GCRY_MD_SHA3_224:  return "sha3-224";
+    case GCRY_MD_SHA3_256:  return "sha3-256";
+    case GCRY_MD_SHA3_384:  return "sha3-384";
+    case GCRY_MD_SHA3_512:  return "sha3-512";
+#endif
+    default:                return NULL;
+    }
+}
+
+/* Returns a new hash transform or NULL with errno set. */
+static AfAlg *
+afalg_md_open(int algo, unsigned int flags)
+{
+    const char *name = afalg_md_name(algo);
+    char hmac_name[64];
+    AfAlg *a;
+    int err;
+
+    if (!name || (flags & ~GCRY_MD_FLAG_HMAC)) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    if (flags & GCRY_MD_FLAG_HMAC) {
+        snprintf(hmac_name, sizeof(hmac_name), "hmac(%s)", name);
+        name = hmac_name;
+    }
+    a = afalg_open("hash", name);
+    if (!a) {
+        return NULL;
+    }
+    a->algo = algo;
+    a->digest_len = gcry_md_get_algo_dlen(algo);
+    /* HMAC operations are started by setkey. */
+    if (!(flags & GCRY_MD_FLAG_HMAC) && (err = afalg_accept(a)) != 0) {
+        afalg_close(a);
+        errno = err;
+        return NULL;
+    }
+    return a;
+}
+
+static int
+afalg_md_write(AfAlg *a, const unsigned char *data, size_t len)
+{
+    if (a->op < 0) {
+        return ENOKEY;
+    }
+    if (a->finalized) {
+        return EINVAL;
+    }
+    if (len >= FILE_CHUNK_SIZE && afalg_pipe(a) == 0) {
+        return afalg_vmsplice(a, data, len);
+    }
+    return afalg_send_more(a, data, len);
+}
+
+static int
+afalg_md_write_file(AfAlg *a, int fd)
+{
+    long long offset = 0;
+    size_t n;
+    int err;
+
+    if (a->op < 0) {
+        return ENOKEY;
+    }
+    if (a->finalized) {
+        return EINVAL;
+    }
+    do {
+        err = afalg_splice_file(a, fd, offset, (size_t)1 << 30, &n);
+        offset += (long long)n;
+    } while (!err && n > 0);
+    return err;
+}
+
+/* Finalizes the digest on the first call. */
+static int
+afalg_md_read(AfAlg *a)
+{
+    ssize_t n;
+
+    if (a->op < 0) {
+        return ENOKEY;
+    }
+    if (!a->finalized) {
+        n = recv(a->op, a->digest, a->digest_len, 0);
+        if (n != (ssize_t)a->digest_len) {
+            return n < 0 ? errno : EIO;
+        }
+        a->finalized = 1;
+    }
+    return 0;
+}
+
+/* Kernel name of a cipher, or NULL if unsupported. */
+static const char *
+afalg_cipher_name(int algo)
+{
+    switch (algo) {
+    case GCRY_CIPHER_AES128:
+    case GCRY_CIPHER_AES192:
+    case GCRY_CIPHER_AES256:        return "aes";
+    case GCRY_CIPHER_3DES:          return "des3_ede";
+    case GCRY_CIPHER_DES:           return "des";
+    case GCRY_CIPHER_TWOFISH:
+    case GCRY_CIPHER_TWOFISH128:    return "twofish";
+    case GCRY_CIPHER_SERPENT128:
+    case GCRY_CIPHER_SERPENT192:
+    case GCRY_CIPHER_SERPENT256:    return "serpent";
+    case GCRY_CIPHER_CAMELLIA128:
+    case GCRY_CIPHER_CAMELLIA192:
+    case GCRY_CIPHER_CAMELLIA256:   return "camellia";
+    case GCRY_CIPHER_CAST5:         return "cast5";
+    default:                        return NULL;
+    }
+}
+
+/* Returns a new skcipher transform (ECB, CBC or CTR mode) or NULL with errno
+ * set. */
+static AfAlg *
+afalg_cipher_open(int algo, int mode, unsigned int flags)
+{
+    const char *name = afalg_cipher_name(algo), *mode_name;
+    char full_name[64];
+    AfAlg *a;
+
+    switch (mode) {
+    case GCRY_CIPHER_MODE_ECB:  mode_name = "ecb"; break;
+    case GCRY_CIPHER_MODE_CBC:  mode_name = "cbc"; break;
+    case GCRY_CIPHER_MODE_CTR:  mode_name = "ctr"; break;
+    default:                    mode_name = NULL; break;
+    }
+    if (!name || !mode_name || flags) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    snprintf(full_name, sizeof(full_name), "%s(%s)", mode_name, name);
+    a = afalg_open("skcipher", full_name);
+    if (!a) {
+        return NULL;
+    }
+    a->mode = mode;
+    a->block_len = gcry_cipher_get_algo_blklen(algo);
+    a->key_len = gcry_cipher_get_algo_keylen(algo);
+    a->keystream_pos = a->block_len;
+    return a;
+}
+
+static int
+afalg_cipher_setkey(AfAlg *a, const void *key, size_t key_len)
+{
+    /* The kernel derives the variant from the key length. */
+    if (key_len != a->key_len) {
+        return EINVAL;
+    }
+    return afalg_setkey(a, key, key_len);
+}
+
+static int
+afalg_cipher_setiv(AfAlg *a, const void *iv, size_t iv_len)
+{
+    if (iv_len > a->block_len) {
+        return EINVAL;
+    }
+    memset(a->iv, 0, sizeof(a->iv));
+    memcpy(a->iv, iv, iv_len);
+    a->keystream_pos = a->block_len;
+    return 0;
+}
+
+/* Updates the IV after len bytes were processed. last_in is the last input
+ * block, out the output. */
+static void
+afalg_cipher_advance(AfAlg *a, int encrypt, const unsigned char *last_in,
+        const unsigned char *out, size_t len)
+{
+    if (a->mode == GCRY_CIPHER_MODE_CBC) {
+        memcpy(a->iv, encrypt ? out + len - a->block_len : last_in,
+                a->block_len);
+    } else if (a->mode == GCRY_CIPHER_MODE_CTR) {
+        ctr_add(a->iv, a->block_len, (len + a->block_len - 1) / a->block_len);
+    }
+}
+
+/* Starts a request with the operation and IV, data follows with MSG_MORE if
+ * more is set. */
+static int
+afalg_cipher_start(AfAlg *a, int encrypt, const unsigned char *data,
+        size_t len, int more)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(unsigned int)) +
+            CMSG_SPACE(sizeof(struct af_alg_iv) + 16)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct af_alg_iv *iv;
+    struct iovec iov;
+    ssize_t n;
+
+    memset(&control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(unsigned int));
+    if (a->mode != GCRY_CIPHER_MODE_ECB) {
+        msg.msg_controllen += CMSG_SPACE(sizeof(struct af_alg_iv) +
+                a->block_len);
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_OP;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned int));
+    *(unsigned int *)CMSG_DATA(cmsg) = encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+    if (a->mode != GCRY_CIPHER_MODE_ECB) {
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + a->block_len);
+        iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+        iv->ivlen = (unsigned int)a->block_len;
+        memcpy(iv->iv, a->iv, a->block_len);
+    }
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    do {
+        n = sendmsg(a->op, &msg, more ? MSG_MORE : 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return errno;
+    }
+    if ((size_t)n < len) {
+        return afalg_send_more(a, data + n, len - (size_t)n);
+    }
+    return 0;
+}
+
+/* Ends a request that was continued with MSG_MORE. */
+static int
+afalg_cipher_end(AfAlg *a)
+{
+    return send(a->op, NULL, 0, 0) < 0 ? errno : 0;
+}
+
+/* Processes whole blocks (at most FILE_CHUNK_SIZE) in one request. */
+static int
+afalg_cipher_request(AfAlg *a, int encrypt, const unsigned char *in,
+        unsigned char *out, size_t len)
+{
+    unsigned char last_in[16];
+    int err;
+
+    memcpy(last_in, in + len - a->block_len, a->block_len);
+    err = afalg_cipher_start(a, encrypt, in, len, 0);
+    if (!err) {
+        err = afalg_read_all(a->op, out, len);
+    }
+    if (!err) {
+        afalg_cipher_advance(a, encrypt, last_in, out, len);
+    }
+    return err;
+}
+
+/* Encrypts or decrypts like gcry_cipher_encrypt/decrypt, keeping the IV or
+ * counter (and unused CTR keystream) between calls. */
+static int
+afalg_cipher_crypt(AfAlg *a, int encrypt, const unsigned char *in,
+        unsigned char *out, size_t len)
+{
+    unsigned char block[16], keystream[16];
+    size_t n, i;
+    int err;
+
+    if (a->op < 0) {
+        return ENOKEY;
+    }
+    if (a->mode != GCRY_CIPHER_MODE_CTR && len % a->block_len) {
+        return EINVAL;
+    }
+    for (; len > 0 && a->keystream_pos < a->block_len; len--) {
+        *out++ = *in++ ^ a->keystream[a->keystream_pos++];
+    }
+    while (len >= a->block_len) {
+        n = len < FILE_CHUNK_SIZE ? len - len % a->block_len : FILE_CHUNK_SIZE;
+        if ((err = afalg_cipher_request(a, encrypt, in, out, n)) != 0) {
+            return err;
+        }
+        in += n;
+        out += n;
+        len -= n;
+    }
+    if (len > 0) {
+        /* Encrypt a zero padded block and keep the unused keystream. */
+        memset(block, 0, sizeof(block));
+        memcpy(block, in, len);
+        if ((err = afalg_cipher_request(a, 1, block, keystream,
+                        a->block_len)) != 0) {
+            return err;
+        }
+        for (i = 0; i < a->block_len; i++) {
+            a->keystream[i] = keystream[i] ^ block[i];
+        }
+        memcpy(out, keystream, len);
+        a->keystream_pos = len;
+    }
+    return 0;
+}
+
+/* Encrypts or decrypts a file into another. Whole blocks are spliced from
+ * the input file into the kernel, the rest is read. */
+static int
+afalg_cipher_crypt_file(AfAlg *a, int encrypt, int in_fd, int out_fd)
+{
+    unsigned char *buf, last_in[16];
+    unsigned long long offset = 0, remaining;
+    struct stat st;
+    size_t n, done;
+    ssize_t r;
+    int err = 0;
+
+    if (a->op < 0) {
+        return ENOKEY;
+    }
+    if (fstat(in_fd, &st)) {
+        return errno;
+    }
+    buf = malloc(FILE_CHUNK_SIZE);
+    if (!buf) {
+        return ENOMEM;
+    }
+    while (!err && offset < (unsigned long long)st.st_size) {
+        remaining = (unsigned long long)st.st_size - offset;
+        n = remaining < FILE_CHUNK_SIZE ? (size_t)remaining : FILE_CHUNK_SIZE;
+        n -= n % a->block_len;
+        if (n == 0 || a->keystream_pos < a->block_len) {
+            /* A partial block or unused CTR keystream. */
+            n = remaining < FILE_CHUNK_SIZE ? (size_t)remaining :
+                FILE_CHUNK_SIZE;
+            r = pread(in_fd, buf, n, (off_t)offset);
+            if (r != (ssize_t)n) {
+                err = r < 0 ? errno : EIO;
+                break;
+            }
+            err = afalg_cipher_crypt(a, encrypt, buf, buf, n);
+        } else {
+            if (pread(in_fd, last_in, a->block_len,
+                        (off_t)(offset + n - a->block_len)) !=
+                    (ssize_t)a->block_len) {
+                err = EIO;
+                break;
+            }
+            err = afalg_cipher_start(a, encrypt, NULL, 0, 1);
+            if (!err) {
+                err = afalg_splice_file(a, in_fd, (long long)offset, n, &done);
+            }
+            if (!err && done != n) {
+                err = EIO;  /* the file shrank */
+            }
+            if (!err) {
+                err = afalg_cipher_end(a);
+            }
+            if (!err) {
+                err = afalg_read_all(a->op, buf, n);
+            }
+            if (!err) {
+                afalg_cipher_advance(a, encrypt, last_in, buf, n);
+            }
+        }
+        if (!err) {
+            err = afalg_write_all(out_fd, buf, n);
+        }
+        offset += n;
+    }
+    free(buf);
+    return err;
+}
+
+/* Throws an error for a failed AF_ALG operation. */
+static void
+afalg_check(lua_State *L, int err, const char *what)
+{
+    if (err == EINVAL) {
+        luaL_error(L, "AF_ALG %s failed: invalid length or state", what);
+    } else if (err) {
+        luaL_error(L, "AF_ALG %s failed: %s", what, strerror(err));
+    }
+}
+#endif
+/* }}} */
+
+/* {{{ Symmetric encryption */
+typedef struct {
+    gcry_cipher_hd_t h;
+    int algo;
+    int mode;           /* Cipher mode */
+    unsigned int flags;
+    void *alg;          /* AF_ALG transform instead of h */
+    LgcryptKey *key;    /* A gcrypt.Key given to setkey, for decrypt_lazy */
+    int key_ref;        /* keeps the key alive */
+} LgcryptCipher;
+
+/* Initializes a new gcrypt.Cipher userdata and pushes it on the stack. */
+static LgcryptCipher *
+lgcrypt_cipher_new(lua_State *L)
+{
+    LgcryptCipher *state;
+
+    state = (LgcryptCipher *) lua_newuserdata(L, sizeof(LgcryptCipher));
+    state->h = NULL;
+    state->algo = 0;
+    state->mode = 0;
+    state->flags = 0;
+    state->alg = NULL;
+    state->key = NULL;
+    state->key_ref = LUA_NOREF;
+    luaL_getmetatable(L, "gcrypt.Cipher");
+    lua_setmetatable(L, -2);
+    return state;
+}
+
+/* gcrypt.Cipher(algo, mode[, flags[, backend]]) */
+static int
+lgcrypt_cipher_open(lua_State *L)
+{
+    int algo, mode, flags, backend;
+    LgcryptCipher *state;
+    gcry_error_t err;
+
+    algo = luaL_checkint(L, 1);
+    mode = luaL_checkint(L, 2);
+    flags = (unsigned int)luaL_optinteger(L, 3, 0);
+    backend = luaL_checkoption(L, 4, "libgcrypt", backend_names);
+
+    state = lgcrypt_cipher_new(L);
+    state->algo = algo;
+    state->mode = mode;
+    state->flags = (unsigned int)flags;
+
+    if (backend == BACKEND_AF_ALG) {
+#ifdef HAVE_AF_ALG
+        state->alg = afalg_cipher_open(algo, mode, (unsigned int)flags);
+        if (!state->alg) {
+            lua_pop(L, 1);
+            luaL_error(L, "AF_ALG cipher unavailable: %s", strerror(errno));
+        }
+        return 1;
+#else
+        luaL_argerror(L, 4, "af_alg is not supported");
+#endif
+    }
+
+    err = gcry_cipher_open(&state->h, algo, mode, flags);
+    if (err) {
+        lua_pop(L, 1);
+        luaL_error(L, "gcry_cipher_open() failed with %s", gcry_strerror(err));
+    }
+    return 1;
+}
+
+static LgcryptCipher *
+getCipher(lua_State *L, int arg)
+{
+    return (LgcryptCipher *)luaL_checkudata(L, arg, "gcrypt.Cipher");
+}
+
+static LgcryptCipher *
+checkCipher(lua_State *L, int arg)
+{
+    LgcryptCipher *state = getCipher(L, arg);
+    if (!state->h && !state->alg) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return state;
+}
+
+/* For functions that are only available with the Libgcrypt backend. */
+static LgcryptCipher *
+checkGcryCipher(lua_State *L, int arg)
+{
+    LgcryptCipher *state = checkCipher(L, arg);
+    if (!state->h) {
+        luaL_error(L, "Unsupported by the af_alg backend");
+    }
+    return state;
+}
+
+static void
+cipher_forget_key(lua_State *L, LgcryptCipher *state)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, state->key_ref);
+    state->key_ref = LUA_NOREF;
+    state->key = NULL;
+}
+
+/* References the key at arg if it is a gcrypt.Key. String keys are not
+ * retained, so rekeying with them costs no secure memory. */
+static void
+cipher_keep_key(lua_State *L, LgcryptCipher *state, int arg)
+{
+    if (is_key(L, arg)) {
+        state->key = (LgcryptKey *) lua_touserdata(L, arg);
+        lua_pushvalue(L, arg);
+        state->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+static int
+lgcrypt_cipher___gc(lua_State *L)
+{
+    LgcryptCipher *state = getCipher(L, 1);
+
+    if (state->h) {
+        gcry_cipher_close(state->h);
+        state->h = NULL;
+    }
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_close(state->alg);
+        state->alg = NULL;
+    }
+#endif
+    cipher_forget_key(L, state);
+    return 0;
+}
+
+static int
+lgcrypt_cipher_setkey(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    size_t key_len;
+    const char *key = check_key(L, 2, &key_len);
+    gcry_error_t err;
+
+    cipher_forget_key(L, state);
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_cipher_setkey(state->alg, key, key_len), "setkey");
+        cipher_keep_key(L, state, 2);
+        return 0;
+    }
+#endif
+    err = gcry_cipher_setkey(state->h, key, key_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_setkey() failed with %s", gcry_strerror(err));
+    }
+    cipher_keep_key(L, state, 2);
+    return 0;
+}
+
+static int
+lgcrypt_cipher_setiv(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    size_t iv_len;
+    const char *iv = luaL_checklstring(L, 2, &iv_len);
+    gcry_error_t err;
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_cipher_setiv(state->alg, iv, iv_len), "setiv");
+        return 0;
+    }
+#endif
+    err = gcry_cipher_setiv(state->h, iv, iv_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_setiv() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_cipher_setctr(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    size_t ctr_len;
+    const char *ctr = luaL_checklstring(L, 2, &ctr_len);
+    gcry_error_t err;
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_cipher_setiv(state->alg, ctr, ctr_len), "setctr");
+        return 0;
+    }
+#endif
+    err = gcry_cipher_setctr(state->h, ctr, ctr_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_setctr() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_cipher_reset(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    gcry_error_t err;
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_cipher_setiv(state->alg, "", 0);
+        return 0;
+    }
+#endif
+    err = gcry_cipher_reset(state->h);
+    if (err) {
+        luaL_error(L, "gcry_cipher_reset() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+static int
+lgcrypt_cipher_authenticate(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    size_t abuf_len;
+    const char *abuf = luaL_checklstring(L, 2, &abuf_len);
+    gcry_error_t err;
+
+    err = gcry_cipher_authenticate(state->h, abuf, abuf_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_authenticate() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+/* Libgcrypt 1.6.5 has some quirks
+ * https://lists.gnupg.org/pipermail/gcrypt-devel/2016-March/003754.html */
+static size_t
+get_tag_length(LgcryptCipher *state)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    size_t nbytes = 0;
+    gcry_error_t err;
+
+    err = gcry_cipher_info(state->h, GCRYCTL_GET_TAGLEN, NULL, &nbytes);
+    return !err ? nbytes : 0;
+#else
+    return state->mode == GCRY_CIPHER_MODE_GCM ? 16 : 0;
+#endif
+}
+
+static int
+lgcrypt_cipher_gettag(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    char tag[16];
+    size_t tag_len;
+    gcry_error_t err;
+
+    tag_len = get_tag_length(state);
+    if (tag_len == 0) {
+        luaL_error(L, "Unsupported cipher mode");
+    }
+    err = gcry_cipher_gettag(state->h, tag, tag_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_gettag() failed with %s", gcry_strerror(err));
+    }
+    lua_pushlstring(L, tag, tag_len);
+    return 1;
+}
+
+static int
+lgcrypt_cipher_checktag(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    size_t tag_len;
+    const char *tag = luaL_checklstring(L, 2, &tag_len);
+    gcry_error_t err;
+
+    err = gcry_cipher_checktag(state->h, tag, tag_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_checktag() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+/* Sets the CCM lengths (GCRYCTL_SET_CCM_LENGTHS), must be called after setiv
+ * and before authenticate/encrypt/decrypt. */
+static int
+lgcrypt_cipher_set_ccm_lengths(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    unsigned long long params[3];
+    gcry_error_t err;
+
+    params[0] = (unsigned long long)luaL_checkinteger(L, 2);  /* encrypted length */
+    params[1] = (unsigned long long)luaL_checkinteger(L, 3);  /* AAD length */
+    params[2] = (unsigned long long)luaL_checkinteger(L, 4);  /* tag length */
+
+    err = gcry_cipher_ctl(state->h, GCRYCTL_SET_CCM_LENGTHS, params, sizeof(params));
+    if (err) {
+        luaL_error(L, "gcry_cipher_ctl() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+#endif
+
+static int
+lgcrypt_cipher_encrypt(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    size_t in_len, out_len;
+    const char *in;
+    char *out;
+    gcry_error_t err;
+
+    in = luaL_checklstring(L, 2, &in_len);
+
+    out_len = in_len;
+    out = lua_newuserdata(L, out_len);
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_cipher_crypt(state->alg, 1,
+                    (const unsigned char *) in, (unsigned char *) out,
+                    in_len), "encrypt");
+        lua_pushlstring(L, out, out_len);
+        lua_remove(L, -2);
+        return 1;
+    }
+#endif
+    err = gcry_cipher_encrypt(state->h, out, out_len, in, in_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_encrypt() failed with %s", gcry_strerror(err));
+    }
+    lua_pushlstring(L, out, out_len);
+    lua_remove(L, -2);
+    return 1;
+}
+
+static int
+lgcrypt_cipher_decrypt(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    size_t in_len, out_len;
+    const char *in;
+    char *out;
+    gcry_error_t err;
+
+    in = luaL_checklstring(L, 2, &in_len);
+
+    out_len = in_len;
+    out = lua_newuserdata(L, out_len);
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_cipher_crypt(state->alg, 0,
+                    (const unsigned char *) in, (unsigned char *) out,
+                    in_len), "decrypt");
+        lua_pushlstring(L, out, out_len);
+        lua_remove(L, -2);
+        return 1;
+    }
+#endif
+    err = gcry_cipher_decrypt(state->h, out, out_len, in, in_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s", gcry_strerror(err));
+    }
+    lua_pushlstring(L, out, out_len);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/* Encrypts or decrypts the file at in_path into out_path. */
+static int
+cipher_crypt_file(lua_State *L, int encrypt)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    const char *in_path = luaL_checkstring(L, 2);
+    const char *out_path = luaL_checkstring(L, 3);
+    unsigned char *buf;
+    FILE *in, *out;
+    size_t n;
+    gcry_error_t err = 0;
+    int io_err = 0, failed;
+
+    buf = lua_newuserdata(L, FILE_CHUNK_SIZE);
+    in = fopen(in_path, "rb");
+    if (!in) {
+        luaL_error(L, "Failed to open %s: %s", in_path, strerror(errno));
+    }
+    out = fopen(out_path, "wb");
+    if (!out) {
+        io_err = errno;
+        fclose(in);
+        luaL_error(L, "Failed to open %s: %s", out_path, strerror(io_err));
+    }
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        io_err = afalg_cipher_crypt_file(state->alg, encrypt, fileno(in),
+                fileno(out));
+        failed = fclose(out);
+        fclose(in);
+        afalg_check(L, io_err, encrypt ? "encrypt" : "decrypt");
+        if (failed) {
+            luaL_error(L, "Failed to write %s: %s", out_path, strerror(errno));
+        }
+        return 0;
+    }
+#endif
+    while (!err && !io_err && (n = fread(buf, 1, FILE_CHUNK_SIZE, in)) > 0) {
+        if (encrypt) {
+            err = gcry_cipher_encrypt(state->h, buf, n, NULL, 0);
+        } else {
+            err = gcry_cipher_decrypt(state->h, buf, n, NULL, 0);
+        }
+        if (!err && fwrite(buf, 1, n, out) != n) {
+            io_err = errno;
+        }
+    }
+    if (ferror(in)) {
+        io_err = errno;
+    }
+    failed = fclose(out);
+    if (failed && !io_err) {
+        io_err = errno;
+    }
+    fclose(in);
+    if (err) {
+        luaL_error(L, "gcry_cipher_%s() failed with %s",
+                encrypt ? "encrypt" : "decrypt", gcry_strerror(err));
+    }
+    if (io_err) {
+        luaL_error(L, "File encryption failed: %s", strerror(io_err));
+    }
+    return 0;
+}
+
+/* cipher:encrypt_file(in_path, out_path) */
+static int
+lgcrypt_cipher_encrypt_file(lua_State *L)
+{
+    return cipher_crypt_file(L, 1);
+}
+
+/* cipher:decrypt_file(in_path, out_path) */
+static int
+lgcrypt_cipher_decrypt_file(lua_State *L)
+{
+    return cipher_crypt_file(L, 0);
+}
+
+/* Returns the change in length of wrapping (AESWRAP adds 8 bytes). */
+static size_t
+wrap_overhead(LgcryptCipher *state)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010500 /* 1.5.0 */
+    if (state->mode == GCRY_CIPHER_MODE_AESWRAP) {
+        return 8;
+    }
+#endif
+    (void)state;
+    return 0;
+}
+
+/* cipher:wrap_key(key) encrypts a string or gcrypt.Key. */
+static int
+lgcrypt_cipher_wrap_key(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    size_t key_len, out_len;
+    const char *key = check_key(L, 2, &key_len);
+    char *out;
+    gcry_error_t err;
+
+    out_len = key_len + wrap_overhead(state);
+    out = lua_newuserdata(L, out_len);
+    err = gcry_cipher_encrypt(state->h, out, out_len, key, key_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_encrypt() failed with %s", gcry_strerror(err));
+    }
+    lua_pushlstring(L, out, out_len);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/* cipher:unwrap_key(wrapped) decrypts into a gcrypt.Key. */
+static int
+lgcrypt_cipher_unwrap_key(lua_State *L)
+{
+    LgcryptCipher *state = checkGcryCipher(L, 1);
+    size_t in_len, overhead = wrap_overhead(state);
+    const char *in = luaL_checklstring(L, 2, &in_len);
+    LgcryptKey *key;
+    gcry_error_t err;
+
+    if (in_len < overhead) {
+        luaL_error(L, "Wrapped key too short");
+    }
+    key = key_new(L, in_len - overhead);
+    err = gcry_cipher_decrypt(state->h, key->data, key->len, in, in_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s", gcry_strerror(err));
+    }
+    return 1;
+}
+
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+/* A record whose decryption is deferred until the plaintext is needed. The
+ * strings are kept as references and released after decryption. */
+typedef struct {
+    int algo;               /* 0 once the object is dead */
+    int mode;
+    unsigned int flags;
+    LgcryptKey *key;        /* the key of the cipher */
+    int key_ref;
+    size_t len;
+    int ciphertext_ref, iv_ref, aad_ref, tag_ref;
+    int plaintext_ref;      /* LUA_NOREF until decrypted */
+} LgcryptLazyPlaintext;
+
+/* Returns non-zero if records of the mode can be decrypted independently
+ * given the key, IV (or counter), AAD and tag. */
+static int
+is_record_mode(int mode)
+{
+    switch (mode) {
+    case GCRY_CIPHER_MODE_CTR:
+    case GCRY_CIPHER_MODE_CCM:
+    case GCRY_CIPHER_MODE_GCM:
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    case GCRY_CIPHER_MODE_POLY1305:
+    case GCRY_CIPHER_MODE_OCB:
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+static LgcryptLazyPlaintext *
+getLazyPlaintext(lua_State *L, int arg)
+{
+    return (LgcryptLazyPlaintext *)luaL_checkudata(L, arg,
+            "gcrypt.LazyPlaintext");
+}
+
+static LgcryptLazyPlaintext *
+checkLazyPlaintext(lua_State *L, int arg)
+{
+    LgcryptLazyPlaintext *lazy = getLazyPlaintext(L, arg);
+    if (!lazy->algo) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return lazy;
+}
+
+/* Releases the captured key and input strings. */
+static void
+lazy_release(lua_State *L, LgcryptLazyPlaintext *lazy)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, lazy->key_ref);
+    lazy->key_ref = LUA_NOREF;
+    lazy->key = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, lazy->ciphertext_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lazy->iv_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lazy->aad_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lazy->tag_ref);
+    lazy->ciphertext_ref = lazy->iv_ref = LUA_NOREF;
+    lazy->aad_ref = lazy->tag_ref = LUA_NOREF;
+}
+
+static int
+lgcrypt_lazy_plaintext___gc(lua_State *L)
+{
+    LgcryptLazyPlaintext *lazy = getLazyPlaintext(L, 1);
+
+    if (lazy->algo) {
+        lazy_release(L, lazy);
+        luaL_unref(L, LUA_REGISTRYINDEX, lazy->plaintext_ref);
+        lazy->plaintext_ref = LUA_NOREF;
+        lazy->algo = 0;
+    }
+    return 0;
+}
+
+/* Pushes the string of a reference, returns its length. */
+static const char *
+lazy_string(lua_State *L, int ref, size_t *len)
+{
+    const char *s;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    s = lua_tolstring(L, -1, len);
+    lua_pop(L, 1);  /* still referenced */
+    return s;
+}
+
+/* Decrypts an independent record with a keyed handle in one of the record
+ * modes. Records of all modes but CTR must have a tag. Returns an error and
+ * the failed step. */
+static gcry_error_t
+record_decrypt(gcry_cipher_hd_t h, int mode, const void *iv, size_t iv_len,
+        const void *aad, size_t aad_len, const void *tag, size_t tag_len,
+        const void *in, size_t len, unsigned char *out, const char **step)
+{
+    unsigned long long params[3];
+    gcry_error_t err = 0;
+
+    if (mode != GCRY_CIPHER_MODE_CTR && (!tag || !tag_len)) {
+        *step = "gcry_cipher_checktag";
+        return gcry_error(GPG_ERR_CHECKSUM);
+    }
+
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    if (tag && mode == GCRY_CIPHER_MODE_OCB) {
+        /* The tag length must be set before the nonce. */
+        *step = "gcry_cipher_ctl";
+        err = gcry_cipher_ctl(h, GCRYCTL_SET_TAGLEN, &tag_len, sizeof(tag_len));
+    }
+#endif
+    if (!err && mode == GCRY_CIPHER_MODE_CTR) {
+        *step = "gcry_cipher_setctr";
+        err = gcry_cipher_setctr(h, iv, iv_len);
+    } else if (!err) {
+        *step = "gcry_cipher_setiv";
+        err = gcry_cipher_setiv(h, iv, iv_len);
+    }
+    if (!err && mode == GCRY_CIPHER_MODE_CCM) {
+        params[0] = len;
+        params[1] = aad_len;
+        params[2] = tag_len;
+        *step = "gcry_cipher_ctl";
+        err = gcry_cipher_ctl(h, GCRYCTL_SET_CCM_LENGTHS, params, sizeof(params));
+    }
+    if (!err && aad) {
+        *step = "gcry_cipher_authenticate";
+        err = gcry_cipher_authenticate(h, aad, aad_len);
+    }
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    if (!err && mode == GCRY_CIPHER_MODE_OCB) {
+        *step = "gcry_cipher_final";
+        err = gcry_cipher_final(h);
+    }
+#endif
+    if (!err) {
+        *step = "gcry_cipher_decrypt";
+        err = gcry_cipher_decrypt(h, out, len, in, len);
+    }
+    if (!err && tag) {
+        *step = "gcry_cipher_checktag";
+        err = gcry_cipher_checktag(h, tag, tag_len);
+    }
+    return err;
+}
+
+/* Decrypts the record into out, returns an error and the failed step. */
+static gcry_error_t
+lazy_decrypt(lua_State *L, LgcryptLazyPlaintext *lazy, unsigned char *out,
+        const char **step)
+{
+    const char *ciphertext, *iv, *aad = NULL, *tag = NULL;
+    size_t len, iv_len, aad_len = 0, tag_len = 0;
+    gcry_cipher_hd_t h;
+    gcry_error_t err;
+
+    ciphertext = lazy_string(L, lazy->ciphertext_ref, &len);
+    iv = lazy_string(L, lazy->iv_ref, &iv_len);
+    if (lazy->aad_ref != LUA_NOREF) {
+        aad = lazy_string(L, lazy->aad_ref, &aad_len);
+    }
+    if (lazy->tag_ref != LUA_NOREF) {
+        tag = lazy_string(L, lazy->tag_ref, &tag_len);
+    }
+
+    *step = "gcry_cipher_open";
+    err = gcry_cipher_open(&h, lazy->algo, lazy->mode, lazy->flags);
+    if (err) {
+        return err;
+    }
+    *step = "gcry_cipher_setkey";
+    err = lazy->key->data ?
+        gcry_cipher_setkey(h, lazy->key->data, lazy->key->len) :
+        gcry_error(GPG_ERR_MISSING_KEY);
+    if (!err) {
+        err = record_decrypt(h, lazy->mode, iv, iv_len, aad, aad_len,
+                tag, tag_len, ciphertext, len, out, step);
+    }
+    gcry_cipher_close(h);
+    return err;
+}
+
+/* record:plaintext() decrypts the record on first use. */
+static int
+lgcrypt_lazy_plaintext_plaintext(lua_State *L)
+{
+    LgcryptLazyPlaintext *lazy = checkLazyPlaintext(L, 1);
+    unsigned char *out;
+    const char *step;
+    gcry_error_t err;
+
+    if (lazy->plaintext_ref == LUA_NOREF) {
+        out = lua_newuserdata(L, lazy->len);
+        err = lazy_decrypt(L, lazy, out, &step);
+        if (err) {
+            memset(out, 0, lazy->len);
+            luaL_error(L, "%s() failed with %s", step, gcry_strerror(err));
+        }
+        lua_pushlstring(L, (const char *) out, lazy->len);
+        memset(out, 0, lazy->len);
+        lazy->plaintext_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+        lazy_release(L, lazy);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lazy->plaintext_ref);
+    return 1;
+}
+
+/* record:decrypted() returns whether the plaintext was produced. */
+static int
+lgcrypt_lazy_plaintext_decrypted(lua_State *L)
+{
+    lua_pushboolean(L, checkLazyPlaintext(L, 1)->plaintext_ref != LUA_NOREF);
+    return 1;
+}
+
+static int
+lgcrypt_lazy_plaintext___len(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkLazyPlaintext(L, 1)->len);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_lazy_plaintext_meta[] = {
+    {"__gc",        lgcrypt_lazy_plaintext___gc},
+    {"__len",       lgcrypt_lazy_plaintext___len},
+    {"plaintext",   lgcrypt_lazy_plaintext_plaintext},
+    {"decrypted",   lgcrypt_lazy_plaintext_decrypted},
+    {NULL,          NULL}
+};
+
+/* Returns a reference to the string argument, or LUA_NOREF for nil. */
+static int
+ref_opt_string(lua_State *L, int arg)
+{
+    if (lua_isnoneornil(L, arg)) {
+        return LUA_NOREF;
+    }
+    luaL_checkstring(L, arg);
+    lua_pushvalue(L, arg);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* cipher:decrypt_lazy(ciphertext, iv[, aad[, tag]]) captures the key, the IV
+ * (the counter in CTR mode), AAD and tag of a record and returns a
+ * gcrypt.LazyPlaintext that decrypts it on first access. */
+static int
+lgcrypt_cipher_decrypt_lazy(lua_State *L)
+{
+    LgcryptCipher *state = checkCipher(L, 1);
+    LgcryptLazyPlaintext *lazy;
+    size_t len, tag_len = 0;
+
+    lua_settop(L, 5);
+    luaL_checklstring(L, 2, &len);
+    luaL_checkstring(L, 3);
+    if (!is_record_mode(state->mode)) {
+        luaL_error(L, "Unsupported cipher mode");
+    }
+    if (!state->key) {
+        luaL_error(L, "No gcrypt.Key was set");
+    }
+    if (!state->key->data) {
+        luaL_error(L, "Called into a dead object");
+    }
+    if (state->mode == GCRY_CIPHER_MODE_CTR) {
+        luaL_argcheck(L, lua_isnoneornil(L, 4) && lua_isnoneornil(L, 5), 4,
+                "CTR mode has no AAD or tag");
+    } else {
+        if (!lua_isnoneornil(L, 5)) {
+            luaL_checklstring(L, 5, &tag_len);
+        }
+        luaL_argcheck(L, tag_len > 0, 5, "authenticated modes require a tag");
+    }
+
+    lazy = (LgcryptLazyPlaintext *) lua_newuserdata(L,
+            sizeof(LgcryptLazyPlaintext));
+    memset(lazy, 0, sizeof(LgcryptLazyPlaintext));
+    lazy->key_ref = lazy->ciphertext_ref = lazy->iv_ref = LUA_NOREF;
+    lazy->aad_ref = lazy->tag_ref = lazy->plaintext_ref = LUA_NOREF;
+    luaL_getmetatable(L, "gcrypt.LazyPlaintext");
+    lua_setmetatable(L, -2);
+
+    lazy->algo = state->algo;
+    lazy->mode = state->mode;
+    lazy->flags = state->flags;
+    /* Rekeying the cipher replaces its key object, so this one is shared. */
+    lazy->key = state->key;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->key_ref);
+    lazy->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lazy->len = len;
+    lazy->ciphertext_ref = ref_opt_string(L, 2);
+    lazy->iv_ref = ref_opt_string(L, 3);
+    lazy->aad_ref = ref_opt_string(L, 4);
+    lazy->tag_ref = ref_opt_string(L, 5);
+    return 1;
+}
+#endif
+
+/* https://gnupg.org/documentation/manuals/gcrypt/Working-with-cipher-handles.html */
+static const struct luaL_Reg lgcrypt_cipher_meta[] = {
+    {"__gc",            lgcrypt_cipher___gc},
+    {"setkey",          lgcrypt_cipher_setkey},
+    {"setiv",           lgcrypt_cipher_setiv},
+    {"setctr",          lgcrypt_cipher_setctr},
+    {"reset",           lgcrypt_cipher_reset},
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    {"authenticate",    lgcrypt_cipher_authenticate},
+    {"gettag",          lgcrypt_cipher_gettag},
+    {"checktag",        lgcrypt_cipher_checktag},
+    {"set_ccm_lengths", lgcrypt_cipher_set_ccm_lengths},
+    {"decrypt_lazy",    lgcrypt_cipher_decrypt_lazy},
+#endif
+    {"encrypt",         lgcrypt_cipher_encrypt},
+    {"decrypt",         lgcrypt_cipher_decrypt},
+    {"encrypt_file",    lgcrypt_cipher_encrypt_file},
+    {"decrypt_file",    lgcrypt_cipher_decrypt_file},
+    {"wrap_key",        lgcrypt_cipher_wrap_key},
+    {"unwrap_key",      lgcrypt_cipher_unwrap_key},
+    {NULL,              NULL}
+};
+/* }}} */
+
+/* {{{ Decrypting readers */
+enum { SECTOR_XTS, SECTOR_CTR };
+static const char *const sector_mode_names[] = { "xts", "ctr", NULL };
+
+/* Sector IVs are a tweak (XTS) or counter block (CTR) of this size. */
+#define SECTOR_IV_LEN   16
+
+typedef struct {
+    FILE *fp;
+    LgcryptCipher *cipher;
+    int cipher_ref;         /* keeps the cipher alive */
+    int iv_fn_ref;          /* LUA_NOREF for the default IVs */
+    int mode;
+    size_t sector_size;
+    unsigned long long data_offset;
+    unsigned long long data_size;
+    unsigned char iv[SECTOR_IV_LEN];    /* CTR start counter */
+    LruCache sectors;       /* decrypted sectors */
+} LgcryptDecryptingReader;
+
+/* Computes the tweak or counter block for a sector. The default XTS tweak
+ * is the little-endian sector number (dm-crypt "plain64"), the default CTR
+ * counter continues from the start counter as for a single stream. */
+static void
+sector_iv(lua_State *L, LgcryptDecryptingReader *r, unsigned long long sector,
+        unsigned char *iv)
+{
+    const char *s;
+    size_t len;
+    unsigned n;
+
+    if (r->iv_fn_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, r->iv_fn_ref);
+        lua_pushinteger(L, (lua_Integer)sector);
+        lua_call(L, 1, 1);
+        s = lua_tolstring(L, -1, &len);
+        if (!s || len != SECTOR_IV_LEN) {
+            luaL_error(L, "iv_fn must return a string of %d bytes",
+                    SECTOR_IV_LEN);
+        }
+        memcpy(iv, s, SECTOR_IV_LEN);
+        lua_pop(L, 1);
+    } else if (r->mode == SECTOR_XTS) {
+        memset(iv, 0, SECTOR_IV_LEN);
+        for (n = 0; n < 8; n++) {
+            iv[n] = (unsigned char)(sector >> (8 * n));
+        }
+    } else {
+        memcpy(iv, r->iv, SECTOR_IV_LEN);
+        ctr_add(iv, SECTOR_IV_LEN, sector * (r->sector_size / SECTOR_IV_LEN));
+    }
+}
+
+/* Returns a decrypted sector, the length is stored in sector_len. */
+static const unsigned char *
+decrypted_sector(lua_State *L, LgcryptDecryptingReader *r,
+        unsigned long long sector, unsigned char *scratch, size_t *sector_len)
+{
+    unsigned long long offset = sector * r->sector_size;
+    unsigned char iv[SECTOR_IV_LEN];
+    unsigned char *cached;
+    gcry_error_t err;
+
+    *sector_len = r->sector_size;
+    if (r->data_size - offset < r->sector_size) {
+        *sector_len = (size_t)(r->data_size - offset);
+    }
+    cached = lru_get(&r->sectors, sector);
+    if (cached) {
+        return cached;
+    }
+    if (read_at(r->fp, r->data_offset + offset, scratch, *sector_len)) {
+        luaL_error(L, "Failed to read sector %d", (int)sector);
+    }
+    sector_iv(L, r, sector, iv);
+    if (r->mode == SECTOR_XTS) {
+        err = gcry_cipher_setiv(r->cipher->h, iv, SECTOR_IV_LEN);
+    } else {
+        err = gcry_cipher_setctr(r->cipher->h, iv, SECTOR_IV_LEN);
+    }
+    if (!err) {
+        err = gcry_cipher_decrypt(r->cipher->h, scratch, *sector_len, NULL, 0);
+    }
+    if (err) {
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s",
+                gcry_strerror(err));
+    }
+    cached = lru_put(&r->sectors, sector);
+    if (cached) {
+        memcpy(cached, scratch, *sector_len);
+        return cached;
+    }
+    return scratch;
+}
+
+static LgcryptDecryptingReader *
+getDecryptingReader(lua_State *L, int arg)
+{
+    return (LgcryptDecryptingReader *)luaL_checkudata(L, arg,
+            "gcrypt.DecryptingReader");
+}
+
+static LgcryptDecryptingReader *
+checkDecryptingReader(lua_State *L, int arg)
+{
+    LgcryptDecryptingReader *r = getDecryptingReader(L, arg);
+    if (!r->fp) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return r;
+}
+
+static int
+lgcrypt_decrypting_reader___gc(lua_State *L)
+{
+    LgcryptDecryptingReader *r = getDecryptingReader(L, 1);
+
+    if (r->fp) {
+        fclose(r->fp);
+        r->fp = NULL;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, r->cipher_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, r->iv_fn_ref);
+    r->cipher_ref = r->iv_fn_ref = LUA_NOREF;
+    lru_free(&r->sectors);
+    return 0;
+}
+
+/* gcrypt.DecryptingReader(path, cipher[, options]) */
+static int
+lgcrypt_decrypting_reader_open(lua_State *L)
+{
+    LgcryptDecryptingReader *r;
+    LgcryptCipher *cipher;
+    const char *path, *iv;
+    size_t iv_len = 0;
+    lua_Integer sector_size, data_offset, cache_sectors;
+    long long end;
+    int mode;
+
+    path = luaL_checkstring(L, 1);
+    cipher = checkGcryCipher(L, 2);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    switch (cipher->mode) {
+#if GCRYPT_VERSION_NUMBER >= 0x010800 /* 1.8.0 */
+    case GCRY_CIPHER_MODE_XTS:  mode = SECTOR_XTS; break;
+#endif
+    case GCRY_CIPHER_MODE_CTR:  mode = SECTOR_CTR; break;
+    default:
+        return luaL_argerror(L, 2, "cipher must be in XTS or CTR mode");
+    }
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "mode");
+        if (!lua_isnil(L, -1) && (!lua_isstring(L, -1) ||
+                    strcmp(lua_tostring(L, -1), sector_mode_names[mode]))) {
+            luaL_error(L, "option 'mode' does not match the cipher mode");
+        }
+        lua_pop(L, 1);
+    }
+    sector_size = opt_field_integer(L, 3, "sector_size",
+            mode == SECTOR_XTS ? 512 : 4096);
+    data_offset = opt_field_integer(L, 3, "data_offset", 0);
+    cache_sectors = opt_field_integer(L, 3, "cache_sectors", 64);
+    luaL_argcheck(L, sector_size > 0 && sector_size % SECTOR_IV_LEN == 0, 3,
+            "sector size must be a positive multiple of 16");
+    luaL_argcheck(L, data_offset >= 0 && cache_sectors >= 0, 3,
+            "offsets and cache sizes must not be negative");
+
+    r = (LgcryptDecryptingReader *) lua_newuserdata(L,
+            sizeof(LgcryptDecryptingReader));
+    memset(r, 0, sizeof(LgcryptDecryptingReader));
+    r->cipher_ref = r->iv_fn_ref = LUA_NOREF;
+    luaL_getmetatable(L, "gcrypt.DecryptingReader");
+    lua_setmetatable(L, -2);
+
+    r->cipher = cipher;
+    r->mode = mode;
+    r->sector_size = (size_t)sector_size;
+    r->data_offset = (unsigned long long)data_offset;
+    lua_pushvalue(L, 2);
+    r->cipher_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "iv_fn");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+        } else if (lua_isfunction(L, -1)) {
+            r->iv_fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            luaL_error(L, "option 'iv_fn' must be a function");
+        }
+        lua_getfield(L, 3, "iv");
+        iv = lua_tolstring(L, -1, &iv_len);
+        if (iv && iv_len != SECTOR_IV_LEN) {
+            luaL_error(L, "option 'iv' must be %d bytes", SECTOR_IV_LEN);
+        }
+        if (iv) {
+            memcpy(r->iv, iv, SECTOR_IV_LEN);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (!lru_init(&r->sectors, (size_t)cache_sectors, r->sector_size)) {
+        luaL_error(L, "Out of memory");
+    }
+    r->fp = fopen(path, "rb");
+    if (!r->fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+#ifdef _WIN32
+    end = _fseeki64(r->fp, 0, SEEK_END) ? -1 : _ftelli64(r->fp);
+#else
+    end = fseeko(r->fp, 0, SEEK_END) ? -1 : (long long)ftello(r->fp);
+#endif
+    if (end < 0) {
+        luaL_error(L, "Failed to seek %s: %s", path, strerror(errno));
+    }
+    if ((unsigned long long)end > r->data_offset) {
+        r->data_size = (unsigned long long)end - r->data_offset;
+    }
+    return 1;
+}
+
+/* reader:read(offset, len) returns decrypted data, shorter at the end. */
+static int
+lgcrypt_decrypting_reader_read(lua_State *L)
+{
+    LgcryptDecryptingReader *r = checkDecryptingReader(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+    unsigned long long pos, end;
+    const unsigned char *sector;
+    unsigned char *scratch;
+    size_t sector_len, skip, n;
+    luaL_Buffer b;
+
+    luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+    luaL_argcheck(L, len >= 0, 3, "length must not be negative");
+    pos = (unsigned long long)offset;
+    end = pos + (unsigned long long)len;
+    if (end > r->data_size) {
+        end = r->data_size;
+    }
+
+    scratch = lua_newuserdata(L, r->sector_size);
+    luaL_buffinit(L, &b);
+    while (pos < end) {
+        sector = decrypted_sector(L, r, pos / r->sector_size, scratch,
+                &sector_len);
+        skip = (size_t)(pos % r->sector_size);
+        n = sector_len - skip;
+        if (n > end - pos) {
+            n = (size_t)(end - pos);
+        }
+        luaL_addlstring(&b, (const char *) sector + skip, n);
+        pos += n;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* reader:size() returns the size of the encrypted data. */
+static int
+lgcrypt_decrypting_reader_size(lua_State *L)
+{
+    LgcryptDecryptingReader *r = checkDecryptingReader(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)r->data_size);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_decrypting_reader_meta[] = {
+    {"__gc",    lgcrypt_decrypting_reader___gc},
+    {"read",    lgcrypt_decrypting_reader_read},
+    {"size",    lgcrypt_decrypting_reader_size},
+    {NULL,      NULL}
+};
+/* }}} */
+
+/* {{{ Encrypted files */
+/* Size of the read-ahead and write-behind buffers, a multiple of the block
+ * size so that only the last chunk of a file may be partial. */
+#define ENCRYPTED_FILE_BUFFER   (256 * 1024)
+#define ENCRYPTED_FILE_TAG_LEN  16
+
+typedef struct {
+    FILE *fp;
+    LgcryptCipher *cipher;
+    int cipher_ref;         /* keeps the cipher alive */
+    int writing;
+    int aead;               /* a tag follows the ciphertext */
+    int verified;           /* AEAD reads: 1 if authenticated, -1 if not */
+    unsigned char *buf;
+    size_t buf_len, buf_pos;
+    unsigned long long remaining;   /* ciphertext left to read */
+} LgcryptEncryptedFile;
+
+/* Returns non-zero if the cipher mode appends an authentication tag. */
+static int
+is_aead_mode(int mode)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    if (mode == GCRY_CIPHER_MODE_GCM) {
+        return 1;
+    }
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    if (mode == GCRY_CIPHER_MODE_POLY1305) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Returns non-zero if data of any length can be processed in chunks. */
+static int
+is_stream_mode(int mode)
+{
+    switch (mode) {
+    case GCRY_CIPHER_MODE_CFB:
+    case GCRY_CIPHER_MODE_STREAM:
+    case GCRY_CIPHER_MODE_OFB:
+    case GCRY_CIPHER_MODE_CTR:
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    case GCRY_CIPHER_MODE_CFB8:
+#endif
+        return 1;
+    }
+    return is_aead_mode(mode);
+}
+
+/* Encrypts and writes the buffered data. If final is set, the tag of AEAD
+ * modes is written as well. Returns an error message or NULL. */
+static const char *
+encrypted_file_flush(LgcryptEncryptedFile *f, int final)
+{
+    unsigned char tag[ENCRYPTED_FILE_TAG_LEN];
+
+    if (f->buf_len) {
+        if (gcry_cipher_encrypt(f->cipher->h, f->buf, f->buf_len, NULL, 0)) {
+            return "Encryption failed";
+        }
+        if (fwrite(f->buf, 1, f->buf_len, f->fp) != f->buf_len) {
+            return "Write failed";
+        }
+        f->buf_len = 0;
+    }
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    if (final && f->aead) {
+        if (gcry_cipher_gettag(f->cipher->h, tag, sizeof(tag))) {
+            return "Failed to obtain the authentication tag";
+        }
+        if (fwrite(tag, 1, sizeof(tag), f->fp) != sizeof(tag)) {
+            return "Write failed";
+        }
+    }
+#else
+    (void)tag;
+    (void)final;
+#endif
+    return NULL;
+}
+
+/* Reads and decrypts the whole ciphertext of an AEAD file into the buffer
+ * and checks the tag, so that no plaintext is returned unauthenticated. */
+static void
+encrypted_file_authenticate(lua_State *L, LgcryptEncryptedFile *f)
+{
+    unsigned char tag[ENCRYPTED_FILE_TAG_LEN];
+    unsigned char *buf;
+    size_t n = (size_t)f->remaining;
+    gcry_error_t err;
+
+    if (f->verified < 0) {
+        luaL_error(L, "Authentication tag mismatch");
+    }
+    f->verified = -1;
+    if (n != f->remaining) {
+        luaL_error(L, "Encrypted file too large");
+    }
+    if (n > ENCRYPTED_FILE_BUFFER) {
+        buf = realloc(f->buf, n);
+        if (!buf) {
+            luaL_error(L, "Out of memory");
+        }
+        f->buf = buf;
+    }
+    if (fread(f->buf, 1, n, f->fp) != n ||
+            fread(tag, 1, sizeof(tag), f->fp) != sizeof(tag)) {
+        luaL_error(L, "Read failed");
+    }
+    if (n) {
+        err = gcry_cipher_decrypt(f->cipher->h, f->buf, n, NULL, 0);
+        if (err) {
+            luaL_error(L, "gcry_cipher_decrypt() failed with %s",
+                    gcry_strerror(err));
+        }
+    }
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    if (gcry_cipher_checktag(f->cipher->h, tag, sizeof(tag))) {
+        memset(f->buf, 0, n);
+        luaL_error(L, "Authentication tag mismatch");
+    }
+#endif
+    f->verified = 1;
+    f->remaining = 0;
+    f->buf_len = n;
+}
+
+/* Reads and decrypts the next chunk once the buffer is consumed. AEAD files
+ * are authenticated as a whole first. Returns zero at the end of the file. */
+static int
+encrypted_file_fill(lua_State *L, LgcryptEncryptedFile *f)
+{
+    size_t n = ENCRYPTED_FILE_BUFFER;
+    gcry_error_t err;
+
+    if (f->buf_pos < f->buf_len) {
+        return 1;
+    }
+    f->buf_pos = f->buf_len = 0;
+    if (f->aead && f->verified <= 0) {
+        encrypted_file_authenticate(L, f);
+        return f->buf_len > 0;
+    }
+    if (f->remaining == 0) {
+        return 0;
+    }
+    if (n > f->remaining) {
+        n = (size_t)f->remaining;
+    }
+    if (fread(f->buf, 1, n, f->fp) != n) {
+        luaL_error(L, "Read failed");
+    }
+    err = gcry_cipher_decrypt(f->cipher->h, f->buf, n, NULL, 0);
+    if (err) {
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s",
+                gcry_strerror(err));
+    }
+    f->remaining -= n;
+    f->buf_len = n;
+    return 1;
+}
+
+static LgcryptEncryptedFile *
+getEncryptedFile(lua_State *L, int arg)
+{
+    return (LgcryptEncryptedFile *)luaL_checkudata(L, arg,
+            "gcrypt.EncryptedFile");
+}
+
+static LgcryptEncryptedFile *
+checkEncryptedFile(lua_State *L, int arg)
+{
+    LgcryptEncryptedFile *f = getEncryptedFile(L, arg);
+    if (!f->fp) {
+        luaL_error(L, "Attempt to use a closed file");
+    }
+    return f;
+}
+
+/* Closes the file, returns an error message or NULL. */
+static const char *
+encrypted_file_close(lua_State *L, LgcryptEncryptedFile *f)
+{
+    const char *error = NULL;
+
+    if (f->fp) {
+        if (f->writing) {
+            error = encrypted_file_flush(f, 1);
+        }
+        if (fclose(f->fp) && !error) {
+            error = "Write failed";
+        }
+        f->fp = NULL;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, f->cipher_ref);
+    f->cipher_ref = LUA_NOREF;
+    free(f->buf);
+    f->buf = NULL;
+    return error;
+}
+
+static int
+lgcrypt_encrypted_file___gc(lua_State *L)
+{
+    encrypted_file_close(L, getEncryptedFile(L, 1));
+    return 0;
+}
+
+/* gcrypt.open_encrypted(path, mode, cipher) */
+static int
+lgcrypt_open_encrypted(lua_State *L)
+{
+    static const char *const mode_names[] = { "r", "w", "rb", "wb", NULL };
+    LgcryptEncryptedFile *f;
+    LgcryptCipher *cipher;
+    const char *path;
+    long long size;
+    int mode;
+
+    path = luaL_checkstring(L, 1);
+    mode = luaL_checkoption(L, 2, "r", mode_names);
+    cipher = checkGcryCipher(L, 3);
+    luaL_argcheck(L, is_stream_mode(cipher->mode), 3,
+            "cipher must be in a stream or AEAD mode");
+
+    f = (LgcryptEncryptedFile *) lua_newuserdata(L,
+            sizeof(LgcryptEncryptedFile));
+    memset(f, 0, sizeof(LgcryptEncryptedFile));
+    f->cipher_ref = LUA_NOREF;
+    luaL_getmetatable(L, "gcrypt.EncryptedFile");
+    lua_setmetatable(L, -2);
+
+    f->cipher = cipher;
+    f->writing = mode & 1;
+    f->aead = is_aead_mode(cipher->mode);
+    lua_pushvalue(L, 3);
+    f->cipher_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    f->buf = malloc(ENCRYPTED_FILE_BUFFER);
+    if (!f->buf) {
+        luaL_error(L, "Out of memory");
+    }
+    f->fp = fopen(path, f->writing ? "wb" : "rb");
+    if (!f->fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    if (!f->writing) {
+#ifdef _WIN32
+        size = _fseeki64(f->fp, 0, SEEK_END) ? -1 : _ftelli64(f->fp);
+#else
+        size = fseeko(f->fp, 0, SEEK_END) ? -1 : (long long)ftello(f->fp);
+#endif
+        if (size < 0 || fseek(f->fp, 0, SEEK_SET)) {
+            luaL_error(L, "Failed to seek %s: %s", path, strerror(errno));
+        }
+        if (f->aead && size < ENCRYPTED_FILE_TAG_LEN) {
+            luaL_error(L, "Missing authentication tag in %s", path);
+        }
+        f->remaining = (unsigned long long)size -
+            (f->aead ? ENCRYPTED_FILE_TAG_LEN : 0);
+    }
+    return 1;
+}
+
+/* Pushes the next line, with the newline if keep_nl is set, or nil at the end
+ * of the file. */
+static int
+encrypted_file_read_line(lua_State *L, LgcryptEncryptedFile *f, int keep_nl)
+{
+    const unsigned char *start, *nl;
+    size_t n, total = 0;
+    luaL_Buffer b;
+
+    luaL_buffinit(L, &b);
+    while (encrypted_file_fill(L, f)) {
+        start = f->buf + f->buf_pos;
+        n = f->buf_len - f->buf_pos;
+        nl = memchr(start, '\n', n);
+        if (nl) {
+            n = (size_t)(nl - start);
+        }
+        luaL_addlstring(&b, (const char *) start, n);
+        f->buf_pos += n;
+        total += n;
+        if (nl) {
+            f->buf_pos++;
+            if (keep_nl) {
+                luaL_addlstring(&b, "\n", 1);
+            }
+            luaL_pushresult(&b);
+            return 1;
+        }
+    }
+    luaL_pushresult(&b);
+    if (total == 0) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* Pushes up to count bytes, or nil at the end of the file. */
+static void
+encrypted_file_read_bytes(lua_State *L, LgcryptEncryptedFile *f, size_t count)
+{
+    size_t n, total = 0;
+    luaL_Buffer b;
+
+    /* read(0) tests for the end of the file. */
+    if (count == 0) {
+        if (encrypted_file_fill(L, f)) {
+            lua_pushliteral(L, "");
+        } else {
+            lua_pushnil(L);
+        }
+        return;
+    }
+    luaL_buffinit(L, &b);
+    while (total < count && encrypted_file_fill(L, f)) {
+        n = f->buf_len - f->buf_pos;
+        if (n > count - total) {
+            n = count - total;
+        }
+        luaL_addlstring(&b, (const char *) f->buf + f->buf_pos, n);
+        f->buf_pos += n;
+        total += n;
+    }
+    luaL_pushresult(&b);
+    if (total == 0) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+}
+
+/* file:read(...) with the formats "a", "l", "L" or a byte count. */
+static int
+lgcrypt_encrypted_file_read(lua_State *L)
+{
+    LgcryptEncryptedFile *f = checkEncryptedFile(L, 1);
+    int n, nargs = lua_gettop(L) - 1;
+    const char *fmt;
+
+    if (f->writing) {
+        luaL_error(L, "File is not open for reading");
+    }
+    if (nargs == 0) {
+        return encrypted_file_read_line(L, f, 0);
+    }
+    for (n = 2; n <= nargs + 1; n++) {
+        if (lua_type(L, n) == LUA_TNUMBER) {
+            lua_Integer count = lua_tointeger(L, n);
+            luaL_argcheck(L, count >= 0, n, "count must not be negative");
+            encrypted_file_read_bytes(L, f, (size_t)count);
+        } else {
+            fmt = luaL_checkstring(L, n);
+            if (*fmt == '*') {
+                fmt++;
+            }
+            switch (*fmt) {
+            case 'a':
+                encrypted_file_read_bytes(L, f, (size_t)-1);
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    lua_pushliteral(L, "");
+                }
+                break;
+            case 'l':
+                encrypted_file_read_line(L, f, 0);
+                break;
+            case 'L':
+                encrypted_file_read_line(L, f, 1);
+                break;
+            default:
+                return luaL_argerror(L, n, "invalid format");
+            }
+        }
+        if (lua_isnil(L, -1)) {
+            return n - 1;
+        }
+    }
+    return nargs;
+}
+
+static int
+encrypted_file_lines_iter(lua_State *L)
+{
+    LgcryptEncryptedFile *f = checkEncryptedFile(L, lua_upvalueindex(1));
+
+    return encrypted_file_read_line(L, f, lua_toboolean(L, lua_upvalueindex(2)));
+}
+
+/* file:lines([keep_newline]) iterates over the decrypted lines. */
+static int
+lgcrypt_encrypted_file_lines(lua_State *L)
+{
+    LgcryptEncryptedFile *f = checkEncryptedFile(L, 1);
+    const char *fmt = luaL_optstring(L, 2, "l");
+
+    if (f->writing) {
+        luaL_error(L, "File is not open for reading");
+    }
+    if (*fmt == '*') {
+        fmt++;
+    }
+    luaL_argcheck(L, *fmt == 'l' || *fmt == 'L', 2, "invalid format");
+    lua_settop(L, 1);
+    lua_pushboolean(L, *fmt == 'L');
+    lua_pushcclosure(L, encrypted_file_lines_iter, 2);
+    return 1;
+}
+
+/* file:write(...) buffers the strings and numbers, returns the file. */
+static int
+lgcrypt_encrypted_file_write(lua_State *L)
+{
+    LgcryptEncryptedFile *f = checkEncryptedFile(L, 1);
+    int arg, nargs = lua_gettop(L);
+    const char *data, *error;
+    size_t len, n;
+
+    if (!f->writing) {
+        luaL_error(L, "File is not open for writing");
+    }
+    for (arg = 2; arg <= nargs; arg++) {
+        data = luaL_checklstring(L, arg, &len);
+        while (len) {
+            n = ENCRYPTED_FILE_BUFFER - f->buf_len;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(f->buf + f->buf_len, data, n);
+            f->buf_len += n;
+            data += n;
+            len -= n;
+            if (f->buf_len == ENCRYPTED_FILE_BUFFER) {
+                error = encrypted_file_flush(f, 0);
+                if (error) {
+                    luaL_error(L, "%s", error);
+                }
+            }
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* file:close() flushes the data and writes the tag of AEAD modes. */
+static int
+lgcrypt_encrypted_file_close(lua_State *L)
+{
+    LgcryptEncryptedFile *f = checkEncryptedFile(L, 1);
+    const char *error = encrypted_file_close(L, f);
+
+    if (error) {
+        luaL_error(L, "%s", error);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_encrypted_file_meta[] = {
+    {"__gc",    lgcrypt_encrypted_file___gc},
+    {"read",    lgcrypt_encrypted_file_read},
+    {"lines",   lgcrypt_encrypted_file_lines},
+    {"write",   lgcrypt_encrypted_file_write},
+    {"close",   lgcrypt_encrypted_file_close},
+    {NULL,      NULL}
+};
+/* }}} */
+
+/* {{{ Sealed files */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+/* STREAM construction over AES-GCM (see README.md for the format). */
+#define SEAL_MAGIC          "GCRYSEAL"
+#define SEAL_HEADER_SIZE    32
+#define SEAL_PREFIX_LEN     7
+#define SEAL_TAG_LEN        16
+#define SEAL_DEFAULT_CHUNK  (64 * 1024)
+#define SEAL_MAX_CHUNK      (16 * 1024 * 1024)
+/* Chunks in flight per batch, at least one per thread. */
+#define SEAL_BATCH_BYTES    (64 * 1024 * 1024)
+
+/* Builds the nonce of a chunk: prefix || be32(index) || final. */
+static void
+seal_nonce(const unsigned char *header, unsigned long index, int final,
+        unsigned char *nonce)
+{
+    memcpy(nonce, header + 16, SEAL_PREFIX_LEN);
+    put_be32(nonce + SEAL_PREFIX_LEN, index);
+    nonce[11] = (unsigned char)(final ? 1 : 0);
+}
+
+/* Encrypts a chunk in place and appends the tag, or checks the tag after len
+ * bytes and decrypts in place. */
+static gcry_error_t
+seal_chunk(gcry_cipher_hd_t h, const unsigned char *header, unsigned long index,
+        int final, unsigned char *data, size_t len, int encrypt)
+{
+    unsigned char nonce[12];
+    gcry_error_t err;
+
+    seal_nonce(header, index, final, nonce);
+    err = gcry_cipher_reset(h);
+    if (!err) {
+        err = gcry_cipher_setiv(h, nonce, sizeof(nonce));
+    }
+    if (!err) {
+        err = gcry_cipher_authenticate(h, header, SEAL_HEADER_SIZE);
+    }
+    if (err) {
+        return err;
+    }
+    if (encrypt) {
+        err = gcry_cipher_encrypt(h, data, len, NULL, 0);
+        if (!err) {
+            err = gcry_cipher_gettag(h, data + len, SEAL_TAG_LEN);
+        }
+    } else {
+        err = gcry_cipher_decrypt(h, data, len, NULL, 0);
+        if (!err) {
+            err = gcry_cipher_checktag(h, data + len, SEAL_TAG_LEN);
+        }
+    }
+    return err;
+}
+
+/* Computes the chunk count and the length of the last chunk from the
+ * size of the chunk data. Returns zero if the size is invalid. */
+static int
+seal_layout(unsigned long long body, size_t chunk_size,
+        unsigned long long *chunks, size_t *last_len)
+{
+    unsigned long long stride = chunk_size + SEAL_TAG_LEN;
+
+    if (body < SEAL_TAG_LEN) {
+        return 0;
+    }
+    *chunks = (body + stride - 1) / stride;
+    body -= (*chunks - 1) * stride;
+    if (body < SEAL_TAG_LEN || *chunks > 0xffffffffULL) {
+        return 0;
+    }
+    *last_len = (size_t)(body - SEAL_TAG_LEN);
+    /* Only an empty file has an empty chunk. */
+    return *last_len > 0 || *chunks == 1;
+}
+
+/* Checks a file header, returns the chunk size or zero if invalid. */
+static size_t
+seal_parse_header(const unsigned char *header, int *algo)
+{
+    static const unsigned char zeros[SEAL_HEADER_SIZE - 23];
+    unsigned long chunk_size = get_be32(header + 12);
+
+    if (memcmp(header, SEAL_MAGIC, 8) || memcmp(header + 23, zeros,
+                sizeof(zeros)) || chunk_size == 0 ||
+            chunk_size > SEAL_MAX_CHUNK) {
+        return 0;
+    }
+    *algo = (int)get_be32(header + 8);
+    return chunk_size;
+}
+
+/* Opens a GCM handle with the key, returns an error message or NULL. */
+static const char *
+seal_open_cipher(gcry_cipher_hd_t *h, int algo, const char *key,
+        size_t key_len)
+{
+    gcry_error_t err;
+
+    err = gcry_cipher_open(h, algo, GCRY_CIPHER_MODE_GCM, 0);
+    if (err) {
+        *h = NULL;
+        return gcry_strerror(err);
+    }
+    err = gcry_cipher_setkey(*h, key, key_len);
+    if (err) {
+        return gcry_strerror(err);
+    }
+    return NULL;
+}
+
+/* A batch of chunks, processed by one cipher handle per thread. */
+typedef struct {
+    gcry_cipher_hd_t h[MAX_THREADS];
+    unsigned threads;
+    int encrypt;
+    unsigned char header[SEAL_HEADER_SIZE];
+    size_t chunk_size;
+    unsigned char *buf;         /* chunk_size + tag per chunk */
+    size_t *lens;               /* plaintext length per chunk */
+    unsigned char *failed;      /* per chunk */
+    unsigned long long first;   /* index of the first chunk */
+    size_t count;
+    int final;                  /* whether the last chunk is final */
+} SealJob;
+
+/* Processes every threads-th chunk starting at worker with its handle. */
+static void
+seal_worker(void *ctx, size_t worker)
+{
+    SealJob *job = (SealJob *) ctx;
+    size_t i;
+
+    for (i = worker; i < job->count; i += job->threads) {
+        job->failed[i] = seal_chunk(job->h[worker], job->header,
+                (unsigned long)(job->first + i),
+                job->final && i + 1 == job->count,
+                job->buf + i * (job->chunk_size + SEAL_TAG_LEN),
+                job->lens[i], job->encrypt) != 0;
+    }
+}
+
+/* Allocates the batch buffers and cipher handles, returns an error message
+ * or NULL. */
+static const char *
+seal_job_init(SealJob *job, size_t *batch, int algo, const char *key,
+        size_t key_len)
+{
+    const char *error;
+    unsigned i;
+
+    *batch = SEAL_BATCH_BYTES / (job->chunk_size + SEAL_TAG_LEN);
+    if (*batch < job->threads) {
+        *batch = job->threads;
+    }
+    job->buf = malloc(*batch * (job->chunk_size + SEAL_TAG_LEN));
+    job->lens = malloc(*batch * sizeof(size_t));
+    job->failed = malloc(*batch);
+    if (!job->buf || !job->lens || !job->failed) {
+        return "Out of memory";
+    }
+    for (i = 0; i < job->threads; i++) {
+        error = seal_open_cipher(&job->h[i], algo, key, key_len);
+        if (error) {
+            return error;
+        }
+    }
+    return NULL;
+}
+
+static void
+seal_job_free(SealJob *job)
+{
+    unsigned i;
+
+    for (i = 0; i < job->threads; i++) {
+        if (job->h[i]) {
+            gcry_cipher_close(job->h[i]);
+        }
+    }
+    free(job->buf);
+    free(job->lens);
+    free(job->failed);
+}
+
+/* Encrypts in to out, returns an error message or NULL. */
+static const char *
+seal_stream(SealJob *job, size_t batch, FILE *in, FILE *out)
+{
+    size_t stride = job->chunk_size + SEAL_TAG_LEN, i, n;
+    int c, done = 0;
+
+    if (fwrite(job->header, 1, SEAL_HEADER_SIZE, out) != SEAL_HEADER_SIZE) {
+        return "Write failed";
+    }
+    for (job->first = 0; !done; job->first += job->count) {
+        for (i = 0; i < batch && !done; i++) {
+            n = fread(job->buf + i * stride, 1, job->chunk_size, in);
+            job->lens[i] = n;
+            if (n < job->chunk_size) {
+                done = 1;
+            } else if ((c = getc(in)) == EOF) {
+                done = 1;
+            } else {
+                ungetc(c, in);
+            }
+        }
+        if (ferror(in)) {
+            return "Read failed";
+        }
+        job->count = i;
+        job->final = done;
+        if (job->first + job->count > 0xffffffffULL) {
+            return "File too large for the chunk size";
+        }
+        parallel_for(job->threads, job->threads, seal_worker, job);
+        for (i = 0; i < job->count; i++) {
+            if (job->failed[i]) {
+                return "Encryption failed";
+            }
+            n = job->lens[i] + SEAL_TAG_LEN;
+            if (fwrite(job->buf + i * stride, 1, n, out) != n) {
+                return "Write failed";
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Decrypts the chunks of in to out, returns an error message or NULL. A failed
+ * chunk is reported in the caller's buffer error (at least 64 bytes).
+ */
+static const char *
+unseal_stream(SealJob *job, size_t batch, unsigned long long chunks,
+        size_t last_len, FILE *in, FILE *out, char *error)
+{
+    size_t stride = job->chunk_size + SEAL_TAG_LEN, i, n;
+
+    for (job->first = 0; job->first < chunks; job->first += job->count) {
+        job->count = batch;
+        if (job->count > chunks - job->first) {
+            job->count = (size_t)(chunks - job->first);
+        }
+        job->final = job->first + job->count == chunks;
+        for (i = 0; i < job->count; i++) {
+            job->lens[i] = job->final && i + 1 == job->count ? last_len :
+                job->chunk_size;
+            n = job->lens[i] + SEAL_TAG_LEN;
+            if (fread(job->buf + i * stride, 1, n, in) != n) {
+                return "Read failed";
+            }
+        }
+        parallel_for(job->threads, job->threads, seal_worker, job);
+        for (i = 0; i < job->count; i++) {
+            if (job->failed[i]) {
+                sprintf(error, "Authentication failed for chunk %lu",
+                        (unsigned long)(job->first + i));
+                return error;
+            }
+            n = job->lens[i];
+            if (fwrite(job->buf + i * stride, 1, n, out) != n) {
+                return "Write failed";
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Reads the thread count option of the table at arg. */
+static unsigned
+opt_threads(lua_State *L, int arg)
+{
+    lua_Integer threads = opt_field_integer(L, arg, "threads",
+            default_threads());
+
+    luaL_argcheck(L, threads >= 1, arg, "thread count must be positive");
+    return threads > MAX_THREADS ? MAX_THREADS : (unsigned)threads;
+}
+
+/* gcrypt.seal_file(algo, key, in_path, out_path[, options]) */
+static int
+lgcrypt_seal_file(lua_State *L)
+{
+    int algo = luaL_checkint(L, 1);
+    size_t key_len, prefix_len = 0, batch;
+    const char *key = check_key(L, 2, &key_len);
+    const char *in_path = luaL_checkstring(L, 3);
+    const char *out_path = luaL_checkstring(L, 4);
+    const char *prefix = NULL, *error = NULL;
+    lua_Integer chunk_size;
+    FILE *in = NULL, *out = NULL;
+    SealJob job;
+
+    chunk_size = opt_field_integer(L, 5, "chunk_size", SEAL_DEFAULT_CHUNK);
+    luaL_argcheck(L, chunk_size > 0 && chunk_size <= SEAL_MAX_CHUNK, 5,
+            "chunk size out of range");
+    if (lua_istable(L, 5)) {
+        lua_getfield(L, 5, "nonce_prefix");
+        prefix = lua_tolstring(L, -1, &prefix_len);
+        luaL_argcheck(L, !prefix || prefix_len == SEAL_PREFIX_LEN, 5,
+                "nonce prefix must be 7 bytes");
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.threads = opt_threads(L, 5);
+    job.encrypt = 1;
+    job.chunk_size = (size_t)chunk_size;
+    memcpy(job.header, SEAL_MAGIC, 8);
+    put_be32(job.header + 8, (unsigned long)algo);
+    put_be32(job.header + 12, (unsigned long)chunk_size);
+    if (prefix) {
+        memcpy(job.header + 16, prefix, SEAL_PREFIX_LEN);
+    } else {
+        gcry_create_nonce(job.header + 16, SEAL_PREFIX_LEN);
+    }
+
+    error = seal_job_init(&job, &batch, algo, key, key_len);
+    if (!error && !(in = fopen(in_path, "rb"))) {
+        error = strerror(errno);
+    }
+    if (!error && !(out = fopen(out_path, "wb"))) {
+        error = strerror(errno);
+    }
+    if (!error) {
+        error = seal_stream(&job, batch, in, out);
+    }
+    if (out && fclose(out) && !error) {
+        error = "Write failed";
+    }
+    if (in) {
+        fclose(in);
+    }
+    seal_job_free(&job);
+    if (error) {
+        luaL_error(L, "Failed to seal %s: %s", in_path, error);
+    }
+    return 0;
+}
+
+/* Reads the header of a sealed file, returns an error message or NULL. */
+static const char *
+seal_read_header(FILE *fp, unsigned char *header, int *algo,
+        size_t *chunk_size, unsigned long long *chunks, size_t *last_len)
+{
+    long long size;
+
+#ifdef _WIN32
+    size = _fseeki64(fp, 0, SEEK_END) ? -1 : _ftelli64(fp);
+#else
+    size = fseeko(fp, 0, SEEK_END) ? -1 : (long long)ftello(fp);
+#endif
+    if (size < 0 || fseek(fp, 0, SEEK_SET)) {
+        return strerror(errno);
+    }
+    if (size < SEAL_HEADER_SIZE ||
+            fread(header, 1, SEAL_HEADER_SIZE, fp) != SEAL_HEADER_SIZE ||
+            !(*chunk_size = seal_parse_header(header, algo)) ||
+            !seal_layout((unsigned long long)size - SEAL_HEADER_SIZE,
+                *chunk_size, chunks, last_len)) {
+        return "Invalid sealed file";
+    }
+    return NULL;
+}
+
+/* gcrypt.open_file(key, in_path, out_path[, options]) */
+static int
+lgcrypt_open_file(lua_State *L)
+{
+    size_t key_len, last_len = 0, batch;
+    const char *key = check_key(L, 1, &key_len);
+    const char *in_path = luaL_checkstring(L, 2);
+    const char *out_path = luaL_checkstring(L, 3);
+    const char *error = NULL;
+    char message[64];
+    unsigned long long chunks = 0;
+    FILE *in = NULL, *out = NULL;
+    SealJob job;
+    int algo = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.threads = opt_threads(L, 4);
+    if (!(in = fopen(in_path, "rb"))) {
+        error = strerror(errno);
+    }
+    if (!error) {
+        error = seal_read_header(in, job.header, &algo, &job.chunk_size,
+                &chunks, &last_len);
+    }
+    if (!error) {
+        error = seal_job_init(&job, &batch, algo, key, key_len);
+    }
+    if (!error && !(out = fopen(out_path, "wb"))) {
+        error = strerror(errno);
+    }
+    if (!error) {
+        error = unseal_stream(&job, batch, chunks, last_len, in, out,
+                message);
+    }
+    if (out && fclose(out) && !error) {
+        error = "Write failed";
+    }
+    if (in) {
+        fclose(in);
+    }
+    seal_job_free(&job);
+    if (error) {
+        /* Do not leave unauthenticated or partial plaintext behind. */
+        if (out) {
+            remove(out_path);
+        }
+        luaL_error(L, "Failed to open %s: %s", in_path, error);
+    }
+    return 0;
+}
+
+typedef struct {
+    FILE *fp;
+    gcry_cipher_hd_t h;
+    unsigned char header[SEAL_HEADER_SIZE];
+    size_t chunk_size, last_len;
+    unsigned long long chunks;
+    unsigned long long data_size;
+    LruCache cache;         /* authenticated plaintext chunks */
+} LgcryptSealedReader;
+
+static LgcryptSealedReader *
+getSealedReader(lua_State *L, int arg)
+{
+    return (LgcryptSealedReader *)luaL_checkudata(L, arg,
+            "gcrypt.SealedReader");
+}
+
+static LgcryptSealedReader *
+checkSealedReader(lua_State *L, int arg)
+{
+    LgcryptSealedReader *r = getSealedReader(L, arg);
+    if (!r->fp) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return r;
+}
+
+static int
+lgcrypt_sealed_reader___gc(lua_State *L)
+{
+    LgcryptSealedReader *r = getSealedReader(L, 1);
+
+    if (r->fp) {
+        fclose(r->fp);
+        r->fp = NULL;
+    }
+    if (r->h) {
+        gcry_cipher_close(r->h);
+        r->h = NULL;
+    }
+    lru_free(&r->cache);
+    return 0;
+}
+
+/* gcrypt.SealedReader(path, key[, options]) */
+static int
+lgcrypt_sealed_reader_open(lua_State *L)
+{
+    LgcryptSealedReader *r;
+    const char *path, *key, *error;
+    size_t key_len;
+    lua_Integer cache_chunks;
+    int algo;
+
+    path = luaL_checkstring(L, 1);
+    key = check_key(L, 2, &key_len);
+    cache_chunks = opt_field_integer(L, 3, "cache_chunks", 16);
+    luaL_argcheck(L, cache_chunks >= 0, 3, "cache size must not be negative");
+
+    r = (LgcryptSealedReader *) lua_newuserdata(L,
+            sizeof(LgcryptSealedReader));
+    memset(r, 0, sizeof(LgcryptSealedReader));
+    luaL_getmetatable(L, "gcrypt.SealedReader");
+    lua_setmetatable(L, -2);
+
+    r->fp = fopen(path, "rb");
+    if (!r->fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+    error = seal_read_header(r->fp, r->header, &algo, &r->chunk_size,
+            &r->chunks, &r->last_len);
+    if (!error) {
+        error = seal_open_cipher(&r->h, algo, key, key_len);
+    }
+    if (error) {
+        luaL_error(L, "Failed to open %s: %s", path, error);
+    }
+    r->data_size = (r->chunks - 1) * r->chunk_size + r->last_len;
+    if (!lru_init(&r->cache, (size_t)cache_chunks, r->chunk_size)) {
+        luaL_error(L, "Out of memory");
+    }
+    return 1;
+}
+
+/* Returns an authenticated chunk, the length is stored in chunk_len. */
+static const unsigned char *
+sealed_chunk(lua_State *L, LgcryptSealedReader *r, unsigned long long chunk,
+        unsigned char *scratch, size_t *chunk_len)
+{
+    unsigned char *cached;
+    int final = chunk + 1 == r->chunks;
+
+    *chunk_len = final ? r->last_len : r->chunk_size;
+    cached = lru_get(&r->cache, chunk);
+    if (cached) {
+        return cached;
+    }
+    if (read_at(r->fp, SEAL_HEADER_SIZE + chunk *
+                (r->chunk_size + SEAL_TAG_LEN), scratch,
+                *chunk_len + SEAL_TAG_LEN)) {
+        luaL_error(L, "Failed to read chunk %d", (int)chunk);
+    }
+    if (seal_chunk(r->h, r->header, (unsigned long)chunk, final, scratch,
+                *chunk_len, 0)) {
+        luaL_error(L, "Authentication failed for chunk %d", (int)chunk);
+    }
+    cached = lru_put(&r->cache, chunk);
+    if (cached) {
+        memcpy(cached, scratch, *chunk_len);
+        return cached;
+    }
+    return scratch;
+}
+
+/* reader:read(offset, len) returns authenticated data, shorter at the end. */
+static int
+lgcrypt_sealed_reader_read(lua_State *L)
+{
+    LgcryptSealedReader *r = checkSealedReader(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+    unsigned long long pos, end;
+    const unsigned char *chunk;
+    unsigned char *scratch;
+    size_t chunk_len, skip, n;
+    luaL_Buffer b;
+
+    luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+    luaL_argcheck(L, len >= 0, 3, "length must not be negative");
+    pos = (unsigned long long)offset;
+    end = pos + (unsigned long long)len;
+    if (end > r->data_size) {
+        end = r->data_size;
+    }
+
+    scratch = lua_newuserdata(L, r->chunk_size + SEAL_TAG_LEN);
+    luaL_buffinit(L, &b);
+    while (pos < end) {
+        chunk = sealed_chunk(L, r, pos / r->chunk_size, scratch, &chunk_len);
+        skip = (size_t)(pos % r->chunk_size);
+        n = chunk_len - skip;
+        if (n > end - pos) {
+            n = (size_t)(end - pos);
+        }
+        luaL_addlstring(&b, (const char *) chunk + skip, n);
+        pos += n;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* reader:size() returns the plaintext size. */
+static int
+lgcrypt_sealed_reader_size(lua_State *L)
+{
+    LgcryptSealedReader *r = checkSealedReader(L, 1);
+
+    lua_pushinteger(L, (lua_Integer)r->data_size);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_sealed_reader_meta[] = {
+    {"__gc",    lgcrypt_sealed_reader___gc},
+    {"read",    lgcrypt_sealed_reader_read},
+    {"size",    lgcrypt_sealed_reader_size},
+    {NULL,      NULL}
+};
+#endif
+/* }}} */
+/* {{{ Message digests */
+/* Memoized digests of repeated inputs, disabled until gcrypt.digest_memo
+ * sets a capacity. Entries are found by a fingerprint of the algorithm and
+ * input and confirmed by comparing the input. */
+#define MEMO_DEFAULT_MAX_INPUT  4096
+
+typedef struct {
+    int algo;
+    size_t len;
+    unsigned char digest[MERKLE_MAX_DIGEST];
+    /* The input follows. */
+} MemoEntry;
+
+static LruCache memo;           /* values are MemoEntry pointers */
+static size_t memo_max_input = MEMO_DEFAULT_MAX_INPUT;
+static unsigned long memo_hits, memo_misses;
+
+/* Copies the memoized digest of the input to digest, returns zero on a
+ * miss. */
+static int
+memo_lookup(int algo, const void *data, size_t len, unsigned char *digest)
+{
+    MemoEntry **slot, *e;
+
+    if (!memo.capacity || len > memo_max_input) {
+        return 0;
+    }
+    slot = (MemoEntry **) lru_get(&memo, fingerprint64((unsigned long long)algo, data, len));
+    e = slot ? *slot : NULL;
+    if (e && e->algo == algo && e->len == len && !memcmp(e + 1, data, len)) {
+        memcpy(digest, e->digest, gcry_md_get_algo_dlen(algo));
+        memo_hits++;
+        return 1;
+    }
+    memo_misses++;
+    return 0;
+}
+
+static void
+memo_store(int algo, const void *data, size_t len,
+        const unsigned char *digest)
+{
+    unsigned long long key;
+    MemoEntry **slot, *e;
+    size_t digest_len = gcry_md_get_algo_dlen(algo);
+
+    if (!memo.capacity || len > memo_max_input ||
+            digest_len > MERKLE_MAX_DIGEST) {
+        return;
+    }
+    e = malloc(sizeof(MemoEntry) + len);
+    if (!e) {
+        return;
+    }
+    e->algo = algo;
+    e->len = len;
+    memcpy(e->digest, digest, digest_len);
+    memcpy(e + 1, data, len);
+    key = fingerprint64((unsigned long long)algo, data, len);
+    /* A colliding entry is replaced. */
+    slot = (MemoEntry **) lru_get(&memo, key);
+    if (!slot) {
+        slot = (MemoEntry **) lru_put(&memo, key);
+    }
+    if (!slot) {
+        free(e);
+        return;
+    }
+    free(*slot);
+    *slot = e;
+}
+
+static void
+memo_clear(void)
+{
+    LruEntry *e;
+
+    for (e = memo.newest; e; e = e->older) {
+        free(*(MemoEntry **) LRU_VALUE(e));
+    }
+    lru_free(&memo);
+}
+
+/* gcrypt.digest_memo([max_entries[, max_input]]) configures the digest
+ * memoization of gcrypt.hash and md:read, returns the statistics. */
+static int
+lgcrypt_digest_memo(lua_State *L)
+{
+    lua_Integer max_entries, max_input;
+
+    if (!lua_isnoneornil(L, 1)) {
+        max_entries = luaL_checkinteger(L, 1);
+        max_input = luaL_optinteger(L, 2, MEMO_DEFAULT_MAX_INPUT);
+        luaL_argcheck(L, max_entries >= 0, 1, "must not be negative");
+        luaL_argcheck(L, max_input >= 0, 2, "must not be negative");
+        memo_clear();
+        memo_hits = memo_misses = 0;
+        memo_max_input = (size_t)max_input;
+        if (max_entries > 0 &&
+                !lru_init(&memo, (size_t)max_entries, sizeof(MemoEntry *))) {
+            luaL_error(L, "Out of memory");
+        }
+    }
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)memo_hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)memo_misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)memo.count);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, (lua_Integer)memo.capacity);
+    lua_setfield(L, -2, "max_entries");
+    lua_pushinteger(L, (lua_Integer)memo_max_input);
+    lua_setfield(L, -2, "max_input");
+    return 1;
+}
+
+typedef struct {
+    gcry_md_hd_t h;
+    void *alg;          /* AF_ALG transform instead of h */
+    /* Input that is held back while it can be memoized. */
+    unsigned char *memo_buf;
+    size_t memo_len, memo_cap;
+    int memo;
+} LgcryptHash;
+
+/* Passes held back input to the handle and stops memoization. */
+static void
+hash_memo_flush(LgcryptHash *state)
+{
+    if (state->memo) {
+        gcry_md_write(state->h, state->memo_buf, state->memo_len);
+        free(state->memo_buf);
+        state->memo_buf = NULL;
+        state->memo_len = 0;
+        state->memo = 0;
+    }
+}
+
+/* Initializes a new gcrypt.Hash userdata and pushes it on the stack. */
+static LgcryptHash *
+lgcrypt_hash_new(lua_State *L)
+{
+    LgcryptHash *state;
+
+    state = (LgcryptHash *) lua_newuserdata(L, sizeof(LgcryptHash));
+    state->h = NULL;
+    state->alg = NULL;
+    state->memo_buf = NULL;
+    state->memo_len = state->memo_cap = 0;
+    state->memo = 0;
+    luaL_getmetatable(L, "gcrypt.Hash");
+    lua_setmetatable(L, -2);
+    return state;
+}
+
+/* gcrypt.Hash(algo[, flags[, backend]]) */
+static int
+lgcrypt_hash_open(lua_State *L)
+{
+    int algo, backend;
+    unsigned int flags;
+    LgcryptHash *state;
+    gcry_error_t err;
+
+    algo = luaL_checkint(L, 1);
+    flags = (unsigned int)luaL_optinteger(L, 2, 0);
+    backend = luaL_checkoption(L, 3, "libgcrypt", backend_names);
+
+    state = lgcrypt_hash_new(L);
+
+    if (backend == BACKEND_AF_ALG) {
+#ifdef HAVE_AF_ALG
+        state->alg = afalg_md_open(algo, flags);
+        if (!state->alg) {
+            lua_pop(L, 1);
+            luaL_error(L, "AF_ALG hash unavailable: %s", strerror(errno));
+        }
+        return 1;
+#else
+        luaL_argerror(L, 3, "af_alg is not supported");
+#endif
+    }
+
+    err = gcry_md_open(&state->h, algo, flags);
+    if (err) {
+        lua_pop(L, 1);
+        luaL_error(L, "gcry_md_open() failed with %s", gcry_strerror(err));
+    }
+    /* Keyed and secure hashes are never memoized. */
+    if (memo.capacity && flags == 0) {
+        state->memo_cap = memo_max_input;
+        state->memo = 1;
+    }
+    return 1;
+}
+
+static LgcryptHash *
+getHash(lua_State *L, int arg)
+{
+    return (LgcryptHash *)luaL_checkudata(L, arg, "gcrypt.Hash");
+}
+
+static LgcryptHash *
+checkHash(lua_State *L, int arg)
+{
+    LgcryptHash *state = getHash(L, arg);
+    if (!state->h && !state->alg) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return state;
+}
+
+static int
+lgcrypt_hash___gc(lua_State *L)
+{
+    LgcryptHash *state = getHash(L, 1);
+
+    if (state->h) {
+        gcry_md_close(state->h);
+        state->h = NULL;
+    }
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_close(state->alg);
+        state->alg = NULL;
+    }
+#endif
+    free(state->memo_buf);
+    state->memo_buf = NULL;
+    return 0;
+}
+
+
+static int
+lgcrypt_hash_setkey(lua_State *L)
+{
+    LgcryptHash *state = checkHash(L, 1);
+    size_t key_len;
+    const char *key = check_key(L, 2, &key_len);
+    gcry_error_t err;
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_setkey(state->alg, key, key_len), "setkey");
+        return 0;
+    }
+#endif
+    hash_memo_flush(state);
+    err = gcry_md_setkey(state->h, key, key_len);
+    if (err) {
+        luaL_error(L, "gcry_md_setkey() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_hash_reset(lua_State *L)
+{
+    LgcryptHash *state = checkHash(L, 1);
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        AfAlg *a = state->alg;
+
+        if (a->op >= 0) {
+            afalg_check(L, afalg_accept(a), "reset");
+        }
+        return 0;
+    }
+#endif
+    gcry_md_reset(state->h);
+    if (state->memo_cap) {
+        state->memo_len = 0;
+        state->memo = 1;
+    }
+    return 0;
+}
+
+static int
+lgcrypt_hash_write(lua_State *L)
+{
+    LgcryptHash *state = checkHash(L, 1);
+    size_t buffer_len;
+    const char *buffer = luaL_checklstring(L, 2, &buffer_len);
+
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        afalg_check(L, afalg_md_write(state->alg,
+                    (const unsigned char *) buffer, buffer_len), "write");
+        return 0;
+    }
+#endif
+    if (state->memo && buffer_len <= state->memo_cap - state->memo_len) {
+        if (!state->memo_buf) {
+            state->memo_buf = malloc(state->memo_cap + 1);
+        }
+        if (state->memo_buf) {
+            memcpy(state->memo_buf + state->memo_len, buffer, buffer_len);
+            state->memo_len += buffer_len;
+            return 0;
+        }
+    }
+    hash_memo_flush(state);
+    gcry_md_write(state->h, buffer, buffer_len);
+    return 0;
+}
+
+/* md:write_file(path) hashes the contents of a file. */
+static int
+lgcrypt_hash_write_file(lua_State *L)
+{
+    LgcryptHash *state = checkHash(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    unsigned char *buf;
+    FILE *fp;
+    size_t n;
+    int err = 0;
+
+    buf = lua_newuserdata(L, FILE_CHUNK_SIZE);
+    fp = fopen(path, "rb");
+    if (!fp) {
+        luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+    }
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        err = afalg_md_write_file(state->alg, fileno(fp));
+        fclose(fp);
+        afalg_check(L, err, "write");
+        return 0;
+    }
+#endif
+    hash_memo_flush(state);
+    while ((n = fread(buf, 1, FILE_CHUNK_SIZE, fp)) > 0) {
+        gcry_md_write(state->h, buf, n);
+    }
+    if (ferror(fp)) {
+        err = errno;
+    }
+    fclose(fp);
+    if (err) {
+        luaL_error(L, "Failed to read %s: %s", path, strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_hash_read(lua_State *L)
+{
+    LgcryptHash *state = checkHash(L, 1);
+    unsigned char *digest, *input, memoized[MERKLE_MAX_DIGEST];
+    size_t digest_len;
+    int algo, format;
+
+    /* md:read([algo][, format]) */
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        lua_pushnil(L);
+        lua_insert(L, 2);
+    }
+#ifdef HAVE_AF_ALG
+    if (state->alg) {
+        AfAlg *a = state->alg;
+
+        algo = (int)luaL_optinteger(L, 2, a->algo);
+        format = luaL_checkoption(L, 3, "binary", format_names);
+        if (algo != a->algo) {
+            luaL_error(L, "Unable to obtain digest for a disabled algorithm");
+        }
+        afalg_check(L, afalg_md_read(a), "read");
+        push_encoded(L, a->digest, a->digest_len, format);
+        return 1;
+    }
+#endif
+    algo = (int)luaL_optinteger(L, 2, gcry_md_get_algo(state->h));
+    format = luaL_checkoption(L, 3, "binary", format_names);
+    if (!gcry_md_is_enabled(state->h, algo)) {
+        luaL_error(L, "Unable to obtain digest for a disabled algorithm");
+    }
+
+    digest_len = gcry_md_get_algo_dlen(algo);
+    if (!digest_len) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    if (state->memo && algo == gcry_md_get_algo(state->h)) {
+        input = state->memo_buf ? state->memo_buf : (unsigned char *) "";
+        if (memo_lookup(algo, input, state->memo_len, memoized)) {
+            push_encoded(L, memoized, digest_len, format);
+            return 1;
+        }
+        gcry_md_write(state->h, input, state->memo_len);
+        digest = gcry_md_read(state->h, algo);
+        if (digest) {
+            memo_store(algo, input, state->memo_len, digest);
+        }
+        /* The input was consumed, later reads use the handle. */
+        free(state->memo_buf);
+        state->memo_buf = NULL;
+        state->memo_len = 0;
+        state->memo = 0;
+    } else {
+        hash_memo_flush(state);
+        digest = gcry_md_read(state->h, algo);
+    }
+    if (!digest) {
+        luaL_error(L, "Failed to obtain digest");
+    }
+    push_encoded(L, digest, digest_len, format);
+    return 1;
+}
+
+/* gcrypt.hash(algo, data[, format]) calculates a digest in one call. */
+static int
+lgcrypt_hash(lua_State *L)
+{
+    int algo, format;
+    size_t data_len, digest_len;
+    const char *data;
+    unsigned char digest[64];
+
+    algo = luaL_checkint(L, 1);
+    data = luaL_checklstring(L, 2, &data_len);
+    format = luaL_checkoption(L, 3, "binary", format_names);
+
+    digest_len = gcry_md_get_algo_dlen(algo);
+    if (!digest_len || digest_len > sizeof(digest)) {
+        luaL_error(L, "Invalid digest length detected");
+    }
+    if (!memo_lookup(algo, data, data_len, digest)) {
+        gcry_md_hash_buffer(algo, digest, data, data_len);
+        memo_store(algo, data, data_len, digest);
+    }
+    push_encoded(L, digest, digest_len, format);
+    return 1;
+}
+
+
+
+/* https://gnupg.org/documentation/manuals/gcrypt/Working-with-hash-algorithms.html */
+static const struct luaL_Reg lgcrypt_hash_meta[] = {
+    {"__gc",    lgcrypt_hash___gc},
+    {"setkey",  lgcrypt_hash_setkey},
+    {"reset",   lgcrypt_hash_reset},
+    {"write",   lgcrypt_hash_write},
+    {"write_file", lgcrypt_hash_write_file},
+    {"read",    lgcrypt_hash_read},
+    {NULL,      NULL}
+};
+/* }}} */
+/* {{{ Message authentication codes */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+typedef struct {
+    gcry_mac_hd_t h;
+    int algo;
+    unsigned int flags;
+    LgcryptKey *key;        /* a gcrypt.Key given to setkey, for pipelines */
+    int key_ref;            /* keeps the key alive */
+} LgcryptMac;
+
+static int
+lgcrypt_mac_open(lua_State *L)
+{
+    int algo;
+    unsigned int flags;
+    LgcryptMac *state;
+    gcry_error_t err;
+
+    algo = luaL_checkint(L, 1);
+    flags = (unsigned int)luaL_optinteger(L, 2, 0);
+
+    state = (LgcryptMac *) lua_newuserdata(L, sizeof(LgcryptMac));
+    state->h = NULL;
+    state->algo = algo;
+    state->flags = flags;
+    state->key = NULL;
+    state->key_ref = LUA_NOREF;
+    luaL_getmetatable(L, "gcrypt.Mac");
+    lua_setmetatable(L, -2);
+
+    err = gcry_mac_open(&state->h, algo, flags, NULL);
+    if (err) {
+        lua_pop(L, 1);
+        luaL_error(L, "gcry_mac_open() failed with %s", gcry_strerror(err));
+    }
+    return 1;
+}
+
+static LgcryptMac *
+getMac(lua_State *L, int arg)
+{
+    return (LgcryptMac *)luaL_checkudata(L, arg, "gcrypt.Mac");
+}
+
+static LgcryptMac *
+checkMac(lua_State *L, int arg)
+{
+    LgcryptMac *state = getMac(L, arg);
+    if (!state->h) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return state;
+}
+
+static void
+mac_forget_key(lua_State *L, LgcryptMac *state)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, state->key_ref);
+    state->key_ref = LUA_NOREF;
+    state->key = NULL;
+}
+
+static int
+lgcrypt_mac___gc(lua_State *L)
+{
+    LgcryptMac *state = getMac(L, 1);
+
+    if (state->h) {
+        gcry_mac_close(state->h);
+        state->h = NULL;
+    }
+    mac_forget_key(L, state);
+    return 0;
+}
+
+static int
+lgcrypt_mac_setkey(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    size_t key_len;
+    const char *key = check_key(L, 2, &key_len);
+    gcry_error_t err;
+
+    err = gcry_mac_setkey(state->h, key, key_len);
+    if (err) {
+        luaL_error(L, "gcry_mac_setkey() failed with %s", gcry_strerror(err));
+    }
+    /* Like a cipher, only a gcrypt.Key is retained. */
+    mac_forget_key(L, state);
+    if (is_key(L, 2)) {
+        state->key = (LgcryptKey *) lua_touserdata(L, 2);
+        lua_pushvalue(L, 2);
+        state->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 0;
+}
+
+static int
+lgcrypt_mac_setiv(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    size_t iv_len;
+    const char *iv = luaL_checklstring(L, 2, &iv_len);
+    gcry_error_t err;
+
+    err = gcry_mac_setiv(state->h, iv, iv_len);
+    if (err) {
+        luaL_error(L, "gcry_mac_setiv() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_mac_reset(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    gcry_error_t err;
+
+    err = gcry_mac_reset(state->h);
+    if (err) {
+        luaL_error(L, "gcry_mac_reset() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_mac_write(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    size_t buffer_len;
+    const char *buffer = luaL_checklstring(L, 2, &buffer_len);
+    gcry_error_t err;
+
+    err = gcry_mac_write(state->h, buffer, buffer_len);
+    if (err) {
+        luaL_error(L, "gcry_mac_write() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+static int
+lgcrypt_mac_read(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    unsigned char mac[64];
+    size_t mac_len;
+    gcry_error_t err;
+
+    mac_len = gcry_mac_get_algo_maclen(state->algo);
+    if (!mac_len || mac_len > sizeof(mac)) {
+        luaL_error(L, "Invalid MAC length detected");
+    }
+    err = gcry_mac_read(state->h, mac, &mac_len);
+    if (err) {
+        luaL_error(L, "gcry_mac_read() failed with %s", gcry_strerror(err));
+    }
+    lua_pushlstring(L, (const char *) mac, mac_len);
+    return 1;
+}
+
+static int
+lgcrypt_mac_verify(lua_State *L)
+{
+    LgcryptMac *state = checkMac(L, 1);
+    size_t mac_len;
+    const char *mac = luaL_checklstring(L, 2, &mac_len);
+    gcry_error_t err;
+
+    err = gcry_mac_verify(state->h, mac, mac_len);
+    if (err) {
+        luaL_error(L, "gcry_mac_verify() failed with %s", gcry_strerror(err));
+    }
+    return 0;
+}
+
+/* https://gnupg.org/documentation/manuals/gcrypt/Working-with-MAC-algorithms.html */
+static const struct luaL_Reg lgcrypt_mac_meta[] = {
+    {"__gc",    lgcrypt_mac___gc},
+    {"setkey",  lgcrypt_mac_setkey},
+    {"setiv",   lgcrypt_mac_setiv},
+    {"reset",   lgcrypt_mac_reset},
+    {"write",   lgcrypt_mac_write},
+    {"read",    lgcrypt_mac_read},
+    {"verify",  lgcrypt_mac_verify},
+    {NULL,      NULL}
+};
+#endif
+/* }}} */
+/* {{{ Pipelines */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+#define PIPELINE_MAX_STAGES     8
+/* Records pulled by pipe:run_stream before they are processed. */
+#define PIPELINE_BATCH          1024
+
+enum { STAGE_DECRYPT, STAGE_HASH, STAGE_VERIFY, STAGE_MATCH };
+static const char *const stage_names[] = {
+    "decrypt", "hash", "verify", "match", NULL
+};
+
+typedef struct {
+    int kind;
+    int ref;                    /* keeps the object alive */
+    LgcryptCipher *cipher;      /* decrypt */
+    LgcryptHash *md;            /* hash and verify, or mac */
+    LgcryptMac *mac;
+    LgcryptDigestSet *set;      /* match */
+    size_t digest_len;
+    size_t iv_len;              /* prefix of the record (decrypt) */
+    size_t tag_len;             /* suffix of the record (decrypt, verify) */
+    unsigned char *aad;         /* NULL without AAD */
+    size_t aad_len;
+} PipelineStage;
+
+typedef struct {
+    size_t count;               /* 0 once the object is dead */
+    PipelineStage stages[PIPELINE_MAX_STAGES];
+} LgcryptPipeline;
+
+/* Handles of one thread, indexed by stage. */
+typedef struct {
+    gcry_cipher_hd_t cipher[PIPELINE_MAX_STAGES];
+    gcry_md_hd_t md[PIPELINE_MAX_STAGES];
+    gcry_mac_hd_t mac[PIPELINE_MAX_STAGES];
+} PipelineHandles;
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    const unsigned char *output;    /* data or owned */
+    size_t out_len;
+    unsigned char *owned;           /* allocated output, if any */
+    const char *status;             /* NULL on success */
+} PipelineRecord;
+
+typedef struct {
+    LgcryptPipeline *pipe;
+    unsigned threads;
+    PipelineHandles *handles;       /* per thread */
+    size_t count;
+    PipelineRecord *records;
+} PipelineJob;
+
+static void
+pipeline_handles_close(LgcryptPipeline *pipe, PipelineHandles *h)
+{
+    size_t s;
+
+    for (s = 0; s < pipe->count; s++) {
+        if (h->cipher[s]) {
+            gcry_cipher_close(h->cipher[s]);
+        }
+        if (h->md[s]) {
+            gcry_md_close(h->md[s]);
+        }
+        if (h->mac[s]) {
+            gcry_mac_close(h->mac[s]);
+        }
+    }
+    memset(h, 0, sizeof(PipelineHandles));
+}
+
+/* Opens the handles of one thread from the current keys of the objects. */
+static gcry_error_t
+pipeline_handles_open(LgcryptPipeline *pipe, PipelineHandles *h)
+{
+    PipelineStage *st;
+    gcry_error_t err = 0;
+    size_t s;
+
+    for (s = 0; s < pipe->count && !err; s++) {
+        st = &pipe->stages[s];
+        if (st->cipher) {
+            err = gcry_cipher_open(&h->cipher[s], st->cipher->algo,
+                    st->cipher->mode, st->cipher->flags);
+            if (!err) {
+                err = gcry_cipher_setkey(h->cipher[s], st->cipher->key->data,
+                        st->cipher->key->len);
+            }
+        } else if (st->md) {
+            /* A copy keeps the HMAC key. */
+            err = gcry_md_copy(&h->md[s], st->md->h);
+        } else if (st->mac) {
+            err = gcry_mac_open(&h->mac[s], st->mac->algo, st->mac->flags,
+                    NULL);
+            if (!err) {
+                err = gcry_mac_setkey(h->mac[s], st->mac->key->data,
+                        st->mac->key->len);
+            }
+        }
+    }
+    if (err) {
+        pipeline_handles_close(pipe, h);
+    }
+    return err;
+}
+
+/* Computes the digest or MAC of a hash or verify stage. */
+static gcry_error_t
+stage_digest(PipelineStage *st, PipelineHandles *h, size_t s,
+        const unsigned char *data, size_t len, unsigned char *out)
+{
+    size_t out_len = st->digest_len;
+    gcry_error_t err;
+
+    if (st->md) {
+        gcry_md_reset(h->md[s]);
+        gcry_md_write(h->md[s], data, len);
+        memcpy(out, gcry_md_read(h->md[s], 0), st->digest_len);
+        return 0;
+    }
+    err = gcry_mac_reset(h->mac[s]);
+    if (!err) {
+        err = gcry_mac_write(h->mac[s], data, len);
+    }
+    if (!err) {
+        err = gcry_mac_read(h->mac[s], out, &out_len);
+    }
+    return err;
+}
+
+/* Runs a record through all stages, returns an error message or NULL. */
+static const char *
+pipeline_record(LgcryptPipeline *pipe, PipelineHandles *h, PipelineRecord *r)
+{
+    const unsigned char *cur = r->data;
+    size_t len = r->len, n, s, pos;
+    unsigned char *buf = NULL, *next, digest[64];
+    PipelineStage *st;
+    const char *step;
+
+    for (s = 0; s < pipe->count; s++) {
+        st = &pipe->stages[s];
+        switch (st->kind) {
+        case STAGE_DECRYPT:
+            if (len < st->iv_len + st->tag_len) {
+                free(buf);
+                return "Record too short";
+            }
+            n = len - st->iv_len - st->tag_len;
+            next = malloc(n ? n : 1);
+            if (!next) {
+                free(buf);
+                return "Out of memory";
+            }
+            if (record_decrypt(h->cipher[s], st->cipher->mode,
+                        cur, st->iv_len, st->aad, st->aad_len,
+                        st->tag_len ? cur + st->iv_len + n : NULL, st->tag_len,
+                        cur + st->iv_len, n, next, &step)) {
+                memset(next, 0, n);
+                free(next);
+                free(buf);
+                return strcmp(step, "gcry_cipher_checktag") ?
+                    "Decryption failed" : "Authentication failed";
+            }
+            free(buf);
+            cur = buf = next;
+            len = n;
+            break;
+        case STAGE_HASH:
+            next = malloc(st->digest_len);
+            if (!next || stage_digest(st, h, s, cur, len, next)) {
+                free(next);
+                free(buf);
+                return "Hashing failed";
+            }
+            free(buf);
+            cur = buf = next;
+            len = st->digest_len;
+            break;
+        case STAGE_VERIFY:
+            if (len < st->tag_len) {
+                free(buf);
+                return "Record too short";
+            }
+            len -= st->tag_len;
+            if (stage_digest(st, h, s, cur, len, digest) ||
+                    !ct_equal(digest, cur + len, st->tag_len)) {
+                free(buf);
+                return "Authentication failed";
+            }
+            break;
+        case STAGE_MATCH:
+            if (len != st->set->digest_len ||
+                    !digest_set_find(st->set, cur, &pos)) {
+                free(buf);
+                return "Not in the digest set";
+            }
+            break;
+        }
+    }
+    r->output = cur;
+    r->out_len = len;
+    r->owned = buf;
+    return NULL;
+}
+
+/* Processes every threads-th record starting at worker with its handles. */
+static void
+pipeline_worker(void *ctx, size_t worker)
+{
+    PipelineJob *job = (PipelineJob *) ctx;
+    size_t i;
+
+    for (i = worker; i < job->count; i += job->threads) {
+        job->records[i].status = pipeline_record(job->pipe,
+                &job->handles[worker], &job->records[i]);
+    }
+}
+
+static LgcryptPipeline *
+getPipeline(lua_State *L, int arg)
+{
+    return (LgcryptPipeline *)luaL_checkudata(L, arg, "gcrypt.Pipeline");
+}
+
+static LgcryptPipeline *
+checkPipeline(lua_State *L, int arg)
+{
+    LgcryptPipeline *pipe = getPipeline(L, arg);
+    if (!pipe->count) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return pipe;
+}
+
+static int
+lgcrypt_pipeline___gc(lua_State *L)
+{
+    LgcryptPipeline *pipe = getPipeline(L, 1);
+    size_t s;
+
+    for (s = 0; s < pipe->count; s++) {
+        luaL_unref(L, LUA_REGISTRYINDEX, pipe->stages[s].ref);
+        free(pipe->stages[s].aad);
+    }
+    memset(pipe, 0, sizeof(LgcryptPipeline));
+    return 0;
+}
+
+/* Parses the stage table at index t. */
+static void
+pipeline_stage(lua_State *L, LgcryptPipeline *pipe, int t)
+{
+    PipelineStage *st = &pipe->stages[pipe->count];
+    int number = (int)pipe->count + 1, obj, i;
+    lua_Integer iv_len, tag_len;
+    const char *kind, *aad;
+    size_t aad_len;
+
+    if (!lua_istable(L, t)) {
+        luaL_error(L, "stage %d must be a table", number);
+    }
+    lua_rawgeti(L, t, 1);
+    kind = lua_tostring(L, -1);
+    for (i = 0; kind && stage_names[i] && strcmp(kind, stage_names[i]); i++)
+        ;
+    if (!kind || !stage_names[i]) {
+        luaL_error(L, "stage %d has an unknown kind", number);
+    }
+    st->kind = i;
+    st->ref = LUA_NOREF;
+    lua_rawgeti(L, t, 2);
+    obj = lua_gettop(L);
+
+    switch (st->kind) {
+    case STAGE_DECRYPT:
+        st->cipher = (LgcryptCipher *) luaL_testudata(L, obj, "gcrypt.Cipher");
+        if (!st->cipher) {
+            luaL_error(L, "stage %d needs a gcrypt.Cipher", number);
+        }
+        if (!is_record_mode(st->cipher->mode)) {
+            luaL_error(L, "stage %d: unsupported cipher mode", number);
+        }
+        iv_len = opt_field_integer(L, t, "iv_len",
+                st->cipher->mode == GCRY_CIPHER_MODE_CTR ? 16 : 12);
+        tag_len = opt_field_integer(L, t, "tag_len",
+                st->cipher->mode == GCRY_CIPHER_MODE_CTR ? 0 : 16);
+        if (iv_len < 1 || tag_len < 0 || tag_len > 16 ||
+                (tag_len && st->cipher->mode == GCRY_CIPHER_MODE_CTR) ||
+                (!tag_len && st->cipher->mode != GCRY_CIPHER_MODE_CTR)) {
+            luaL_error(L, "stage %d: invalid iv_len or tag_len", number);
+        }
+        st->iv_len = (size_t)iv_len;
+        st->tag_len = (size_t)tag_len;
+        lua_getfield(L, t, "aad");
+        aad = lua_tolstring(L, -1, &aad_len);
+        if (aad) {
+            st->aad = malloc(aad_len ? aad_len : 1);
+            if (!st->aad) {
+                luaL_error(L, "Out of memory");
+            }
+            memcpy(st->aad, aad, aad_len);
+            st->aad_len = aad_len;
+        }
+        lua_pop(L, 1);
+        break;
+    case STAGE_HASH:
+    case STAGE_VERIFY:
+        st->md = (LgcryptHash *) luaL_testudata(L, obj, "gcrypt.Hash");
+        st->mac = (LgcryptMac *) luaL_testudata(L, obj, "gcrypt.Mac");
+        if (st->md && st->md->h) {
+            st->digest_len = gcry_md_get_algo_dlen(gcry_md_get_algo(st->md->h));
+        } else if (st->md && st->md->alg) {
+            luaL_error(L, "Unsupported by the af_alg backend");
+        } else if (st->mac && st->mac->h) {
+            st->digest_len = gcry_mac_get_algo_maclen(st->mac->algo);
+        } else {
+            luaL_error(L, "stage %d needs a gcrypt.Hash or gcrypt.Mac", number);
+        }
+        if (!st->digest_len || st->digest_len > 64) {
+            luaL_error(L, "Invalid digest length detected");
+        }
+        tag_len = opt_field_integer(L, t, "tag_len",
+                (lua_Integer)st->digest_len);
+        if (tag_len < 1 || tag_len > (lua_Integer)st->digest_len) {
+            luaL_error(L, "stage %d: invalid tag_len", number);
+        }
+        st->tag_len = st->kind == STAGE_VERIFY ? (size_t)tag_len : 0;
+        break;
+    case STAGE_MATCH:
+        st->set = (LgcryptDigestSet *) luaL_testudata(L, obj,
+                "gcrypt.DigestSet");
+        if (!st->set) {
+            luaL_error(L, "stage %d needs a gcrypt.DigestSet", number);
+        }
+        break;
+    }
+    st->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);  /* kind */
+    pipe->count++;
+}
+
+/* gcrypt.Pipeline{stage...} chains stages that run over records in C:
+ * {"decrypt", cipher[, iv_len=, tag_len=, aad=]}, {"hash", md_or_mac},
+ * {"verify", md_or_mac[, tag_len=]} and {"match", digest_set}. */
+static int
+lgcrypt_pipeline_open(lua_State *L)
+{
+    LgcryptPipeline *pipe;
+    int i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    pipe = (LgcryptPipeline *) lua_newuserdata(L, sizeof(LgcryptPipeline));
+    memset(pipe, 0, sizeof(LgcryptPipeline));
+    luaL_getmetatable(L, "gcrypt.Pipeline");
+    lua_setmetatable(L, -2);
+
+    for (i = 1; ; i++) {
+        lua_rawgeti(L, 1, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        if (pipe->count == PIPELINE_MAX_STAGES) {
+            luaL_error(L, "Too many stages");
+        }
+        pipeline_stage(L, pipe, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    if (!pipe->count) {
+        luaL_error(L, "A pipeline needs at least one stage");
+    }
+    return 1;
+}
+
+/* Checks that the objects of the stages can still be used. */
+static void
+pipeline_check(lua_State *L, LgcryptPipeline *pipe)
+{
+    PipelineStage *st;
+    size_t s;
+
+    for (s = 0; s < pipe->count; s++) {
+        st = &pipe->stages[s];
+        if ((st->cipher && !st->cipher->h && !st->cipher->alg) ||
+                (st->md && !st->md->h) || (st->mac && !st->mac->h)) {
+            luaL_error(L, "Called into a dead object");
+        }
+        if ((st->cipher && !st->cipher->key) || (st->mac && !st->mac->key)) {
+            luaL_error(L, "No gcrypt.Key was set");
+        }
+        if ((st->cipher && !st->cipher->key->data) ||
+                (st->mac && !st->mac->key->data)) {
+            luaL_error(L, "Called into a dead object");
+        }
+    }
+}
+
+/* Runs the count records in the list at index t and pushes the list of
+ * outputs (false on failure) and the list of statuses (true or an error
+ * message). */
+static void
+pipeline_process(lua_State *L, LgcryptPipeline *pipe, int t, size_t count,
+        unsigned threads)
+{
+    PipelineJob job;
+    PipelineRecord *r;
+    gcry_error_t err = 0;
+    size_t i;
+    unsigned j;
+
+    pipeline_check(L, pipe);
+    if (threads > count) {
+        threads = count ? (unsigned)count : 1;
+    }
+    job.pipe = pipe;
+    job.threads = threads;
+    job.count = count;
+    /* Both stay on the stack until the results are pushed. */
+    job.records = lua_newuserdata(L, (count + 1) * sizeof(PipelineRecord));
+    job.handles = lua_newuserdata(L, threads * sizeof(PipelineHandles));
+    memset(job.handles, 0, threads * sizeof(PipelineHandles));
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, t, (int)i + 1);
+        job.records[i].data = (const unsigned char *) lua_tolstring(L, -1,
+                &job.records[i].len);
+        job.records[i].owned = NULL;
+        lua_pop(L, 1);
+    }
+    for (j = 0; j < threads && !err; j++) {
+        err = pipeline_handles_open(pipe, &job.handles[j]);
+    }
+    if (!err) {
+        parallel_for(threads, threads, pipeline_worker, &job);
+    }
+    for (j = 0; j < threads; j++) {
+        pipeline_handles_close(pipe, &job.handles[j]);
+    }
+    if (err) {
+        luaL_error(L, "Pipeline setup failed with %s", gcry_strerror(err));
+    }
+
+    lua_createtable(L, (int)count, 0);
+    lua_createtable(L, (int)count, 0);
+    for (i = 0; i < count; i++) {
+        r = &job.records[i];
+        if (r->status) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, r->status);
+        } else {
+            lua_pushlstring(L, (const char *) r->output, r->out_len);
+            lua_pushboolean(L, 1);
+            if (r->owned) {
+                memset(r->owned, 0, r->out_len);
+                free(r->owned);
+            }
+        }
+        lua_rawseti(L, -3, (int)i + 1);
+        lua_rawseti(L, -3, (int)i + 1);
+    }
+    lua_remove(L, -3);
+    lua_remove(L, -3);
+}
+
+/* Counts the records in the list at index t, which must be strings. */
+static size_t
+pipeline_count(lua_State *L, int t)
+{
+    size_t count;
+
+    for (count = 0; ; count++) {
+        lua_rawgeti(L, t, (int)count + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return count;
+        }
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_error(L, "records must be strings");
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/* pipe:run(records[, threads]) returns the list of outputs (false for a
+ * failed record) and the list of statuses (true or an error message), in
+ * the order of the records. */
+static int
+lgcrypt_pipeline_run(lua_State *L)
+{
+    LgcryptPipeline *pipe = checkPipeline(L, 1);
+    unsigned threads;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    threads = check_threads(L, 3);
+    pipeline_process(L, pipe, 2, pipeline_count(L, 2), threads);
+    return 2;
+}
+
+/* pipe:run_stream(next_record, emit[, threads]) pulls records from
+ * next_record() until it returns nil and calls emit(output, status) for each
+ * of them in order. Returns the number of records. */
+static int
+lgcrypt_pipeline_run_stream(lua_State *L)
+{
+    LgcryptPipeline *pipe = checkPipeline(L, 1);
+    unsigned threads;
+    size_t count, total = 0, i;
+    int done = 0, batch;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    threads = check_threads(L, 4);
+    lua_settop(L, 4);
+    while (!done) {
+        lua_createtable(L, PIPELINE_BATCH, 0);
+        batch = lua_gettop(L);
+        for (count = 0; count < PIPELINE_BATCH; count++) {
+            lua_pushvalue(L, 2);
+            lua_call(L, 0, 1);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                done = 1;
+                break;
+            }
+            if (lua_type(L, -1) != LUA_TSTRING) {
+                luaL_error(L, "records must be strings");
+            }
+            lua_rawseti(L, batch, (int)count + 1);
+        }
+        pipeline_process(L, pipe, batch, count, threads);
+        for (i = 0; i < count; i++) {
+            lua_pushvalue(L, 3);
+            lua_rawgeti(L, batch + 1, (int)i + 1);
+            lua_rawgeti(L, batch + 2, (int)i + 1);
+            lua_call(L, 2, 0);
+        }
+        lua_settop(L, 4);
+        total += count;
+    }
+    lua_pushinteger(L, (lua_Integer)total);
+    return 1;
+}
+
+static const struct luaL_Reg lgcrypt_pipeline_meta[] = {
+    {"__gc",        lgcrypt_pipeline___gc},
+    {"run",         lgcrypt_pipeline_run},
+    {"run_stream",  lgcrypt_pipeline_run_stream},
+    {NULL,          NULL}
+};
+#endif
+/* }}} */
+/* {{{ Key derivation */
+/* NIST SP 800-108 KDF in Counter Mode with HMAC as PRF and r = 32:
+ * K(i) = HMAC(key, [i]_2 || Label || 0x00 || Context || [L]_2) */
+static gcry_error_t
+kdf_sp800_108(int algo, const void *key, size_t key_len,
+              const void *label, size_t label_len,
+              const void *context, size_t context_len,
+              unsigned char *out, size_t out_len)
+{
+    gcry_md_hd_t h;
+    gcry_error_t err;
+    unsigned char counter[4], length[4], zero = 0;
+    unsigned long i;
+    size_t digest_len, n;
+
+    digest_len = gcry_md_get_algo_dlen(algo);
+    if (!digest_len) {
+        return gcry_error(GPG_ERR_DIGEST_ALGO);
+    }
+    /* L is encoded as a 32-bit number of bits. */
+    if (out_len == 0 || out_len > 0x1fffffff) {
+        return gcry_error(GPG_ERR_INV_LENGTH);
+    }
+
+    err = gcry_md_open(&h, algo, GCRY_MD_FLAG_HMAC);
+    if (err) {
+        return err;
+    }
+    err = gcry_md_setkey(h, key, key_len);
+    if (err) {
+        gcry_md_close(h);
+        return err;
+    }
+
+    put_be32(length, (unsigned long)(out_len * 8));
+    for (i = 1; out_len > 0; i++) {
+        /* Resetting a HMAC handle retains the key. */
+        gcry_md_reset(h);
+        put_be32(counter, i);
+        gcry_md_write(h, counter, sizeof(counter));
+        gcry_md_write(h, label, label_len);
+        gcry_md_write(h, &zero, 1);
+        gcry_md_write(h, context, context_len);
+        gcry_md_write(h, length, sizeof(length));
+
+        n = out_len < digest_len ? out_len : digest_len;
+        memcpy(out, gcry_md_read(h, algo), n);
+        out += n;
+        out_len -= n;
+    }
+    gcry_md_close(h);
+    return 0;
+}
+
+/* Pushes the output buffer of a key derivation: a gcrypt.Key if the input
+ * key at arg is one, or else a temporary buffer for finish_derived. */
+static unsigned char *
+push_derived(lua_State *L, int arg, size_t len)
+{
+    if (is_key(L, arg)) {
+        return key_new(L, len)->data;
+    }
+    return lua_newuserdata(L, len);
+}
+
+/* Replaces a temporary buffer by a string. */
+static void
+finish_derived(lua_State *L, int arg, const unsigned char *out, size_t len)
+{
+    if (!is_key(L, arg)) {
+        lua_pushlstring(L, (const char *) out, len);
+        lua_remove(L, -2);
+    }
+}
+
+/* gcrypt.kdf_sp800_108(md_algo, key, label, context, length) */
+static int
+lgcrypt_kdf_sp800_108(lua_State *L)
+{
+    int algo;
+    size_t key_len, label_len, context_len, out_len;
+    const char *key, *label, *context;
+    lua_Integer length;
+    unsigned char *out;
+    gcry_error_t err;
+
+    algo = luaL_checkint(L, 1);
+    key = check_key(L, 2, &key_len);
+    label = luaL_checklstring(L, 3, &label_len);
+    context = luaL_checklstring(L, 4, &context_len);
+    length = luaL_checkinteger(L, 5);
+    luaL_argcheck(L, length >= 0, 5, "length must not be negative");
+    out_len = (size_t)length;
+
+    out = push_derived(L, 2, out_len);
+    err = kdf_sp800_108(algo, key, key_len, label, label_len,
+            context, context_len, out, out_len);
+    if (err) {
+        luaL_error(L, "SP 800-108 key derivation failed with %s", gcry_strerror(err));
+    }
+    finish_derived(L, 2, out, out_len);
+    return 1;
+}
+
+/* RFC 5869 HKDF with HMAC-algo. */
+static gcry_error_t
+hkdf(int algo, const void *ikm, size_t ikm_len, const void *salt,
+        size_t salt_len, const void *info, size_t info_len,
+        unsigned char *out, size_t out_len)
+{
+    unsigned char prk[64], zeros[64], t[64], counter;
+    size_t digest_len = gcry_md_get_algo_dlen(algo), n;
+    gcry_md_hd_t h;
+    gcry_error_t err;
+
+    if (!digest_len || digest_len > sizeof(prk) ||
+            out_len > 255 * digest_len) {
+        return gcry_error(GPG_ERR_INV_ARG);
+    }
+    /* HKDF-Extract, a missing salt is a string of zeros. */
+    if (!salt_len) {
+        memset(zeros, 0, digest_len);
+        salt = zeros;
+        salt_len = digest_len;
+    }
+    err = gcry_md_open(&h, algo, GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+    if (err) {
+        return err;
+    }
+    err = gcry_md_setkey(h, salt, salt_len);
+    if (!err) {
+        gcry_md_write(h, ikm, ikm_len);
+        memcpy(prk, gcry_md_read(h, algo), digest_len);
+        err = gcry_md_setkey(h, prk, digest_len);
+    }
+    /* HKDF-Expand: T(i) = HMAC(PRK, T(i-1) || info || i) */
+    for (counter = 1; !err && out_len > 0; counter++) {
+        gcry_md_reset(h);
+        if (counter > 1) {
+            gcry_md_write(h, t, digest_len);
+        }
+        gcry_md_write(h, info, info_len);
+        gcry_md_write(h, &counter, 1);
+        memcpy(t, gcry_md_read(h, algo), digest_len);
+
+        n = out_len < digest_len ? out_len : digest_len;
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+    gcry_md_close(h);
+    memset(prk, 0, sizeof(prk));
+    memset(t, 0, sizeof(t));
+    return err;
+}
+
+/* gcrypt.hkdf(md_algo, ikm, salt, info, length) */
+static int
+lgcrypt_hkdf(lua_State *L)
+{
+    int algo;
+    size_t ikm_len, salt_len, info_len, out_len;
+    const char *ikm, *salt, *info;
+    lua_Integer length;
+    unsigned char *out;
+    gcry_error_t err;
+
+    algo = luaL_checkint(L, 1);
+    ikm = check_key(L, 2, &ikm_len);
+    salt = luaL_optlstring(L, 3, "", &salt_len);
+    info = luaL_optlstring(L, 4, "", &info_len);
+    length = luaL_checkinteger(L, 5);
+    luaL_argcheck(L, length >= 0, 5, "length must not be negative");
+    out_len = (size_t)length;
+
+    out = push_derived(L, 2, out_len);
+    err = hkdf(algo, ikm, ikm_len, salt, salt_len, info, info_len,
+            out, out_len);
+    if (err) {
+        luaL_error(L, "HKDF failed with %s", gcry_strerror(err));
+    }
+    finish_derived(L, 2, out, out_len);
+    return 1;
+}
+/* }}} */
+/* {{{ SMB3 decryption */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+/* MS-SMB2 2.2.41 SMB2 TRANSFORM_HEADER */
+#define SMB2_TRANSFORM_HEADER_LEN   52
+#define SMB2_TRANSFORM_AAD_OFFSET   20
+#define SMB2_TRANSFORM_AAD_LEN      32
+
+/* MS-SMB2 2.2.3.1.2 SMB2_ENCRYPTION_CAPABILITIES cipher identifiers */
+#define SMB2_ENCRYPTION_AES128_CCM  1
+#define SMB2_ENCRYPTION_AES128_GCM  2
+#define SMB2_ENCRYPTION_AES256_CCM  3
+#define SMB2_ENCRYPTION_AES256_GCM  4
+
+/* Most messages queued for background decryption per session. */
+#define SMB3_PREFETCH_JOBS  64
+
+#ifdef HAVE_PTHREAD
+enum { JOB_FREE, JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+
+typedef struct {
+    int state;
+    int dir;
+    unsigned long order;        /* jobs are started in queue order */
+    unsigned char *msg;
+    size_t msg_len;
+    unsigned char *out;
+    size_t out_len;
+} Smb3PrefetchJob;
+
+/* Worker threads that decrypt queued messages with their own handles. The
+ * results are moved into the plaintext cache by the Lua thread. */
+typedef struct {
+    int algo, mode;
+    unsigned char *keys[2];     /* owned by the decryptor */
+    size_t key_len;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a job was queued or stop was set */
+    pthread_cond_t done;        /* a job finished */
+    int stop;
+    unsigned threads;
+    pthread_t tids[MAX_THREADS];
+    unsigned long next_order;
+    size_t bytes;               /* size of the queued messages */
+    Smb3PrefetchJob jobs[SMB3_PREFETCH_JOBS];
+} Smb3Prefetch;
+#endif
 
-/* {{{ Symmetric encryption */
 typedef struct {
-    gcry_cipher_hd_t h;
-    int mode;           /* Cipher mode */
-} LgcryptCipher;
+    /* Indexed by direction: 0 is client to server, 1 is server to client. */
+    gcry_cipher_hd_t h[2];
+    unsigned char *keys[2];     /* in secure memory */
+    size_t key_len;
+    int algo;
+    int mode;           /* GCRY_CIPHER_MODE_CCM or GCRY_CIPHER_MODE_GCM */
+    PlainBinding cache;
+#ifdef HAVE_PTHREAD
+    Smb3Prefetch *prefetch;     /* started by gcrypt.prefetch */
+#endif
+} LgcryptSmb3;
 
-/* Initializes a new gcrypt.Cipher userdata and pushes it on the stack. */
-static LgcryptCipher *
-lgcrypt_cipher_new(lua_State *L)
+/* Checks the transform header, returns an error message or NULL. */
+static const char *
+smb3_check_message(const unsigned char *msg, size_t msg_len, size_t *enc_len)
 {
-    LgcryptCipher *state;
+    if (msg_len < SMB2_TRANSFORM_HEADER_LEN || memcmp(msg, "\xfdSMB", 4)) {
+        return "Not a SMB2 transform header";
+    }
+    *enc_len = get_le32(msg + 36);  /* OriginalMessageSize */
+    if (*enc_len > msg_len - SMB2_TRANSFORM_HEADER_LEN) {
+        return "Truncated SMB2 transform message";
+    }
+    return NULL;
+}
 
-    state = (LgcryptCipher *) lua_newuserdata(L, sizeof(LgcryptCipher));
-    state->h = NULL;
-    state->mode = 0;
-    luaL_getmetatable(L, "gcrypt.Cipher");
-    lua_setmetatable(L, -2);
+/* Decrypts and authenticates a checked message into out. On failure, step
+ * names the function that failed. */
+static gcry_error_t
+smb3_decrypt_message(gcry_cipher_hd_t h, int mode, const unsigned char *msg,
+        size_t enc_len, unsigned char *out, const char **step)
+{
+    unsigned long long params[3];
+    gcry_error_t err;
+
+    /* The nonce is 11 bytes for CCM and 12 bytes for GCM. */
+    *step = "gcry_cipher_setiv";
+    err = gcry_cipher_setiv(h, msg + 20,
+            mode == GCRY_CIPHER_MODE_CCM ? 11 : 12);
+    if (!err && mode == GCRY_CIPHER_MODE_CCM) {
+        params[0] = enc_len;
+        params[1] = SMB2_TRANSFORM_AAD_LEN;
+        params[2] = 16;
+        *step = "gcry_cipher_ctl";
+        err = gcry_cipher_ctl(h, GCRYCTL_SET_CCM_LENGTHS, params, sizeof(params));
+    }
+    if (!err) {
+        *step = "gcry_cipher_authenticate";
+        err = gcry_cipher_authenticate(h, msg + SMB2_TRANSFORM_AAD_OFFSET,
+                SMB2_TRANSFORM_AAD_LEN);
+    }
+    if (!err) {
+        *step = "gcry_cipher_decrypt";
+        err = gcry_cipher_decrypt(h, out, enc_len,
+                msg + SMB2_TRANSFORM_HEADER_LEN, enc_len);
+    }
+    if (!err) {
+        /* The Signature field holds the authentication tag. */
+        *step = "gcry_cipher_checktag";
+        err = gcry_cipher_checktag(h, msg + 4, 16);
+    }
+    return err;
+}
+
+/* Stores the plaintext of a message in the cache of the session. */
+static void
+smb3_cache_store(LgcryptSmb3 *state, int dir, const unsigned char *msg,
+        const unsigned char *out, size_t out_len)
+{
+    /* Cached by nonce, checked against the rest of the header and the
+     * ciphertext, so a message with an altered body is authenticated again. */
+    plain_binding_store(&state->cache, dir, get_be64(msg + 20),
+            msg + 4, SMB2_TRANSFORM_HEADER_LEN - 4 + out_len, out, out_len);
+}
+
+#ifdef HAVE_PTHREAD
+/* Returns the oldest queued job or NULL. Called with the lock held. */
+static Smb3PrefetchJob *
+smb3_prefetch_next(Smb3Prefetch *p)
+{
+    Smb3PrefetchJob *job = NULL;
+    size_t i;
+
+    for (i = 0; i < SMB3_PREFETCH_JOBS; i++) {
+        if (p->jobs[i].state == JOB_QUEUED &&
+                (!job || p->jobs[i].order < job->order)) {
+            job = &p->jobs[i];
+        }
+    }
+    return job;
+}
+
+static void *
+smb3_prefetch_worker(void *arg)
+{
+    Smb3Prefetch *p = (Smb3Prefetch *) arg;
+    gcry_cipher_hd_t h[2] = { NULL, NULL };
+    Smb3PrefetchJob *job;
+    const char *step;
+    size_t enc_len;
+    int i, ok;
+
+    for (i = 0; i < 2; i++) {
+        if (gcry_cipher_open(&h[i], p->algo, p->mode, 0) ||
+                gcry_cipher_setkey(h[i], p->keys[i], p->key_len)) {
+            /* Jobs fail and are decrypted on demand instead. */
+            gcry_cipher_close(h[i]);
+            h[i] = NULL;
+        }
+    }
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && !(job = smb3_prefetch_next(p))) {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        if (p->stop) {
+            break;
+        }
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&p->lock);
+
+        smb3_check_message(job->msg, job->msg_len, &enc_len);
+        job->out = malloc(enc_len ? enc_len : 1);
+        job->out_len = enc_len;
+        ok = h[job->dir] && job->out &&
+            !smb3_decrypt_message(h[job->dir], p->mode, job->msg, enc_len,
+                    job->out, &step);
+
+        pthread_mutex_lock(&p->lock);
+        job->state = ok ? JOB_DONE : JOB_FAILED;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < 2; i++) {
+        if (h[i]) {
+            gcry_cipher_close(h[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Starts the worker threads, returns NULL if none could be started. */
+static Smb3Prefetch *
+smb3_prefetch_start(LgcryptSmb3 *state, unsigned threads)
+{
+    Smb3Prefetch *p = calloc(1, sizeof(Smb3Prefetch));
+    unsigned i;
+
+    if (!p) {
+        return NULL;
+    }
+    p->algo = state->algo;
+    p->mode = state->mode;
+    p->keys[0] = state->keys[0];
+    p->keys[1] = state->keys[1];
+    p->key_len = state->key_len;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&p->tids[p->threads], NULL, smb3_prefetch_worker, p)) {
+            break;
+        }
+        p->threads++;
+    }
+    if (!p->threads) {
+        pthread_cond_destroy(&p->done);
+        pthread_cond_destroy(&p->work);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void
+smb3_prefetch_free_job(Smb3Prefetch *p, Smb3PrefetchJob *job)
+{
+    p->bytes -= job->msg_len;
+    free(job->msg);
+    if (job->out) {
+        memset(job->out, 0, job->out_len);
+        free(job->out);
+    }
+    memset(job, 0, sizeof(Smb3PrefetchJob));
+}
+
+/* Stops the workers and discards all jobs. */
+static void
+smb3_prefetch_stop(Smb3Prefetch *p)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->threads; i++) {
+        pthread_join(p->tids[i], NULL);
+    }
+    for (i = 0; i < SMB3_PREFETCH_JOBS; i++) {
+        if (p->jobs[i].state != JOB_FREE) {
+            smb3_prefetch_free_job(p, &p->jobs[i]);
+        }
+    }
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+/* Moves finished jobs into the plaintext cache. Called with the lock held. */
+static void
+smb3_prefetch_drain(LgcryptSmb3 *state)
+{
+    Smb3Prefetch *p = state->prefetch;
+    Smb3PrefetchJob *job;
+    size_t i;
+
+    for (i = 0; i < SMB3_PREFETCH_JOBS; i++) {
+        job = &p->jobs[i];
+        if (job->state == JOB_DONE) {
+            smb3_cache_store(state, job->dir, job->msg, job->out, job->out_len);
+        }
+        if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+            smb3_prefetch_free_job(p, job);
+        }
+    }
+}
+
+/* Waits until a queued copy of the message is decrypted, then drains the
+ * finished jobs. */
+static void
+smb3_prefetch_wait(LgcryptSmb3 *state, const unsigned char *msg,
+        size_t msg_len, int dir)
+{
+    Smb3Prefetch *p = state->prefetch;
+    Smb3PrefetchJob *job;
+    size_t i;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < SMB3_PREFETCH_JOBS; i++) {
+        job = &p->jobs[i];
+        if ((job->state == JOB_QUEUED || job->state == JOB_RUNNING) &&
+                job->dir == dir && job->msg_len == msg_len &&
+                !memcmp(job->msg, msg, msg_len)) {
+            while (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+                pthread_cond_wait(&p->done, &p->lock);
+            }
+            break;
+        }
+    }
+    smb3_prefetch_drain(state);
+    pthread_mutex_unlock(&p->lock);
+}
+#endif
+
+static LgcryptSmb3 *
+getSmb3(lua_State *L, int arg)
+{
+    return (LgcryptSmb3 *)luaL_checkudata(L, arg, "gcrypt.Smb3Decryptor");
+}
+
+static LgcryptSmb3 *
+checkSmb3(lua_State *L, int arg)
+{
+    LgcryptSmb3 *state = getSmb3(L, arg);
+    if (!state->h[0]) {
+        luaL_error(L, "Called into a dead object");
+    }
     return state;
 }
 
 static int
-lgcrypt_cipher_open(lua_State *L)
+lgcrypt_smb3___gc(lua_State *L)
 {
-    int algo, mode, flags;
-    LgcryptCipher *state;
+    LgcryptSmb3 *state = getSmb3(L, 1);
+    int i;
+
+#ifdef HAVE_PTHREAD
+    if (state->prefetch) {
+        smb3_prefetch_stop(state->prefetch);
+        state->prefetch = NULL;
+    }
+#endif
+    for (i = 0; i < 2; i++) {
+        if (state->h[i]) {
+            gcry_cipher_close(state->h[i]);
+            state->h[i] = NULL;
+        }
+        secure_free(state->keys[i], state->key_len);
+        state->keys[i] = NULL;
+    }
+    plain_binding_free(L, &state->cache);
+    return 0;
+}
+
+/* gcrypt.Smb3Decryptor(session_key, dialect[, cipher_id[, preauth_hash]])
+ * Derives the encryption keys for both directions (MS-SMB2 3.2.5.3.1). */
+static int
+lgcrypt_smb3_open(lua_State *L)
+{
+    static const char label_30[] = "SMB2AESCCM";
+    static const char label_c2s[] = "SMBC2SCipherKey";
+    static const char label_s2c[] = "SMBS2CCipherKey";
+    static const char context_c2s[] = "ServerIn ";
+    static const char context_s2c[] = "ServerOut";
+    size_t session_key_len, preauth_len;
+    const char *session_key, *preauth;
+    int dialect, cipher_id, algo, i;
+    LgcryptSmb3 *state;
     gcry_error_t err;
 
-    algo = luaL_checkint(L, 1);
-    mode = luaL_checkint(L, 2);
-    flags = (unsigned int)luaL_optinteger(L, 3, 0);
+    session_key = check_key(L, 1, &session_key_len);
+    dialect = luaL_checkint(L, 2);
+    cipher_id = (int)luaL_optinteger(L, 3, SMB2_ENCRYPTION_AES128_CCM);
+    preauth = luaL_optlstring(L, 4, NULL, &preauth_len);
 
-    state = lgcrypt_cipher_new(L);
-    state->mode = mode;
+    if (dialect != 0x0300 && dialect != 0x0302 && dialect != 0x0311) {
+        luaL_argerror(L, 2, "unsupported dialect");
+    }
+    if (dialect != 0x0311 && cipher_id != SMB2_ENCRYPTION_AES128_CCM) {
+        luaL_argerror(L, 3, "only AES-128-CCM is available before SMB 3.1.1");
+    }
+    if (dialect == 0x0311 && !preauth) {
+        luaL_argerror(L, 4, "SMB 3.1.1 requires the preauth integrity hash");
+    }
 
-    err = gcry_cipher_open(&state->h, algo, mode, flags);
+    state = (LgcryptSmb3 *) lua_newuserdata(L, sizeof(LgcryptSmb3));
+    memset(state, 0, sizeof(LgcryptSmb3));
+    luaL_getmetatable(L, "gcrypt.Smb3Decryptor");
+    lua_setmetatable(L, -2);
+
+    switch (cipher_id) {
+    case SMB2_ENCRYPTION_AES128_CCM:
+        algo = GCRY_CIPHER_AES128;
+        state->mode = GCRY_CIPHER_MODE_CCM;
+        break;
+    case SMB2_ENCRYPTION_AES128_GCM:
+        algo = GCRY_CIPHER_AES128;
+        state->mode = GCRY_CIPHER_MODE_GCM;
+        break;
+    case SMB2_ENCRYPTION_AES256_CCM:
+        algo = GCRY_CIPHER_AES256;
+        state->mode = GCRY_CIPHER_MODE_CCM;
+        break;
+    case SMB2_ENCRYPTION_AES256_GCM:
+        algo = GCRY_CIPHER_AES256;
+        state->mode = GCRY_CIPHER_MODE_GCM;
+        break;
+    default:
+        return luaL_argerror(L, 3, "unknown cipher identifier");
+    }
+    state->algo = algo;
+    state->key_len = gcry_cipher_get_algo_keylen(algo);
+    state->keys[0] = secure_alloc(L, state->key_len);
+    state->keys[1] = secure_alloc(L, state->key_len);
+
+    /* Labels and contexts include their terminating NUL. */
+    if (dialect == 0x0311) {
+        err = kdf_sp800_108(GCRY_MD_SHA256, session_key, session_key_len,
+                label_c2s, sizeof(label_c2s), preauth, preauth_len,
+                state->keys[0], state->key_len);
+        if (!err) {
+            err = kdf_sp800_108(GCRY_MD_SHA256, session_key, session_key_len,
+                    label_s2c, sizeof(label_s2c), preauth, preauth_len,
+                    state->keys[1], state->key_len);
+        }
+    } else {
+        err = kdf_sp800_108(GCRY_MD_SHA256, session_key, session_key_len,
+                label_30, sizeof(label_30), context_c2s, sizeof(context_c2s),
+                state->keys[0], state->key_len);
+        if (!err) {
+            err = kdf_sp800_108(GCRY_MD_SHA256, session_key, session_key_len,
+                    label_30, sizeof(label_30), context_s2c, sizeof(context_s2c),
+                    state->keys[1], state->key_len);
+        }
+    }
     if (err) {
-        lua_pop(L, 1);
-        luaL_error(L, "gcry_cipher_open() failed with %s", gcry_strerror(err));
+        luaL_error(L, "SP 800-108 key derivation failed with %s", gcry_strerror(err));
+    }
+
+    for (i = 0; i < 2; i++) {
+        err = gcry_cipher_open(&state->h[i], algo, state->mode, 0);
+        if (err) {
+            luaL_error(L, "gcry_cipher_open() failed with %s", gcry_strerror(err));
+        }
+        err = gcry_cipher_setkey(state->h[i], state->keys[i], state->key_len);
+        if (err) {
+            luaL_error(L, "gcry_cipher_setkey() failed with %s", gcry_strerror(err));
+        }
     }
     return 1;
 }
 
-static LgcryptCipher *
-getCipher(lua_State *L, int arg)
+/* Returns the derived client-to-server and server-to-client keys. */
+static int
+lgcrypt_smb3_keys(lua_State *L)
 {
-    return (LgcryptCipher *)luaL_checkudata(L, arg, "gcrypt.Cipher");
+    LgcryptSmb3 *state = checkSmb3(L, 1);
+
+    lua_pushlstring(L, (const char *) state->keys[0], state->key_len);
+    lua_pushlstring(L, (const char *) state->keys[1], state->key_len);
+    return 2;
 }
 
-static LgcryptCipher *
-checkCipher(lua_State *L, int arg)
+/* decryptor:decrypt(message[, from_server]) decrypts and authenticates a
+ * message that starts with a SMB2 TRANSFORM_HEADER. */
+static int
+lgcrypt_smb3_decrypt(lua_State *L)
 {
-    LgcryptCipher *state = getCipher(L, arg);
-    if (!state->h) {
-        luaL_error(L, "Called into a dead object");
+    LgcryptSmb3 *state = checkSmb3(L, 1);
+    size_t msg_len, enc_len;
+    const unsigned char *msg;
+    const char *error;
+    unsigned char *out;
+    int dir;
+    gcry_error_t err;
+
+    msg = (const unsigned char *) luaL_checklstring(L, 2, &msg_len);
+    dir = lua_toboolean(L, 3) ? 1 : 0;
+
+    error = smb3_check_message(msg, msg_len, &enc_len);
+    if (error) {
+        luaL_error(L, "%s", error);
     }
-    return state;
+#ifdef HAVE_PTHREAD
+    if (state->prefetch) {
+        smb3_prefetch_wait(state, msg, msg_len, dir);
+    }
+#endif
+    if (plain_binding_push(L, &state->cache, dir, get_be64(msg + 20),
+                msg + 4, SMB2_TRANSFORM_HEADER_LEN - 4 + enc_len)) {
+        return 1;
+    }
+
+    out = lua_newuserdata(L, enc_len);
+    err = smb3_decrypt_message(state->h[dir], state->mode, msg, enc_len, out,
+            &error);
+    if (err) {
+        luaL_error(L, "%s() failed with %s", error, gcry_strerror(err));
+    }
+    smb3_cache_store(state, dir, msg, out, enc_len);
+    lua_pushlstring(L, (const char *) out, enc_len);
+    lua_remove(L, -2);
+    return 1;
 }
 
+/* gcrypt.prefetch(session, records[, from_server[, threads]]) queues the
+ * messages in the list records for decryption on background threads. The
+ * plaintext is moved into the cache of the session (see set_cache), where
+ * session:decrypt finds it. Returns the number of queued messages. */
 static int
-lgcrypt_cipher___gc(lua_State *L)
+lgcrypt_prefetch(lua_State *L)
 {
-    LgcryptCipher *state = getCipher(L, 1);
+    LgcryptSmb3 *state = checkSmb3(L, 1);
+    const unsigned char *msg;
+    size_t msg_len, enc_len, queued = 0, bytes = 0;
+    unsigned threads;
+    const char *step;
+    unsigned char *out;
+    int dir, i;
+#ifdef HAVE_PTHREAD
+    Smb3Prefetch *p;
+    Smb3PrefetchJob *job;
+    size_t j;
+#endif
 
-    if (state->h) {
-        gcry_cipher_close(state->h);
-        state->h = NULL;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    dir = lua_toboolean(L, 3) ? 1 : 0;
+    threads = check_threads(L, 4);
+    if (!state->cache.cache) {
+        luaL_error(L, "No plaintext cache set");
+    }
+#ifdef HAVE_PTHREAD
+    if (!state->prefetch) {
+        state->prefetch = smb3_prefetch_start(state, threads);
+    }
+    p = state->prefetch;
+    if (p) {
+        pthread_mutex_lock(&p->lock);
+        smb3_prefetch_drain(state);
+        for (i = 1; ; i++) {
+            lua_rawgeti(L, 2, i);
+            msg = (const unsigned char *) lua_tolstring(L, -1, &msg_len);
+            lua_pop(L, 1);
+            if (!msg) {
+                break;
+            }
+            if (smb3_check_message(msg, msg_len, &enc_len)) {
+                continue;   /* reported when decrypted */
+            }
+            /* Speculation stops when the queue or the cache budget is full. */
+            if (p->bytes + msg_len > state->cache.cache->max_bytes) {
+                break;
+            }
+            for (job = NULL, j = 0; j < SMB3_PREFETCH_JOBS && !job; j++) {
+                if (p->jobs[j].state == JOB_FREE) {
+                    job = &p->jobs[j];
+                }
+            }
+            if (!job || !(job->msg = malloc(msg_len))) {
+                break;
+            }
+            memcpy(job->msg, msg, msg_len);
+            job->msg_len = msg_len;
+            job->dir = dir;
+            job->order = p->next_order++;
+            job->state = JOB_QUEUED;
+            p->bytes += msg_len;
+            queued++;
+        }
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+        lua_pushinteger(L, (lua_Integer)queued);
+        return 1;
+    }
+#else
+    (void)threads;
+#endif
+    /* Without worker threads, the messages are decrypted right away. */
+    for (i = 1; ; i++) {
+        lua_rawgeti(L, 2, i);
+        msg = (const unsigned char *) lua_tolstring(L, -1, &msg_len);
+        lua_pop(L, 1);
+        if (!msg || queued >= SMB3_PREFETCH_JOBS ||
+                bytes + msg_len > state->cache.cache->max_bytes) {
+            break;
+        }
+        if (smb3_check_message(msg, msg_len, &enc_len)) {
+            continue;
+        }
+        bytes += msg_len;
+        out = lua_newuserdata(L, enc_len);
+        if (!smb3_decrypt_message(state->h[dir], state->mode, msg, enc_len,
+                    out, &step)) {
+            smb3_cache_store(state, dir, msg, out, enc_len);
+        }
+        lua_pop(L, 1);
+        queued++;
     }
+    lua_pushinteger(L, (lua_Integer)queued);
+    return 1;
+}
+
+/* decryptor:set_cache(cache, session) serves repeated messages from a
+ * gcrypt.PlaintextCache. decryptor:set_cache(nil) detaches it. */
+static int
+lgcrypt_smb3_set_cache(lua_State *L)
+{
+    plain_binding_set(L, &checkSmb3(L, 1)->cache);
     return 0;
 }
 
+static const struct luaL_Reg lgcrypt_smb3_meta[] = {
+    {"__gc",        lgcrypt_smb3___gc},
+    {"keys",        lgcrypt_smb3_keys},
+    {"decrypt",     lgcrypt_smb3_decrypt},
+    {"set_cache",   lgcrypt_smb3_set_cache},
+    {NULL,          NULL}
+};
+#endif
+/* }}} */
+/* {{{ Kerberos */
+/* RFC 3961 encryption types */
+#define KRB5_ETYPE_AES128_CTS_HMAC_SHA1_96          17
+#define KRB5_ETYPE_AES256_CTS_HMAC_SHA1_96          18
+#define KRB5_ETYPE_AES128_CTS_HMAC_SHA256_128       19
+#define KRB5_ETYPE_AES256_CTS_HMAC_SHA384_192       20
+#define KRB5_ETYPE_RC4_HMAC                         23
+
+/* Number of key usages for which derived keys are retained. */
+#define KRB5_USAGE_CACHE_SIZE   8
 
-static int
-lgcrypt_cipher_setkey(lua_State *L)
+typedef struct {
+    int usage;
+    gcry_cipher_hd_t ke;    /* Keyed with Ke (AES) or unkeyed (RC4) */
+    gcry_md_hd_t ki;        /* HMAC keyed with Ki (AES) or K1 (RC4) */
+} LgcryptKrb5Usage;
+
+typedef struct {
+    int etype;              /* 0 once the object is dead */
+    int algo;               /* Cipher algorithm */
+    int md_algo;            /* HMAC algorithm */
+    size_t key_len;         /* Length of the base key and Ke */
+    size_t ki_len;          /* Length of Ki */
+    size_t conf_len;        /* Length of the confounder */
+    size_t mac_len;         /* Length of the (truncated) checksum */
+    unsigned char *key;     /* in secure memory */
+    unsigned next;          /* Next cache slot to evict */
+    LgcryptKrb5Usage cache[KRB5_USAGE_CACHE_SIZE];
+} LgcryptKrb5Key;
+
+/* n-fold as defined in RFC 3961 section 5.1. */
+static void
+krb5_nfold(const unsigned char *in, size_t in_len,
+           unsigned char *out, size_t out_len)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t key_len;
-    const char *key = luaL_checklstring(L, 2, &key_len);
+    size_t a, b, c, lcm, i, msbit;
+    unsigned int byte = 0;
+
+    /* Compute the least common multiple of the input and output lengths. */
+    a = out_len;
+    b = in_len;
+    while (b) {
+        c = b;
+        b = a % b;
+        a = c;
+    }
+    lcm = out_len * in_len / a;
+
+    memset(out, 0, out_len);
+    /* Add each rotated copy of the input with ones' complement addition. */
+    for (i = lcm; i-- > 0; ) {
+        msbit = (((in_len << 3) - 1) +
+                 (((in_len << 3) + 13) * (i / in_len)) +
+                 ((in_len - (i % in_len)) << 3)) % (in_len << 3);
+        byte += (((in[((in_len - 1) - (msbit >> 3)) % in_len] << 8) |
+                  in[(in_len - (msbit >> 3)) % in_len])
+                 >> ((msbit & 7) + 1)) & 0xff;
+        byte += out[i % out_len];
+        out[i % out_len] = byte & 0xff;
+        byte >>= 8;
+    }
+    /* Propagate the final end-around carry. */
+    if (byte) {
+        for (i = out_len; i-- > 0; ) {
+            byte += out[i];
+            out[i] = byte & 0xff;
+            byte >>= 8;
+        }
+    }
+}
+
+/* RFC 3961 DK(Key, Constant) with the identity random-to-key of AES. The key
+ * is copied into the cipher first, so out may overlap it. */
+static gcry_error_t
+krb5_dk(int algo, const unsigned char *key, size_t key_len,
+        const unsigned char *constant, size_t constant_len,
+        unsigned char *out, size_t out_len)
+{
+    unsigned char block[16];
+    gcry_cipher_hd_t h;
     gcry_error_t err;
+    size_t n;
 
-    err = gcry_cipher_setkey(state->h, key, key_len);
+    err = gcry_cipher_open(&h, algo, GCRY_CIPHER_MODE_ECB, 0);
     if (err) {
-        luaL_error(L, "gcry_cipher_setkey() failed with %s", gcry_strerror(err));
+        return err;
     }
-    return 0;
+    err = gcry_cipher_setkey(h, key, key_len);
+    krb5_nfold(constant, constant_len, block, sizeof(block));
+    while (!err && out_len > 0) {
+        err = gcry_cipher_encrypt(h, block, sizeof(block), NULL, 0);
+        n = out_len < sizeof(block) ? out_len : sizeof(block);
+        memcpy(out, block, n);
+        out += n;
+        out_len -= n;
+    }
+    gcry_cipher_close(h);
+    memset(block, 0, sizeof(block));
+    return err;
 }
 
-static int
-lgcrypt_cipher_setiv(lua_State *L)
+/* Derives a key from the base key and a 5-byte usage constant. */
+static gcry_error_t
+krb5_derive(LgcryptKrb5Key *state, int usage, unsigned char type,
+            unsigned char *out, size_t out_len)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t iv_len;
-    const char *iv = luaL_checklstring(L, 2, &iv_len);
+    unsigned char constant[5];
+
+    put_be32(constant, (unsigned long)usage);
+    constant[4] = type;
+
+    if (state->etype == KRB5_ETYPE_AES128_CTS_HMAC_SHA256_128 ||
+        state->etype == KRB5_ETYPE_AES256_CTS_HMAC_SHA384_192) {
+        /* RFC 8009 KDF-HMAC-SHA2 */
+        return kdf_sp800_108(state->md_algo, state->key, state->key_len,
+                constant, sizeof(constant), NULL, 0, out, out_len);
+    }
+    return krb5_dk(state->algo, state->key, state->key_len,
+            constant, sizeof(constant), out, out_len);
+}
+
+static void
+krb5_usage_close(LgcryptKrb5Usage *u)
+{
+    if (u->ke) {
+        gcry_cipher_close(u->ke);
+        u->ke = NULL;
+    }
+    if (u->ki) {
+        gcry_md_close(u->ki);
+        u->ki = NULL;
+    }
+}
+
+/* Prepares the cipher and HMAC handles for a key usage. */
+static gcry_error_t
+krb5_usage_init(LgcryptKrb5Key *state, LgcryptKrb5Usage *u, int usage)
+{
+    unsigned char ke[32], ki[32], msusage[4];
     gcry_error_t err;
 
-    err = gcry_cipher_setiv(state->h, iv, iv_len);
+    if (state->etype == KRB5_ETYPE_RC4_HMAC) {
+        /* RFC 4757: K1 = HMAC-MD5(Key, T) with the Microsoft usage number */
+        int t = usage == 3 ? 8 : usage == 23 ? 13 : usage;
+
+        msusage[0] = (unsigned char)t;
+        msusage[1] = (unsigned char)(t >> 8);
+        msusage[2] = (unsigned char)(t >> 16);
+        msusage[3] = (unsigned char)(t >> 24);
+        err = gcry_md_open(&u->ki, GCRY_MD_MD5, GCRY_MD_FLAG_HMAC);
+        if (!err) {
+            err = gcry_md_setkey(u->ki, state->key, state->key_len);
+        }
+        if (!err) {
+            gcry_md_write(u->ki, msusage, sizeof(msusage));
+            memcpy(ki, gcry_md_read(u->ki, 0), 16);
+            gcry_md_close(u->ki);
+            u->ki = NULL;
+            err = gcry_md_open(&u->ki, GCRY_MD_MD5, GCRY_MD_FLAG_HMAC);
+        }
+        if (!err) {
+            err = gcry_md_setkey(u->ki, ki, 16);
+        }
+        if (!err) {
+            err = gcry_cipher_open(&u->ke, GCRY_CIPHER_ARCFOUR,
+                    GCRY_CIPHER_MODE_STREAM, 0);
+        }
+    } else {
+        err = krb5_derive(state, usage, 0xaa, ke, state->key_len);
+        if (!err) {
+            err = krb5_derive(state, usage, 0x55, ki, state->ki_len);
+        }
+        if (!err) {
+            err = gcry_cipher_open(&u->ke, state->algo, GCRY_CIPHER_MODE_CBC,
+                    GCRY_CIPHER_CBC_CTS);
+        }
+        if (!err) {
+            err = gcry_cipher_setkey(u->ke, ke, state->key_len);
+        }
+        if (!err) {
+            err = gcry_md_open(&u->ki, state->md_algo, GCRY_MD_FLAG_HMAC);
+        }
+        if (!err) {
+            err = gcry_md_setkey(u->ki, ki, state->ki_len);
+        }
+    }
+    memset(ke, 0, sizeof(ke));
+    memset(ki, 0, sizeof(ki));
     if (err) {
-        luaL_error(L, "gcry_cipher_setiv() failed with %s", gcry_strerror(err));
+        krb5_usage_close(u);
+        return err;
     }
+    u->usage = usage;
     return 0;
 }
 
-static int
-lgcrypt_cipher_setctr(lua_State *L)
+/* Returns the cached handles for a key usage, deriving them if necessary. */
+static LgcryptKrb5Usage *
+krb5_get_usage(lua_State *L, LgcryptKrb5Key *state, int usage)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t ctr_len;
-    const char *ctr = luaL_checklstring(L, 2, &ctr_len);
+    LgcryptKrb5Usage *u;
     gcry_error_t err;
+    int i;
 
-    err = gcry_cipher_setctr(state->h, ctr, ctr_len);
+    for (i = 0; i < KRB5_USAGE_CACHE_SIZE; i++) {
+        u = &state->cache[i];
+        if (u->ke && u->usage == usage) {
+            return u;
+        }
+    }
+
+    u = &state->cache[state->next];
+    state->next = (state->next + 1) % KRB5_USAGE_CACHE_SIZE;
+    krb5_usage_close(u);
+    err = krb5_usage_init(state, u, usage);
     if (err) {
-        luaL_error(L, "gcry_cipher_setctr() failed with %s", gcry_strerror(err));
+        luaL_error(L, "Kerberos key derivation failed with %s", gcry_strerror(err));
+    }
+    return u;
+}
+
+static LgcryptKrb5Key *
+getKrb5Key(lua_State *L, int arg)
+{
+    return (LgcryptKrb5Key *)luaL_checkudata(L, arg, "gcrypt.KerberosKey");
+}
+
+static LgcryptKrb5Key *
+checkKrb5Key(lua_State *L, int arg)
+{
+    LgcryptKrb5Key *state = getKrb5Key(L, arg);
+    if (!state->etype) {
+        luaL_error(L, "Called into a dead object");
+    }
+    return state;
+}
+
+static int
+lgcrypt_krb5_key___gc(lua_State *L)
+{
+    LgcryptKrb5Key *state = getKrb5Key(L, 1);
+    int i;
+
+    for (i = 0; i < KRB5_USAGE_CACHE_SIZE; i++) {
+        krb5_usage_close(&state->cache[i]);
     }
+    secure_free(state->key, state->key_len);
+    state->key = NULL;
+    state->etype = 0;
     return 0;
 }
 
+/* gcrypt.KerberosKey(etype, key) */
 static int
-lgcrypt_cipher_reset(lua_State *L)
+lgcrypt_krb5_key_open(lua_State *L)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
+    LgcryptKrb5Key *state;
+    int etype;
+    size_t key_len;
+    const char *key;
+
+    etype = luaL_checkint(L, 1);
+    key = check_key(L, 2, &key_len);
+
+    state = (LgcryptKrb5Key *) lua_newuserdata(L, sizeof(LgcryptKrb5Key));
+    memset(state, 0, sizeof(LgcryptKrb5Key));
+    luaL_getmetatable(L, "gcrypt.KerberosKey");
+    lua_setmetatable(L, -2);
+
+    switch (etype) {
+    case KRB5_ETYPE_AES128_CTS_HMAC_SHA1_96:
+    case KRB5_ETYPE_AES256_CTS_HMAC_SHA1_96:
+        state->algo = etype == KRB5_ETYPE_AES128_CTS_HMAC_SHA1_96 ?
+            GCRY_CIPHER_AES128 : GCRY_CIPHER_AES256;
+        state->md_algo = GCRY_MD_SHA1;
+        state->key_len = gcry_cipher_get_algo_keylen(state->algo);
+        state->ki_len = state->key_len;
+        state->conf_len = 16;
+        state->mac_len = 12;
+        break;
+    case KRB5_ETYPE_AES128_CTS_HMAC_SHA256_128:
+        state->algo = GCRY_CIPHER_AES128;
+        state->md_algo = GCRY_MD_SHA256;
+        state->key_len = 16;
+        state->ki_len = 16;
+        state->conf_len = 16;
+        state->mac_len = 16;
+        break;
+    case KRB5_ETYPE_AES256_CTS_HMAC_SHA384_192:
+        state->algo = GCRY_CIPHER_AES256;
+        state->md_algo = GCRY_MD_SHA384;
+        state->key_len = 32;
+        state->ki_len = 24;
+        state->conf_len = 16;
+        state->mac_len = 24;
+        break;
+    case KRB5_ETYPE_RC4_HMAC:
+        state->algo = GCRY_CIPHER_ARCFOUR;
+        state->md_algo = GCRY_MD_MD5;
+        state->key_len = 16;
+        state->ki_len = 16;
+        state->conf_len = 8;
+        state->mac_len = 16;
+        break;
+    default:
+        return luaL_argerror(L, 1, "unsupported encryption type");
+    }
+    if (key_len != state->key_len) {
+        luaL_argerror(L, 2, "invalid key length");
+    }
+    state->key = secure_alloc(L, key_len);
+    memcpy(state->key, key, key_len);
+    state->etype = etype;
+    return 1;
+}
+
+/* Computes the checksum over the data that is protected by the etype. For the
+ * RFC 3962 and RFC 4757 etypes, this is the plaintext. For RFC 8009, this is
+ * the (zero) IV followed by the ciphertext. */
+static const unsigned char *
+krb5_checksum(LgcryptKrb5Key *state, LgcryptKrb5Usage *u,
+              const void *data, size_t data_len)
+{
+    static const unsigned char zero_iv[16];
+
+    gcry_md_reset(u->ki);
+    if (state->md_algo == GCRY_MD_SHA256 || state->md_algo == GCRY_MD_SHA384) {
+        gcry_md_write(u->ki, zero_iv, sizeof(zero_iv));
+    }
+    gcry_md_write(u->ki, data, data_len);
+    return gcry_md_read(u->ki, 0);
+}
+
+/* key:encrypt(usage, plaintext[, confounder]) */
+static int
+lgcrypt_krb5_key_encrypt(lua_State *L)
+{
+    LgcryptKrb5Key *state = checkKrb5Key(L, 1);
+    int usage = luaL_checkint(L, 2);
+    size_t in_len, conf_len, data_len;
+    const char *in = luaL_checklstring(L, 3, &in_len);
+    const char *conf = luaL_optlstring(L, 4, NULL, &conf_len);
+    LgcryptKrb5Usage *u;
+    unsigned char *out, *data;
+    const unsigned char *mac;
     gcry_error_t err;
 
-    err = gcry_cipher_reset(state->h);
+    if (conf && conf_len != state->conf_len) {
+        luaL_argerror(L, 4, "invalid confounder length");
+    }
+    u = krb5_get_usage(L, state, usage);
+
+    data_len = state->conf_len + in_len;
+    out = lua_newuserdata(L, data_len + state->mac_len);
+    if (state->etype == KRB5_ETYPE_RC4_HMAC) {
+        /* checksum || RC4(K3, confounder || plaintext) */
+        data = out + state->mac_len;
+    } else {
+        /* CTS(Ke, confounder || plaintext) || checksum */
+        data = out;
+    }
+    if (conf) {
+        memcpy(data, conf, conf_len);
+    } else {
+        gcry_randomize(data, state->conf_len, GCRY_STRONG_RANDOM);
+    }
+    memcpy(data + state->conf_len, in, in_len);
+
+    if (state->etype == KRB5_ETYPE_RC4_HMAC) {
+        mac = krb5_checksum(state, u, data, data_len);
+        memcpy(out, mac, state->mac_len);
+        /* K3 = HMAC-MD5(K1, checksum) */
+        mac = krb5_checksum(state, u, out, state->mac_len);
+        err = gcry_cipher_setkey(u->ke, mac, 16);
+        if (!err) {
+            err = gcry_cipher_encrypt(u->ke, data, data_len, NULL, 0);
+        }
+    } else {
+        if (state->md_algo == GCRY_MD_SHA1) {
+            mac = krb5_checksum(state, u, data, data_len);
+            memcpy(out + data_len, mac, state->mac_len);
+        }
+        err = gcry_cipher_reset(u->ke);
+        if (!err) {
+            err = gcry_cipher_encrypt(u->ke, data, data_len, NULL, 0);
+        }
+        if (!err && state->md_algo != GCRY_MD_SHA1) {
+            mac = krb5_checksum(state, u, data, data_len);
+            memcpy(out + data_len, mac, state->mac_len);
+        }
+    }
     if (err) {
-        luaL_error(L, "gcry_cipher_reset() failed with %s", gcry_strerror(err));
+        luaL_error(L, "gcry_cipher_encrypt() failed with %s", gcry_strerror(err));
     }
-    return 0;
+    lua_pushlstring(L, (const char *) out, data_len + state->mac_len);
+    lua_remove(L, -2);
+    return 1;
 }
 
-#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+/* key:decrypt(usage, ciphertext) returns the plaintext without confounder. */
 static int
-lgcrypt_cipher_authenticate(lua_State *L)
+lgcrypt_krb5_key_decrypt(lua_State *L)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t abuf_len;
-    const char *abuf = luaL_checklstring(L, 2, &abuf_len);
+    LgcryptKrb5Key *state = checkKrb5Key(L, 1);
+    int usage = luaL_checkint(L, 2);
+    size_t in_len, data_len;
+    const unsigned char *in;
+    const unsigned char *in_data, *in_mac;
+    LgcryptKrb5Usage *u;
+    unsigned char *data;
+    const unsigned char *mac;
     gcry_error_t err;
 
-    err = gcry_cipher_authenticate(state->h, abuf, abuf_len);
+    in = (const unsigned char *) luaL_checklstring(L, 3, &in_len);
+    if (in_len < state->conf_len + state->mac_len) {
+        luaL_error(L, "Ciphertext is too short");
+    }
+    u = krb5_get_usage(L, state, usage);
+
+    data_len = in_len - state->mac_len;
+    if (state->etype == KRB5_ETYPE_RC4_HMAC) {
+        in_mac = in;
+        in_data = in + state->mac_len;
+    } else {
+        in_data = in;
+        in_mac = in + data_len;
+    }
+
+    /* RFC 8009 authenticates the ciphertext, check it before decrypting. */
+    if (state->md_algo == GCRY_MD_SHA256 || state->md_algo == GCRY_MD_SHA384) {
+        mac = krb5_checksum(state, u, in_data, data_len);
+        if (!ct_equal(mac, in_mac, state->mac_len)) {
+            luaL_error(L, "Kerberos checksum verification failed");
+        }
+    }
+
+    data = lua_newuserdata(L, data_len);
+    if (state->etype == KRB5_ETYPE_RC4_HMAC) {
+        /* K3 = HMAC-MD5(K1, checksum) */
+        mac = krb5_checksum(state, u, in_mac, state->mac_len);
+        err = gcry_cipher_setkey(u->ke, mac, 16);
+    } else {
+        err = gcry_cipher_reset(u->ke);
+    }
+    if (!err) {
+        err = gcry_cipher_decrypt(u->ke, data, data_len, in_data, data_len);
+    }
     if (err) {
-        luaL_error(L, "gcry_cipher_authenticate() failed with %s", gcry_strerror(err));
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s", gcry_strerror(err));
     }
-    return 0;
+
+    if (state->md_algo == GCRY_MD_SHA1 || state->md_algo == GCRY_MD_MD5) {
+        mac = krb5_checksum(state, u, data, data_len);
+        if (!ct_equal(mac, in_mac, state->mac_len)) {
+            luaL_error(L, "Kerberos checksum verification failed");
+        }
+    }
+    lua_pushlstring(L, (const char *) data + state->conf_len,
+            data_len - state->conf_len);
+    lua_remove(L, -2);
+    return 1;
 }
 
-/* Libgcrypt 1.6.5 has some quirks
- * https://lists.gnupg.org/pipermail/gcrypt-devel/2016-March/003754.html */
+/* Converts UTF-8 to UTF-16LE into out (2 * len bytes suffice). Returns the
+ * number of bytes written or (size_t)-1 if the input is not valid UTF-8. */
 static size_t
-get_tag_length(LgcryptCipher *state)
+utf8_to_utf16le(const unsigned char *in, size_t len, unsigned char *out)
 {
-#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
-    size_t nbytes = 0;
-    gcry_error_t err;
+    static const unsigned long min_cp[4] = { 0, 0x80, 0x800, 0x10000 };
+    unsigned long cp;
+    size_t i = 0, n = 0, extra, j;
 
-    err = gcry_cipher_info(state->h, GCRYCTL_GET_TAGLEN, NULL, &nbytes);
-    return !err ? nbytes : 0;
-#else
-    return state->mode == GCRY_CIPHER_MODE_GCM ? 16 : 0;
-#endif
+    while (i < len) {
+        cp = in[i];
+        extra = cp < 0x80 ? 0 : (cp & 0xe0) == 0xc0 ? 1 :
+            (cp & 0xf0) == 0xe0 ? 2 : (cp & 0xf8) == 0xf0 ? 3 : 4;
+        if (extra > 3 || len - i <= extra) {
+            return (size_t)-1;
+        }
+        cp &= extra ? 0x3f >> extra : 0x7f;
+        for (j = 1; j <= extra; j++) {
+            if ((in[i + j] & 0xc0) != 0x80) {
+                return (size_t)-1;
+            }
+            cp = cp << 6 | (in[i + j] & 0x3f);
+        }
+        /* Reject overlong forms, surrogates and values beyond Unicode. */
+        if (cp < min_cp[extra] || (cp >= 0xd800 && cp < 0xe000) ||
+                cp > 0x10ffff) {
+            return (size_t)-1;
+        }
+        i += extra + 1;
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            out[n++] = (unsigned char)(cp >> 10);
+            out[n++] = (unsigned char)(0xd8 | cp >> 18);
+            cp = 0xdc00 | (cp & 0x3ff);
+        }
+        out[n++] = (unsigned char)cp;
+        out[n++] = (unsigned char)(cp >> 8);
+    }
+    return n;
 }
 
+/* gcrypt.krb5_string_to_key(etype, password[, salt[, iterations]]) derives
+ * the key of etype 17/18 (RFC 3962, PBKDF2-HMAC-SHA1 followed by
+ * DK(tkey, "kerberos")) or 23 (RFC 4757, MD4 of the UTF-16LE password). */
 static int
-lgcrypt_cipher_gettag(lua_State *L)
+lgcrypt_krb5_string_to_key(lua_State *L)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    char tag[16];
-    size_t tag_len;
+    int etype, algo;
+    size_t password_len, salt_len, key_len, utf16_len;
+    const char *password, *salt;
+    lua_Integer iterations;
+    unsigned char *out, *utf16;
     gcry_error_t err;
 
-    tag_len = get_tag_length(state);
-    if (tag_len == 0) {
-        luaL_error(L, "Unsupported cipher mode");
+    etype = luaL_checkint(L, 1);
+    password = check_key(L, 2, &password_len);
+    salt = luaL_optlstring(L, 3, "", &salt_len);
+    iterations = luaL_optinteger(L, 4, 4096);
+    luaL_argcheck(L, iterations > 0 && iterations <= 0xffffffffL, 4,
+            "iteration count out of range");
+
+    switch (etype) {
+    case KRB5_ETYPE_AES128_CTS_HMAC_SHA1_96:
+    case KRB5_ETYPE_AES256_CTS_HMAC_SHA1_96:
+        algo = etype == KRB5_ETYPE_AES128_CTS_HMAC_SHA1_96 ?
+            GCRY_CIPHER_AES128 : GCRY_CIPHER_AES256;
+        key_len = gcry_cipher_get_algo_keylen(algo);
+        out = push_derived(L, 2, key_len);
+        err = gcry_kdf_derive(password, password_len, GCRY_KDF_PBKDF2,
+                GCRY_MD_SHA1, salt, salt_len, (unsigned long)iterations,
+                key_len, out);
+        if (!err) {
+            err = krb5_dk(algo, out, key_len,
+                    (const unsigned char *) "kerberos", 8, out, key_len);
+        }
+        break;
+    case KRB5_ETYPE_RC4_HMAC:
+        key_len = 16;
+        utf16 = secure_alloc(L, 2 * password_len);
+        utf16_len = utf8_to_utf16le((const unsigned char *) password,
+                password_len, utf16);
+        if (utf16_len == (size_t)-1) {
+            secure_free(utf16, 2 * password_len);
+            return luaL_argerror(L, 2, "invalid UTF-8");
+        }
+        out = push_derived(L, 2, key_len);
+        gcry_md_hash_buffer(GCRY_MD_MD4, out, utf16, utf16_len);
+        secure_free(utf16, 2 * password_len);
+        err = 0;
+        break;
+    default:
+        return luaL_argerror(L, 1, "unsupported encryption type");
     }
-    err = gcry_cipher_gettag(state->h, tag, tag_len);
     if (err) {
-        luaL_error(L, "gcry_cipher_gettag() failed with %s", gcry_strerror(err));
+        luaL_error(L, "Kerberos string-to-key failed with %s", gcry_strerror(err));
     }
-    lua_pushlstring(L, tag, tag_len);
+    finish_derived(L, 2, out, key_len);
     return 1;
 }
 
-static int
-lgcrypt_cipher_checktag(lua_State *L)
+static const struct luaL_Reg lgcrypt_krb5_key_meta[] = {
+    {"__gc",    lgcrypt_krb5_key___gc},
+    {"encrypt", lgcrypt_krb5_key_encrypt},
+    {"decrypt", lgcrypt_krb5_key_decrypt},
+    {NULL,      NULL}
+};
+/* }}} */
+/* {{{ Bluetooth Low Energy */
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+/* All values are in the most significant octet first order that is used by
+ * the sample data in the Bluetooth Core specification. Over the air, these
+ * values are transmitted in the reverse order. */
+
+/* AES-CMAC with a 128-bit key, the basis for the LE Secure Connections
+ * functions (Core v4.2, Vol 3, Part H, 2.2.5). */
+static gcry_error_t
+ble_aes_cmac(const void *key, const void *msg, size_t msg_len,
+             unsigned char *out)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t tag_len;
-    const char *tag = luaL_checklstring(L, 2, &tag_len);
+    gcry_mac_hd_t h;
     gcry_error_t err;
+    size_t out_len = 16;
 
-    err = gcry_cipher_checktag(state->h, tag, tag_len);
+    err = gcry_mac_open(&h, GCRY_MAC_CMAC_AES, 0, NULL);
     if (err) {
-        luaL_error(L, "gcry_cipher_checktag() failed with %s", gcry_strerror(err));
+        return err;
     }
-    return 0;
+    err = gcry_mac_setkey(h, key, 16);
+    if (!err) {
+        err = gcry_mac_write(h, msg, msg_len);
+    }
+    if (!err) {
+        err = gcry_mac_read(h, out, &out_len);
+    }
+    gcry_mac_close(h);
+    return err;
 }
-#endif
 
-static int
-lgcrypt_cipher_encrypt(lua_State *L)
+/* Checks that argument arg is a string of exactly len bytes. */
+static const unsigned char *
+check_fixed_string(lua_State *L, int arg, size_t len)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t in_len, out_len;
-    const char *in;
-    char *out;
-    gcry_error_t err;
+    size_t actual_len;
+    const char *s = luaL_checklstring(L, arg, &actual_len);
 
-    in = luaL_checklstring(L, 2, &in_len);
+    if (actual_len != len) {
+        luaL_argerror(L, arg, lua_pushfstring(L, "expected %d bytes", (int)len));
+    }
+    return (const unsigned char *) s;
+}
 
-    out_len = in_len;
-    out = lua_newuserdata(L, out_len);
-    err = gcry_cipher_encrypt(state->h, out, out_len, in, in_len);
+static void
+ble_cmac_result(lua_State *L, gcry_error_t err, const unsigned char *mac)
+{
     if (err) {
-        luaL_error(L, "gcry_cipher_encrypt() failed with %s", gcry_strerror(err));
+        luaL_error(L, "AES-CMAC failed with %s", gcry_strerror(err));
     }
-    lua_pushlstring(L, out, out_len);
-    lua_remove(L, -2);
+    lua_pushlstring(L, (const char *) mac, 16);
+}
+
+/* gcrypt.ble_f4(U, V, X, Z) = AES-CMAC_X(U || V || Z) */
+static int
+lgcrypt_ble_f4(lua_State *L)
+{
+    unsigned char msg[65], mac[16];
+
+    memcpy(msg, check_fixed_string(L, 1, 32), 32);
+    memcpy(msg + 32, check_fixed_string(L, 2, 32), 32);
+    msg[64] = (unsigned char)luaL_checkint(L, 4);
+    ble_cmac_result(L, ble_aes_cmac(check_fixed_string(L, 3, 16), msg,
+                sizeof(msg), mac), mac);
     return 1;
 }
 
+/* gcrypt.ble_f5(W, N1, N2, A1, A2) returns MacKey and LTK. */
 static int
-lgcrypt_cipher_decrypt(lua_State *L)
+lgcrypt_ble_f5(lua_State *L)
 {
-    LgcryptCipher *state = checkCipher(L, 1);
-    size_t in_len, out_len;
-    const char *in;
-    char *out;
+    static const unsigned char salt[16] = {
+        0x6c, 0x88, 0x83, 0x91, 0xaa, 0xf5, 0xa5, 0x38,
+        0x60, 0x37, 0x0b, 0xdb, 0x5a, 0x60, 0x83, 0xbe
+    };
+    unsigned char t[16], msg[53], mac[16];
+    const unsigned char *w;
     gcry_error_t err;
 
-    in = luaL_checklstring(L, 2, &in_len);
+    w = check_fixed_string(L, 1, 32);
+    /* Counter || keyID "btle" || N1 || N2 || A1 || A2 || Length (256) */
+    msg[0] = 0;
+    memcpy(msg + 1, "btle", 4);
+    memcpy(msg + 5, check_fixed_string(L, 2, 16), 16);
+    memcpy(msg + 21, check_fixed_string(L, 3, 16), 16);
+    memcpy(msg + 37, check_fixed_string(L, 4, 7), 7);
+    memcpy(msg + 44, check_fixed_string(L, 5, 7), 7);
+    msg[51] = 0x01;
+    msg[52] = 0x00;
 
-    out_len = in_len;
-    out = lua_newuserdata(L, out_len);
-    err = gcry_cipher_decrypt(state->h, out, out_len, in, in_len);
-    if (err) {
-        luaL_error(L, "gcry_cipher_decrypt() failed with %s", gcry_strerror(err));
+    err = ble_aes_cmac(salt, w, 32, t);
+    if (!err) {
+        err = ble_aes_cmac(t, msg, sizeof(msg), mac);
     }
-    lua_pushlstring(L, out, out_len);
-    lua_remove(L, -2);
-    return 1;
+    ble_cmac_result(L, err, mac);
+    msg[0] = 1;
+    ble_cmac_result(L, ble_aes_cmac(t, msg, sizeof(msg), mac), mac);
+    return 2;
 }
 
-
-/* https://gnupg.org/documentation/manuals/gcrypt/Working-with-cipher-handles.html */
-static const struct luaL_Reg lgcrypt_cipher_meta[] = {
-    {"__gc",            lgcrypt_cipher___gc},
-    {"setkey",          lgcrypt_cipher_setkey},
-    {"setiv",           lgcrypt_cipher_setiv},
-    {"setctr",          lgcrypt_cipher_setctr},
-    {"reset",           lgcrypt_cipher_reset},
-#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
-    {"authenticate",    lgcrypt_cipher_authenticate},
-    {"gettag",          lgcrypt_cipher_gettag},
-    {"checktag",        lgcrypt_cipher_checktag},
-#endif
-    {"encrypt",         lgcrypt_cipher_encrypt},
-    {"decrypt",         lgcrypt_cipher_decrypt},
-    {NULL,              NULL}
-};
-/* }}} */
-/* {{{ Message digests */
-typedef struct {
-    gcry_md_hd_t h;
-} LgcryptHash;
-
-/* Initializes a new gcrypt.Hash userdata and pushes it on the stack. */
-static LgcryptHash *
-lgcrypt_hash_new(lua_State *L)
+/* gcrypt.ble_f6(W, N1, N2, R, IOcap, A1, A2) =
+ *     AES-CMAC_W(N1 || N2 || R || IOcap || A1 || A2) */
+static int
+lgcrypt_ble_f6(lua_State *L)
 {
-    LgcryptHash *state;
+    unsigned char msg[65], mac[16];
 
-    state = (LgcryptHash *) lua_newuserdata(L, sizeof(LgcryptHash));
-    state->h = NULL;
-    luaL_getmetatable(L, "gcrypt.Hash");
-    lua_setmetatable(L, -2);
-    return state;
+    memcpy(msg, check_fixed_string(L, 2, 16), 16);
+    memcpy(msg + 16, check_fixed_string(L, 3, 16), 16);
+    memcpy(msg + 32, check_fixed_string(L, 4, 16), 16);
+    memcpy(msg + 48, check_fixed_string(L, 5, 3), 3);
+    memcpy(msg + 51, check_fixed_string(L, 6, 7), 7);
+    memcpy(msg + 58, check_fixed_string(L, 7, 7), 7);
+    ble_cmac_result(L, ble_aes_cmac(check_fixed_string(L, 1, 16), msg,
+                sizeof(msg), mac), mac);
+    return 1;
 }
 
+/* gcrypt.ble_g2(U, V, X, Y) = AES-CMAC_X(U || V || Y) mod 2^32 */
 static int
-lgcrypt_hash_open(lua_State *L)
+lgcrypt_ble_g2(lua_State *L)
 {
-    int algo;
-    unsigned int flags;
-    LgcryptHash *state;
+    unsigned char msg[80], mac[16];
     gcry_error_t err;
 
-    algo = luaL_checkint(L, 1);
-    flags = (unsigned int)luaL_optinteger(L, 2, 0);
-
-    state = lgcrypt_hash_new(L);
-
-    err = gcry_md_open(&state->h, algo, flags);
+    memcpy(msg, check_fixed_string(L, 1, 32), 32);
+    memcpy(msg + 32, check_fixed_string(L, 2, 32), 32);
+    memcpy(msg + 64, check_fixed_string(L, 4, 16), 16);
+    err = ble_aes_cmac(check_fixed_string(L, 3, 16), msg, sizeof(msg), mac);
     if (err) {
-        lua_pop(L, 1);
-        luaL_error(L, "gcry_md_open() failed with %s", gcry_strerror(err));
+        luaL_error(L, "AES-CMAC failed with %s", gcry_strerror(err));
     }
+    lua_pushnumber(L, (lua_Number)(((unsigned long)mac[12] << 24) |
+                ((unsigned long)mac[13] << 16) | (mac[14] << 8) | mac[15]));
     return 1;
 }
 
-static LgcryptHash *
-getHash(lua_State *L, int arg)
+/* Link Layer encryption (Core v4.2, Vol 6, Part B, 5.1.3) */
+typedef struct {
+    gcry_cipher_hd_t h;             /* AES-CCM keyed with the session key */
+    unsigned char *session_key;     /* 16 bytes in secure memory */
+    unsigned char iv[8];            /* Least significant octet first */
+    double counter[2];              /* Indexed by directionBit */
+    PlainBinding cache;
+} LgcryptBleLink;
+
+static LgcryptBleLink *
+getBleLink(lua_State *L, int arg)
 {
-    return (LgcryptHash *)luaL_checkudata(L, arg, "gcrypt.Hash");
+    return (LgcryptBleLink *)luaL_checkudata(L, arg, "gcrypt.BleLinkDecryptor");
 }
 
-static LgcryptHash *
-checkHash(lua_State *L, int arg)
+static LgcryptBleLink *
+checkBleLink(lua_State *L, int arg)
 {
-    LgcryptHash *state = getHash(L, arg);
+    LgcryptBleLink *state = getBleLink(L, arg);
     if (!state->h) {
         luaL_error(L, "Called into a dead object");
     }
@@ -347,98 +10602,191 @@ checkHash(lua_State *L, int arg)
 }
 
 static int
-lgcrypt_hash___gc(lua_State *L)
+lgcrypt_ble_link___gc(lua_State *L)
 {
-    LgcryptHash *state = getHash(L, 1);
+    LgcryptBleLink *state = getBleLink(L, 1);
 
     if (state->h) {
-        gcry_md_close(state->h);
+        gcry_cipher_close(state->h);
         state->h = NULL;
     }
+    secure_free(state->session_key, 16);
+    state->session_key = NULL;
+    plain_binding_free(L, &state->cache);
     return 0;
 }
 
-
+/* gcrypt.BleLinkDecryptor(ltk, skd, iv) derives the session key
+ * SK = e(LTK, SKDs || SKDm). If skd is nil, ltk is used as session key. */
 static int
-lgcrypt_hash_setkey(lua_State *L)
+lgcrypt_ble_link_open(lua_State *L)
 {
-    LgcryptHash *state = checkHash(L, 1);
-    size_t key_len;
-    const char *key = luaL_checklstring(L, 2, &key_len);
+    const unsigned char *ltk, *skd, *iv;
+    LgcryptBleLink *state;
     gcry_error_t err;
+    int i;
 
-    err = gcry_md_setkey(state->h, key, key_len);
+    ltk = check_fixed_string(L, 1, 16);
+    skd = lua_isnoneornil(L, 2) ? NULL : check_fixed_string(L, 2, 16);
+    iv = check_fixed_string(L, 3, 8);
+
+    state = (LgcryptBleLink *) lua_newuserdata(L, sizeof(LgcryptBleLink));
+    memset(state, 0, sizeof(LgcryptBleLink));
+    luaL_getmetatable(L, "gcrypt.BleLinkDecryptor");
+    lua_setmetatable(L, -2);
+    state->session_key = secure_alloc(L, 16);
+
+    if (skd) {
+        err = gcry_cipher_open(&state->h, GCRY_CIPHER_AES128,
+                GCRY_CIPHER_MODE_ECB, 0);
+        if (!err) {
+            err = gcry_cipher_setkey(state->h, ltk, 16);
+        }
+        if (!err) {
+            err = gcry_cipher_encrypt(state->h, state->session_key, 16, skd, 16);
+        }
+        if (state->h) {
+            gcry_cipher_close(state->h);
+            state->h = NULL;
+        }
+        if (err) {
+            luaL_error(L, "Session key derivation failed with %s", gcry_strerror(err));
+        }
+    } else {
+        memcpy(state->session_key, ltk, 16);
+    }
+    for (i = 0; i < 8; i++) {
+        state->iv[i] = iv[7 - i];
+    }
+
+    err = gcry_cipher_open(&state->h, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CCM, 0);
     if (err) {
-        luaL_error(L, "gcry_md_setkey() failed with %s", gcry_strerror(err));
+        luaL_error(L, "gcry_cipher_open() failed with %s", gcry_strerror(err));
     }
-    return 0;
+    err = gcry_cipher_setkey(state->h, state->session_key, 16);
+    if (err) {
+        luaL_error(L, "gcry_cipher_setkey() failed with %s", gcry_strerror(err));
+    }
+    return 1;
 }
 
 static int
-lgcrypt_hash_reset(lua_State *L)
+lgcrypt_ble_link_session_key(lua_State *L)
 {
-    LgcryptHash *state = checkHash(L, 1);
-    gcry_md_reset(state->h);
-    return 0;
+    LgcryptBleLink *state = checkBleLink(L, 1);
+
+    lua_pushlstring(L, (const char *) state->session_key, 16);
+    return 1;
 }
 
+/* link:decrypt(pdu, master_to_slave[, counter]) decrypts a Data Channel PDU
+ * (header, encrypted payload and MIC) and returns the payload. Without an
+ * explicit counter, the packet counter for the direction is used and
+ * incremented after successful authentication. */
 static int
-lgcrypt_hash_write(lua_State *L)
+lgcrypt_ble_link_decrypt(lua_State *L)
 {
-    LgcryptHash *state = checkHash(L, 1);
-    size_t buffer_len;
-    const char *buffer = luaL_checklstring(L, 2, &buffer_len);
+    LgcryptBleLink *state = checkBleLink(L, 1);
+    size_t pdu_len, enc_len;
+    const unsigned char *pdu;
+    unsigned char nonce[13], aad;
+    unsigned long long params[3];
+    double counter;
+    int dir, i;
+    char *out;
+    gcry_error_t err;
 
-    gcry_md_write(state->h, buffer, buffer_len);
-    return 0;
-}
+    pdu = (const unsigned char *) luaL_checklstring(L, 2, &pdu_len);
+    dir = lua_toboolean(L, 3) ? 1 : 0;
+    counter = luaL_optnumber(L, 4, state->counter[dir]);
 
-static int
-lgcrypt_hash_read(lua_State *L)
-{
-    LgcryptHash *state = checkHash(L, 1);
-    unsigned char *digest;
-    size_t digest_len;
-    int algo;
+    /* Header (2), payload and MIC (4) */
+    if (pdu_len < 2 || pdu[1] < 4 || pdu_len < 2 + (size_t)pdu[1]) {
+        luaL_error(L, "Invalid encrypted Data Channel PDU");
+    }
+    enc_len = pdu[1] - 4;
+    if (plain_binding_push(L, &state->cache, dir, (unsigned long long)counter,
+                pdu, 2 + (size_t)pdu[1])) {
+        state->counter[dir] = counter + 1;
+        return 1;
+    }
 
-    algo = (int)luaL_optinteger(L, 2, gcry_md_get_algo(state->h));
-    if (!gcry_md_is_enabled(state->h, algo)) {
-        luaL_error(L, "Unable to obtain digest for a disabled algorithm");
+    /* packetCounter (39 bits, LSO first), directionBit, IV */
+    for (i = 0; i < 5; i++) {
+        nonce[i] = (unsigned char)((unsigned long long)counter >> (8 * i));
     }
+    nonce[4] = (nonce[4] & 0x7f) | (dir << 7);
+    memcpy(nonce + 5, state->iv, 8);
+    /* The NESN, SN and MD bits are masked in the header. */
+    aad = pdu[0] & 0xe3;
 
-    digest_len = gcry_md_get_algo_dlen(algo);
-    if (!digest_len) {
-        luaL_error(L, "Invalid digest length detected");
+    err = gcry_cipher_setiv(state->h, nonce, sizeof(nonce));
+    if (!err) {
+        params[0] = enc_len;
+        params[1] = 1;
+        params[2] = 4;
+        err = gcry_cipher_ctl(state->h, GCRYCTL_SET_CCM_LENGTHS, params, sizeof(params));
     }
-    digest = gcry_md_read(state->h, algo);
-    if (!digest) {
-        luaL_error(L, "Failed to obtain digest");
+    if (!err) {
+        err = gcry_cipher_authenticate(state->h, &aad, 1);
     }
-    lua_pushlstring(L, (const char *) digest, digest_len);
+    if (err) {
+        luaL_error(L, "AES-CCM setup failed with %s", gcry_strerror(err));
+    }
+    out = lua_newuserdata(L, enc_len);
+    err = gcry_cipher_decrypt(state->h, out, enc_len, pdu + 2, enc_len);
+    if (err) {
+        luaL_error(L, "gcry_cipher_decrypt() failed with %s", gcry_strerror(err));
+    }
+    err = gcry_cipher_checktag(state->h, pdu + 2 + enc_len, 4);
+    if (err) {
+        luaL_error(L, "gcry_cipher_checktag() failed with %s", gcry_strerror(err));
+    }
+    state->counter[dir] = counter + 1;
+    plain_binding_store(&state->cache, dir, (unsigned long long)counter,
+            pdu, 2 + (size_t)pdu[1], (const unsigned char *) out, enc_len);
+    lua_pushlstring(L, out, enc_len);
+    lua_remove(L, -2);
     return 1;
 }
 
+/* link:set_cache(cache, session) serves repeated PDUs from a
+ * gcrypt.PlaintextCache. link:set_cache(nil) detaches it. */
+static int
+lgcrypt_ble_link_set_cache(lua_State *L)
+{
+    plain_binding_set(L, &checkBleLink(L, 1)->cache);
+    return 0;
+}
 
-
-/* https://gnupg.org/documentation/manuals/gcrypt/Working-with-hash-algorithms.html */
-static const struct luaL_Reg lgcrypt_hash_meta[] = {
-    {"__gc",    lgcrypt_hash___gc},
-    {"setkey",  lgcrypt_hash_setkey},
-    {"reset",   lgcrypt_hash_reset},
-    {"write",   lgcrypt_hash_write},
-    {"read",    lgcrypt_hash_read},
-    {NULL,      NULL}
+static const struct luaL_Reg lgcrypt_ble_link_meta[] = {
+    {"__gc",        lgcrypt_ble_link___gc},
+    {"session_key", lgcrypt_ble_link_session_key},
+    {"decrypt",     lgcrypt_ble_link_decrypt},
+    {"set_cache",   lgcrypt_ble_link_set_cache},
+    {NULL,          NULL}
 };
+#endif
 /* }}} */
 
+/* gcrypt.init([secmem_size]) */
 static int
 lgcrypt_init(lua_State *L)
 {
+    lua_Integer secmem_size = luaL_optinteger(L, 1, 0);
+
     if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
         luaL_error(L, "Libgcrypt was already initialized");
     }
     gcry_check_version(NULL);
-    gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+    if (secmem_size > 0) {
+        /* Used by gcrypt.Key, for example. */
+        gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
+        gcry_control(GCRYCTL_INIT_SECMEM, (int)secmem_size, 0);
+        gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
+    } else {
+        gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+    }
     gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
     return 0;
 }
@@ -459,6 +10807,62 @@ static const struct luaL_Reg lgcrypt[] = {
     {"check_version",   lgcrypt_check_version},
     {"Cipher",          lgcrypt_cipher_open},
     {"Hash",            lgcrypt_hash_open},
+    {"hash",            lgcrypt_hash},
+    {"digest_memo",     lgcrypt_digest_memo},
+    {"tohex",           lgcrypt_tohex},
+    {"fromhex",         lgcrypt_fromhex},
+    {"b64encode",       lgcrypt_b64encode},
+    {"b64decode",       lgcrypt_b64decode},
+    {"Buffer",          lgcrypt_buffer_open},
+    {"xor",             lgcrypt_xor},
+    {"xor_into",        lgcrypt_xor_into},
+    {"equal",           lgcrypt_equal},
+    {"crc32",           lgcrypt_crc32},
+    {"crc32c",          lgcrypt_crc32c},
+    {"crc32_combine",   lgcrypt_crc32_combine},
+    {"crc32c_combine",  lgcrypt_crc32c_combine},
+    {"hash_pieces",     lgcrypt_hash_pieces},
+    {"digest_many",     lgcrypt_digest_many},
+    {"cdc",             lgcrypt_cdc},
+    {"merkle_root",     lgcrypt_merkle_root},
+    {"MerkleLog",       lgcrypt_merkle_log_open},
+    {"VerifiedReader",  lgcrypt_verified_reader_open},
+    {"DecryptingReader", lgcrypt_decrypting_reader_open},
+    {"open_encrypted",  lgcrypt_open_encrypted},
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    {"seal_file",       lgcrypt_seal_file},
+    {"open_file",       lgcrypt_open_file},
+    {"SealedReader",    lgcrypt_sealed_reader_open},
+#endif
+    {"io_engine",       lgcrypt_io_engine},
+    {"hash_file",       lgcrypt_hash_file},
+    {"hash_files",      lgcrypt_hash_files},
+    {"DigestSet",       lgcrypt_digest_set_open},
+    {"load_digest_set", lgcrypt_load_digest_set},
+    {"PlaintextCache",  lgcrypt_plaintext_cache_open},
+#ifdef HAVE_MMAP
+    {"DigestCache",     lgcrypt_digest_cache_open},
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    {"Mac",             lgcrypt_mac_open},
+    {"Pipeline",        lgcrypt_pipeline_open},
+#endif
+    {"kdf_sp800_108",   lgcrypt_kdf_sp800_108},
+    {"hkdf",            lgcrypt_hkdf},
+    {"Key",             lgcrypt_key_open},
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    {"Smb3Decryptor",   lgcrypt_smb3_open},
+    {"prefetch",        lgcrypt_prefetch},
+#endif
+    {"KerberosKey",     lgcrypt_krb5_key_open},
+    {"krb5_string_to_key", lgcrypt_krb5_string_to_key},
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    {"BleLinkDecryptor", lgcrypt_ble_link_open},
+    {"ble_f4",          lgcrypt_ble_f4},
+    {"ble_f5",          lgcrypt_ble_f5},
+    {"ble_f6",          lgcrypt_ble_f6},
+    {"ble_g2",          lgcrypt_ble_g2},
+#endif
     {NULL, NULL}
 };
 
@@ -475,8 +10879,38 @@ register_metatable(lua_State *L, const char *name, const struct luaL_Reg *funcs)
 int
 luaopen_luagcrypt(lua_State *L)
 {
+#ifdef HAVE_TARGET_ISA
+    cpu_detect();
+#endif
+    register_metatable(L, "gcrypt.Key",    lgcrypt_key_meta);
     register_metatable(L, "gcrypt.Cipher", lgcrypt_cipher_meta);
     register_metatable(L, "gcrypt.Hash",   lgcrypt_hash_meta);
+    register_metatable(L, "gcrypt.Buffer", lgcrypt_buffer_meta);
+    register_metatable(L, "gcrypt.Source", lgcrypt_source_meta);
+    register_metatable(L, "gcrypt.MerkleLog", lgcrypt_merkle_log_meta);
+    register_metatable(L, "gcrypt.DigestSet", lgcrypt_digest_set_meta);
+    register_metatable(L, "gcrypt.PlaintextCache",
+            lgcrypt_plaintext_cache_meta);
+    register_metatable(L, "gcrypt.VerifiedReader", lgcrypt_verified_reader_meta);
+    register_metatable(L, "gcrypt.DecryptingReader",
+            lgcrypt_decrypting_reader_meta);
+    register_metatable(L, "gcrypt.EncryptedFile", lgcrypt_encrypted_file_meta);
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    register_metatable(L, "gcrypt.LazyPlaintext", lgcrypt_lazy_plaintext_meta);
+    register_metatable(L, "gcrypt.SealedReader", lgcrypt_sealed_reader_meta);
+#endif
+#ifdef HAVE_MMAP
+    register_metatable(L, "gcrypt.DigestCache", lgcrypt_digest_cache_meta);
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    register_metatable(L, "gcrypt.Mac",    lgcrypt_mac_meta);
+    register_metatable(L, "gcrypt.Pipeline", lgcrypt_pipeline_meta);
+    register_metatable(L, "gcrypt.Smb3Decryptor", lgcrypt_smb3_meta);
+#endif
+    register_metatable(L, "gcrypt.KerberosKey", lgcrypt_krb5_key_meta);
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    register_metatable(L, "gcrypt.BleLinkDecryptor", lgcrypt_ble_link_meta);
+#endif
 
     luaL_newlib(L, lgcrypt);
 
@@ -537,6 +10971,9 @@ luaopen_luagcrypt(lua_State *L)
     INT_GCRY(CIPHER_MODE_OCB);
     INT_GCRY(CIPHER_MODE_CFB8);
 #endif
+#if GCRYPT_VERSION_NUMBER >= 0x010800 /* 1.8.0 */
+    INT_GCRY(CIPHER_MODE_XTS);
+#endif
 
     INT_GCRY(CIPHER_CBC_CTS);
 
@@ -574,6 +11011,24 @@ luaopen_luagcrypt(lua_State *L)
 #endif
 
     INT_GCRY(MD_FLAG_HMAC);
+
+#if GCRYPT_VERSION_NUMBER >= 0x010600 /* 1.6.0 */
+    /* https://gnupg.org/documentation/manuals/gcrypt/Available-MAC-algorithms.html */
+    INT_GCRY(MAC_HMAC_SHA256);
+    INT_GCRY(MAC_HMAC_SHA224);
+    INT_GCRY(MAC_HMAC_SHA512);
+    INT_GCRY(MAC_HMAC_SHA384);
+    INT_GCRY(MAC_HMAC_SHA1);
+    INT_GCRY(MAC_HMAC_MD5);
+    INT_GCRY(MAC_CMAC_AES);
+    INT_GCRY(MAC_CMAC_3DES);
+    INT_GCRY(MAC_CMAC_CAMELLIA);
+    INT_GCRY(MAC_GMAC_AES);
+    INT_GCRY(MAC_GMAC_CAMELLIA);
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700 /* 1.7.0 */
+    INT_GCRY(MAC_POLY1305);
+#endif
 #undef INT_GCRY
 
     return 1;
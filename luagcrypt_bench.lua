@@ -0,0 +1,194 @@
+--
+-- Benchmarks for luagcrypt.
+--
+-- Usage: lua luagcrypt_bench.lua [size_mib [path]]
+-- The test file is created in the temporary directory unless a path is given,
+-- use a file on the storage of interest. Results with a cold page cache are
+-- obtained by dropping caches between runs (echo 3 > /proc/sys/vm/drop_caches).
+--
+-- Licensed under the MIT license. See the LICENSE file for details.
+--
+
+local gcrypt = require("luagcrypt")
+
+local size_mib = tonumber(arg and arg[1]) or 256
+local path = arg and arg[2]
+
+-- Wall clock time is needed to see overlapped I/O, os.clock() only measures
+-- the processor time of this process.
+local clock = os.clock
+local has_socket, socket = pcall(require, "socket")
+if has_socket and socket.gettime then
+    clock = socket.gettime
+else
+    print("LuaSocket not found, reporting processor time")
+end
+
+-- Runs fn a few times and returns the best time in seconds.
+local function best_time(fn)
+    local best
+    for _ = 1, 3 do
+        local start = clock()
+        fn()
+        local elapsed = clock() - start
+        if not best or elapsed < best then
+            best = elapsed
+        end
+    end
+    return best
+end
+
+local function report(name, bytes, seconds)
+    print(string.format("%-28s %8.1f MiB/s", name,
+                        bytes / 1048576 / math.max(seconds, 1e-9)))
+end
+
+local function create_file(mib)
+    local file_path = path or os.tmpname()
+    local f = assert(io.open(file_path, "wb"))
+    local block = string.rep(gcrypt.hash(gcrypt.MD_SHA256, "bench"), 32768)
+    for _ = 1, mib do
+        f:write(block)
+    end
+    f:close()
+    return file_path
+end
+
+function bench_file_hashing()
+    local file_path = create_file(size_mib)
+    local bytes = size_mib * 1048576
+    local engines = {"read", "mmap", "io_uring"}
+    for _, engine in ipairs(engines) do
+        local depths = engine == "io_uring" and {1, 4, 16, 64} or {1}
+        for _, depth in ipairs(depths) do
+            local ok, _, _, usable = pcall(gcrypt.io_engine, engine, depth)
+            if ok and usable then
+                local t = best_time(function()
+                    gcrypt.hash_file(gcrypt.MD_SHA256, file_path)
+                end)
+                local name = "hash_file " .. engine
+                if engine == "io_uring" then
+                    name = name .. " qd=" .. depth
+                end
+                report(name, bytes, t)
+            end
+        end
+    end
+    gcrypt.io_engine("auto")
+    if not path then
+        os.remove(file_path)
+    end
+end
+
+function bench_backends()
+    if not pcall(gcrypt.Hash, gcrypt.MD_SHA256, 0, "af_alg") then
+        print("AF_ALG is not available, skipping")
+        return
+    end
+    local file_path = create_file(size_mib)
+    local out_path = os.tmpname()
+    local bytes = size_mib * 1048576
+    local data = string.rep("\0", 1048576)
+    local key = string.rep("k", 16)
+    for _, backend in ipairs({"libgcrypt", "af_alg"}) do
+        local md = gcrypt.Hash(gcrypt.MD_SHA256, 0, backend)
+        report("SHA-256 write " .. backend, 64 * #data, best_time(function()
+            md:reset()
+            for _ = 1, 64 do
+                md:write(data)
+            end
+            md:read()
+        end))
+        report("SHA-256 write_file " .. backend, bytes, best_time(function()
+            md:reset()
+            md:write_file(file_path)
+            md:read()
+        end))
+        local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128,
+                                     gcrypt.CIPHER_MODE_CTR, 0, backend)
+        cipher:setkey(key)
+        report("AES-128-CTR encrypt " .. backend, 64 * #data, best_time(function()
+            for _ = 1, 64 do
+                cipher:encrypt(data)
+            end
+        end))
+        report("AES-128-CTR encrypt_file " .. backend, bytes, best_time(function()
+            cipher:encrypt_file(file_path, out_path)
+        end))
+    end
+    os.remove(out_path)
+    if not path then
+        os.remove(file_path)
+    end
+end
+
+function bench_pipeline()
+    if not gcrypt.Pipeline then
+        print("gcrypt.Pipeline requires Libgcrypt 1.6.0")
+        return
+    end
+    local key = string.rep("k", 16)
+    local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM)
+    cipher:setkey(gcrypt.Key(key))
+    local records, digests = {}, {}
+    for i = 1, 16384 do
+        local nonce = string.format("%012d", i)
+        local plaintext = string.rep(string.char(i % 256), 1024)
+        cipher:setiv(nonce)
+        records[i] = nonce .. cipher:encrypt(plaintext) .. cipher:gettag()
+        digests[i] = gcrypt.hash(gcrypt.MD_SHA256, plaintext)
+    end
+    local set = gcrypt.DigestSet(32, table.concat(digests))
+    local bytes = 16384 * 1024
+
+    report("open+hash+match in Lua", bytes, best_time(function()
+        for i = 1, #records do
+            local record = records[i]
+            cipher:setiv(string.sub(record, 1, 12))
+            local plaintext = cipher:decrypt(string.sub(record, 13, -17))
+            cipher:checktag(string.sub(record, -16))
+            assert(set:contains(gcrypt.hash(gcrypt.MD_SHA256, plaintext)))
+        end
+    end))
+    local pipe = gcrypt.Pipeline{
+        {"decrypt", cipher},
+        {"hash", gcrypt.Hash(gcrypt.MD_SHA256)},
+        {"match", set},
+    }
+    for _, threads in ipairs({1, 4}) do
+        report("Pipeline, " .. threads .. " thread(s)", bytes, best_time(function()
+            pipe:run(records, threads)
+        end))
+    end
+end
+
+function bench_crc32()
+    local data = string.rep("0123456789abcdef", 4 * 1024 * 1024)
+
+    report("gcrypt.Hash(MD_CRC32)", #data, best_time(function()
+        local md = gcrypt.Hash(gcrypt.MD_CRC32)
+        md:write(data)
+        md:read()
+    end))
+    report("gcrypt.crc32", #data, best_time(function()
+        gcrypt.crc32(data, 0, 1)
+    end))
+    report("gcrypt.crc32c", #data, best_time(function()
+        gcrypt.crc32c(data, 0, 1)
+    end))
+    report("gcrypt.crc32, 4 threads", #data, best_time(function()
+        gcrypt.crc32(data, 0, 4)
+    end))
+end
+
+local benchmarks = {
+    {"file hashing (SHA-256)", bench_file_hashing},
+    {"libgcrypt vs AF_ALG", bench_backends},
+    {"record pipeline (AES-128-GCM, SHA-256)", bench_pipeline},
+    {"CRC-32 and CRC-32C", bench_crc32},
+}
+
+for _, bench in ipairs(benchmarks) do
+    print("== " .. bench[1])
+    bench[2]()
+end
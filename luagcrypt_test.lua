@@ -111,6 +111,23 @@ function test_constants()
     end
 
     assert(gcrypt.MD_FLAG_HMAC == 2)
+
+    if check_version("1.6.0") then
+        assert(gcrypt.MAC_HMAC_SHA256 == 101)
+        assert(gcrypt.MAC_HMAC_SHA224 == 102)
+        assert(gcrypt.MAC_HMAC_SHA512 == 103)
+        assert(gcrypt.MAC_HMAC_SHA384 == 104)
+        assert(gcrypt.MAC_HMAC_SHA1 == 105)
+        assert(gcrypt.MAC_HMAC_MD5 == 106)
+        assert(gcrypt.MAC_CMAC_AES == 201)
+        assert(gcrypt.MAC_CMAC_3DES == 202)
+        assert(gcrypt.MAC_CMAC_CAMELLIA == 203)
+        assert(gcrypt.MAC_GMAC_AES == 401)
+        assert(gcrypt.MAC_GMAC_CAMELLIA == 402)
+    end
+    if check_version("1.7.0") then
+        assert(gcrypt.MAC_POLY1305 == 501)
+    end
 end
 
 function test_aes_cbc_128()
@@ -180,6 +197,77 @@ function test_aes_gcm_128()
     assert(cipher:decrypt(ciphertext_spec) == plaintext_spec)
 end
 
+function test_decrypt_lazy()
+    if not check_version("1.6.0") then return end
+    -- GCM test case 4 from test_aes_gcm_128
+    local plaintext = fromhex("d9313225f88406e5a55909c5aff5269a" ..
+                              "86a7a9531534f7da2e4c303d8a318a72" ..
+                              "1c3c0c95956809532fcf0e2449a6b525" ..
+                              "b16aedf5aa0de657ba637b39")
+    local ciphertext = fromhex("42831ec2217774244b7221b784d0d49c" ..
+                               "e3aa212f2c02a4e035c17e2329aca12e" ..
+                               "21d514b25466931c7d8f6a5aac84aa05" ..
+                               "1ba30b396a0aac973d58e091")
+    local adata = fromhex("feedfacedeadbeeffeedfacedeadbeefabaddad2")
+    local atag = fromhex("5bc94fbc3221a5db94fae95ae7121a47")
+    local iv = fromhex("cafebabefacedbaddecaf888")
+    local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM)
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, iv) end,
+    "No gcrypt.Key was set")
+    -- String keys are not retained.
+    cipher:setkey(fromhex("feffe9928665731c6d6a8f9467308308"))
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, iv, adata, atag) end,
+    "No gcrypt.Key was set")
+    cipher:setkey(gcrypt.Key(fromhex("feffe9928665731c6d6a8f9467308308")))
+    local record = cipher:decrypt_lazy(ciphertext, iv, adata, atag)
+    local forged = cipher:decrypt_lazy(ciphertext, iv, "", atag)
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, iv) end,
+    "authenticated modes require a tag")
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, iv, adata, "") end,
+    "authenticated modes require a tag")
+    -- The captured key is used even if the cipher changes or goes away.
+    cipher:setkey(string.rep("\0", 16))
+    cipher = nil
+    collectgarbage()
+    assert(#record == #plaintext and not record:decrypted())
+    assert(record:plaintext() == plaintext and record:decrypted())
+    assert(record:plaintext() == plaintext)
+    assert_throws(function() forged:plaintext() end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert(not forged:decrypted())
+
+    -- CTR records carry their counter, RFC 3686 Test Vector #6.
+    cipher = gcrypt.Cipher(gcrypt.CIPHER_AES192, gcrypt.CIPHER_MODE_CTR)
+    cipher:setkey(gcrypt.Key(
+        fromhex("02bf391ee8ecb159b959617b0965279bf59b60a786d3e0fe")))
+    local second = cipher:decrypt_lazy(fromhex("d288bc95c69165884536c811662f2188"),
+                                       fromhex("0007bdfd5cbd60278dcc091200000002"))
+    assert(second:plaintext() == fromhex("101112131415161718191a1b1c1d1e1f"))
+    assert_throws(function() cipher:decrypt_lazy("x", iv, "aad") end,
+    "CTR mode has no AAD or tag")
+
+    -- CCM needs the tag length up front.
+    local key = fromhex("404142434445464748494a4b4c4d4e4f")
+    local nonce = fromhex("10111213141516")
+    cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CCM)
+    cipher:setkey(gcrypt.Key(key))
+    cipher:setiv(nonce)
+    cipher:set_ccm_lengths(4, 8, 4)
+    cipher:authenticate(fromhex("0001020304050607"))
+    ciphertext = cipher:encrypt(fromhex("20212223"))
+    atag = cipher:gettag()
+    record = cipher:decrypt_lazy(ciphertext, nonce, fromhex("0001020304050607"),
+                                 atag)
+    assert(record:plaintext() == fromhex("20212223"))
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, nonce) end,
+    "authenticated modes require a tag")
+
+    cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CBC)
+    cipher:setkey(key)
+    assert_throws(function() cipher:decrypt_lazy(ciphertext, nonce) end,
+    "Unsupported cipher mode")
+end
+
 function test_hmac_sha256()
     -- RFC 4231 -- 4.2. Test Case 1
     local md = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC)
@@ -203,6 +291,1510 @@ function test_sha256()
                              "b00361a396177a9cb410ff61f20015ad"))
 end
 
+function test_pipeline()
+    if not check_version("1.6.0") then return end
+    local key = fromhex("feffe9928665731c6d6a8f9467308308")
+    local sealer = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM)
+    sealer:setkey(key)
+    local function seal(i, plaintext)
+        local nonce = string.rep("\0", 8) .. string.char(0, 0, 0, i)
+        sealer:setiv(nonce)
+        sealer:authenticate("hdr")
+        local ciphertext = sealer:encrypt(plaintext)
+        return nonce .. ciphertext .. sealer:gettag()
+    end
+    local plaintexts, records, digests = {}, {}, {}
+    for i = 1, 50 do
+        plaintexts[i] = string.rep(string.char(i), i * 7)
+        records[i] = seal(i, plaintexts[i])
+        digests[i] = gcrypt.hash(gcrypt.MD_SHA256, plaintexts[i])
+    end
+    -- Record 3 is tampered with and record 4 is not known.
+    records[3] = string.sub(records[3], 1, 12) .. "X" .. string.sub(records[3], 14)
+    local set = gcrypt.DigestSet(32, table.concat(digests, "", 1, 3) ..
+                                 table.concat(digests, "", 5))
+
+    local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM)
+    cipher:setkey(gcrypt.Key(key))
+    local pipe = gcrypt.Pipeline{
+        {"decrypt", cipher, aad = "hdr"},
+        {"hash", gcrypt.Hash(gcrypt.MD_SHA256)},
+        {"match", set},
+    }
+    for _, threads in ipairs({1, 4}) do
+        local outputs, status = pipe:run(records, threads)
+        assert(#outputs == #records and #status == #records)
+        for i = 1, #records do
+            if i == 3 then
+                assert(outputs[i] == false and status[i] == "Authentication failed")
+            elseif i == 4 then
+                assert(outputs[i] == false and status[i] == "Not in the digest set")
+            else
+                assert(outputs[i] == digests[i] and status[i] == true)
+            end
+        end
+    end
+    local outputs, status = pipe:run({})
+    assert(#outputs == 0 and #status == 0)
+    outputs, status = pipe:run({"short"})
+    assert(status[1] == "Record too short")
+
+    -- Streams are processed in order, HMAC keys are kept by copies and MAC
+    -- keys must be a gcrypt.Key.
+    local md = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC)
+    md:setkey("key")
+    local mac = gcrypt.Mac(gcrypt.MAC_HMAC_SHA256)
+    mac:setkey("key")
+    assert_throws(function()
+        gcrypt.Pipeline{{"verify", mac, tag_len = 16}}:run({"x"})
+    end, "No gcrypt.Key was set")
+    mac:setkey(gcrypt.Key("key"))
+    md:write("abc")
+    local expected = md:read()
+    local next_index, emitted = 0, {}
+    pipe = gcrypt.Pipeline{{"verify", mac, tag_len = 16}, {"hash", md}}
+    local n = pipe:run_stream(function()
+        next_index = next_index + 1
+        if next_index <= 3 then
+            return "abc" .. string.sub(expected, 1, next_index == 2 and 15 or 16) ..
+                   (next_index == 2 and "X" or "")
+        end
+    end, function(output, status)
+        emitted[#emitted + 1] = {output, status}
+    end, 2)
+    assert(n == 3 and #emitted == 3)
+    assert(emitted[1][1] == expected and emitted[1][2] == true)
+    assert(emitted[2][1] == false and emitted[2][2] == "Authentication failed")
+    assert(emitted[3][1] == expected)
+
+    assert_throws(function() gcrypt.Pipeline{} end,
+    "A pipeline needs at least one stage")
+    assert_throws(function() gcrypt.Pipeline{{"hash", cipher}} end,
+    "stage 1 needs a gcrypt.Hash or gcrypt.Mac")
+    assert_throws(function()
+        gcrypt.Pipeline{{"decrypt", gcrypt.Cipher(gcrypt.CIPHER_AES128,
+                                                  gcrypt.CIPHER_MODE_CBC)}}
+    end, "stage 1: unsupported cipher mode")
+    assert_throws(function()
+        gcrypt.Pipeline{{"decrypt", gcrypt.Cipher(gcrypt.CIPHER_AES128,
+                                                  gcrypt.CIPHER_MODE_GCM),
+                         tag_len = 0}}
+    end, "stage 1: invalid iv_len or tag_len")
+    pipe = gcrypt.Pipeline{{"decrypt", gcrypt.Cipher(gcrypt.CIPHER_AES128,
+                                                     gcrypt.CIPHER_MODE_CTR)}}
+    assert_throws(function() pipe:run(records) end, "No gcrypt.Key was set")
+end
+
+function test_kdf_sp800_108()
+    local key = fromhex("000102030405060708090a0b0c0d0e0f")
+    local okm = gcrypt.kdf_sp800_108(gcrypt.MD_SHA256, key, "label", "context", 42)
+    assert(okm == fromhex("46cbcad197c3f1a8366abd1f4756c99f" ..
+                          "2d1cd843e21e00f4d5b80bcde9e4789c" ..
+                          "e25088a99c51c15bfe88"))
+end
+
+function test_key()
+    local raw = fromhex("000102030405060708090a0b0c0d0e0f")
+    local key = gcrypt.Key(raw)
+    assert(#key == 16)
+    assert(key:bytes() == raw)
+    assert(tostring(key) == "gcrypt.Key (16 bytes)")
+    assert(key:sub(5, 8):bytes() == raw:sub(5, 8))
+    assert(key:sub(-4):bytes() == raw:sub(-4))
+    local random_key = gcrypt.Key(32)
+    assert(#random_key == 32 and random_key:bytes() ~= string.rep("\0", 32))
+
+    -- Keys are accepted by setkey
+    local c1 = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_ECB)
+    local c2 = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_ECB)
+    c1:setkey(raw)
+    c2:setkey(key)
+    assert(c1:encrypt(string.rep("x", 16)) == c2:encrypt(string.rep("x", 16)))
+    local m1 = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC)
+    local m2 = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC)
+    m1:setkey(raw)
+    m2:setkey(key)
+    m1:write("data")
+    m2:write("data")
+    assert(m1:read() == m2:read())
+
+    -- KDFs return a Key for a Key input
+    local okm = gcrypt.kdf_sp800_108(gcrypt.MD_SHA256, key, "label", "context", 42)
+    assert(tostring(okm) == "gcrypt.Key (42 bytes)")
+    assert(okm:bytes() == gcrypt.kdf_sp800_108(gcrypt.MD_SHA256, raw,
+                                               "label", "context", 42))
+    assert_throws(function()
+        gcrypt.kdf_sp800_108(gcrypt.MD_SHA256, raw, "label", "context", -1)
+    end, "length must not be negative")
+
+    -- RFC 5869, Test Case 1 and 3
+    okm = gcrypt.hkdf(gcrypt.MD_SHA256, string.rep("\11", 22),
+                      fromhex("000102030405060708090a0b0c"),
+                      fromhex("f0f1f2f3f4f5f6f7f8f9"), 42)
+    assert(okm == fromhex("3cb25f25faacd57a90434f64d0362f2a" ..
+                          "2d2d0a90cf1a5a4c5db02d56ecc4c5bf" ..
+                          "34007208d5b887185865"))
+    okm = gcrypt.hkdf(gcrypt.MD_SHA256, gcrypt.Key(string.rep("\11", 22)),
+                      nil, nil, 42)
+    assert(okm:bytes() == fromhex("8da4e775a563c18f715f802a063c5a31" ..
+                                  "b8a11f5c5ee1879ec3454e5f3c738d2d" ..
+                                  "9d201395faa4b61a96c8"))
+    assert_throws(function()
+        gcrypt.hkdf(gcrypt.MD_SHA256, raw, nil, nil, -1)
+    end, "length must not be negative")
+
+    -- AES key wrap (RFC 3394, 4.1)
+    local kek = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_AESWRAP)
+    kek:setkey(raw)
+    local wrapped = fromhex("1fa68b0a8112b447aef34bd8fb5a7b82" ..
+                            "9d3e862371d2cfe5")
+    local unwrapped = kek:unwrap_key(wrapped)
+    assert(unwrapped:bytes() == fromhex("00112233445566778899aabbccddeeff"))
+    assert(kek:wrap_key(unwrapped) == wrapped)
+
+    -- The cipher references the Key for lazy decryption.
+    if check_version("1.6.0") then
+        local ctr = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CTR)
+        local counter = string.rep("\0", 16)
+        ctr:setkey(key)
+        ctr:setctr(counter)
+        local ciphertext = ctr:encrypt("lazy")
+        local record = ctr:decrypt_lazy(ciphertext, counter)
+        assert(ctr:decrypt_lazy(ciphertext, counter):plaintext() == "lazy")
+        key:wipe()
+        assert_throws(function() record:plaintext() end, "Missing key")
+        assert_throws(function() ctr:decrypt_lazy(ciphertext, counter) end,
+                      "Called into a dead object")
+    end
+
+    key:wipe()
+    assert_throws(function() return #key end, "Called into a dead object")
+    assert_throws(function() c1:setkey(key) end, "Called into a dead object")
+    assert_throws(function() c1:setkey({}) end, "string or gcrypt.Key expected")
+end
+
+-- Encrypts plaintext into a SMB2 TRANSFORM_HEADER message.
+function smb3_encrypt(algo, mode, key, plaintext, nonce)
+    nonce = nonce or fromhex("0102030405060708090a0b0c0d0e0f10")
+    local aad = nonce .. string.char(#plaintext, 0, 0, 0) .. "\0\0\1\0" ..
+        fromhex("1122334455667788")
+    local cipher = gcrypt.Cipher(algo, mode)
+    cipher:setkey(key)
+    if mode == gcrypt.CIPHER_MODE_CCM then
+        cipher:setiv(string.sub(nonce, 1, 11))
+        cipher:set_ccm_lengths(#plaintext, #aad, 16)
+    else
+        cipher:setiv(string.sub(nonce, 1, 12))
+    end
+    cipher:authenticate(aad)
+    local ciphertext = cipher:encrypt(plaintext)
+    return "\253SMB" .. cipher:gettag() .. aad .. ciphertext
+end
+
+function test_smb3_decrypt()
+    if not check_version("1.6.0") then return end
+    local session_key = fromhex("000102030405060708090a0b0c0d0e0f")
+    local plaintext = "\254SMB" .. string.rep("x", 60)
+
+    -- SMB 3.0 uses AES-128-CCM with fixed labels.
+    local smb3 = gcrypt.Smb3Decryptor(session_key, 0x0300)
+    local c2s, s2c = smb3:keys()
+    assert(c2s == fromhex("8e21f3cae16d07d84c03d74467f57878"))
+    assert(s2c == fromhex("95d8b55c852cd25349994b3842fa4105"))
+    local message = smb3_encrypt(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CCM,
+                                 s2c, plaintext)
+    assert(smb3:decrypt(message, true) == plaintext)
+    assert_throws(function() smb3:decrypt(message) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert_throws(function() smb3:decrypt(string.sub(message, 1, 60)) end,
+    "Truncated SMB2 transform message")
+
+    -- SMB 3.1.1 derives keys from the preauth integrity hash.
+    local preauth = string.rep("\42", 64)
+    smb3 = gcrypt.Smb3Decryptor(session_key, 0x0311, 2, preauth)
+    c2s = gcrypt.kdf_sp800_108(gcrypt.MD_SHA256, session_key,
+                               "SMBC2SCipherKey\0", preauth, 16)
+    message = smb3_encrypt(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM,
+                           c2s, plaintext)
+    assert(smb3:decrypt(message) == plaintext)
+end
+
+function test_kerberos_aes_sha2()
+    -- RFC 8009 -- Appendix A. Test Vectors (Sample encryptions)
+    local key = gcrypt.KerberosKey(19, fromhex("3705d96080c17728a0e800eab6e0d23c"))
+    local ciphertext = key:encrypt(2, "",
+        fromhex("7e5895eaf2672435bad817f545a37148"))
+    assert(ciphertext == fromhex("ef85fb890bb8472f4dab20394dca781d" ..
+                                 "ad877eda39d50c870c0d5a0a8e48c718"))
+    assert(key:decrypt(2, ciphertext) == "")
+    ciphertext = fromhex("84d7f30754ed987bab0bf3506beb09cf" ..
+                         "b55402cef7e6877ce99e247e52d16ed4" ..
+                         "421dfdf8976c")
+    assert(key:decrypt(2, ciphertext) == fromhex("000102030405"))
+
+    key = gcrypt.KerberosKey(20, fromhex("6d404d37faf79f9df0d33568d3206698" ..
+                                         "00eb4836472ea8a026d16b7182460c52"))
+    ciphertext = fromhex("41f53fa5bfe7026d91faf9be959195a0" ..
+                         "58707273a96a40f0a01960621ac61274" ..
+                         "8b9bbfbe7eb4ce3c")
+    assert(key:decrypt(2, ciphertext) == "")
+end
+
+function test_kerberos_aes_sha1()
+    -- RFC 3962 -- Appendix B. Sample Test Vectors (string-to-key)
+    local vectors = {
+        {"password", "ATHENA.MIT.EDUraeburn", 1,
+         "42263c6e89f4fc28b8df68ee09799f15",
+         "fe697b52bc0d3ce14432ba036a92e65bbb52280990a2fa27883998d72af30161"},
+        {"password", "ATHENA.MIT.EDUraeburn", 2,
+         "c651bf29e2300ac27fa469d693bdda13",
+         "a2e16d16b36069c135d5e9d2e25f896102685618b95914b467c67622225824ff"},
+        {"password", "ATHENA.MIT.EDUraeburn", 1200,
+         "4c01cd46d632d01e6dbe230a01ed642a",
+         "55a6ac740ad17b4846941051e1e8b0a7548d93b0ab30a8bc3ff16280382b8c2a"},
+        {"password", fromhex("1234567878563412"), 5,
+         "e9b23d52273747dd5c35cb55be619d8e",
+         "97a4e786be20d81a382d5ebc96d5909cabcdadc87ca48f574504159f16c36e31"},
+        {string.rep("X", 64), "pass phrase equals block size", 1200,
+         "59d1bb789a828b1aa54ef9c2883f69ed",
+         "89adee3608db8bc71f1bfbfe459486b05618b70cbae22092534e56c553ba4b34"},
+        {string.rep("X", 65), "pass phrase exceeds block size", 1200,
+         "cb8005dc5f90179a7f02104c0018751d",
+         "d78c5c9cb872a8c9dad4697f0bb5b2d21496c82beb2caeda2112fceea057401b"},
+        {fromhex("f09d849e"), "EXAMPLE.COMpianist", 50,
+         "f149c1f2e154a73452d43e7fe62a56e5",
+         "4b6d9839f84406df1f09cc166db4b83c571848b784a3d6bdc346589a3e393f9e"},
+    }
+    for i, v in ipairs(vectors) do
+        assert(gcrypt.krb5_string_to_key(17, v[1], v[2], v[3]) == fromhex(v[4]), i)
+        assert(gcrypt.krb5_string_to_key(18, v[1], v[2], v[3]) == fromhex(v[5]), i)
+    end
+    local key = gcrypt.krb5_string_to_key(17, gcrypt.Key("password"),
+                                          "ATHENA.MIT.EDUraeburn", 1)
+    assert(tostring(key) == "gcrypt.Key (16 bytes)")
+    assert(key:bytes() == fromhex(vectors[1][4]))
+
+    -- Encryptions with the keys of the first vector (key usage derivation,
+    -- CTS and HMAC-SHA1-96), checked against an independent implementation.
+    local confounder = fromhex("000102030405060708090a0b0c0d0e0f")
+    local plaintext = "RFC 3962 known answer"
+    key = gcrypt.KerberosKey(17, fromhex(vectors[1][4]))
+    local ciphertext = fromhex("04326cc5e837a11c2fce6170dd4b23f7" ..
+                               "385abaee3238cf1914bc5da2448561d2" ..
+                               "ccb1115d95994aa74d278d055a78100a" ..
+                               "f1")
+    assert(key:encrypt(3, plaintext, confounder) == ciphertext)
+    assert(key:decrypt(3, ciphertext) == plaintext)
+    ciphertext = fromhex("7e8ebc774f65b0a38c5b7eb2ad0bc591" ..
+                         "c4e6e582437a4bcb0a580293")
+    assert(key:encrypt(2, "", confounder) == ciphertext)
+    assert(key:decrypt(2, ciphertext) == "")
+    key = gcrypt.KerberosKey(18, fromhex(vectors[1][5]))
+    ciphertext = fromhex("56faa8fd216243d411dea8cb3c925fb5" ..
+                         "fc0b43e196407a1281fffaab07be67e6" ..
+                         "32b5dcd189b8d06c293cc410a200c436" ..
+                         "6b")
+    assert(key:encrypt(3, plaintext, confounder) == ciphertext)
+    assert(key:decrypt(3, ciphertext) == plaintext)
+end
+
+function test_kerberos_rc4()
+    -- RFC 4757 string-to-key, the NT hash of "password"
+    local base = gcrypt.krb5_string_to_key(23, "password")
+    assert(base == fromhex("8846f7eaee8fb117ad06bdd830b7586c"))
+    assert_throws(function() gcrypt.krb5_string_to_key(23, "\192\128") end,
+    "invalid UTF-8")
+    assert_throws(function() gcrypt.krb5_string_to_key(1, "password") end,
+    "unsupported encryption type")
+
+    -- Key usage 3 (Microsoft usage 8), checked against an independent
+    -- implementation.
+    local key = gcrypt.KerberosKey(23, base)
+    local plaintext = "RFC 3962 known answer"
+    local ciphertext = fromhex("efd28a416ab4a7747edb2bd01564675e" ..
+                               "875a246af5b22bffa623e42d03f40fbf" ..
+                               "61c39ff6fab07de5a612d663fc")
+    assert(key:encrypt(3, plaintext, fromhex("0001020304050607")) == ciphertext)
+    assert(key:decrypt(3, ciphertext) == plaintext)
+end
+
+function test_kerberos_roundtrip()
+    local plaintext = "Kerberos ticket enc-part"
+    local keys = {
+        {17, string.rep("k", 16)},
+        {18, string.rep("k", 32)},
+        {23, string.rep("k", 16)},
+    }
+    for i, v in ipairs(keys) do
+        local key = gcrypt.KerberosKey(v[1], v[2])
+        local ciphertext = key:encrypt(3, plaintext)
+        assert(#ciphertext > #plaintext)
+        assert(key:decrypt(3, ciphertext) == plaintext)
+        assert_throws(function() key:decrypt(2, ciphertext) end,
+        "Kerberos checksum verification failed")
+    end
+    assert_throws(function() gcrypt.KerberosKey(1, "") end,
+    "unsupported encryption type")
+    assert_throws(function() gcrypt.KerberosKey(17, "") end,
+    "invalid key length")
+end
+
+function test_aes_cmac()
+    if not check_version("1.6.0") then return end
+    -- RFC 4493 -- 4. Test Vectors (Example 2)
+    local mac = gcrypt.Mac(gcrypt.MAC_CMAC_AES)
+    mac:setkey(fromhex("2b7e151628aed2a6abf7158809cf4f3c"))
+    mac:write(fromhex("6bc1bee22e409f96e93d7e117393172a"))
+    assert(mac:read() == fromhex("070a16b46b4d4144f79bdd9dd04a287c"))
+    mac:verify(fromhex("070a16b46b4d4144f79bdd9dd04a287c"))
+    assert_throws(function() mac:verify(string.rep("\0", 16)) end,
+    "gcry_mac_verify() failed with Checksum error")
+end
+
+function test_ble_sc_functions()
+    if not check_version("1.6.0") then return end
+    -- Bluetooth Core v4.2, Vol 3, Part H, Appendix D -- Sample Data
+    local u = fromhex("20b003d2f297be2c5e2c83a7e9f9a5b9" ..
+                      "eff49111acf4fddbcc0301480e359de6")
+    local v = fromhex("55188b3d32f6bb9a900afcfbeed4e72a" ..
+                      "59cb9ac2f19d7cfb6b4fdd49f47fc5fd")
+    local x = fromhex("d5cb8454d177733effffb2ec712baeab")
+    assert(gcrypt.ble_f4(u, v, x, 0) ==
+           fromhex("f2c916f107a9bd1cf1eda1bea974872d"))
+
+    local w = fromhex("ec0234a357c8ad05341010a60a397d9b" ..
+                      "99796b13b4f866f1868d34f373bfa698")
+    local n1 = fromhex("d5cb8454d177733effffb2ec712baeab")
+    local n2 = fromhex("a6e8e7cc25a75f6e216583f7ff3dc4cf")
+    local a1 = fromhex("0056123737bfce")
+    local a2 = fromhex("00a713702dcfc1")
+    local mackey, ltk = gcrypt.ble_f5(w, n1, n2, a1, a2)
+    assert(mackey == fromhex("2965f176a1084a02fd3f6a20ce636e20"))
+    assert(ltk == fromhex("6986791169d7cd23980522b594750a38"))
+
+    local r = fromhex("12a3343bb453bb5408da42d20c2d0fc8")
+    assert(gcrypt.ble_f6(mackey, n1, n2, r, fromhex("010102"), a1, a2) ==
+           fromhex("e3c473989cd0e8c5d26c0b09da958f61"))
+
+    assert(gcrypt.ble_g2(u, v, x, n2) == 0x2f9ed5ba)
+end
+
+function test_ble_link_decrypt()
+    if not check_version("1.6.0") then return end
+    -- Bluetooth Core v4.2, Vol 6, Part C, 1 -- Encryption Sample Data
+    local link = gcrypt.BleLinkDecryptor(
+        fromhex("4c68384139f574d836bcf34e9dfb01bf"),
+        fromhex("0213243546576879acbdcedfe0f10213"),
+        fromhex("deafbabebadcab24"))
+    assert(link:session_key() == fromhex("99ad1b5226a37e3e058e3b8e27c2c666"))
+    -- LL_START_ENC_RSP (master to slave, then slave to master)
+    assert(link:decrypt(fromhex("0f059fcda7f448"), true) == "\6")
+    assert(link:decrypt(fromhex("0705a34c13a415"), false) == "\6")
+    -- The packet counter was incremented, so a replay does not authenticate.
+    assert_throws(function() link:decrypt(fromhex("0f059fcda7f448"), true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert(link:decrypt(fromhex("0f059fcda7f448"), true, 0) == "\6")
+end
+
+function test_plaintext_cache()
+    local cache = gcrypt.PlaintextCache(1000)
+    local record = string.rep("r", 300)
+    assert(cache:get("s", 0, 1) == nil)
+    cache:put("s", 0, 1, record, "tag1")
+    assert(cache:get("s", 0, 1, "tag1") == record)
+    -- Session, direction, sequence number and check must all match.
+    assert(cache:get("s", 0, 1) == nil)
+    assert(cache:get("s", 0, 1, "tag2") == nil)
+    assert(cache:get("t", 0, 1, "tag1") == nil)
+    assert(cache:get("s", true, 1, "tag1") == nil)
+    assert(cache:get("s", false, 2, "tag1") == nil)
+    local stats = cache:stats()
+    assert(stats.hits == 1 and stats.misses == 6 and stats.entries == 1)
+    assert(stats.bytes > 300 and stats.max_bytes == 1000)
+
+    -- The least recently used records are evicted to stay within budget.
+    cache:put("s", 0, 2, record)
+    cache:put("s", 0, 3, record)
+    assert(cache:get("s", 0, 1, "tag1") == nil)
+    assert(cache:get("s", 0, 2) == record and cache:get("s", 0, 3) == record)
+    assert(cache:stats().bytes <= 1000)
+    cache:put("s", 0, 3, "short")
+    assert(cache:get("s", 0, 3) == "short")
+    cache:put("s", 0, 4, string.rep("x", 1000))
+    assert(cache:get("s", 0, 4) == nil)
+    cache:clear()
+    stats = cache:stats()
+    assert(stats.entries == 0 and stats.bytes == 0)
+    assert(cache:get("s", 0, 2) == nil)
+
+    if not check_version("1.6.0") then return end
+    -- Decryptors consult the cache before decrypting.
+    local session_key = fromhex("000102030405060708090a0b0c0d0e0f")
+    local plaintext = "\254SMB" .. string.rep("x", 60)
+    local smb3 = gcrypt.Smb3Decryptor(session_key, 0x0300)
+    local c2s, s2c = smb3:keys()
+    local message = smb3_encrypt(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CCM,
+                                 s2c, plaintext)
+    smb3:set_cache(cache, "smb")
+    assert(smb3:decrypt(message, true) == plaintext)
+    assert(smb3:decrypt(message, true) == plaintext)
+    assert(cache:stats().hits == stats.hits + 1)
+    assert(cache:stats().entries == 1)
+    -- A changed tag is not served from the cache.
+    local forged = string.sub(message, 1, 4) .. string.rep("\0", 16) ..
+                   string.sub(message, 21)
+    assert_throws(function() smb3:decrypt(forged, true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    -- Nor is a changed ciphertext behind the same header.
+    local altered = string.sub(message, 1, -2) ..
+                    string.char((string.byte(message, -1) + 1) % 256)
+    assert_throws(function() smb3:decrypt(altered, true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert(smb3:decrypt(message, true) == plaintext)
+    smb3:set_cache(nil)
+    assert(smb3:decrypt(message, true) == plaintext)
+    assert(cache:stats().hits == stats.hits + 2)
+
+    local link = gcrypt.BleLinkDecryptor(
+        fromhex("4c68384139f574d836bcf34e9dfb01bf"),
+        fromhex("0213243546576879acbdcedfe0f10213"),
+        fromhex("deafbabebadcab24"))
+    link:set_cache(cache, "ble")
+    assert(link:decrypt(fromhex("0f059fcda7f448"), true) == "\6")
+    assert(cache:get("ble", true, 0, fromhex("0f059fcda7f448")) == "\6")
+    -- A hit still advances the packet counter.
+    local replay = gcrypt.BleLinkDecryptor(
+        fromhex("4c68384139f574d836bcf34e9dfb01bf"),
+        fromhex("0213243546576879acbdcedfe0f10213"),
+        fromhex("deafbabebadcab24"))
+    replay:set_cache(cache, "ble")
+    assert(replay:decrypt(fromhex("0f059fcda7f448"), true) == "\6")
+    assert(cache:stats().hits == stats.hits + 4)
+    assert_throws(function() replay:decrypt(fromhex("0f059fcda7f448"), true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+end
+
+function test_prefetch()
+    if not check_version("1.6.0") then return end
+    local session_key = fromhex("000102030405060708090a0b0c0d0e0f")
+    local preauth = string.rep("\42", 64)
+    local smb3 = gcrypt.Smb3Decryptor(session_key, 0x0311, 2, preauth)
+    local c2s, s2c = smb3:keys()
+    local plaintexts, messages = {}, {}
+    for i = 1, 20 do
+        plaintexts[i] = "\254SMB" .. string.rep(string.char(i), 60 + i)
+        messages[i] = smb3_encrypt(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM,
+            s2c, plaintexts[i], fromhex(string.format("%016x", i)) ..
+            string.rep("\0", 8))
+    end
+    assert_throws(function() gcrypt.prefetch(smb3, messages, true) end,
+    "No plaintext cache set")
+
+    -- Queued messages are found in the cache when they are needed.
+    local cache = gcrypt.PlaintextCache(1000000)
+    smb3:set_cache(cache, "smb")
+    assert(gcrypt.prefetch(smb3, messages, true, 2) == #messages)
+    for i = 1, #messages do
+        assert(smb3:decrypt(messages[i], true) == plaintexts[i])
+    end
+    local stats = cache:stats()
+    assert(stats.hits == #messages and stats.entries == #messages)
+
+    -- Failures are reported when the message is decrypted.
+    local forged = string.sub(messages[1], 1, 4) .. string.rep("\0", 16) ..
+                   string.sub(messages[1], 21)
+    cache:clear()
+    assert(gcrypt.prefetch(smb3, {forged, messages[2]}, true) == 2)
+    assert_throws(function() smb3:decrypt(forged, true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert(smb3:decrypt(messages[2], true) == plaintexts[2])
+    -- A prefetched plaintext is not served for an altered body.
+    local altered = string.sub(messages[3], 1, -2) ..
+                    string.char((string.byte(messages[3], -1) + 1) % 256)
+    assert(gcrypt.prefetch(smb3, {messages[3]}, true) == 1)
+    assert_throws(function() smb3:decrypt(altered, true) end,
+    "gcry_cipher_checktag() failed with Checksum error")
+    assert(smb3:decrypt(messages[3], true) == plaintexts[3])
+
+    -- Speculation stops at the byte budget of the cache.
+    smb3:set_cache(gcrypt.PlaintextCache(300), "smb")
+    assert(gcrypt.prefetch(smb3, messages) == 2)
+end
+
+function test_encoding()
+    local bytes = ""
+    for i = 0, 255 do
+        bytes = bytes .. string.char(i)
+    end
+    -- Cover both the vectorized loop and the tail.
+    for i, len in ipairs({0, 1, 15, 16, 17, 33, 256}) do
+        local s = string.sub(bytes, 1, len)
+        local hex = string.gsub(s, ".", function(c)
+            return string.format("%02x", string.byte(c))
+        end)
+        assert(gcrypt.tohex(s) == hex)
+        assert(gcrypt.fromhex(hex) == s)
+        assert(gcrypt.fromhex(string.upper(hex)) == s)
+        assert(gcrypt.b64decode(gcrypt.b64encode(s)) == s)
+    end
+    -- RFC 4648 -- 10. Test Vectors
+    assert(gcrypt.b64encode("") == "")
+    assert(gcrypt.b64encode("f") == "Zg==")
+    assert(gcrypt.b64encode("fo") == "Zm8=")
+    assert(gcrypt.b64encode("foo") == "Zm9v")
+    assert(gcrypt.b64encode("foobar") == "Zm9vYmFy")
+    assert(gcrypt.b64decode("Zm9vYg==") == "foob")
+    assert(gcrypt.b64decode("Zm9vYmE=") == "fooba")
+    -- Long enough for the vectorized loops.
+    local b64 = "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8gISIjJCUmJygpKissLS4v"
+    assert(gcrypt.b64encode(string.sub(bytes, 1, 48)) == b64)
+    assert(gcrypt.b64decode(b64) == string.sub(bytes, 1, 48))
+    b64 = gcrypt.b64encode(bytes)
+    assert(gcrypt.b64decode(b64) == bytes)
+
+    assert_throws(function() gcrypt.fromhex("abc") end,
+    "Hex string must be a multiple of two")
+    assert_throws(function() gcrypt.fromhex(string.rep("0", 31) .. "g") end,
+    "Invalid chars in hex")
+    -- Every invalid byte is rejected by the vectorized loop and the tail.
+    local valid = "0123456789abcdefABCDEF"
+    for i = 0, 255 do
+        local c = string.char(i)
+        if not string.find(valid, c, 1, true) then
+            for _, pos in ipairs({1, 17, 32, 64}) do
+                local hex = string.rep("0", pos - 1) .. c .. string.rep("0", 64 - pos)
+                assert(not pcall(gcrypt.fromhex, hex), i)
+            end
+        end
+    end
+    assert_throws(function() gcrypt.b64decode("Zm9=vYmE") end,
+    "Invalid base64 string")
+    valid = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+    for i = 0, 255 do
+        local c = string.char(i)
+        if not string.find(valid, c, 1, true) then
+            for _, pos in ipairs({1, 16, 17, 40, 64, 100}) do
+                local s = string.sub(b64, 1, pos - 1) .. c .. string.sub(b64, pos + 1)
+                assert(not pcall(gcrypt.b64decode, s), i)
+            end
+        end
+    end
+end
+
+function test_digest_formats()
+    local md = gcrypt.Hash(gcrypt.MD_SHA256)
+    md:write("abc")
+    local hex = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+    assert(md:read("hex") == hex)
+    assert(md:read(gcrypt.MD_SHA256, "hex") == hex)
+    assert(md:read(nil, "base64") == "ungWv48Bz+pBQUDeXa4iI7ADYaOWF3qctBD/YfIAFa0=")
+    assert(gcrypt.hash(gcrypt.MD_SHA256, "abc") == fromhex(hex))
+    assert(gcrypt.hash(gcrypt.MD_SHA256, "abc", "hex") == hex)
+    assert_throws(function() md:read("octal") end, "invalid option")
+end
+
+function test_buffer()
+    local buf = gcrypt.Buffer(4)
+    assert(buf:len() == 4)
+    assert(buf:tostring() == "\0\0\0\0")
+    buf:write("ab", 1)
+    assert(buf:tostring() == "\0ab\0")
+    assert(buf:tostring(1, 2) == "ab")
+    buf = gcrypt.Buffer("hello")
+    assert(buf:tostring(3) == "lo")
+    assert_throws(function() buf:write("xy", 4) end, "out of buffer bounds")
+    assert_throws(function() buf:tostring(6) end, "out of buffer bounds")
+end
+
+function test_xor()
+    local a = string.rep("\85", 37)
+    local b = string.rep("\255", 37)
+    assert(gcrypt.xor(a, b) == string.rep("\170", 37))
+    assert(gcrypt.xor("", "") == "")
+    assert_throws(function() gcrypt.xor("a", "bc") end,
+    "Arguments must have equal length")
+
+    local out = gcrypt.Buffer(40)
+    assert(gcrypt.xor(a, b, out, 3) == out)
+    assert(out:tostring(3, 37) == string.rep("\170", 37))
+
+    -- Header protection style mask at an offset
+    local buf = gcrypt.Buffer("0123456789")
+    gcrypt.xor_into(buf, "\1\1\1", 2)
+    assert(buf:tostring() == "0132556789")
+    assert_throws(function() gcrypt.xor_into(buf, "\1\1", 9) end,
+    "out of buffer bounds")
+
+    -- A Buffer may be both an input and the output
+    buf = gcrypt.Buffer(a)
+    assert(gcrypt.xor(buf, b, buf) == buf)
+    assert(buf:tostring() == string.rep("\170", 37))
+    gcrypt.xor_into(buf, buf)
+    assert(buf:tostring() == string.rep("\0", 37))
+    assert_throws(function() gcrypt.xor(buf, buf, buf, 1) end,
+    "out of buffer bounds")
+end
+
+function test_equal()
+    local a = string.rep("x", 33)
+    assert(gcrypt.equal(a, a))
+    assert(gcrypt.equal("", ""))
+    assert(not gcrypt.equal(a, string.rep("x", 32) .. "y"))
+    assert(not gcrypt.equal("y" .. string.rep("x", 32), a))
+    assert(not gcrypt.equal(a, "x"))
+    assert(gcrypt.equal(gcrypt.Buffer(a), a))
+end
+
+function test_crc32()
+    assert(gcrypt.crc32("") == 0)
+    assert(gcrypt.crc32("123456789") == 0xcbf43926)
+    assert(gcrypt.crc32c("123456789") == 0xe3069283)
+    -- RFC 3720, B.4
+    assert(gcrypt.crc32c(string.rep("\0", 32)) == 0x8a9136aa)
+    assert(gcrypt.crc32c(string.rep("\255", 32)) == 0x62a8ab43)
+
+    local data = {}
+    for i = 1, 3000 do
+        data[i] = string.char((i * 7) % 256)
+    end
+    data = table.concat(data)
+    local md = gcrypt.Hash(gcrypt.MD_CRC32)
+    md:write(data)
+    assert(gcrypt.crc32(data) == tonumber(gcrypt.tohex(md:read()), 16))
+    assert(gcrypt.crc32(gcrypt.Buffer(data)) == gcrypt.crc32(data))
+    for _, split in ipairs({0, 1, 100, 2999, 3000}) do
+        local a, b = string.sub(data, 1, split), string.sub(data, split + 1)
+        for _, crc in ipairs({gcrypt.crc32, gcrypt.crc32c}) do
+            assert(crc(b, crc(a)) == crc(data))
+        end
+        assert(gcrypt.crc32_combine(gcrypt.crc32(a), gcrypt.crc32(b), #b) ==
+               gcrypt.crc32(data))
+        assert(gcrypt.crc32c_combine(gcrypt.crc32c(a), gcrypt.crc32c(b), #b) ==
+               gcrypt.crc32c(data))
+    end
+
+    -- Large data is checksummed in parallel
+    local big = string.rep(data, 400)
+    assert(gcrypt.crc32(big, 0, 4) == gcrypt.crc32(big, 0, 1))
+    assert(gcrypt.crc32c(big, 5, 3) == gcrypt.crc32c(big, 5, 1))
+end
+
+-- Returns the concatenated digests of every piece_size bytes of data.
+function expected_pieces(algo, data, piece_size)
+    local digests = {}
+    for i = 1, #data, piece_size do
+        digests[#digests + 1] = gcrypt.hash(algo, string.sub(data, i, i + piece_size - 1))
+    end
+    return table.concat(digests)
+end
+
+function test_hash_pieces()
+    local data = string.rep("0123456789abcdef", 1000) .. "tail"
+    local expected = expected_pieces(gcrypt.MD_SHA1, data, 1000)
+    assert(#expected == 17 * 20)
+
+    local path = os.tmpname()
+    local f = io.open(path, "wb")
+    f:write(data)
+    f:close()
+
+    for threads = 1, 3 do
+        assert(gcrypt.hash_pieces(gcrypt.MD_SHA1, path, 1000, threads) == expected)
+        assert(gcrypt.hash_pieces(gcrypt.MD_SHA1, gcrypt.Buffer(data), 1000,
+                                  threads) == expected)
+    end
+    -- Continues from the current position of an io handle.
+    f = io.open(path, "rb")
+    f:read(16000)
+    assert(gcrypt.hash_pieces(gcrypt.MD_SHA1, f, 1000) ==
+           gcrypt.hash(gcrypt.MD_SHA1, "tail"))
+    f:close()
+    os.remove(path)
+
+    assert(gcrypt.hash_pieces(gcrypt.MD_SHA1, gcrypt.Buffer(""), 1000) == "")
+    assert_throws(function() gcrypt.hash_pieces(gcrypt.MD_SHA1, path, 1000) end,
+    path)
+    assert_throws(function() gcrypt.hash_pieces(gcrypt.MD_SHA1, f, 1000) end,
+    "attempt to use a closed file")
+end
+
+-- Decodes a 64-bit big-endian number.
+function be64(s, pos)
+    local v = 0
+    for i = pos, pos + 7 do
+        v = v * 256 + string.byte(s, i)
+    end
+    return v
+end
+
+-- Returns pseudo-random test data of n * 32 bytes.
+function random_data(n)
+    local parts = {}
+    for i = 1, n do
+        parts[i] = gcrypt.hash(gcrypt.MD_SHA256, tostring(i))
+    end
+    return table.concat(parts)
+end
+
+function test_cdc()
+    local data = random_data(10000)
+    local options = {min = 1024, avg = 4096, max = 16384, algo = gcrypt.MD_SHA1}
+    local offsets, lengths, digests = gcrypt.cdc(gcrypt.Buffer(data), options)
+    local count = #offsets / 8
+    assert(#lengths == #offsets and #digests == count * 20)
+    assert(count > 20)
+    local expected_offset = 0
+    for i = 1, count do
+        local offset, len = be64(offsets, 8 * i - 7), be64(lengths, 8 * i - 7)
+        assert(offset == expected_offset)
+        assert(len <= 16384 and (len >= 1024 or i == count))
+        assert(string.sub(digests, 20 * i - 19, 20 * i) ==
+               gcrypt.hash(gcrypt.MD_SHA1, string.sub(data, offset + 1, offset + len)))
+        expected_offset = offset + len
+    end
+    assert(expected_offset == #data)
+
+    local path = os.tmpname()
+    local f = io.open(path, "wb")
+    f:write(data)
+    f:close()
+    options.threads = 3
+    local offsets2, lengths2, digests2 = gcrypt.cdc(path, options)
+    os.remove(path)
+    assert(offsets2 == offsets and lengths2 == lengths and digests2 == digests)
+
+    -- Boundaries resynchronize after an insertion.
+    local _, _, shifted = gcrypt.cdc(gcrypt.Buffer("x" .. data), options)
+    assert(string.sub(shifted, -100) == string.sub(digests, -100))
+
+    assert_throws(function() gcrypt.cdc(gcrypt.Buffer(data), {min = 1}) end,
+    "invalid chunk sizes")
+end
+
+-- Computes the RFC 6962 Merkle tree hash of a list of leaf hashes.
+function merkle_tree_hash(algo, leaves, first, last)
+    if first == last then
+        return leaves[first]
+    end
+    local k = 1
+    while k * 2 < last - first + 1 do
+        k = k * 2
+    end
+    return gcrypt.hash(algo, "\1" ..
+                       merkle_tree_hash(algo, leaves, first, first + k - 1) ..
+                       merkle_tree_hash(algo, leaves, first + k, last))
+end
+
+function test_merkle_root()
+    local data = random_data(1000) .. "tail"
+    local leaves = {}
+    for i = 1, #data, 1000 do
+        leaves[#leaves + 1] = gcrypt.hash(gcrypt.MD_SHA256,
+                                          "\0" .. string.sub(data, i, i + 999))
+    end
+    assert(#leaves == 33)
+    local expected = merkle_tree_hash(gcrypt.MD_SHA256, leaves, 1, #leaves)
+
+    local path = os.tmpname()
+    local f = io.open(path, "wb")
+    f:write(data)
+    f:close()
+    for threads = 1, 4 do
+        assert(gcrypt.merkle_root(gcrypt.MD_SHA256, path, 1000, threads) ==
+               expected)
+    end
+    os.remove(path)
+
+    local root, levels = gcrypt.merkle_root(gcrypt.MD_SHA256,
+                                            gcrypt.Buffer(data), 1000, 3, true)
+    assert(root == expected)
+    assert(#levels == 7)
+    assert(levels[1] == table.concat(leaves))
+    assert(#levels[2] == 17 * 32)
+    assert(levels[2]:sub(1, 32) ==
+           gcrypt.hash(gcrypt.MD_SHA256, "\1" .. leaves[1] .. leaves[2]))
+    assert(levels[2]:sub(-32) == leaves[33])
+    assert(levels[7] == expected)
+
+    -- A single leaf is the root, the empty tree hashes an empty string.
+    assert(gcrypt.merkle_root(gcrypt.MD_SHA256, gcrypt.Buffer("x"), 1000) ==
+           gcrypt.hash(gcrypt.MD_SHA256, "\0x"))
+    root, levels = gcrypt.merkle_root(gcrypt.MD_SHA256, gcrypt.Buffer(""), 1000,
+                                      1, true)
+    assert(root == gcrypt.hash(gcrypt.MD_SHA256, ""))
+    assert(#levels == 2 and levels[1] == "" and levels[2] == root)
+end
+
+-- RFC 6962 PATH(m, D[first:last]) over a list of leaf hashes.
+function merkle_path(algo, leaves, m, first, last)
+    if first == last then
+        return ""
+    end
+    local k = 1
+    while k * 2 < last - first + 1 do
+        k = k * 2
+    end
+    if m < k then
+        return merkle_path(algo, leaves, m, first, first + k - 1) ..
+               merkle_tree_hash(algo, leaves, first + k, last)
+    end
+    return merkle_path(algo, leaves, m - k, first + k, last) ..
+           merkle_tree_hash(algo, leaves, first, first + k - 1)
+end
+
+-- RFC 6962 SUBPROOF(m, D[first:last], complete).
+function merkle_subproof(algo, leaves, m, first, last, complete)
+    local n = last - first + 1
+    if m == n then
+        return complete and "" or merkle_tree_hash(algo, leaves, first, last)
+    end
+    local k = 1
+    while k * 2 < n do
+        k = k * 2
+    end
+    if m <= k then
+        return merkle_subproof(algo, leaves, m, first, first + k - 1, complete) ..
+               merkle_tree_hash(algo, leaves, first + k, last)
+    end
+    return merkle_subproof(algo, leaves, m - k, first + k, last, false) ..
+           merkle_tree_hash(algo, leaves, first, first + k - 1)
+end
+
+function test_merkle_log()
+    local algo = gcrypt.MD_SHA256
+    -- Test data from the Certificate Transparency reference implementation.
+    local inputs = {"", "00", "10", "2021", "3031", "40414243",
+                    "5051525354555657", "606162636465666768696a6b6c6d6e6f"}
+    local log = gcrypt.MerkleLog(algo)
+    assert(#log == 0)
+    assert(log:root() == gcrypt.hash(algo, ""))
+    for i, input in ipairs(inputs) do
+        assert(log:append(gcrypt.fromhex(input)) == i - 1)
+    end
+    assert(gcrypt.tohex(log:root()) ==
+           "5dc9da79a70659a9ad559cb701ded9a2ab9d823aad2f4960cfe370eff4604328")
+
+    local leaves = {}
+    for i = 1, 21 do
+        leaves[i] = gcrypt.hash(algo, "\0" .. i)
+        if i > #inputs then
+            log:append(tostring(i))
+        end
+    end
+    for i = 1, #inputs do
+        leaves[i] = log:leaf(i - 1)
+    end
+    assert(#log == 21)
+    for n = 1, #log do
+        assert(log:root(n) == merkle_tree_hash(algo, leaves, 1, n))
+        for m = 1, n do
+            assert(log:inclusion_proof(m - 1, n) ==
+                   merkle_path(algo, leaves, m - 1, 1, n))
+            assert(log:consistency_proof(m, n) ==
+                   merkle_subproof(algo, leaves, m, 1, n, true))
+        end
+    end
+    assert(#log:inclusion_proof(0) == 5 * 32)
+    assert(#log:inclusion_proof(20) == 2 * 32)
+    assert(log:consistency_proof(21) == "")
+    assert_throws(function() log:inclusion_proof(21) end, "out of range")
+    assert_throws(function() log:consistency_proof(0) end, "out of range")
+    assert_throws(function() log:root(22) end, "out of range")
+
+    -- File-backed logs are reopened at their last size.
+    local path = os.tmpname()
+    os.remove(path)
+    log = gcrypt.MerkleLog(algo, path)
+    for i = 1, 100 do
+        log:append(tostring(i))
+    end
+    local root = log:root()
+    log:sync()
+    log = nil
+    collectgarbage()
+    log = gcrypt.MerkleLog(algo, path)
+    assert(#log == 100 and log:root() == root)
+    log:append("101")
+    assert(log:consistency_proof(100) ==
+           gcrypt.MerkleLog(algo, path):consistency_proof(100))
+    assert_throws(function() gcrypt.MerkleLog(gcrypt.MD_SHA1, path) end,
+    "different hash algorithm")
+    log = nil
+    collectgarbage()
+    os.remove(path)
+end
+
+-- Writes s to a new temporary file and returns its name.
+function write_temp(s)
+    local path = os.tmpname()
+    local f = io.open(path, "wb")
+    f:write(s)
+    f:close()
+    return path
+end
+
+function test_verified_reader()
+    local algo = gcrypt.MD_SHA256
+    local data = random_data(700) .. "tail"
+    local path = write_temp(data)
+    local tree_path = os.tmpname()
+    local root = gcrypt.merkle_root(algo, path, 1024, 2, tree_path)
+    assert(root == gcrypt.merkle_root(algo, path, 1024))
+
+    local reader = gcrypt.VerifiedReader(path, tree_path, root,
+                                         {cache_blocks = 2, cache_nodes = 8})
+    assert(reader:size() == #data)
+    for _, r in ipairs({{0, 10}, {1000, 100}, {5000, 12000}, {22390, 100},
+                        {0, #data}, {22404, 1}, {30000, 1}, {1024, 0}}) do
+        assert(reader:read(r[1], r[2]) == string.sub(data, r[1] + 1, r[1] + r[2]))
+    end
+
+    -- Corrupted blocks fail verification, other blocks remain readable.
+    local bad = data:sub(1, 3000) .. "X" .. data:sub(3002)
+    local f = io.open(path, "wb")
+    f:write(bad)
+    f:close()
+    reader = gcrypt.VerifiedReader(path, tree_path, root)
+    assert(reader:read(0, 2048) == data:sub(1, 2048))
+    assert_throws(function() reader:read(3000, 1) end, "verification failed")
+    assert(reader:read(4096, 100) == data:sub(4097, 4196))
+    reader = gcrypt.VerifiedReader(path, tree_path, gcrypt.hash(algo, "x"))
+    assert_throws(function() reader:read(0, 1) end, "verification failed")
+    assert_throws(function()
+        gcrypt.VerifiedReader(path, tree_path, root, {algo = gcrypt.MD_SHA1})
+    end, "different hash algorithm")
+    assert_throws(function() gcrypt.VerifiedReader(path, path, root) end,
+    "Invalid hash tree")
+    os.remove(path)
+    os.remove(tree_path)
+end
+
+function test_hash_files()
+    local algo = gcrypt.MD_SHA256
+    local contents = {"", "small", random_data(3000), random_data(40000)}
+    local paths = {}
+    for i, s in ipairs(contents) do
+        paths[i] = write_temp(s)
+    end
+    local missing = os.tmpname()
+    os.remove(missing)
+    table.insert(paths, 3, missing)
+    table.insert(contents, 3, false)
+
+    for threads = 1, 3 do
+        local digests, errors = gcrypt.hash_files(algo, paths, threads)
+        assert(#digests == #paths)
+        for i, s in ipairs(contents) do
+            assert(digests[i] == (s and gcrypt.hash(algo, s)))
+        end
+        assert(errors[3]:find(missing, 1, true) == 1)
+        assert(errors[1] == nil and errors[4] == nil)
+    end
+    table.remove(paths, 3)
+    local digests, errors = gcrypt.hash_files(algo, paths)
+    assert(errors == nil and #digests == 4)
+    assert(#gcrypt.hash_files(algo, {}) == 0)
+    assert_throws(function() gcrypt.hash_files(algo, {1}) end,
+    "paths must be strings")
+    for _, path in ipairs(paths) do
+        os.remove(path)
+    end
+end
+
+function test_digest_cache()
+    if not gcrypt.DigestCache then
+        return
+    end
+    local algo = gcrypt.MD_SHA256
+    local cache_path = os.tmpname()
+    local paths = {}
+    for i = 1, 8 do
+        paths[i] = write_temp("file " .. i)
+    end
+    -- Files modified in the last seconds are not cached.
+    local cache = gcrypt.DigestCache(cache_path)
+    assert(gcrypt.hash_file(algo, paths[1], cache) == gcrypt.hash(algo, "file 1"))
+    assert(cache:stats().stores == 0)
+    assert(os.execute("touch -t 202001010000 " .. table.concat(paths, " ")))
+
+    local digests = gcrypt.hash_files(algo, paths, 2, cache)
+    local stats = cache:stats()
+    assert(stats.hits == 0 and stats.stores == 8 and stats.entries == 8)
+    assert(stats.slots == 1024)
+    cache:sync()
+    cache = nil
+    collectgarbage()
+
+    -- A changed file (size or mtime) is hashed again.
+    local f = io.open(paths[2], "wb")
+    f:write("changed")
+    f:close()
+    cache = gcrypt.DigestCache(cache_path)
+    local digests2 = gcrypt.hash_files(algo, paths, 3, cache)
+    stats = cache:stats()
+    assert(stats.hits == 7 and stats.misses == 1 and stats.stores == 0)
+    assert(digests2[1] == digests[1] and digests2[3] == digests[3])
+    assert(digests2[2] == gcrypt.hash(algo, "changed"))
+    assert(gcrypt.hash_file(gcrypt.MD_SHA1, paths[1], cache) ==
+           gcrypt.hash(gcrypt.MD_SHA1, "file 1"))
+    assert(cache:stats().misses == 2)
+
+    -- A new version of a file replaces its entry.
+    assert(os.execute("touch -t 202101010000 " .. paths[2]))
+    local entries = cache:stats().entries
+    assert(gcrypt.hash_file(algo, paths[2], cache) == digests2[2])
+    assert(gcrypt.hash_file(algo, paths[2], cache) == digests2[2])
+    stats = cache:stats()
+    assert(stats.entries == entries and stats.stores == 2 and stats.hits == 8)
+
+    cache:clear()
+    assert(cache:stats().entries == 0)
+    assert(gcrypt.hash_file(algo, paths[1], cache) == digests[1])
+    assert(cache:stats().misses == 4)
+    cache = nil
+    collectgarbage()
+
+    -- A bounded cache evicts entries to stay within max_entries.
+    os.remove(cache_path)
+    cache = gcrypt.DigestCache(cache_path, 3)
+    gcrypt.hash_files(algo, paths, 2, cache)
+    stats = cache:stats()
+    assert(stats.entries == 3 and stats.evictions == 5 and stats.stores == 8)
+    digests2 = gcrypt.hash_files(algo, paths, 2, cache)
+    stats = cache:stats()
+    assert(stats.hits + stats.misses == 16 and stats.stores == stats.misses)
+    assert(stats.entries == 3)
+    for i = 1, #paths do
+        assert(i == 2 or digests2[i] == digests[i])
+    end
+    if math.type then
+        assert(math.type(stats.stores) == "integer")
+    end
+    assert_throws(function() gcrypt.hash_file(algo, cache_path .. ".none") end,
+    "No such file")
+    assert_throws(function() gcrypt.DigestCache(paths[1]) end,
+    "Invalid digest cache")
+    cache = nil
+    collectgarbage()
+    for _, path in ipairs(paths) do
+        os.remove(path)
+    end
+    os.remove(cache_path)
+end
+
+function test_io_engine()
+    local algo = gcrypt.MD_SHA256
+    assert(gcrypt.io_engine() == "auto")
+    local contents = {"", "small", random_data(2049), random_data(33000),
+                      random_data(100000) .. "x"}
+    local paths, expected = {}, {}
+    for i, s in ipairs(contents) do
+        paths[i] = write_temp(s)
+        expected[i] = gcrypt.hash(algo, s)
+    end
+    local engines = {"read", "mmap", "io_uring"}
+    local ok, _, _, usable = pcall(gcrypt.io_engine, "io_uring")
+    if not ok then
+        print("Skipping io_uring engine, not built with io_uring support")
+        engines[3] = nil
+    elseif not usable then
+        -- The read loop would be tested twice.
+        print("Skipping io_uring engine, io_uring is unavailable")
+        engines[3] = nil
+    end
+    for _, engine in ipairs(engines) do
+        for _, depth in ipairs({1, 3, 16}) do
+            local name, queue_depth
+            name, queue_depth, usable = gcrypt.io_engine(engine, depth)
+            assert(name == engine and queue_depth == depth and usable)
+            local digests = gcrypt.hash_files(algo, paths, 2)
+            for i = 1, #paths do
+                assert(digests[i] == expected[i])
+                assert(gcrypt.hash_file(algo, paths[i]) == expected[i])
+            end
+        end
+    end
+    assert_throws(function() gcrypt.io_engine("read", 0) end,
+    "queue depth out of range")
+    assert_throws(function() gcrypt.io_engine("aio") end, "invalid option")
+    assert(gcrypt.io_engine("auto", 8) == "auto")
+    for _, path in ipairs(paths) do
+        os.remove(path)
+    end
+end
+
+-- Returns the contents of the file at path.
+function read_file(path)
+    local f = io.open(path, "rb")
+    local s = f:read("*a")
+    f:close()
+    return s
+end
+
+function test_backends()
+    local data = random_data(70000) .. "tail"
+    local in_path, out_path = write_temp(data), os.tmpname()
+    local key = string.rep("k", 16)
+    local backends = {"libgcrypt", "af_alg"}
+    if not pcall(gcrypt.Hash, gcrypt.MD_SHA256, 0, "af_alg") then
+        -- AF_ALG is not available on this system.
+        backends[2] = nil
+    end
+    for _, backend in ipairs(backends) do
+        local md = gcrypt.Hash(gcrypt.MD_SHA256, 0, backend)
+        md:write(data)
+        assert(md:read() == gcrypt.hash(gcrypt.MD_SHA256, data))
+        md:reset()
+        md:write_file(in_path)
+        assert(md:read() == gcrypt.hash(gcrypt.MD_SHA256, data))
+
+        local mac = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC, backend)
+        mac:setkey(key)
+        mac:write("Hi There")
+        local ref = gcrypt.Hash(gcrypt.MD_SHA256, gcrypt.MD_FLAG_HMAC)
+        ref:setkey(key)
+        ref:write("Hi There")
+        assert(mac:read() == ref:read())
+
+        for _, mode in ipairs({gcrypt.CIPHER_MODE_CBC, gcrypt.CIPHER_MODE_CTR}) do
+            local n = mode == gcrypt.CIPHER_MODE_CBC and 65536 + 48 or #data
+            local plaintext = data:sub(1, n)
+            local ref = gcrypt.Cipher(gcrypt.CIPHER_AES128, mode)
+            ref:setkey(key)
+            ref:setiv(string.rep("\0", 16))
+            ref:setctr(string.rep("\0", 16))
+            local expected = ref:encrypt(plaintext)
+            local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, mode, 0, backend)
+            cipher:setkey(key)
+            if mode == gcrypt.CIPHER_MODE_CTR then
+                cipher:setctr(string.rep("\0", 16))
+                -- Split at an odd offset to carry over the keystream.
+                local ciphertext = cipher:encrypt(plaintext:sub(1, 5)) ..
+                                   cipher:encrypt(plaintext:sub(6))
+                assert(ciphertext == expected)
+                cipher:setctr(string.rep("\0", 16))
+            else
+                cipher:setiv(string.rep("\0", 16))
+                assert(cipher:encrypt(plaintext) == expected)
+                cipher:setiv(string.rep("\0", 16))
+            end
+            local f = io.open(in_path, "wb")
+            f:write(plaintext)
+            f:close()
+            cipher:encrypt_file(in_path, out_path)
+            assert(read_file(out_path) == expected)
+            cipher:reset()
+            cipher:decrypt_file(out_path, in_path)
+            assert(read_file(in_path) == plaintext)
+        end
+    end
+    assert_throws(function() gcrypt.Hash(gcrypt.MD_SHA256, 0, "openssl") end,
+    "invalid option")
+    os.remove(in_path)
+    os.remove(out_path)
+end
+
+function test_decrypting_reader()
+    local key = string.rep("k", 32)
+    local data = random_data(150) .. "tail"
+    local header = "HEADER"
+    local function check(reader)
+        assert(reader:size() == #data)
+        for _, r in ipairs({{0, 1}, {0, #data}, {511, 2}, {1000, 3000},
+                            {#data - 4, 100}, {#data, 1}, {7, 0}}) do
+            assert(reader:read(r[1], r[2]) == data:sub(r[1] + 1, r[1] + r[2]))
+        end
+    end
+
+    -- CTR encrypts the data as a single stream from the start counter.
+    local iv = string.rep("\0", 15) .. "\254"
+    local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES256, gcrypt.CIPHER_MODE_CTR)
+    cipher:setkey(key)
+    cipher:setctr(iv)
+    local path = write_temp(header .. cipher:encrypt(data))
+    check(gcrypt.DecryptingReader(path, cipher, {iv = iv, sector_size = 64,
+                                                 data_offset = #header}))
+    check(gcrypt.DecryptingReader(path, cipher, {
+        mode = "ctr", data_offset = #header, cache_sectors = 0,
+        iv_fn = function(sector)
+            -- 4096-byte sectors advance the counter by 256 blocks.
+            return string.rep("\0", 14) .. string.char(sector, 254)
+        end}))
+    assert_throws(function()
+        gcrypt.DecryptingReader(path, cipher, {mode = "xts"})
+    end, "does not match")
+    assert_throws(function()
+        gcrypt.DecryptingReader(path, cipher, {sector_size = 100})
+    end, "multiple of 16")
+    os.remove(path)
+
+    if not gcrypt.CIPHER_MODE_XTS then return end
+    -- XTS sectors are encrypted with the little-endian sector number tweak.
+    cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_XTS)
+    cipher:setkey(key)
+    local sectors = {}
+    for i = 0, math.ceil(#data / 512) - 1 do
+        cipher:setiv(string.char(i) .. string.rep("\0", 15))
+        sectors[#sectors + 1] = cipher:encrypt(data:sub(i * 512 + 1,
+                                                        i * 512 + 512))
+    end
+    path = write_temp(table.concat(sectors))
+    local reader = gcrypt.DecryptingReader(path, cipher, {cache_sectors = 2})
+    check(reader)
+    check(reader)
+    os.remove(path)
+end
+
+function test_open_encrypted()
+    local key, iv = string.rep("k", 16), string.rep("i", 12)
+    local path = os.tmpname()
+    local lines = {"first", "", "third line", string.rep("long ", 70000)}
+    local text = table.concat(lines, "\n") .. "\nlast"
+
+    local cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_CTR)
+    cipher:setkey(key)
+    cipher:setctr(string.rep("\0", 16))
+    local f = gcrypt.open_encrypted(path, "w", cipher)
+    assert(f:write(text:sub(1, 3), text:sub(4, 300000)) == f)
+    f:write(text:sub(300001))
+    assert(f:close())
+    assert_throws(function() f:write("x") end, "closed file")
+    cipher:setctr(string.rep("\0", 16))
+    local expected = cipher:encrypt(text)
+    assert(read_file(path) == expected)
+
+    cipher:setctr(string.rep("\0", 16))
+    f = gcrypt.open_encrypted(path, "r", cipher)
+    local a, b, rest = f:read("l", 2, "*a")
+    assert(a == "first" and b == "\nt" and rest == text:sub(9))
+    assert(f:read(0) == nil and f:read("a") == "" and f:read() == nil)
+    f:close()
+
+    if not check_version("1.6.0") then return end
+    cipher = gcrypt.Cipher(gcrypt.CIPHER_AES128, gcrypt.CIPHER_MODE_GCM)
+    cipher:setkey(key)
+    cipher:setiv(iv)
+    f = gcrypt.open_encrypted(path, "w", cipher)
+    f:write(text)
+    f:close()
+    cipher:setiv(iv)
+    local ciphertext = cipher:encrypt(text)
+    local tag = cipher:gettag()
+    assert(read_file(path) == ciphertext .. tag)
+
+    cipher:setiv(iv)
+    f = gcrypt.open_encrypted(path, "r", cipher)
+    local i = 0
+    for line in f:lines() do
+        i = i + 1
+        assert(line == (lines[i] or "last"))
+    end
+    assert(i == #lines + 1)
+    f:close()
+
+    -- The tag is checked before any data is returned.
+    local tampered = {
+        ciphertext .. string.rep("\0", 16),
+        string.char((ciphertext:byte(1) + 1) % 256) .. ciphertext:sub(2) .. tag,
+        tag,                            -- truncated to the tag
+        string.rep("\0", 16),
+    }
+    for _, data in ipairs(tampered) do
+        local fp = io.open(path, "wb")
+        fp:write(data)
+        fp:close()
+        cipher:setiv(iv)
+        f = gcrypt.open_encrypted(path, "r", cipher)
+        assert_throws(function() f:read(1000) end, "Authentication tag mismatch")
+        assert_throws(function() f:lines()() end, "Authentication tag mismatch")
+        f:close()
+    end
+
+    -- An empty file still has a valid tag.
+    cipher:setiv(iv)
+    f = gcrypt.open_encrypted(path, "w", cipher)
+    f:close()
+    cipher:setiv(iv)
+    f = gcrypt.open_encrypted(path, "r", cipher)
+    assert(f:read("a") == "" and f:read() == nil)
+    f:close()
+    os.remove(path)
+end
+
+-- Seals data as specified in README.md with a fixed nonce prefix.
+function seal_reference(algo, key, prefix, chunk_size, data)
+    local header = "GCRYSEAL" .. string.char(0, 0, 0, algo) ..
+        string.char(0, math.floor(chunk_size / 65536) % 256,
+                    math.floor(chunk_size / 256) % 256, chunk_size % 256) ..
+        prefix .. string.rep("\0", 9)
+    local parts = {header}
+    local chunks = math.max(1, math.ceil(#data / chunk_size))
+    local cipher = gcrypt.Cipher(algo, gcrypt.CIPHER_MODE_GCM)
+    cipher:setkey(key)
+    for i = 0, chunks - 1 do
+        cipher:setiv(prefix .. string.char(0, 0, math.floor(i / 256), i % 256,
+                                           i == chunks - 1 and 1 or 0))
+        cipher:authenticate(header)
+        parts[#parts + 1] = cipher:encrypt(data:sub(i * chunk_size + 1,
+                                                    (i + 1) * chunk_size))
+        parts[#parts + 1] = cipher:gettag()
+    end
+    return table.concat(parts)
+end
+
+function test_seal_file()
+    if not check_version("1.6.0") then return end
+    local algo, key = gcrypt.CIPHER_AES128, string.rep("k", 16)
+    local prefix = "nonce07"
+    local in_path, sealed_path, out_path = os.tmpname(), os.tmpname(),
+        os.tmpname()
+
+    -- Test vector: "abc" in chunks of 2 bytes.
+    local f = io.open(in_path, "wb")
+    f:write("abc")
+    f:close()
+    gcrypt.seal_file(algo, key, in_path, sealed_path,
+                     {chunk_size = 2, nonce_prefix = prefix})
+    assert(gcrypt.tohex(read_file(sealed_path)) ==
+        "474352595345414c0000000700000002" ..
+        "6e6f6e63653037000000000000000000" ..
+        "1771cb9b025373980215026498552d21" ..
+        "66be340ccaf2d5b2a0503c0821693885" ..
+        "be2550")
+
+    for _, n in ipairs({0, 1, 63, 64, 65, 64 * 9 + 5}) do
+        local data = random_data(n):sub(1, n * 3)
+        f = io.open(in_path, "wb")
+        f:write(data)
+        f:close()
+        for _, threads in ipairs({1, 4}) do
+            gcrypt.seal_file(algo, key, in_path, sealed_path,
+                             {chunk_size = 96, nonce_prefix = prefix,
+                              threads = threads})
+            assert(read_file(sealed_path) ==
+                   seal_reference(algo, key, prefix, 96, data))
+            gcrypt.open_file(key, sealed_path, out_path, {threads = threads})
+            assert(read_file(out_path) == data)
+        end
+        local reader = gcrypt.SealedReader(sealed_path, key,
+                                           {cache_chunks = 2})
+        assert(reader:size() == #data)
+        for _, r in ipairs({{0, #data}, {95, 2}, {100, 500}, {#data, 9}}) do
+            assert(reader:read(r[1], r[2]) == data:sub(r[1] + 1, r[1] + r[2]))
+        end
+    end
+
+    -- Dropping the last chunk or changing a byte must be detected.
+    local sealed = read_file(sealed_path)
+    f = io.open(sealed_path, "wb")
+    f:write(sealed:sub(1, 32 + 2 * 112))
+    f:close()
+    assert_throws(function() gcrypt.open_file(key, sealed_path, out_path) end,
+                  "Authentication failed for chunk 1")
+    assert(not io.open(out_path, "rb"))
+    f = io.open(sealed_path, "wb")
+    f:write(sealed:sub(1, 200), "X", sealed:sub(202))
+    f:close()
+    local reader = gcrypt.SealedReader(sealed_path, key)
+    assert(reader:read(0, 10) == random_data(64 * 9 + 5):sub(1, 10))
+    assert_throws(function() reader:read(96, 1) end,
+                  "Authentication failed for chunk 1")
+    assert_throws(function()
+        gcrypt.open_file(string.rep("x", 16), sealed_path, out_path)
+    end, "Authentication failed for chunk 0")
+    os.remove(in_path)
+    os.remove(sealed_path)
+end
+
+function test_digest_set()
+    local algo = gcrypt.MD_SHA256
+    local messages = {}
+    for i = 1, 1000 do
+        messages[i] = "message " .. i
+    end
+    local packed = gcrypt.digest_many(algo, messages, 4)
+    assert(#packed == 1000 * 32)
+    assert(packed:sub(32 * 9 + 1, 32 * 10) == gcrypt.hash(algo, "message 10"))
+    assert(gcrypt.digest_many(algo, {}) == "")
+
+    local set = gcrypt.DigestSet(32, packed:sub(1, 32 * 500))
+    assert(#set == 500)
+    assert(set:add(gcrypt.hash(algo, "message 1")) == false)
+    assert(set:add(gcrypt.hash(algo, "message 501")) == true)
+    assert(set:add_many(packed) == 499 and set:size() == 1000)
+    assert(set:contains(gcrypt.hash(algo, "message 1000")))
+    assert(not set:contains(gcrypt.hash(algo, "message 1001")))
+    local queries = gcrypt.digest_many(algo, {"x", "message 7", "y",
+                                              "message 1"})
+    local found = set:contains_many(queries)
+    assert(#found == 2 and found[1] == 2 and found[2] == 4)
+    assert_throws(function() set:contains("short") end, "digest length")
+
+    local path = os.tmpname()
+    set:save(path)
+    local loaded = gcrypt.load_digest_set(path)
+    assert(#loaded == 1000)
+    assert(#loaded:contains_many(packed) == 1000)
+    assert(#loaded:contains_many(queries) == 2)
+    set = nil
+    loaded = nil
+    collectgarbage()
+    local f = io.open(path, "r+b")
+    f:write("X")
+    f:close()
+    assert_throws(function() gcrypt.load_digest_set(path) end,
+                  "Invalid digest set file")
+
+    -- A bitmap that disagrees with the count is rejected.
+    gcrypt.DigestSet(32, packed:sub(1, 32)):save(path)
+    f = io.open(path, "r+b")
+    f:seek("set", 32)
+    f:write(string.rep("\255", 8))
+    f:close()
+    assert_throws(function() gcrypt.load_digest_set(path) end,
+                  "Invalid digest set file")
+    os.remove(path)
+end
+
+function test_digest_memo()
+    local algo = gcrypt.MD_SHA256
+    local expected = gcrypt.hash(algo, "abc")
+    local stats = gcrypt.digest_memo(2, 16)
+    assert(stats.max_entries == 2 and stats.max_input == 16)
+    assert(gcrypt.hash(algo, "abc") == expected)
+    assert(gcrypt.hash(algo, "abc", "hex") == gcrypt.tohex(expected))
+    assert(gcrypt.hash(gcrypt.MD_SHA1, "abc") ~= expected)
+    stats = gcrypt.digest_memo()
+    assert(stats.hits == 1 and stats.misses == 2 and stats.entries == 2)
+
+    -- md:read holds back short input and shares the entries.
+    local md = gcrypt.Hash(algo)
+    md:write("a")
+    md:write("bc")
+    assert(md:read() == expected and md:read() == expected)
+    assert(gcrypt.digest_memo().hits == 3)
+    md:reset()
+    md:write(string.rep("x", 17))
+    assert(md:read() == gcrypt.hash(algo, string.rep("x", 17)))
+    md:reset()
+    assert(md:read() == gcrypt.hash(algo, ""))
+
+    -- The least recently used entry is evicted, long input is not cached.
+    gcrypt.hash(algo, "1")
+    gcrypt.hash(algo, "2")
+    stats = gcrypt.digest_memo()
+    assert(gcrypt.hash(algo, "abc") == expected)
+    assert(gcrypt.digest_memo().misses == stats.misses + 1)
+    assert(gcrypt.digest_memo().entries == 2)
+
+    local mac = gcrypt.Hash(algo, gcrypt.MD_FLAG_HMAC)
+    mac:setkey("key")
+    mac:write("abc")
+    assert(mac:read() ~= expected)
+    stats = gcrypt.digest_memo(0)
+    assert(stats.entries == 0 and stats.hits == 0 and stats.max_entries == 0)
+end
+
 function assert_throws(func, message)
     local ok, err = pcall(func)
     if ok then
@@ -289,8 +1881,42 @@ local all_tests = {
     {"test_aes_cbc_128",    test_aes_cbc_128},
     {"test_aes_ctr_192",    test_aes_ctr_192},
     {"test_aes_gcm_128",    test_aes_gcm_128},
+    {"test_decrypt_lazy",   test_decrypt_lazy},
     {"test_hmac_sha256",    test_hmac_sha256},
     {"test_sha256",         test_sha256},
+    {"test_encoding",       test_encoding},
+    {"test_digest_formats", test_digest_formats},
+    {"test_digest_memo",    test_digest_memo},
+    {"test_buffer",         test_buffer},
+    {"test_xor",            test_xor},
+    {"test_equal",          test_equal},
+    {"test_crc32",          test_crc32},
+    {"test_hash_pieces",    test_hash_pieces},
+    {"test_cdc",            test_cdc},
+    {"test_merkle_root",    test_merkle_root},
+    {"test_merkle_log",     test_merkle_log},
+    {"test_verified_reader", test_verified_reader},
+    {"test_decrypting_reader", test_decrypting_reader},
+    {"test_open_encrypted", test_open_encrypted},
+    {"test_seal_file",      test_seal_file},
+    {"test_hash_files",     test_hash_files},
+    {"test_digest_cache",   test_digest_cache},
+    {"test_io_engine",      test_io_engine},
+    {"test_digest_set",     test_digest_set},
+    {"test_pipeline",       test_pipeline},
+    {"test_backends",       test_backends},
+    {"test_kdf_sp800_108",  test_kdf_sp800_108},
+    {"test_key",            test_key},
+    {"test_smb3_decrypt",   test_smb3_decrypt},
+    {"test_kerberos_aes_sha2", test_kerberos_aes_sha2},
+    {"test_kerberos_aes_sha1", test_kerberos_aes_sha1},
+    {"test_kerberos_rc4",   test_kerberos_rc4},
+    {"test_kerberos_roundtrip", test_kerberos_roundtrip},
+    {"test_aes_cmac",       test_aes_cmac},
+    {"test_ble_sc_functions", test_ble_sc_functions},
+    {"test_ble_link_decrypt", test_ble_link_decrypt},
+    {"test_plaintext_cache", test_plaintext_cache},
+    {"test_prefetch",       test_prefetch},
     {"test_cipher_bad",     test_cipher_bad},
     {"test_cipher_gettag",  test_cipher_gettag},
     {"test_aes_ctr_bad",    test_aes_ctr_bad},